@@ -19,6 +19,9 @@
 #include <stdlib.h>
 #include <string>
 #include <errno.h>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
 
 #include "qemu-usb/vl.h"
 #include "USB.h"
@@ -53,6 +56,13 @@ int64_t usb_bit_time;
 s64 clocks = 0;
 s64 remaining = 0;
 
+// Emulated USB time against wall clock, see UpdateEmulationSpeed()
+static double emu_speed = 1.0;
+static s64 speed_cycles = 0;
+static std::chrono::steady_clock::time_point speed_start, speed_last;
+// Every cycle handed to USBasync, read by device threads through GetEmulatedTimeUs()
+static std::atomic<s64> emu_cycles(0);
+
 #if _WIN32
 HWND gsWnd=NULL;
 #endif
@@ -173,6 +183,8 @@ EXPORT_C_(s32) USBinit() {
 
 	clocks = 0;
 	remaining = 0;
+	emu_speed = 1.0;
+	speed_start = speed_last = std::chrono::steady_clock::time_point();
 
 	return 0;
 }
@@ -365,6 +377,14 @@ EXPORT_C_(s32) USBfreeze(int mode, freezeData *data) {
 			usbd.t.rhport[i].port.dev = NULL; // pointers
 		}
 
+		//Savestate should match what's on the host, e.g. USB stick images
+		for(int i=0; i< qemu_ohci->num_ports; i++)
+		{
+			USBDevice *dev = qemu_ohci->rhport[i].port.dev;
+			if (dev && dev->handle_flush)
+				dev->handle_flush(dev);
+		}
+
 		usbd.cycles = clocks;
 		usbd.remaining = remaining;
 		memcpy(data->data, &usbd, data->size);
@@ -376,8 +396,37 @@ EXPORT_C_(s32) USBfreeze(int mode, freezeData *data) {
 	return 0;
 }
 
+// Compare cycles handed to USBasync with elapsed wall time every quarter second
+static void UpdateEmulationSpeed(u32 cycles)
+{
+	auto now = std::chrono::steady_clock::now();
+	// First call or emulation was paused, start a new window instead of reporting a slowdown
+	if (speed_last.time_since_epoch().count() == 0 || now - speed_last > std::chrono::milliseconds(500))
+	{
+		speed_start = speed_last = now;
+		speed_cycles = 0;
+		return;
+	}
+
+	speed_last = now;
+	speed_cycles += cycles;
+
+	double wall = std::chrono::duration<double>(now - speed_start).count();
+	if (wall < 0.25)
+		return;
+
+	double speed = (double)speed_cycles / PSXCLK / wall;
+	emu_speed += (speed - emu_speed) * 0.5;
+	emu_speed = std::min(std::max(emu_speed, 0.1), 10.0);
+
+	speed_start = now;
+	speed_cycles = 0;
+}
+
 EXPORT_C_(void) USBasync(u32 cycles)
 {
+	UpdateEmulationSpeed(cycles);
+	emu_cycles += cycles;
 	remaining += cycles;
 	clocks += remaining;
 	if(qemu_ohci->eof_timer>0)
@@ -420,3 +469,15 @@ s64 get_clock()
 {
 	return clocks;
 }
+
+double GetEmulationSpeed()
+{
+	return emu_speed;
+}
+
+s64 GetEmulatedTimeUs()
+{
+	s64 cycles = emu_cycles.load();
+	// Split up so it doesn't overflow after a couple of days
+	return cycles / PSXCLK * 1000000 + cycles % PSXCLK * 1000000 / PSXCLK;
+}
@@ -103,10 +103,13 @@ void SysMessageA(const char *fmt, ...);
 #endif
 #endif
 s64 get_clock();
+// Emulated time / wall time, 1.0 at full speed
+double GetEmulationSpeed();
+// Emulated time since the plugin was loaded, any thread may call it
+s64 GetEmulatedTimeUs();
 
 USBDevice *usb_hub_init(int nb_ports);
 USBDevice *usb_msd_init(const TCHAR *filename);
-USBDevice *eyetoy_init(void);
 USBDevice *usb_mouse_init(void);
 
 /* usb-pad-raw.cpp */
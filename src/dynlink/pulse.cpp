@@ -53,6 +53,9 @@ FUNDEFDECL(pa_stream_cork);
 FUNDEFDECL(pa_stream_is_corked);
 FUNDEFDECL(pa_stream_is_suspended);
 FUNDEFDECL(pa_stream_set_state_callback);
+FUNDEFDECL(pa_stream_set_latency_update_callback);
+FUNDEFDECL(pa_stream_get_latency);
+FUNDEFDECL(pa_stream_get_buffer_attr);
 FUNDEFDECL(pa_threaded_mainloop_lock);
 FUNDEFDECL(pa_threaded_mainloop_unlock);
 FUNDEFDECL(pa_threaded_mainloop_signal);
@@ -117,6 +120,9 @@ bool DynLoadPulse()
 	FUN_LOAD(pulse_handle, pa_stream_is_corked);
 	FUN_LOAD(pulse_handle, pa_stream_is_suspended);
 	FUN_LOAD(pulse_handle, pa_stream_set_state_callback);
+	FUN_LOAD(pulse_handle, pa_stream_set_latency_update_callback);
+	FUN_LOAD(pulse_handle, pa_stream_get_latency);
+	FUN_LOAD(pulse_handle, pa_stream_get_buffer_attr);
 	FUN_LOAD(pulse_handle, pa_threaded_mainloop_lock);
 	FUN_LOAD(pulse_handle, pa_threaded_mainloop_unlock);
 	FUN_LOAD(pulse_handle, pa_threaded_mainloop_signal);
@@ -173,6 +179,9 @@ void DynUnloadPulse()
 	FUN_UNLOAD(pa_stream_is_corked);
 	FUN_UNLOAD(pa_stream_is_suspended);
 	FUN_UNLOAD(pa_stream_set_state_callback);
+	FUN_UNLOAD(pa_stream_set_latency_update_callback);
+	FUN_UNLOAD(pa_stream_get_latency);
+	FUN_UNLOAD(pa_stream_get_buffer_attr);
 	FUN_UNLOAD(pa_threaded_mainloop_lock);
 	FUN_UNLOAD(pa_threaded_mainloop_unlock);
 	FUN_UNLOAD(pa_threaded_mainloop_signal);
@@ -477,6 +486,26 @@ void pa_stream_set_state_callback(pa_stream *s, pa_stream_notify_cb_t cb, void *
 		pfn_pa_stream_set_state_callback(s, cb, userdata);
 }
 
+void pa_stream_set_latency_update_callback(pa_stream *s, pa_stream_notify_cb_t cb, void *userdata)
+{
+	if (pfn_pa_stream_set_latency_update_callback)
+		pfn_pa_stream_set_latency_update_callback(s, cb, userdata);
+}
+
+int pa_stream_get_latency(pa_stream *s, pa_usec_t *r_usec, int *negative)
+{
+	if (pfn_pa_stream_get_latency)
+		return pfn_pa_stream_get_latency(s, r_usec, negative);
+	return -PA_ERR_NOTIMPLEMENTED;
+}
+
+const pa_buffer_attr* pa_stream_get_buffer_attr(pa_stream *s)
+{
+	if (pfn_pa_stream_get_buffer_attr)
+		return pfn_pa_stream_get_buffer_attr(s);
+	return NULL;
+}
+
 size_t pa_sample_size(const pa_sample_spec *spec)
 {
 	if (pfn_pa_sample_size)
@@ -0,0 +1,269 @@
+#include "blockcache.h"
+#include <algorithm>
+#include <cstring>
+
+CachedBlockDevice::CachedBlockDevice(BlockDevice *dev, uint32_t cacheKB, uint32_t readAhead)
+: mDev(dev)
+, mMaxLines(std::max<uint32_t>(cacheKB * 1024ULL / BLOCKCACHE_LINE, 4))
+, mReadAhead(std::min(readAhead, mMaxLines / 2))
+, mLastEnd(UINT64_MAX)
+, mSequential(0)
+, mEndLine(UINT64_MAX)
+, mQuit(false)
+{
+	mThread = std::thread(&CachedBlockDevice::Worker, this);
+}
+
+CachedBlockDevice::~CachedBlockDevice()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mCond.notify_all();
+	if (mThread.joinable())
+		mThread.join();
+
+	for (auto& it : mLines)
+		delete it.second;
+	delete mDev;
+}
+
+BlockCacheStats CachedBlockDevice::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mStats;
+}
+
+int64_t CachedBlockDevice::Read(uint64_t offset, void *buf, uint32_t len)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	ReadAhead(offset, len);
+
+	uint32_t done = 0;
+	while (done < len)
+	{
+		uint64_t pos = offset + done;
+		uint32_t skip = pos % BLOCKCACHE_LINE;
+		Line *line = Load(lock, pos / BLOCKCACHE_LINE, false);
+		if (!line)
+			return done ? (int64_t)done : -1;
+		if (skip >= line->valid)
+			break;
+
+		uint32_t n = std::min(line->valid - skip, len - done);
+		memcpy((uint8_t *)buf + done, line->data.data() + skip, n);
+		done += n;
+		if (line->valid < BLOCKCACHE_LINE)
+			break; // end of image
+	}
+	return done;
+}
+
+int64_t CachedBlockDevice::Write(uint64_t offset, const void *buf, uint32_t len)
+{
+	// Device first, so a line loaded after this sees the new data
+	int64_t ret = mDev->Write(offset, buf, len);
+	if (ret <= 0)
+		return ret;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	uint64_t end = offset + ret;
+	if (mEndLine != UINT64_MAX && end > mEndLine * BLOCKCACHE_LINE)
+		mEndLine = UINT64_MAX;
+	for (uint64_t index = offset / BLOCKCACHE_LINE; index * BLOCKCACHE_LINE < end; index++)
+	{
+		auto it = mLines.find(index);
+		if (it == mLines.end())
+			continue;
+
+		Line *line = it->second;
+		if (line->state == LINE_LOADING)
+		{
+			line->stale = true;
+			continue;
+		}
+
+		uint64_t base = index * BLOCKCACHE_LINE;
+		uint32_t from = offset > base ? (uint32_t)(offset - base) : 0;
+		uint32_t to = (uint32_t)std::min<uint64_t>(end - base, BLOCKCACHE_LINE);
+		if (from > line->valid)
+		{
+			// Image grew with a gap we never read
+			Erase(line);
+			continue;
+		}
+		memcpy(line->data.data() + from, (const uint8_t *)buf + (base + from - offset), to - from);
+		line->valid = std::max(line->valid, to);
+	}
+	return ret;
+}
+
+CachedBlockDevice::Line* CachedBlockDevice::Load(std::unique_lock<std::mutex>& lock, uint64_t index, bool prefetch)
+{
+	while (true)
+	{
+		auto it = mLines.find(index);
+		if (it != mLines.end())
+		{
+			Line *line = it->second;
+			if (line->state == LINE_LOADING)
+			{
+				// Probably the read-ahead worker, might get dropped so look again after
+				mCond.wait(lock);
+				continue;
+			}
+			mStats.hits++;
+			if (line->prefetched && !line->used)
+				mStats.prefetchUsed++;
+			line->used = true;
+			Touch(line);
+			return line;
+		}
+
+		if (!prefetch)
+			mStats.misses++;
+
+		Line *line = Insert(index, prefetch);
+		lock.unlock();
+		int64_t ret = mDev->Read(index * BLOCKCACHE_LINE, line->data.data(), BLOCKCACHE_LINE);
+		lock.lock();
+		mCond.notify_all();
+
+		if (ret < 0 || (prefetch && ret == 0))
+		{
+			if (ret == 0)
+				mEndLine = std::min(mEndLine, index);
+			Erase(line);
+			return nullptr;
+		}
+		if (line->stale)
+		{
+			Erase(line);
+			if (prefetch)
+				return nullptr;
+			continue;
+		}
+		line->valid = (uint32_t)ret;
+		line->state = LINE_READY;
+		line->used = !prefetch;
+		if (prefetch)
+			mStats.prefetched++;
+		return line;
+	}
+}
+
+CachedBlockDevice::Line* CachedBlockDevice::Insert(uint64_t index, bool prefetch)
+{
+	while (mLines.size() >= mMaxLines)
+	{
+		size_t before = mLines.size();
+		Evict();
+		if (mLines.size() == before)
+			break; // everything is loading, go over for a moment
+	}
+
+	Line *line = new Line();
+	line->index = index;
+	line->data.resize(BLOCKCACHE_LINE);
+	line->valid = 0;
+	line->state = LINE_LOADING;
+	line->prefetched = prefetch;
+	line->used = false;
+	line->stale = false;
+	mLru.push_front(line);
+	line->lru = mLru.begin();
+	mLines[index] = line;
+	return line;
+}
+
+void CachedBlockDevice::Discard()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mPrefetch.clear();
+		mLastEnd = UINT64_MAX;
+		mSequential = 0;
+		mEndLine = UINT64_MAX;
+		for (auto it = mLru.begin(); it != mLru.end(); )
+		{
+			Line *line = *it++;
+			// Loads in flight are dropped by whoever finishes them
+			if (line->state == LINE_READY)
+				Erase(line);
+			else
+				line->stale = true;
+		}
+	}
+	mDev->Discard();
+}
+
+void CachedBlockDevice::Erase(Line *line)
+{
+	if (line->prefetched && !line->used && line->state == LINE_READY)
+		mStats.prefetchWasted++;
+	mLines.erase(line->index);
+	mLru.erase(line->lru);
+	delete line;
+}
+
+void CachedBlockDevice::Touch(Line *line)
+{
+	mLru.splice(mLru.begin(), mLru, line->lru);
+}
+
+void CachedBlockDevice::Evict()
+{
+	for (auto it = mLru.rbegin(); it != mLru.rend(); ++it)
+	{
+		if ((*it)->state == LINE_READY)
+		{
+			Erase(*it);
+			return;
+		}
+	}
+}
+
+// Queue the lines after this read once the guest has read sequentially a few times
+void CachedBlockDevice::ReadAhead(uint64_t offset, uint32_t len)
+{
+	if (!mReadAhead)
+		return;
+
+	if (offset == mLastEnd)
+		mSequential++;
+	else
+	{
+		mSequential = 0;
+		mPrefetch.clear();
+	}
+	mLastEnd = offset + len;
+	if (mSequential < 2)
+		return;
+
+	uint64_t first = mLastEnd / BLOCKCACHE_LINE;
+	for (uint64_t index = first; index < first + mReadAhead && index < mEndLine; index++)
+	{
+		if (mLines.count(index) ||
+			std::find(mPrefetch.begin(), mPrefetch.end(), index) != mPrefetch.end())
+			continue;
+		mPrefetch.push_back(index);
+	}
+	mCond.notify_all();
+}
+
+void CachedBlockDevice::Worker()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true)
+	{
+		mCond.wait(lock, [this] { return mQuit || !mPrefetch.empty(); });
+		if (mQuit)
+			break;
+
+		uint64_t index = mPrefetch.front();
+		mPrefetch.pop_front();
+		if (!mLines.count(index))
+			Load(lock, index, true);
+	}
+}
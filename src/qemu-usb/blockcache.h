@@ -0,0 +1,98 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+#include <cstdint>
+#include <list>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "blockdev.h"
+
+#define S_CACHE_SIZE	TEXT("Block cache size (KiB, 0 to disable)")
+#define N_CACHE_SIZE	TEXT("cache_size")
+#define S_READ_AHEAD	TEXT("Read-ahead (cache lines)")
+#define N_READ_AHEAD	TEXT("read_ahead")
+
+#define BLOCKCACHE_LINE (32 * 1024)
+#define BLOCKCACHE_DEFAULT_KB 4096
+#define BLOCKCACHE_DEFAULT_READ_AHEAD 8
+
+struct BlockCacheStats
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t prefetched; // lines read by the read-ahead worker
+	uint64_t prefetchUsed;
+	uint64_t prefetchWasted; // evicted before anyone read them
+
+	BlockCacheStats()
+	: hits(0), misses(0), prefetched(0), prefetchUsed(0), prefetchWasted(0) {}
+};
+
+/*
+	LRU cache of fixed size lines in front of another BlockDevice. Once reads
+	turn sequential a worker fetches the next lines ahead of the guest.
+	Writes go straight through and update lines already cached.
+*/
+class CachedBlockDevice : public BlockDevice
+{
+	enum LineState {
+		LINE_LOADING,
+		LINE_READY,
+	};
+
+	struct Line
+	{
+		uint64_t index;
+		std::vector<uint8_t> data;
+		uint32_t valid; // short at end of image
+		LineState state;
+		bool prefetched;
+		bool used;
+		bool stale; // written while loading, drop when load finishes
+		std::list<Line *>::iterator lru;
+	};
+
+public:
+	// Takes ownership of dev
+	CachedBlockDevice(BlockDevice *dev, uint32_t cacheKB, uint32_t readAhead);
+	~CachedBlockDevice();
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len);
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len);
+	uint64_t Size() { return mDev->Size(); }
+	bool Flush() { return mDev->Flush(); }
+	void Discard();
+	bool ReadOnly() const { return mDev->ReadOnly(); }
+
+	BlockCacheStats GetStats();
+
+private:
+	void Worker();
+	Line* Load(std::unique_lock<std::mutex>& lock, uint64_t index, bool prefetch);
+	Line* Insert(uint64_t index, bool prefetch);
+	void Erase(Line *line);
+	void Touch(Line *line);
+	void Evict();
+	void ReadAhead(uint64_t offset, uint32_t len);
+
+	BlockDevice *mDev;
+	uint32_t mMaxLines;
+	uint32_t mReadAhead;
+
+	std::unordered_map<uint64_t, Line *> mLines;
+	std::list<Line *> mLru; // most recent first
+	std::deque<uint64_t> mPrefetch;
+	uint64_t mLastEnd; // end of the previous read, for sequential detection
+	uint32_t mSequential;
+	uint64_t mEndLine; // first line found past the end of image
+	BlockCacheStats mStats;
+	bool mQuit;
+
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::thread mThread;
+};
+#endif
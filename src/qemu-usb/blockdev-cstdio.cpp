@@ -0,0 +1,129 @@
+#include "blockdev.h"
+#include <cstdio>
+#include <mutex>
+#ifdef __GLIBC__
+#include <stdio_ext.h>
+#endif
+
+#define APINAME "cstdio"
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+namespace blockdev_cstdio {
+
+// The old FILE* path, kept for hosts without pread
+class CstdioBlockDevice : public BlockDevice
+{
+	enum LastOp { OP_NONE, OP_READ, OP_WRITE };
+
+public:
+	CstdioBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mPos(0), mLastOp(OP_NONE)
+	{
+		mFile = wfopen(path.c_str(), TEXT("r+b"));
+		if (!mFile)
+			throw BlockDeviceError("Could not open image file");
+	}
+
+	~CstdioBlockDevice()
+	{
+		if (mFile)
+			fclose(mFile);
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!Seek(offset, OP_READ))
+			return -1;
+		size_t ret = fread(buf, 1, len, mFile);
+		if (ret < len && ferror(mFile))
+		{
+			clearerr(mFile);
+			mLastOp = OP_NONE;
+			return -1;
+		}
+		mPos += ret;
+		return ret;
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!Seek(offset, OP_WRITE))
+			return -1;
+		size_t ret = fwrite(buf, 1, len, mFile);
+		if (ret < len)
+		{
+			clearerr(mFile);
+			mLastOp = OP_NONE;
+			return ret ? (int64_t)ret : -1;
+		}
+		mPos += ret;
+		return ret;
+	}
+
+	uint64_t Size()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mLastOp = OP_NONE;
+		if (fseeko(mFile, 0, SEEK_END))
+			return 0;
+		int64_t end = ftello(mFile);
+		return end > 0 ? end : 0;
+	}
+
+	bool Flush()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return fflush(mFile) == 0;
+	}
+
+	// Elsewhere the stdio buffer still goes out on close, at most BUFSIZ bytes
+	void Discard()
+	{
+#ifdef __GLIBC__
+		std::lock_guard<std::mutex> lock(mMutex);
+		__fpurge(mFile);
+		mLastOp = OP_NONE;
+#endif
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("cstdio");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return std::vector<CONFIGVARIANT>();
+	}
+
+private:
+	// Only seek when needed, stdio requires one when switching between read and write
+	bool Seek(uint64_t offset, LastOp op)
+	{
+		if (mLastOp == op && mPos == offset)
+			return true;
+		if (fseeko(mFile, offset, SEEK_SET))
+		{
+			mLastOp = OP_NONE;
+			return false;
+		}
+		mPos = offset;
+		mLastOp = op;
+		return true;
+	}
+
+	FILE *mFile;
+	uint64_t mPos;
+	LastOp mLastOp;
+	std::mutex mMutex; // stream and cache workers share the position
+};
+
+REGISTER_BLOCKDEV(APINAME, CstdioBlockDevice);
+};
+#undef APINAME
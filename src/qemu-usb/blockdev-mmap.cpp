@@ -0,0 +1,209 @@
+#include "blockdev.h"
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define APINAME "mmap"
+
+// 32-bit builds can't map a whole stick image, so they slide a window over it
+#define MMAP_WINDOW (64 * 1024 * 1024)
+
+namespace blockdev_mmap {
+
+/*
+	Image mapped into memory, reads and writes are plain copies to and from
+	the mapping. Read-only image files are mapped read-only and fail writes.
+	The image can't grow, writes past the end are cut short.
+*/
+class MmapBlockDevice : public BlockDevice
+{
+public:
+	MmapBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mFd(-1), mReadOnly(false), mSize(0), mWindow(0)
+	, mMap(nullptr), mMapOff(0), mMapLen(0), mDirty(false)
+	{
+		mFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (mFd < 0 && (errno == EACCES || errno == EROFS))
+		{
+			mFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+			mReadOnly = true;
+		}
+		if (mFd < 0)
+			throw BlockDeviceError("Could not open image file");
+
+		off_t end = lseek(mFd, 0, SEEK_END);
+		if (end <= 0)
+		{
+			close(mFd);
+			throw BlockDeviceError("Image file is empty");
+		}
+		mSize = end;
+
+		if (sizeof(void *) >= 8)
+			mWindow = mSize;
+		else
+			mWindow = MMAP_WINDOW;
+
+		if (!MapWindow(0))
+		{
+			close(mFd);
+			throw BlockDeviceError("Could not map image file");
+		}
+	}
+
+	~MmapBlockDevice()
+	{
+		Unmap();
+		if (mFd >= 0)
+			close(mFd);
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (offset >= mSize)
+			return 0;
+		if (len > mSize - offset)
+			len = mSize - offset;
+
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint32_t avail;
+			uint8_t *p = MapAt(offset + done, avail);
+			if (!p)
+				return done ? (int64_t)done : -1;
+			uint32_t n = len - done < avail ? len - done : avail;
+			memcpy((uint8_t *)buf + done, p, n);
+			done += n;
+		}
+		return done;
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mReadOnly)
+			return -1;
+		if (offset >= mSize)
+			return -1;
+		if (len > mSize - offset)
+			len = mSize - offset;
+
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint32_t avail;
+			uint8_t *p = MapAt(offset + done, avail);
+			if (!p)
+				return done ? (int64_t)done : -1;
+			uint32_t n = len - done < avail ? len - done : avail;
+			memcpy(p, (const uint8_t *)buf + done, n);
+			done += n;
+			mDirty = true;
+		}
+		return done;
+	}
+
+	uint64_t Size()
+	{
+		return mSize;
+	}
+
+	bool Flush()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		bool ok = true;
+		if (mDirty && mMap)
+			ok = msync(mMap, mMapLen, MS_SYNC) == 0;
+		// Covers windows already unmapped on 32-bit
+		if (!mReadOnly)
+			ok = fdatasync(mFd) == 0 && ok;
+		mDirty = false;
+		return ok;
+	}
+
+	bool Mapped() const
+	{
+		return true;
+	}
+
+	bool ReadOnly() const
+	{
+		return mReadOnly;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("mmap");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return std::vector<CONFIGVARIANT>();
+	}
+
+private:
+	// Pointer to offset with bytes left in the window, remaps if needed
+	uint8_t* MapAt(uint64_t offset, uint32_t& avail)
+	{
+		if (!mMap || offset < mMapOff || offset >= mMapOff + mMapLen)
+		{
+			if (!MapWindow(offset - offset % mWindow))
+				return nullptr;
+		}
+		uint64_t left = mMapOff + mMapLen - offset;
+		avail = left > UINT32_MAX ? UINT32_MAX : (uint32_t)left;
+		return (uint8_t *)mMap + (offset - mMapOff);
+	}
+
+	bool MapWindow(uint64_t offset)
+	{
+		Unmap();
+		uint64_t len = mSize - offset < mWindow ? mSize - offset : mWindow;
+		void *p = mmap(nullptr, len, mReadOnly ? PROT_READ : PROT_READ | PROT_WRITE,
+			MAP_SHARED, mFd, offset);
+		if (p == MAP_FAILED)
+		{
+			OSDebugOut(TEXT("mmap: mapping %llu bytes at %llu failed: %d\n"),
+				(unsigned long long)len, (unsigned long long)offset, errno);
+			return false;
+		}
+		mMap = p;
+		mMapOff = offset;
+		mMapLen = len;
+		return true;
+	}
+
+	void Unmap()
+	{
+		if (!mMap)
+			return;
+		if (mDirty)
+			msync(mMap, mMapLen, MS_SYNC);
+		munmap(mMap, mMapLen);
+		mMap = nullptr;
+		mMapLen = 0;
+		mDirty = false;
+	}
+
+	int mFd;
+	bool mReadOnly;
+	uint64_t mSize;
+	uint64_t mWindow;
+	void *mMap;
+	uint64_t mMapOff;
+	uint64_t mMapLen;
+	bool mDirty; // written to the current window since the last msync
+	std::mutex mMutex;
+};
+
+REGISTER_BLOCKDEV(APINAME, MmapBlockDevice);
+};
+#undef APINAME
+#undef MMAP_WINDOW
@@ -0,0 +1,333 @@
+#include "blockdev.h"
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define APINAME "overlay"
+
+// Copy-on-write granularity, a partial write copies the rest of the block from the base
+#define OVERLAY_BLOCK 4096
+#define OVERLAY_MAGIC "USBQOVL1"
+#define OVERLAY_VERSION 1
+
+namespace blockdev_overlay {
+
+/*
+	Delta file layout, all little endian like the hosts we run on:
+	header in the first block, then the block bitmap, then block data
+	at dataOffset + index * blockSize. Blocks never written stay holes.
+*/
+struct OverlayHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t blockSize;
+	uint64_t size; // base image size, also the overlay size
+	int64_t baseMtime; // delta is stale if the base changed under it
+	uint64_t bitmapOffset;
+	uint64_t dataOffset;
+};
+
+static int LoadIntSetting(int port, const std::string& api, const TCHAR *name, int def)
+{
+	CONFIGVARIANT var(name, CONFIG_TYPE_INT);
+	if (LoadSetting(port, api, var))
+		return var.intValue;
+	return def;
+}
+
+static bool FullPread(int fd, void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return false;
+		if (ret == 0)
+		{
+			// Holes past the end of a sparse delta read as zeros
+			memset((uint8_t *)buf + done, 0, len - done);
+			break;
+		}
+		done += ret;
+	}
+	return true;
+}
+
+static bool FullPwrite(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	size_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pwrite(fd, (const uint8_t *)buf + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		done += ret;
+	}
+	return true;
+}
+
+/*
+	Read-only base image plus a sparse delta file. Written blocks go to the
+	delta and are marked in a bitmap, kept in memory and mirrored in the
+	delta file. Reads take marked blocks from the delta and the rest from the
+	base. Discarding the delta truncates it and clears the bitmap, the cost
+	does not depend on how much was written.
+	The base is never written, so several instances can share it.
+*/
+class OverlayBlockDevice : public BlockDevice
+{
+public:
+	OverlayBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mBaseFd(-1), mDeltaFd(-1)
+	{
+		mBaseFd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (mBaseFd < 0)
+			throw BlockDeviceError("Could not open base image");
+
+		struct stat st;
+		if (fstat(mBaseFd, &st) || st.st_size <= 0)
+		{
+			Close();
+			throw BlockDeviceError("Base image is empty");
+		}
+
+		CONFIGVARIANT varDelta(N_DELTA_PATH, CONFIG_TYPE_TCHAR);
+		TSTDSTRING deltaPath;
+		if (LoadSetting(port, api, varDelta) && !varDelta.tstrValue.empty())
+			deltaPath = varDelta.tstrValue;
+		else
+			deltaPath = path + TEXT(".") + std::to_string(port) + TEXT(".delta");
+
+		mDeltaFd = open(deltaPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (mDeltaFd < 0)
+		{
+			Close();
+			throw BlockDeviceError("Could not open delta file");
+		}
+		// Two instances writing one delta would corrupt it, sharing the base is fine
+		if (flock(mDeltaFd, LOCK_EX | LOCK_NB))
+		{
+			Close();
+			throw BlockDeviceError("Delta file is in use");
+		}
+
+		memset(&mHeader, 0, sizeof(mHeader));
+		memcpy(mHeader.magic, OVERLAY_MAGIC, sizeof(mHeader.magic));
+		mHeader.version = OVERLAY_VERSION;
+		mHeader.blockSize = OVERLAY_BLOCK;
+		mHeader.size = st.st_size;
+		mHeader.baseMtime = st.st_mtime;
+		mHeader.bitmapOffset = OVERLAY_BLOCK;
+
+		uint64_t blocks = (mHeader.size + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK;
+		mBitmap.resize((blocks + 63) / 64);
+		uint64_t bitmapBytes = mBitmap.size() * sizeof(uint64_t);
+		mHeader.dataOffset = mHeader.bitmapOffset +
+			(bitmapBytes + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK * OVERLAY_BLOCK;
+
+		bool discard = LoadIntSetting(port, api, N_DISCARD_DELTA, 1) != 0;
+		if (discard || !LoadDelta())
+		{
+			if (!Reset())
+			{
+				Close();
+				throw BlockDeviceError("Could not initialize delta file");
+			}
+		}
+	}
+
+	~OverlayBlockDevice()
+	{
+		if (mDeltaFd >= 0)
+			fdatasync(mDeltaFd);
+		Close();
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (offset >= mHeader.size)
+			return 0;
+		if (len > mHeader.size - offset)
+			len = mHeader.size - offset;
+
+		// Runs of blocks from the same file are read in one go
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint64_t pos = offset + done;
+			uint64_t block = pos / OVERLAY_BLOCK;
+			bool inDelta = Test(block);
+			uint32_t n = std::min<uint32_t>(OVERLAY_BLOCK - pos % OVERLAY_BLOCK, len - done);
+			while (done + n < len && Test(++block) == inDelta)
+				n += std::min<uint32_t>(OVERLAY_BLOCK, len - done - n);
+
+			bool ok = inDelta ?
+				FullPread(mDeltaFd, (uint8_t *)buf + done, n, DataOffset(0) + pos) :
+				FullPread(mBaseFd, (uint8_t *)buf + done, n, pos);
+			if (!ok)
+				return done ? (int64_t)done : -1;
+			done += n;
+		}
+		return done;
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		// Fixed size like the base, writes past the end are cut short
+		if (offset >= mHeader.size)
+			return -1;
+		if (len > mHeader.size - offset)
+			len = mHeader.size - offset;
+
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint64_t pos = offset + done;
+			uint64_t block = pos / OVERLAY_BLOCK;
+			uint32_t skip = pos % OVERLAY_BLOCK;
+			uint32_t n = std::min<uint32_t>(OVERLAY_BLOCK - skip, len - done);
+
+			if ((skip || n < OVERLAY_BLOCK) && !Test(block))
+			{
+				// First write to this block, bring the rest over from the base
+				uint8_t tmp[OVERLAY_BLOCK];
+				if (!FullPread(mBaseFd, tmp, OVERLAY_BLOCK, block * OVERLAY_BLOCK))
+					return done ? (int64_t)done : -1;
+				memcpy(tmp + skip, (const uint8_t *)buf + done, n);
+				if (!FullPwrite(mDeltaFd, tmp, OVERLAY_BLOCK, DataOffset(block)))
+					return done ? (int64_t)done : -1;
+			}
+			else
+			{
+				// Whole blocks, and partial ones already in the delta, go straight in
+				while (done + n < len && (len - done - n >= OVERLAY_BLOCK || Test(block + (skip + n) / OVERLAY_BLOCK)))
+					n += std::min<uint32_t>(OVERLAY_BLOCK, len - done - n);
+				if (!FullPwrite(mDeltaFd, (const uint8_t *)buf + done, n, DataOffset(0) + pos))
+					return done ? (int64_t)done : -1;
+			}
+
+			if (!Mark(block, (skip + n + OVERLAY_BLOCK - 1) / OVERLAY_BLOCK))
+				return done ? (int64_t)done : -1;
+			done += n;
+		}
+		return done;
+	}
+
+	uint64_t Size()
+	{
+		return mHeader.size;
+	}
+
+	bool Flush()
+	{
+		return fdatasync(mDeltaFd) == 0;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("Copy-on-write overlay");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_DELTA_PATH, N_DELTA_PATH, CONFIG_TYPE_TCHAR));
+		params.push_back(CONFIGVARIANT(S_DISCARD_DELTA, N_DISCARD_DELTA, CONFIG_TYPE_INT));
+		return params;
+	}
+
+private:
+	uint64_t DataOffset(uint64_t block) const
+	{
+		return mHeader.dataOffset + block * OVERLAY_BLOCK;
+	}
+
+	bool Test(uint64_t block) const
+	{
+		return (mBitmap[block / 64] >> (block % 64)) & 1;
+	}
+
+	// Set count bits from block and write the touched bitmap words out after the data
+	bool Mark(uint64_t block, uint64_t count)
+	{
+		uint64_t first = block / 64, last = (block + count - 1) / 64;
+		bool changed = false;
+		for (uint64_t b = block; b < block + count; b++)
+		{
+			uint64_t bit = 1ULL << (b % 64);
+			if (!(mBitmap[b / 64] & bit))
+			{
+				mBitmap[b / 64] |= bit;
+				changed = true;
+			}
+		}
+		if (!changed)
+			return true;
+		return FullPwrite(mDeltaFd, &mBitmap[first], (last - first + 1) * sizeof(uint64_t),
+			mHeader.bitmapOffset + first * sizeof(uint64_t));
+	}
+
+	// Reuse what a previous run left in the delta
+	bool LoadDelta()
+	{
+		OverlayHeader header;
+		if (!FullPread(mDeltaFd, &header, sizeof(header), 0) ||
+			memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) ||
+			header.version != mHeader.version ||
+			header.blockSize != mHeader.blockSize ||
+			header.dataOffset != mHeader.dataOffset)
+			return false;
+
+		if (header.size != mHeader.size || header.baseMtime != mHeader.baseMtime)
+		{
+			OSDebugOut(TEXT("overlay: base image changed, discarding delta\n"));
+			return false;
+		}
+		return FullPread(mDeltaFd, mBitmap.data(), mBitmap.size() * sizeof(uint64_t), mHeader.bitmapOffset);
+	}
+
+	// Drop every change, the delta goes back to a bare header
+	bool Reset()
+	{
+		std::fill(mBitmap.begin(), mBitmap.end(), 0);
+		if (ftruncate(mDeltaFd, 0))
+			return false;
+		return FullPwrite(mDeltaFd, &mHeader, sizeof(mHeader), 0);
+	}
+
+	void Close()
+	{
+		if (mDeltaFd >= 0)
+			close(mDeltaFd);
+		if (mBaseFd >= 0)
+			close(mBaseFd);
+		mDeltaFd = mBaseFd = -1;
+	}
+
+	int mBaseFd;
+	int mDeltaFd;
+	OverlayHeader mHeader;
+	std::vector<uint64_t> mBitmap;
+	std::mutex mMutex;
+};
+
+REGISTER_BLOCKDEV(APINAME, OverlayBlockDevice);
+};
+#undef APINAME
+#undef OVERLAY_BLOCK
+#undef OVERLAY_MAGIC
+#undef OVERLAY_VERSION
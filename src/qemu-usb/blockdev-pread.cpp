@@ -0,0 +1,249 @@
+#include "blockdev.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define APINAME "pread"
+
+// O_DIRECT wants offset, length and buffer aligned to the logical block size,
+// page size covers every disk and filesystem we care about
+#define DIRECT_ALIGN 4096
+// Largest bounce buffer for requests from unaligned memory, one per call
+#define BOUNCE_SIZE (64 * 1024)
+
+namespace blockdev_pread {
+
+static int LoadIntSetting(int port, const std::string& api, const TCHAR *name, int def)
+{
+	CONFIGVARIANT var(name, CONFIG_TYPE_INT);
+	if (LoadSetting(port, api, var))
+		return var.intValue;
+	return def;
+}
+
+static int64_t FullPread(int fd, void *buf, uint32_t len, uint64_t offset)
+{
+	uint32_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int64_t FullPwrite(int fd, const void *buf, uint32_t len, uint64_t offset)
+{
+	uint32_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pwrite(fd, (const uint8_t *)buf + done, len - done, offset + done);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return done ? (int64_t)done : -1;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+static inline bool IsAligned(uint64_t v)
+{
+	return (v & (DIRECT_ALIGN - 1)) == 0;
+}
+
+/*
+	Positional I/O on a file descriptor. With O_DIRECT a second descriptor is
+	opened and used for block aligned requests; anything else, like single
+	bulk packets, goes through the page cache on the first one. The direct
+	descriptor lives until the device is destroyed, other threads may still
+	be using it when direct I/O gets switched off.
+*/
+class PreadBlockDevice : public BlockDevice
+{
+public:
+	PreadBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mFd(-1), mDirectFd(-1), mDirect(false)
+	{
+		mFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (mFd < 0)
+			throw BlockDeviceError("Could not open image file");
+
+#ifdef O_DIRECT
+		if (LoadIntSetting(port, api, N_DIRECT_IO, 0))
+		{
+			mDirectFd = open(path.c_str(), O_RDWR | O_CLOEXEC | O_DIRECT);
+			if (mDirectFd < 0)
+				OSDebugOut(TEXT("pread: O_DIRECT not supported here, using page cache\n"));
+			mDirect = mDirectFd >= 0;
+		}
+#endif
+
+#ifdef POSIX_FADV_NORMAL
+		int advice = POSIX_FADV_NORMAL;
+		switch (LoadIntSetting(port, api, N_FADVISE, BLOCK_HINT_NONE))
+		{
+		case BLOCK_HINT_SEQUENTIAL: advice = POSIX_FADV_SEQUENTIAL; break;
+		case BLOCK_HINT_RANDOM: advice = POSIX_FADV_RANDOM; break;
+		default: break;
+		}
+		if (advice != POSIX_FADV_NORMAL)
+			posix_fadvise(mFd, 0, 0, advice);
+#endif
+	}
+
+	~PreadBlockDevice()
+	{
+		if (mDirectFd >= 0)
+			close(mDirectFd);
+		if (mFd >= 0)
+			close(mFd);
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		if (mDirect && IsAligned(offset) && IsAligned(len))
+		{
+			int64_t ret = DirectRead(offset, buf, len);
+			if (ret >= 0 || errno != EINVAL)
+				return ret;
+			DisableDirect();
+		}
+		return FullPread(mFd, buf, len, offset);
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		if (mDirect && IsAligned(offset) && IsAligned(len))
+		{
+			int64_t ret = DirectWrite(offset, buf, len);
+			if (ret >= 0 || errno != EINVAL)
+				return ret;
+			DisableDirect();
+		}
+		return FullPwrite(mFd, buf, len, offset);
+	}
+
+	uint64_t Size()
+	{
+		// Works for block devices too, pread/pwrite don't use the file position
+		off_t end = lseek(mFd, 0, SEEK_END);
+		return end > 0 ? end : 0;
+	}
+
+	bool Flush()
+	{
+		return fdatasync(mFd) == 0;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("pread/pwrite");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_DIRECT_IO, N_DIRECT_IO, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_FADVISE, N_FADVISE, CONFIG_TYPE_INT));
+		return params;
+	}
+
+private:
+	int64_t DirectRead(uint64_t offset, void *buf, uint32_t len)
+	{
+		if (IsAligned((uintptr_t)buf))
+			return FullPread(mDirectFd, buf, len, offset);
+
+		uint32_t size = len < BOUNCE_SIZE ? len : BOUNCE_SIZE;
+		void *bounce;
+		if ((errno = posix_memalign(&bounce, DIRECT_ALIGN, size)))
+			return -1;
+
+		int64_t done = 0;
+		while (done < len)
+		{
+			uint32_t n = len - done < size ? len - done : size;
+			int64_t ret = FullPread(mDirectFd, bounce, n, offset + done);
+			if (ret < 0)
+			{
+				if (!done)
+					done = -1;
+				break;
+			}
+			memcpy((uint8_t *)buf + done, bounce, ret);
+			done += ret;
+			if (ret < n)
+				break;
+		}
+		// Caller looks at errno to decide whether to drop O_DIRECT
+		int err = errno;
+		free(bounce);
+		errno = err;
+		return done;
+	}
+
+	int64_t DirectWrite(uint64_t offset, const void *buf, uint32_t len)
+	{
+		if (IsAligned((uintptr_t)buf))
+			return FullPwrite(mDirectFd, buf, len, offset);
+
+		uint32_t size = len < BOUNCE_SIZE ? len : BOUNCE_SIZE;
+		void *bounce;
+		if ((errno = posix_memalign(&bounce, DIRECT_ALIGN, size)))
+			return -1;
+
+		int64_t done = 0;
+		while (done < len)
+		{
+			uint32_t n = len - done < size ? len - done : size;
+			memcpy(bounce, (const uint8_t *)buf + done, n);
+			int64_t ret = FullPwrite(mDirectFd, bounce, n, offset + done);
+			if (ret < 0)
+			{
+				if (!done)
+					done = -1;
+				break;
+			}
+			done += ret;
+			if (ret < n)
+				break;
+		}
+		int err = errno;
+		free(bounce);
+		errno = err;
+		return done;
+	}
+
+	// Later requests use the page cache, the descriptor stays open for ones in flight
+	void DisableDirect()
+	{
+		if (mDirect.exchange(false))
+			OSDebugOut(TEXT("pread: O_DIRECT rejected, using page cache\n"));
+	}
+
+	int mFd;
+	int mDirectFd;
+	std::atomic<bool> mDirect;
+};
+
+REGISTER_BLOCKDEV(APINAME, PreadBlockDevice);
+};
+#undef APINAME
+#undef DIRECT_ALIGN
+#undef BOUNCE_SIZE
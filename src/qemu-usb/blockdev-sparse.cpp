@@ -0,0 +1,255 @@
+#include "blockdev.h"
+#include "sparseimage.h"
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <vector>
+#ifdef __GLIBC__
+#include <stdio_ext.h>
+#endif
+
+#define APINAME "sparse"
+
+// Decoded compressed clusters kept around, sequential reads hit the same one many times
+#define SPARSE_CACHE_CLUSTERS 16
+
+namespace blockdev_sparse {
+
+/*
+	Image in the sparse container format, see sparseimage.h. Zero clusters
+	are never read from disk, RAW clusters are read in place and compressed
+	ones are decoded into a small LRU cache. A write to a zero or compressed
+	cluster appends it RAW and repoints the index entry, all-zero results
+	become zero clusters again. RAW clusters are written in place unless
+	the write zeroes the whole cluster, partial zeroing would need a read.
+*/
+class SparseBlockDevice : public BlockDevice
+{
+	struct Decoded
+	{
+		uint64_t index;
+		std::vector<uint8_t> data;
+	};
+
+public:
+	SparseBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mEnd(0)
+	{
+		mFile = wfopen(path.c_str(), TEXT("r+b"));
+		if (!mFile)
+			throw BlockDeviceError("Could not open image file");
+
+		if (!SparseReadHeader(mFile, mHeader, mIndex))
+		{
+			fclose(mFile);
+			throw BlockDeviceError("Not a sparse image");
+		}
+
+		for (auto& entry : mIndex)
+		{
+			if (!SparseCodecAvailable(entry.type))
+			{
+				fclose(mFile);
+				throw BlockDeviceError("Image uses a compression this build lacks");
+			}
+		}
+		mEnd = SparseFileSize(mFile);
+	}
+
+	~SparseBlockDevice()
+	{
+		if (mFile)
+			fclose(mFile);
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (offset >= mHeader.size)
+			return 0;
+		if (len > mHeader.size - offset)
+			len = mHeader.size - offset;
+
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint64_t pos = offset + done;
+			uint64_t cluster = pos / mHeader.clusterSize;
+			uint32_t skip = pos % mHeader.clusterSize;
+			uint32_t n = std::min(mHeader.clusterSize - skip, len - done);
+			uint8_t *dst = (uint8_t *)buf + done;
+			const SparseIndexEntry& entry = mIndex[cluster];
+
+			if (entry.type == SPARSE_ZERO)
+				memset(dst, 0, n);
+			else if (entry.type == SPARSE_RAW)
+			{
+				if (!SparseReadAt(mFile, entry.offset + skip, dst, n))
+					return done ? (int64_t)done : -1;
+			}
+			else
+			{
+				const uint8_t *data = Decode(cluster);
+				if (!data)
+					return done ? (int64_t)done : -1;
+				memcpy(dst, data + skip, n);
+			}
+			done += n;
+		}
+		return done;
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		// Fixed size, writes past the end are cut short
+		if (offset >= mHeader.size)
+			return -1;
+		if (len > mHeader.size - offset)
+			len = mHeader.size - offset;
+
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint64_t pos = offset + done;
+			uint64_t cluster = pos / mHeader.clusterSize;
+			uint32_t skip = pos % mHeader.clusterSize;
+			uint32_t n = std::min(mHeader.clusterSize - skip, len - done);
+			if (!WriteCluster(cluster, skip, (const uint8_t *)buf + done, n))
+				return done ? (int64_t)done : -1;
+			done += n;
+		}
+		return done;
+	}
+
+	uint64_t Size()
+	{
+		return mHeader.size;
+	}
+
+	bool Flush()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return fflush(mFile) == 0;
+	}
+
+	// Buffered data or index updates must not reach a file that was replaced
+	void Discard()
+	{
+#ifdef __GLIBC__
+		std::lock_guard<std::mutex> lock(mMutex);
+		__fpurge(mFile);
+#endif
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("Sparse/compressed image");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return std::vector<CONFIGVARIANT>();
+	}
+
+private:
+	bool WriteCluster(uint64_t cluster, uint32_t skip, const uint8_t *src, uint32_t n)
+	{
+		SparseIndexEntry& entry = mIndex[cluster];
+		// Only a whole cluster of zeros turns a RAW cluster back into a zero one
+		if (entry.type == SPARSE_RAW && (n < mHeader.clusterSize || !SparseIsZero(src, n)))
+			return SparseWriteAt(mFile, entry.offset + skip, src, n);
+
+		// Zeros over a zero cluster, the guest formatting or wiping free space
+		if (entry.type == SPARSE_ZERO && SparseIsZero(src, n))
+			return true;
+
+		std::vector<uint8_t> data(mHeader.clusterSize);
+		if (entry.type == SPARSE_ZERO || entry.type == SPARSE_RAW)
+			memset(data.data(), 0, data.size());
+		else
+		{
+			const uint8_t *decoded = Decode(cluster);
+			if (!decoded)
+				return false;
+			memcpy(data.data(), decoded, data.size());
+		}
+		memcpy(data.data() + skip, src, n);
+		Forget(cluster);
+
+		// Old data of a compressed or RAW cluster is left behind, msdconvert reclaims it
+		SparseIndexEntry updated;
+		if (SparseIsZero(data.data(), data.size()))
+		{
+			updated.offset = 0;
+			updated.length = 0;
+			updated.type = SPARSE_ZERO;
+		}
+		else
+		{
+			if (!SparseWriteAt(mFile, mEnd, data.data(), data.size()))
+				return false;
+			updated.offset = mEnd;
+			updated.length = mHeader.clusterSize;
+			updated.type = SPARSE_RAW;
+			mEnd += mHeader.clusterSize;
+		}
+
+		// Data before the index entry that points to it
+		if (!SparseWriteIndex(mFile, mHeader, &updated, cluster, 1))
+			return false;
+		entry = updated;
+		return true;
+	}
+
+	const uint8_t* Decode(uint64_t cluster)
+	{
+		for (auto it = mCache.begin(); it != mCache.end(); ++it)
+		{
+			if (it->index == cluster)
+			{
+				mCache.splice(mCache.begin(), mCache, it);
+				return mCache.front().data.data();
+			}
+		}
+
+		if (mCache.size() >= SPARSE_CACHE_CLUSTERS)
+			mCache.pop_back();
+		mCache.push_front(Decoded());
+		Decoded& d = mCache.front();
+		d.index = cluster;
+		d.data.resize(mHeader.clusterSize);
+		if (!SparseReadCluster(mFile, mHeader, mIndex[cluster], d.data.data(), mScratch))
+		{
+			OSDebugOut(TEXT("sparse: cluster %llu is corrupt\n"), (unsigned long long)cluster);
+			mCache.pop_front();
+			return nullptr;
+		}
+		return d.data.data();
+	}
+
+	void Forget(uint64_t cluster)
+	{
+		for (auto it = mCache.begin(); it != mCache.end(); ++it)
+		{
+			if (it->index == cluster)
+			{
+				mCache.erase(it);
+				return;
+			}
+		}
+	}
+
+	FILE *mFile;
+	SparseHeader mHeader;
+	std::vector<SparseIndexEntry> mIndex;
+	uint64_t mEnd; // where rewritten clusters are appended
+	std::list<Decoded> mCache; // most recent first
+	std::vector<uint8_t> mScratch;
+	std::mutex mMutex;
+};
+
+REGISTER_BLOCKDEV(APINAME, SparseBlockDevice);
+};
+#undef APINAME
+#undef SPARSE_CACHE_CLUSTERS
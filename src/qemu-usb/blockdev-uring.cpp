@@ -0,0 +1,347 @@
+#include "blockdev.h"
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#define APINAME "io_uring"
+
+// Same number on every architecture since 5.1
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+// Entries submitted in one go, a request is split into this many pieces at most per batch
+#define URING_DEPTH 32
+// Piece size, so one 64K stream chunk is four reads the kernel can run in parallel
+#define URING_PIECE (16 * 1024)
+
+namespace blockdev_uring {
+
+static int64_t FullPread(int fd, void *buf, uint32_t len, uint64_t offset)
+{
+	uint32_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pread(fd, (uint8_t *)buf + done, len - done, offset + done);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return done ? (int64_t)done : -1;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int64_t FullPwrite(int fd, const void *buf, uint32_t len, uint64_t offset)
+{
+	uint32_t done = 0;
+	while (done < len)
+	{
+		ssize_t ret = pwrite(fd, (const uint8_t *)buf + done, len - done, offset + done);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return done ? (int64_t)done : -1;
+		}
+		done += ret;
+	}
+	return done;
+}
+
+/*
+	Splits each request into pieces, queues them all on an io_uring and
+	waits for the batch with a single io_uring_enter. Calls come from the
+	stream and write-back workers, the MSD NAKs bulk packets until their
+	chunk has completed. Kernels without io_uring (or where it is
+	blocked) get plain pread/pwrite.
+*/
+class UringBlockDevice : public BlockDevice
+{
+public:
+	UringBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mFd(-1), mRingFd(-1)
+	, mSqRing(MAP_FAILED), mCqRing(MAP_FAILED), mSqes(MAP_FAILED)
+	, mSqRingSize(0), mCqRingSize(0), mSqesSize(0)
+	{
+		mFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (mFd < 0)
+			throw BlockDeviceError("Could not open image file");
+
+		if (!SetupRing())
+		{
+			OSDebugOut(TEXT("io_uring: not available (%d), using pread/pwrite\n"), errno);
+			TeardownRing();
+		}
+	}
+
+	~UringBlockDevice()
+	{
+		TeardownRing();
+		if (mFd >= 0)
+			close(mFd);
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		return Transfer(IORING_OP_READV, offset, (uint8_t *)buf, len);
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		return Transfer(IORING_OP_WRITEV, offset, (uint8_t *)buf, len);
+	}
+
+	uint64_t Size()
+	{
+		off_t end = lseek(mFd, 0, SEEK_END);
+		return end > 0 ? end : 0;
+	}
+
+	bool Flush()
+	{
+		return fdatasync(mFd) == 0;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("io_uring");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return std::vector<CONFIGVARIANT>();
+	}
+
+private:
+	bool SetupRing()
+	{
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		mRingFd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+		if (mRingFd < 0)
+			return false;
+
+		mSqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+		mCqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		mSqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+		bool single = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			single = true;
+			mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+		}
+#endif
+		mSqRing = mmap(nullptr, mSqRingSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQ_RING);
+		if (mSqRing == MAP_FAILED)
+			return false;
+
+		if (single)
+			mCqRing = mSqRing;
+		else
+		{
+			mCqRing = mmap(nullptr, mCqRingSize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_CQ_RING);
+			if (mCqRing == MAP_FAILED)
+				return false;
+		}
+
+		mSqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, mRingFd, IORING_OFF_SQES);
+		if (mSqes == MAP_FAILED)
+			return false;
+
+		uint8_t *sq = (uint8_t *)mSqRing;
+		uint8_t *cq = (uint8_t *)mCqRing;
+		mSqTail = (uint32_t *)(sq + p.sq_off.tail);
+		mSqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+		mSqArray = (uint32_t *)(sq + p.sq_off.array);
+		mCqHead = (uint32_t *)(cq + p.cq_off.head);
+		mCqTail = (uint32_t *)(cq + p.cq_off.tail);
+		mCqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+		mCqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+		return true;
+	}
+
+	void TeardownRing()
+	{
+		int err = errno;
+		if (mSqes != MAP_FAILED)
+			munmap(mSqes, mSqesSize);
+		if (mCqRing != MAP_FAILED && mCqRing != mSqRing)
+			munmap(mCqRing, mCqRingSize);
+		if (mSqRing != MAP_FAILED)
+			munmap(mSqRing, mSqRingSize);
+		if (mRingFd >= 0)
+			close(mRingFd);
+		mSqes = mCqRing = mSqRing = MAP_FAILED;
+		mRingFd = -1;
+		errno = err;
+	}
+
+	// Queue up to URING_DEPTH pieces, wait for all of them, repeat
+	int64_t Transfer(uint8_t op, uint64_t offset, uint8_t *buf, uint32_t len)
+	{
+		std::unique_lock<std::mutex> lock(mMutex);
+		// Checked under the lock, another request may have torn the ring down
+		if (mRingFd < 0)
+		{
+			lock.unlock();
+			return op == IORING_OP_READV ?
+				FullPread(mFd, buf, len, offset) :
+				FullPwrite(mFd, buf, len, offset);
+		}
+
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint32_t count = 0;
+			uint32_t tail = *mSqTail;
+			for (uint32_t pos = done; pos < len && count < URING_DEPTH; pos += URING_PIECE, count++)
+			{
+				mIov[count].iov_base = buf + pos;
+				mIov[count].iov_len = std::min<uint32_t>(len - pos, URING_PIECE);
+
+				uint32_t idx = tail & mSqMask;
+				struct io_uring_sqe *sqe = (struct io_uring_sqe *)mSqes + idx;
+				memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode = op;
+				sqe->fd = mFd;
+				sqe->off = offset + pos;
+				sqe->addr = (uintptr_t)&mIov[count];
+				sqe->len = 1;
+				sqe->user_data = count;
+				mSqArray[idx] = idx;
+				tail++;
+			}
+			__atomic_store_n(mSqTail, tail, __ATOMIC_RELEASE);
+
+			if (!Complete(count))
+			{
+				// Ring is unusable, finish this request without it
+				OSDebugOut(TEXT("io_uring: enter failed (%d), using pread/pwrite\n"), errno);
+				TeardownRing();
+				int64_t ret = op == IORING_OP_READV ?
+					FullPread(mFd, buf + done, len - done, offset + done) :
+					FullPwrite(mFd, buf + done, len - done, offset + done);
+				if (ret < 0)
+					return done ? (int64_t)done : -1;
+				return done + ret;
+			}
+
+			// Pieces finish out of order, only the leading complete ones count
+			for (uint32_t i = 0; i < count; i++)
+			{
+				int32_t res = mResults[i];
+				uint32_t want = mIov[i].iov_len;
+				if (res < 0)
+				{
+					errno = -res;
+					return done ? (int64_t)done : -1;
+				}
+				done += res;
+				if ((uint32_t)res < want)
+				{
+					// End of image, or a rare partial transfer that plain I/O can finish
+					if (res == 0 && op == IORING_OP_READV)
+						return done;
+					int64_t ret = op == IORING_OP_READV ?
+						FullPread(mFd, buf + done, want - res, offset + done) :
+						FullPwrite(mFd, buf + done, want - res, offset + done);
+					if (ret > 0)
+						done += ret;
+					if (ret != (int64_t)(want - res))
+						return done ? (int64_t)done : -1;
+				}
+			}
+		}
+		return done;
+	}
+
+	// Submit what is queued and reap count completions into mResults
+	bool Complete(uint32_t count)
+	{
+		uint32_t toSubmit = count;
+		uint32_t reaped = 0;
+		while (true)
+		{
+			uint32_t head = *mCqHead;
+			uint32_t tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+			for (; head != tail; head++)
+			{
+				struct io_uring_cqe *cqe = &mCqes[head & mCqMask];
+				if (cqe->user_data < URING_DEPTH)
+					mResults[cqe->user_data] = cqe->res;
+				reaped++;
+			}
+			__atomic_store_n(mCqHead, head, __ATOMIC_RELEASE);
+			if (reaped >= count)
+				return true;
+
+			int ret = syscall(__NR_io_uring_enter, mRingFd, toSubmit, count - reaped,
+				IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (ret < 0)
+			{
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				// Don't tear down the ring under requests the kernel already took
+				WaitInflight(count - toSubmit - reaped);
+				return false;
+			}
+			toSubmit -= std::min<uint32_t>(ret, toSubmit);
+		}
+	}
+
+	// Best effort drain before giving up on the ring
+	void WaitInflight(uint32_t n)
+	{
+		while (n && syscall(__NR_io_uring_enter, mRingFd, 0, n, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno == EINTR)
+			;
+	}
+
+	int mFd;
+	int mRingFd;
+	void *mSqRing;
+	void *mCqRing;
+	void *mSqes;
+	size_t mSqRingSize;
+	size_t mCqRingSize;
+	size_t mSqesSize;
+
+	uint32_t *mSqTail;
+	uint32_t *mSqArray;
+	uint32_t mSqMask;
+	uint32_t *mCqHead;
+	uint32_t *mCqTail;
+	uint32_t mCqMask;
+	struct io_uring_cqe *mCqes;
+
+	struct iovec mIov[URING_DEPTH];
+	int32_t mResults[URING_DEPTH];
+	std::mutex mMutex; // one batch in flight, the iovecs and results are shared
+};
+
+REGISTER_BLOCKDEV(APINAME, UringBlockDevice);
+};
+#undef APINAME
+#undef URING_DEPTH
+#undef URING_PIECE
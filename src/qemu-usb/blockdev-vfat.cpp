@@ -0,0 +1,717 @@
+#include "blockdev.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define APINAME "vfat"
+
+#define VFAT_SECTOR 512
+// Partition starts 1 MiB in, after an MBR, like any recently formatted stick
+#define VFAT_PART_START 2048
+#define VFAT_RESERVED 32
+#define VFAT_NUM_FATS 2
+#define VFAT_ROOT_CLUSTER 2
+#define VFAT_EOC 0x0FFFFFFF
+#define VFAT_DIRENT 32
+#define VFAT_MIN_MB 512
+#define VFAT_MAX_MB (1024 * 1024)
+#define VFAT_DEFAULT_MB 4096
+// Host files kept open between reads
+#define VFAT_OPEN_FILES 16
+
+namespace blockdev_vfat {
+
+static inline void Put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static inline void Put32(uint8_t *p, uint32_t v) { Put16(p, v); Put16(p + 2, v >> 16); }
+
+// UTF-8 to UTF-16, false on malformed input
+static bool ToUtf16(const std::string& in, std::vector<uint16_t>& out)
+{
+	out.clear();
+	for (size_t i = 0; i < in.size();)
+	{
+		uint8_t c = in[i];
+		uint32_t cp;
+		int extra;
+		if (c < 0x80) { cp = c; extra = 0; }
+		else if ((c & 0xE0) == 0xC0) { cp = c & 0x1F; extra = 1; }
+		else if ((c & 0xF0) == 0xE0) { cp = c & 0x0F; extra = 2; }
+		else if ((c & 0xF8) == 0xF0) { cp = c & 0x07; extra = 3; }
+		else return false;
+		if (extra && i + extra >= in.size())
+			return false;
+		for (int k = 1; k <= extra; k++)
+		{
+			if ((in[i + k] & 0xC0) != 0x80)
+				return false;
+			cp = (cp << 6) | (in[i + k] & 0x3F);
+		}
+		i += extra + 1;
+		if (cp >= 0x10000)
+		{
+			cp -= 0x10000;
+			out.push_back(0xD800 | (cp >> 10));
+			out.push_back(0xDC00 | (cp & 0x3FF));
+		}
+		else
+			out.push_back(cp);
+	}
+	return true;
+}
+
+static bool ValidShortChar(char c)
+{
+	if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+		return true;
+	return c && strchr("$%'-_@~`!(){}^#&", c);
+}
+
+// Name already is an upper case 8.3 name, needs no long name entries
+static bool IsShortName(const std::string& name)
+{
+	size_t dot = name.find('.');
+	std::string base = name.substr(0, dot);
+	std::string ext = dot == std::string::npos ? "" : name.substr(dot + 1);
+	if (base.empty() || base.size() > 8 || ext.size() > 3 || (dot != std::string::npos && ext.empty()))
+		return false;
+	for (char c : base + ext)
+		if (!ValidShortChar(c))
+			return false;
+	return true;
+}
+
+// Long name entries a name takes, -1 if it can't be represented
+static int LongEntries(const std::string& name)
+{
+	if (IsShortName(name))
+		return 0;
+	std::vector<uint16_t> utf16;
+	if (!ToUtf16(name, utf16) || utf16.empty() || utf16.size() > 255)
+		return -1;
+	return (utf16.size() + 12) / 13;
+}
+
+static uint8_t ShortNameChecksum(const uint8_t *name)
+{
+	uint8_t sum = 0;
+	for (int i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+	return sum;
+}
+
+static void DosTime(time_t t, uint16_t& date, uint16_t& time)
+{
+	struct tm tm;
+	localtime_r(&t, &tm);
+	if (tm.tm_year > 80 + 127)
+		tm.tm_year = 80 + 127;
+	if (tm.tm_year < 80)
+	{
+		date = (1 << 5) | 1; // 1980-01-01
+		time = 0;
+		return;
+	}
+	date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+	time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+/*
+	Presents a host directory as a FAT32 stick. Nothing is built up front:
+	a directory is listed when it gets its clusters, and only read and
+	stat'ed, which allocates clusters for its children, when the guest
+	reads it or reads the FAT past what has been allocated so far. Every
+	file gets one contiguous cluster run and its data clusters are served
+	straight from the host file. The drive is read-only.
+*/
+class VfatBlockDevice : public BlockDevice
+{
+	struct Node
+	{
+		std::string hostPath;
+		std::string name;
+		bool dir;
+		uint32_t size;
+		time_t mtime;
+		uint32_t firstCluster; // 0 for empty files
+		uint32_t clusters;
+		uint32_t parentCluster; // for "..", 0 is the root
+		bool scanned;
+		std::vector<std::string> names; // directory listing taken at allocation
+		std::vector<uint8_t> entries; // directory clusters, built on first use
+	};
+
+	struct OpenFile
+	{
+		Node *node;
+		int fd;
+	};
+
+public:
+	VfatBlockDevice(int port, const std::string& api, const TSTDSTRING& path)
+	: mNextFree(VFAT_ROOT_CLUSTER)
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) || !S_ISDIR(st.st_mode))
+			throw BlockDeviceError("Not a directory");
+
+		CONFIGVARIANT varSize(N_VFAT_SIZE, CONFIG_TYPE_INT);
+		uint64_t sizeMB = VFAT_DEFAULT_MB;
+		if (LoadSetting(port, api, varSize) && varSize.intValue > 0)
+			sizeMB = varSize.intValue;
+		// 32-bit sector counts, stay well clear of 2 TiB
+		sizeMB = std::min<uint64_t>(std::max<uint64_t>(sizeMB, VFAT_MIN_MB), VFAT_MAX_MB);
+		Layout(sizeMB * 1024 * 1024 / VFAT_SECTOR);
+
+		mVolumeId = 0x5553424D; // "USBM"
+		for (char c : path)
+			mVolumeId = mVolumeId * 31 + (uint8_t)c;
+
+		Node *root = NewNode(path, "", true, 0, st.st_mtime);
+		root->parentCluster = 0;
+		ListDir(root);
+		if (!Allocate(root))
+			throw BlockDeviceError("Volume too small for root directory");
+		mUnscanned.push_back(root);
+	}
+
+	~VfatBlockDevice()
+	{
+		for (auto& f : mOpenFiles)
+			close(f.fd);
+	}
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		uint64_t size = (uint64_t)(VFAT_PART_START + mPartSectors) * VFAT_SECTOR;
+		if (offset >= size)
+			return 0;
+		if (len > size - offset)
+			len = size - offset;
+
+		uint64_t dataStart = (uint64_t)(VFAT_PART_START + mDataSector) * VFAT_SECTOR;
+		uint32_t done = 0;
+		while (done < len)
+		{
+			uint64_t pos = offset + done;
+			uint8_t *dst = (uint8_t *)buf + done;
+			uint32_t n;
+			if (pos >= dataStart)
+			{
+				n = ReadData(pos - dataStart, dst, len - done);
+				if (!n)
+					return done ? (int64_t)done : -1;
+			}
+			else
+			{
+				uint8_t sector[VFAT_SECTOR];
+				uint32_t skip = pos % VFAT_SECTOR;
+				n = std::min<uint32_t>(VFAT_SECTOR - skip, len - done);
+				BuildSector(pos / VFAT_SECTOR, sector);
+				memcpy(dst, sector + skip, n);
+			}
+			done += n;
+		}
+		return done;
+	}
+
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len)
+	{
+		return -1;
+	}
+
+	bool ReadOnly() const
+	{
+		return true;
+	}
+
+	uint64_t Size()
+	{
+		return (uint64_t)(VFAT_PART_START + mPartSectors) * VFAT_SECTOR;
+	}
+
+	bool Flush()
+	{
+		return true;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("Host directory (virtual FAT32)");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_VFAT_SIZE, N_VFAT_SIZE, CONFIG_TYPE_INT));
+		return params;
+	}
+
+private:
+	// Cluster size by volume size, as the usual format tools pick it
+	void Layout(uint32_t totalSectors)
+	{
+		mPartSectors = totalSectors - VFAT_PART_START;
+		uint64_t bytes = (uint64_t)mPartSectors * VFAT_SECTOR;
+		if (bytes <= 8ULL << 30)
+			mSectorsPerCluster = 8;
+		else if (bytes <= 16ULL << 30)
+			mSectorsPerCluster = 16;
+		else if (bytes <= 32ULL << 30)
+			mSectorsPerCluster = 32;
+		else
+			mSectorsPerCluster = 64;
+		mClusterSize = mSectorsPerCluster * VFAT_SECTOR;
+
+		// Sized for every cluster the data area could hold, a bit generous is fine
+		uint32_t maxClusters = (mPartSectors - VFAT_RESERVED) / mSectorsPerCluster;
+		mFatSectors = ((uint64_t)(maxClusters + 2) * 4 + VFAT_SECTOR - 1) / VFAT_SECTOR;
+		mDataSector = VFAT_RESERVED + VFAT_NUM_FATS * mFatSectors;
+		mClusters = (mPartSectors - mDataSector) / mSectorsPerCluster;
+	}
+
+	Node* NewNode(const std::string& hostPath, const std::string& name, bool dir, uint32_t size, time_t mtime)
+	{
+		Node *node = new Node();
+		node->hostPath = hostPath;
+		node->name = name;
+		node->dir = dir;
+		node->size = size;
+		node->mtime = mtime;
+		node->firstCluster = 0;
+		node->clusters = 0;
+		node->parentCluster = 0;
+		node->scanned = false;
+		mNodes.push_back(std::unique_ptr<Node>(node));
+		return node;
+	}
+
+	// Take the listing now so the directory's size can't change once allocated
+	void ListDir(Node *node)
+	{
+		DIR *dir = opendir(node->hostPath.c_str());
+		if (!dir)
+			return;
+		while (struct dirent *ent = readdir(dir))
+		{
+			std::string name = ent->d_name;
+			if (name == "." || name == ".." || LongEntries(name) < 0)
+				continue;
+			node->names.push_back(name);
+		}
+		closedir(dir);
+	}
+
+	bool Allocate(Node *node)
+	{
+		uint64_t bytes;
+		if (node->dir)
+		{
+			uint64_t count = node == mNodes.front().get() ? 0 : 2; // "." and ".."
+			for (auto& name : node->names)
+				count += 1 + LongEntries(name);
+			bytes = std::max<uint64_t>(count * VFAT_DIRENT, 1);
+		}
+		else
+			bytes = node->size;
+
+		uint32_t clusters = (bytes + mClusterSize - 1) / mClusterSize;
+		if (!clusters)
+			return true;
+		if (clusters > mClusters + VFAT_ROOT_CLUSTER - mNextFree)
+			return false;
+
+		node->firstCluster = mNextFree;
+		node->clusters = clusters;
+		mNextFree += clusters;
+		mExtents[node->firstCluster] = node;
+		return true;
+	}
+
+	// stat the listing, allocate the children and build the directory entries
+	void Scan(Node *dir)
+	{
+		dir->scanned = true;
+		std::vector<Node *> children;
+		for (auto& name : dir->names)
+		{
+			std::string hostPath = dir->hostPath + "/" + name;
+			struct stat st;
+			if (stat(hostPath.c_str(), &st))
+				continue;
+			bool isDir = S_ISDIR(st.st_mode);
+			// FAT32 files stop at 4 GiB
+			if ((!isDir && !S_ISREG(st.st_mode)) || (!isDir && st.st_size > 0xFFFFFFFFLL))
+				continue;
+
+			Node *child = NewNode(hostPath, name, isDir, isDir ? 0 : (uint32_t)st.st_size, st.st_mtime);
+			child->parentCluster = dir == mNodes.front().get() ? 0 : dir->firstCluster;
+			if (isDir)
+				ListDir(child);
+			if (!Allocate(child))
+			{
+				OSDebugOut(TEXT("vfat: volume full, leaving out %s\n"), hostPath.c_str());
+				continue;
+			}
+			if (isDir)
+				mUnscanned.push_back(child);
+			children.push_back(child);
+		}
+		dir->names.clear();
+		BuildEntries(dir, children);
+	}
+
+	void BuildEntries(Node *dir, const std::vector<Node *>& children)
+	{
+		std::vector<uint8_t>& out = dir->entries;
+		out.reserve(dir->clusters * mClusterSize);
+		if (dir != mNodes.front().get())
+		{
+			AddEntry(out, (const uint8_t *)".          ", 0x10, dir->firstCluster, 0, dir->mtime);
+			AddEntry(out, (const uint8_t *)"..         ", 0x10, dir->parentCluster, 0, dir->mtime);
+		}
+
+		// Real short names first so generated ones steer clear of them
+		std::set<std::string> used;
+		for (Node *child : children)
+			if (!LongEntries(child->name))
+				used.insert(ShortKey(child->name));
+
+		for (Node *child : children)
+		{
+			uint8_t shortName[11];
+			bool isLong = LongEntries(child->name) > 0;
+			MakeShortName(child->name, isLong, used, shortName);
+			if (isLong)
+				AddLongEntries(out, child->name, ShortNameChecksum(shortName));
+			AddEntry(out, shortName, child->dir ? 0x10 : 0x20, child->firstCluster, child->size, child->mtime);
+		}
+		// Allocation counted entries for names that disappeared since, those stay free
+		out.resize((size_t)dir->clusters * mClusterSize);
+	}
+
+	void MakeShortName(const std::string& name, bool isLong, std::set<std::string>& used, uint8_t *out)
+	{
+		std::string base, ext;
+		size_t dot = name.rfind('.');
+		if (!isLong)
+		{
+			base = name.substr(0, dot);
+			ext = dot == std::string::npos ? "" : name.substr(dot + 1);
+		}
+		else
+		{
+			for (size_t i = 0; i < name.size() && i != dot; i++)
+			{
+				char c = toupper((uint8_t)name[i]);
+				if (c == ' ' || c == '.')
+					continue;
+				base += ValidShortChar(c) ? c : '_';
+			}
+			if (dot != std::string::npos && dot != 0)
+			{
+				for (size_t i = dot + 1; i < name.size() && ext.size() < 3; i++)
+				{
+					char c = toupper((uint8_t)name[i]);
+					if (c != ' ')
+						ext += ValidShortChar(c) ? c : '_';
+				}
+			}
+			if (base.empty())
+				base = "_";
+
+			// BASE~N, shortening the base as N grows
+			std::string tail, candidate;
+			for (uint32_t n = 1;; n++)
+			{
+				tail = "~" + std::to_string(n);
+				candidate = base.substr(0, 8 - tail.size()) + tail;
+				if (!used.count(candidate + "." + ext))
+					break;
+			}
+			base = candidate;
+			used.insert(candidate + "." + ext);
+		}
+
+		memset(out, ' ', 11);
+		memcpy(out, base.data(), std::min<size_t>(base.size(), 8));
+		memcpy(out + 8, ext.data(), std::min<size_t>(ext.size(), 3));
+		// 0xE5 marks a deleted entry, 0x05 stands in for it
+		if (out[0] == 0xE5)
+			out[0] = 0x05;
+	}
+
+	static std::string ShortKey(const std::string& name)
+	{
+		return name.find('.') == std::string::npos ? name + "." : name;
+	}
+
+	void AddLongEntries(std::vector<uint8_t>& out, const std::string& name, uint8_t checksum)
+	{
+		std::vector<uint16_t> utf16;
+		ToUtf16(name, utf16);
+		size_t count = (utf16.size() + 12) / 13;
+		// Terminated by 0x0000 unless it fills the last entry, padded with 0xFFFF
+		if (utf16.size() % 13)
+			utf16.push_back(0);
+		utf16.resize(count * 13, 0xFFFF);
+
+		static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+		for (size_t i = count; i > 0; i--)
+		{
+			uint8_t ent[VFAT_DIRENT] = {};
+			ent[0] = i | (i == count ? 0x40 : 0);
+			ent[11] = 0x0F;
+			ent[13] = checksum;
+			for (int k = 0; k < 13; k++)
+				Put16(ent + offsets[k], utf16[(i - 1) * 13 + k]);
+			out.insert(out.end(), ent, ent + VFAT_DIRENT);
+		}
+	}
+
+	void AddEntry(std::vector<uint8_t>& out, const uint8_t *name, uint8_t attr, uint32_t cluster, uint32_t size, time_t mtime)
+	{
+		uint8_t ent[VFAT_DIRENT] = {};
+		uint16_t date, time;
+		DosTime(mtime, date, time);
+		memcpy(ent, name, 11);
+		ent[11] = attr;
+		Put16(ent + 14, time);
+		Put16(ent + 16, date);
+		Put16(ent + 18, date);
+		Put16(ent + 20, cluster >> 16);
+		Put16(ent + 22, time);
+		Put16(ent + 24, date);
+		Put16(ent + 26, cluster & 0xFFFF);
+		Put32(ent + 28, size);
+		out.insert(out.end(), ent, ent + VFAT_DIRENT);
+	}
+
+	// Allocation happens in scan order, so a FAT read past it scans ahead
+	void AllocateUpTo(uint32_t cluster)
+	{
+		while (cluster >= mNextFree && !mUnscanned.empty())
+		{
+			Node *dir = mUnscanned.front();
+			mUnscanned.pop_front();
+			if (!dir->scanned)
+				Scan(dir);
+		}
+	}
+
+	Node* Owner(uint32_t cluster)
+	{
+		AllocateUpTo(cluster);
+		auto it = mExtents.upper_bound(cluster);
+		if (it == mExtents.begin())
+			return nullptr;
+		--it;
+		Node *node = it->second;
+		return cluster < node->firstCluster + node->clusters ? node : nullptr;
+	}
+
+	uint32_t FatEntry(uint32_t cluster)
+	{
+		if (cluster == 0)
+			return 0x0FFFFFF8;
+		if (cluster == 1)
+			return VFAT_EOC;
+		if (cluster >= mClusters + VFAT_ROOT_CLUSTER)
+			return 0;
+		Node *node = Owner(cluster);
+		if (!node)
+			return 0;
+		return cluster + 1 == node->firstCluster + node->clusters ? VFAT_EOC : cluster + 1;
+	}
+
+	void BuildSector(uint64_t sector, uint8_t *out)
+	{
+		memset(out, 0, VFAT_SECTOR);
+		if (sector < VFAT_PART_START)
+		{
+			if (sector == 0)
+				BuildMbr(out);
+			return;
+		}
+
+		uint32_t rel = sector - VFAT_PART_START;
+		if (rel == 0 || rel == 6)
+			BuildBootSector(out);
+		else if (rel == 1 || rel == 7)
+			BuildFsInfo(out);
+		else if (rel >= VFAT_RESERVED)
+		{
+			// Both FAT copies are the same
+			uint32_t fatSector = (rel - VFAT_RESERVED) % mFatSectors;
+			uint32_t first = fatSector * (VFAT_SECTOR / 4);
+			for (uint32_t i = 0; i < VFAT_SECTOR / 4; i++)
+				Put32(out + i * 4, FatEntry(first + i));
+		}
+	}
+
+	void BuildMbr(uint8_t *out)
+	{
+		uint8_t *part = out + 446;
+		part[1] = 0xFE; part[2] = 0xFF; part[3] = 0xFF; // CHS unused, LBA only
+		part[4] = 0x0C; // FAT32 LBA
+		part[5] = 0xFE; part[6] = 0xFF; part[7] = 0xFF;
+		Put32(part + 8, VFAT_PART_START);
+		Put32(part + 12, mPartSectors);
+		Put32(out + 440, mVolumeId);
+		out[510] = 0x55;
+		out[511] = 0xAA;
+	}
+
+	void BuildBootSector(uint8_t *out)
+	{
+		out[0] = 0xEB; out[1] = 0x58; out[2] = 0x90;
+		memcpy(out + 3, "USBQEMU ", 8);
+		Put16(out + 11, VFAT_SECTOR);
+		out[13] = mSectorsPerCluster;
+		Put16(out + 14, VFAT_RESERVED);
+		out[16] = VFAT_NUM_FATS;
+		out[21] = 0xF8;
+		Put16(out + 24, 63);
+		Put16(out + 26, 255);
+		Put32(out + 28, VFAT_PART_START);
+		Put32(out + 32, mPartSectors);
+		Put32(out + 36, mFatSectors);
+		Put32(out + 44, VFAT_ROOT_CLUSTER);
+		Put16(out + 48, 1); // FSInfo
+		Put16(out + 50, 6); // backup boot sector
+		out[64] = 0x80;
+		out[66] = 0x29;
+		Put32(out + 67, mVolumeId);
+		memcpy(out + 71, "USBQEMU    ", 11);
+		memcpy(out + 82, "FAT32   ", 8);
+		out[510] = 0x55;
+		out[511] = 0xAA;
+	}
+
+	void BuildFsInfo(uint8_t *out)
+	{
+		Put32(out, 0x41615252);
+		Put32(out + 484, 0x61417272);
+		// Not known until everything is scanned, drivers count it themselves
+		Put32(out + 488, 0xFFFFFFFF);
+		Put32(out + 492, 0xFFFFFFFF);
+		Put32(out + 508, 0xAA550000);
+	}
+
+	// Serve data area bytes, file runs go to the host file in one read
+	uint32_t ReadData(uint64_t off, uint8_t *dst, uint32_t len)
+	{
+		uint32_t cluster = off / mClusterSize + VFAT_ROOT_CLUSTER;
+		Node *node = cluster < mClusters + VFAT_ROOT_CLUSTER ? Owner(cluster) : nullptr;
+		if (!node)
+		{
+			uint32_t n = std::min<uint64_t>(mClusterSize - off % mClusterSize, len);
+			memset(dst, 0, n);
+			return n;
+		}
+
+		uint64_t nodeOff = off - (uint64_t)(node->firstCluster - VFAT_ROOT_CLUSTER) * mClusterSize;
+		uint64_t nodeBytes = (uint64_t)node->clusters * mClusterSize;
+		uint32_t n = std::min<uint64_t>(nodeBytes - nodeOff, len);
+
+		if (node->dir)
+		{
+			if (!node->scanned)
+				Scan(node);
+			memcpy(dst, node->entries.data() + nodeOff, n);
+			return n;
+		}
+
+		// Slack after the end of file, and whatever the file lost since it was listed, reads as zeros
+		uint32_t fromFile = nodeOff < node->size ? std::min<uint64_t>(node->size - nodeOff, n) : 0;
+		if (fromFile)
+		{
+			int fd = OpenHostFile(node);
+			if (fd < 0)
+				return 0;
+			uint32_t got = 0;
+			while (got < fromFile)
+			{
+				ssize_t ret = pread(fd, dst + got, fromFile - got, nodeOff + got);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret < 0)
+					return 0;
+				if (ret == 0)
+					break;
+				got += ret;
+			}
+			fromFile = got;
+		}
+		memset(dst + fromFile, 0, n - fromFile);
+		return n;
+	}
+
+	int OpenHostFile(Node *node)
+	{
+		for (auto it = mOpenFiles.begin(); it != mOpenFiles.end(); ++it)
+		{
+			if (it->node == node)
+			{
+				mOpenFiles.splice(mOpenFiles.begin(), mOpenFiles, it);
+				return it->fd;
+			}
+		}
+
+		int fd = open(node->hostPath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			OSDebugOut(TEXT("vfat: could not open %s\n"), node->hostPath.c_str());
+			return -1;
+		}
+		if (mOpenFiles.size() >= VFAT_OPEN_FILES)
+		{
+			close(mOpenFiles.back().fd);
+			mOpenFiles.pop_back();
+		}
+		mOpenFiles.push_front({ node, fd });
+		return fd;
+	}
+
+	uint32_t mPartSectors;
+	uint32_t mSectorsPerCluster;
+	uint32_t mClusterSize;
+	uint32_t mFatSectors;
+	uint32_t mDataSector; // partition relative
+	uint32_t mClusters;
+	uint32_t mVolumeId;
+
+	std::vector<std::unique_ptr<Node> > mNodes; // root first
+	std::map<uint32_t, Node *> mExtents; // first cluster to owner
+	std::deque<Node *> mUnscanned; // allocated directories in allocation order
+	uint32_t mNextFree;
+	std::list<OpenFile> mOpenFiles; // most recent first
+	std::mutex mMutex;
+};
+
+REGISTER_BLOCKDEV(APINAME, VfatBlockDevice);
+};
+#undef APINAME
+#undef VFAT_SECTOR
+#undef VFAT_PART_START
+#undef VFAT_RESERVED
+#undef VFAT_NUM_FATS
+#undef VFAT_ROOT_CLUSTER
+#undef VFAT_EOC
+#undef VFAT_DIRENT
+#undef VFAT_MIN_MB
+#undef VFAT_MAX_MB
+#undef VFAT_DEFAULT_MB
+#undef VFAT_OPEN_FILES
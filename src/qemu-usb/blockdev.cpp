@@ -0,0 +1,6 @@
+#include "blockdev.h"
+
+BlockDeviceProxyBase::BlockDeviceProxyBase(const std::string& name)
+{
+	RegisterBlockDevice::instance().Add(name, this);
+}
@@ -0,0 +1,160 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+#include <cstdint>
+#include <string>
+#include <map>
+#include <list>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include "../helpers.h"
+#include "../configuration.h"
+#include "../osdebugout.h"
+
+// pread backend options
+#define S_DIRECT_IO	TEXT("Bypass host page cache (O_DIRECT)")
+#define N_DIRECT_IO	TEXT("direct_io")
+#define S_FADVISE	TEXT("Access pattern hint")
+#define N_FADVISE	TEXT("fadvise")
+
+// vfat backend options
+#define S_VFAT_SIZE	TEXT("Volume size (MiB)")
+#define N_VFAT_SIZE	TEXT("vfat_size")
+
+// overlay backend options
+#define S_DELTA_PATH	TEXT("Delta file (empty for next to the image)")
+#define N_DELTA_PATH	TEXT("delta_path")
+#define S_DISCARD_DELTA	TEXT("Discard changes on start")
+#define N_DISCARD_DELTA	TEXT("discard_delta")
+
+enum BlockAccessHint {
+	BLOCK_HINT_NONE = 0,
+	BLOCK_HINT_SEQUENTIAL,
+	BLOCK_HINT_RANDOM,
+};
+
+class BlockDeviceError : public std::runtime_error
+{
+public:
+	BlockDeviceError(const char* msg) : std::runtime_error(msg) {}
+	virtual ~BlockDeviceError() throw () {}
+};
+
+/*
+	Disk image addressed by byte offset. There is no shared file position,
+	so a read or write never depends on what the previous call did.
+	Calls can come from several worker threads at once.
+*/
+class BlockDevice
+{
+public:
+	virtual ~BlockDevice() {}
+	// Bytes transferred, short at end of image, -1 on error
+	virtual int64_t Read(uint64_t offset, void *buf, uint32_t len) = 0;
+	virtual int64_t Write(uint64_t offset, const void *buf, uint32_t len) = 0;
+	// Image size in bytes
+	virtual uint64_t Size() = 0;
+	// Push written data to the host file
+	virtual bool Flush() = 0;
+	// File changed under us: drop buffered writes and cached data unwritten
+	virtual void Discard() {}
+	// Reads are memory copies, callers can read straight into their buffers
+	virtual bool Mapped() const { return false; }
+	// Writes always fail, the guest should see a write protected disk
+	virtual bool ReadOnly() const { return false; }
+
+	//Remember to add to your class
+	//static const TCHAR* Name();
+	//static std::vector<CONFIGVARIANT> GetSettings();
+};
+
+class BlockDeviceProxyBase
+{
+	BlockDeviceProxyBase(const BlockDeviceProxyBase&) = delete;
+
+	public:
+	BlockDeviceProxyBase(const std::string& name);
+	virtual ~BlockDeviceProxyBase() {}
+	virtual BlockDevice* CreateObject(int port, const std::string& api, const TSTDSTRING& path) const = 0;
+	virtual const TCHAR* Name() const = 0;
+	virtual std::vector<CONFIGVARIANT> GetSettings() = 0;
+};
+
+template <class T>
+class BlockDeviceProxy : public BlockDeviceProxyBase
+{
+	BlockDeviceProxy(const BlockDeviceProxy&) = delete;
+
+	public:
+	BlockDeviceProxy(const std::string& name): BlockDeviceProxyBase(name) {}
+	BlockDevice* CreateObject(int port, const std::string& api, const TSTDSTRING& path) const
+	{
+		try
+		{
+			return new T(port, api, path);
+		}
+		catch(BlockDeviceError& err)
+		{
+			OSDebugOut(TEXT("BlockDevice port %d: %") TEXT(SFMTs) TEXT("\n"), port, err.what());
+			(void)err;
+			return nullptr;
+		}
+	}
+	virtual const TCHAR* Name() const
+	{
+		return T::Name();
+	}
+	virtual std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return T::GetSettings();
+	}
+};
+
+class RegisterBlockDevice
+{
+	RegisterBlockDevice(const RegisterBlockDevice&) = delete;
+	RegisterBlockDevice() {}
+
+	public:
+	typedef std::map<std::string, BlockDeviceProxyBase* > RegisterBlockDeviceMap;
+	static RegisterBlockDevice& instance() {
+		static RegisterBlockDevice registerBlockDevice;
+		return registerBlockDevice;
+	}
+
+	~RegisterBlockDevice() {}
+
+	void Add(const std::string& name, BlockDeviceProxyBase* creator)
+	{
+		registerBlockDeviceMap[name] = creator;
+	}
+
+	BlockDeviceProxyBase* Proxy(const std::string& name)
+	{
+		auto it = registerBlockDeviceMap.find(name);
+		if (it != registerBlockDeviceMap.end())
+			return it->second;
+		return nullptr;
+	}
+
+	std::list<std::string> Names() const
+	{
+		std::list<std::string> nameList;
+		std::transform(
+			registerBlockDeviceMap.begin(), registerBlockDeviceMap.end(),
+			std::back_inserter(nameList),
+			SelectKey());
+		return nameList;
+	}
+
+	const RegisterBlockDeviceMap& Map() const
+	{
+		return registerBlockDeviceMap;
+	}
+
+private:
+	RegisterBlockDeviceMap registerBlockDeviceMap;
+};
+
+#define REGISTER_BLOCKDEV(name,cls) BlockDeviceProxy<cls> g##cls##Proxy(name)
+#endif
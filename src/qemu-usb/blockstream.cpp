@@ -0,0 +1,274 @@
+#include "blockstream.h"
+#include <cstring>
+
+BlockStream::BlockStream(BlockDevice *dev, uint32_t chunkSize)
+: mDev(dev)
+, mChunkSize(chunkSize)
+, mCur(0)
+, mWork(0)
+, mNext(0)
+, mEnd(0)
+, mError(false)
+, mQuit(false)
+{
+	for (auto& c : mChunks)
+	{
+		c.data.resize(mChunkSize);
+		c.offset = 0;
+		c.len = 0;
+		c.pos = 0;
+		c.write = false;
+		c.ok = true;
+		c.state = CHUNK_FREE;
+	}
+	mThread = std::thread(&BlockStream::Worker, this);
+}
+
+BlockStream::~BlockStream()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mCond.notify_all();
+	if (mThread.joinable())
+		mThread.join();
+}
+
+void BlockStream::Worker()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true)
+	{
+		mCond.wait(lock, [this] { return mQuit || mChunks[mWork].state == CHUNK_PENDING; });
+		if (mQuit)
+			break;
+
+		Chunk& c = mChunks[mWork];
+		c.state = CHUNK_BUSY;
+		lock.unlock();
+
+		int64_t ret;
+		if (c.write)
+			ret = mDev->Write(c.offset, c.data.data(), c.len);
+		else
+		{
+			ret = mDev->Read(c.offset, c.data.data(), c.len);
+			// Past the end of image or failed, guest gets zeros
+			if (ret < c.len)
+				memset(c.data.data() + (ret > 0 ? ret : 0), 0, c.len - (ret > 0 ? ret : 0));
+		}
+
+		lock.lock();
+		c.ok = ret == c.len;
+		c.state = CHUNK_DONE;
+		mWork ^= 1;
+		mCond.notify_all();
+	}
+}
+
+void BlockStream::QueueRead(Chunk& c)
+{
+	if (mNext >= mEnd)
+	{
+		c.state = CHUNK_FREE;
+		return;
+	}
+	c.offset = mNext;
+	c.len = mEnd - mNext < mChunkSize ? (uint32_t)(mEnd - mNext) : mChunkSize;
+	c.pos = 0;
+	c.write = false;
+	c.state = CHUNK_PENDING;
+	mNext += c.len;
+}
+
+void BlockStream::Submit(Chunk& c)
+{
+	c.offset = mNext;
+	c.len = c.pos;
+	c.write = true;
+	c.state = CHUNK_PENDING;
+	mNext += c.len;
+}
+
+void BlockStream::WaitIdle(std::unique_lock<std::mutex>& lock, Chunk& c)
+{
+	mCond.wait(lock, [&c] { return !Waiting(c); });
+}
+
+void BlockStream::StartRead(uint64_t offset, uint64_t len)
+{
+	Cancel();
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mNext = offset;
+		mEnd = offset + len;
+		QueueRead(mChunks[0]);
+		QueueRead(mChunks[1]);
+	}
+	mCond.notify_all();
+}
+
+bool BlockStream::Read(uint8_t *dst, uint32_t len)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (len > 0)
+	{
+		Chunk& c = mChunks[mCur];
+		WaitIdle(lock, c);
+		if (c.state == CHUNK_FREE)
+		{
+			// Guest asked for more than the command covers
+			memset(dst, 0, len);
+			return !mError;
+		}
+
+		uint32_t n = c.len - c.pos < len ? c.len - c.pos : len;
+		memcpy(dst, c.data.data() + c.pos, n);
+		c.pos += n;
+		dst += n;
+		len -= n;
+		if (!c.ok)
+			mError = true;
+
+		if (c.pos == c.len)
+		{
+			QueueRead(c);
+			mCur ^= 1;
+			mCond.notify_all();
+		}
+	}
+	return !mError;
+}
+
+bool BlockStream::ReadReady(uint32_t len)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	// Packets are far smaller than a chunk, at most they straddle two
+	for (int i = 0, cur = mCur; i < 2; i++, cur ^= 1)
+	{
+		const Chunk& c = mChunks[cur];
+		if (Waiting(c))
+			return false;
+		if (c.state == CHUNK_FREE || c.len - c.pos >= len)
+			return true;
+		len -= c.len - c.pos;
+	}
+	return true;
+}
+
+void BlockStream::StartWrite(uint64_t offset, uint64_t len)
+{
+	Cancel();
+	std::lock_guard<std::mutex> lock(mMutex);
+	mNext = offset;
+	mEnd = offset + len;
+}
+
+bool BlockStream::Write(const uint8_t *src, uint32_t len)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (len > 0)
+	{
+		Chunk& c = mChunks[mCur];
+		WaitIdle(lock, c);
+		if (c.state == CHUNK_DONE)
+		{
+			if (!c.ok)
+				mError = true;
+			c.state = CHUNK_FREE;
+			c.pos = 0;
+		}
+
+		uint32_t n = mChunkSize - c.pos < len ? mChunkSize - c.pos : len;
+		memcpy(c.data.data() + c.pos, src, n);
+		c.pos += n;
+		src += n;
+		len -= n;
+
+		if (c.pos == mChunkSize)
+		{
+			Submit(c);
+			mCur ^= 1;
+			mCond.notify_all();
+		}
+	}
+	return !mError;
+}
+
+bool BlockStream::WriteReady(uint32_t len)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (int i = 0, cur = mCur; i < 2; i++, cur ^= 1)
+	{
+		const Chunk& c = mChunks[cur];
+		if (Waiting(c))
+			return false;
+		uint32_t room = mChunkSize - (c.state == CHUNK_DONE ? 0 : c.pos);
+		if (room >= len)
+			return true;
+		len -= room;
+	}
+	return true;
+}
+
+void BlockStream::SubmitPartial()
+{
+	Chunk& last = mChunks[mCur];
+	if (last.state == CHUNK_FREE && last.pos > 0)
+	{
+		Submit(last);
+		mCond.notify_all();
+	}
+}
+
+void BlockStream::EndWrite()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	SubmitPartial();
+}
+
+bool BlockStream::Idle()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return !Waiting(mChunks[0]) && !Waiting(mChunks[1]);
+}
+
+bool BlockStream::FinishWrite()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	SubmitPartial();
+
+	for (auto& c : mChunks)
+	{
+		WaitIdle(lock, c);
+		if (c.state == CHUNK_DONE && !c.ok)
+			mError = true;
+		c.state = CHUNK_FREE;
+		c.pos = 0;
+	}
+	mCur = mWork = 0;
+
+	bool ok = !mError;
+	mError = false;
+	return ok;
+}
+
+void BlockStream::Cancel()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	for (auto& c : mChunks)
+	{
+		if (c.state == CHUNK_PENDING)
+			c.state = CHUNK_FREE;
+	}
+	for (auto& c : mChunks)
+	{
+		WaitIdle(lock, c);
+		c.state = CHUNK_FREE;
+		c.pos = 0;
+	}
+	mCur = mWork = 0;
+	mNext = mEnd = 0;
+	mError = false;
+}
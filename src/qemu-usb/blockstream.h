@@ -0,0 +1,89 @@
+#ifndef BLOCKSTREAM_H
+#define BLOCKSTREAM_H
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "blockdev.h"
+
+// Big enough for full speed sequential reads, small enough to keep per device
+#define BLOCKSTREAM_CHUNK (64 * 1024)
+
+/*
+	Streams one READ or WRITE command through two chunk buffers. A worker
+	thread reads the next chunk while the current one goes out in bulk
+	packets, or writes out a filled chunk while the next one is filling.
+	Only one stream is active at a time and all calls come from one thread.
+	The Ready calls let the caller NAK a packet instead of waiting on the
+	worker, the host controller retries it next frame.
+*/
+class BlockStream
+{
+	enum ChunkState {
+		CHUNK_FREE,
+		CHUNK_PENDING, // queued for the worker
+		CHUNK_BUSY, // worker is on it
+		CHUNK_DONE,
+	};
+
+	struct Chunk
+	{
+		std::vector<uint8_t> data;
+		uint64_t offset;
+		uint32_t len;
+		uint32_t pos;
+		bool write;
+		bool ok;
+		ChunkState state;
+	};
+
+public:
+	BlockStream(BlockDevice *dev, uint32_t chunkSize = BLOCKSTREAM_CHUNK);
+	~BlockStream();
+
+	// Start reading len bytes at offset, first chunks are fetched in the background
+	void StartRead(uint64_t offset, uint64_t len);
+	// Next len bytes of the stream, zero filled and false on read error
+	bool Read(uint8_t *dst, uint32_t len);
+	// Read(len) would not wait for the worker
+	bool ReadReady(uint32_t len);
+
+	void StartWrite(uint64_t offset, uint64_t len);
+	// Queue data, full chunks go to the worker. False once a write failed
+	bool Write(const uint8_t *src, uint32_t len);
+	// Write(len) would not wait for the worker
+	bool WriteReady(uint32_t len);
+	// Queue the partial chunk without waiting
+	void EndWrite();
+	// Nothing queued or in flight, FinishWrite() would not wait
+	bool Idle();
+	// Write out the partial chunk and wait for everything queued
+	bool FinishWrite();
+
+	// Drop whatever is queued and wait for the worker to go idle
+	void Cancel();
+
+private:
+	void Worker();
+	void QueueRead(Chunk& c);
+	void Submit(Chunk& c);
+	void SubmitPartial();
+	static bool Waiting(const Chunk& c) { return c.state == CHUNK_PENDING || c.state == CHUNK_BUSY; }
+	void WaitIdle(std::unique_lock<std::mutex>& lock, Chunk& c);
+
+	BlockDevice *mDev;
+	uint32_t mChunkSize;
+	Chunk mChunks[2];
+	int mCur; // chunk the USB side is using
+	int mWork; // chunk the worker takes next
+	uint64_t mNext; // image offset of the next chunk to queue
+	uint64_t mEnd;
+	bool mError;
+	bool mQuit;
+
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::thread mThread;
+};
+#endif
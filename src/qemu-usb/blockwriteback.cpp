@@ -0,0 +1,223 @@
+#include "blockwriteback.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+WriteBackBlockDevice::WriteBackBlockDevice(BlockDevice *dev, uint32_t maxDirtyKB)
+: mDev(dev)
+, mMaxDirty((size_t)maxDirtyKB * 1024)
+, mDirty(0)
+, mVersion(0)
+, mRetired(0)
+, mSyncWaiters(0)
+, mError(false)
+, mQuit(false)
+{
+	mThread = std::thread(&WriteBackBlockDevice::Worker, this);
+}
+
+WriteBackBlockDevice::~WriteBackBlockDevice()
+{
+	Flush();
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mCond.notify_all();
+	mDone.notify_all();
+	if (mThread.joinable())
+		mThread.join();
+	delete mDev;
+}
+
+int64_t WriteBackBlockDevice::Read(uint64_t offset, void *buf, uint32_t len)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true)
+	{
+		uint64_t retired = mRetired;
+		lock.unlock();
+		int64_t ret = mDev->Read(offset, buf, len);
+		lock.lock();
+		if (ret < 0)
+			return ret;
+		// An extent was written and dropped meanwhile, the read may have missed it
+		if (retired != mRetired)
+			continue;
+
+		uint32_t valid = (uint32_t)ret;
+		Overlay(offset, (uint8_t *)buf, len, valid);
+		return valid;
+	}
+}
+
+// Copy dirty data over what was read from the device
+void WriteBackBlockDevice::Overlay(uint64_t offset, uint8_t *buf, uint32_t len, uint32_t& valid)
+{
+	uint64_t end = offset + len;
+	auto it = mExtents.upper_bound(offset);
+	if (it != mExtents.begin())
+		--it;
+
+	for (; it != mExtents.end() && it->first < end; ++it)
+	{
+		uint64_t extEnd = it->first + it->second.data.size();
+		if (extEnd <= offset)
+			continue;
+
+		uint32_t from = it->first > offset ? (uint32_t)(it->first - offset) : 0;
+		uint32_t to = (uint32_t)(std::min(extEnd, end) - offset);
+		// Written past the end of image, the gap reads as zeros
+		if (from > valid)
+			memset(buf + valid, 0, from - valid);
+		memcpy(buf + from, it->second.data.data() + (offset + from - it->first), to - from);
+		valid = std::max(valid, to);
+	}
+}
+
+int64_t WriteBackBlockDevice::Write(uint64_t offset, const void *buf, uint32_t len)
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	// Don't let the guest get too far ahead of the disk
+	if (mDirty + len > mMaxDirty)
+	{
+		mCond.notify_all();
+		mDone.wait(lock, [&] { return mDirty + len <= mMaxDirty || mDirty == 0 || mQuit; });
+	}
+
+	uint64_t start = offset;
+	uint64_t end = offset + len;
+
+	// Overlapping extents have to be merged, touching ones only while small
+	auto first = mExtents.upper_bound(offset);
+	if (first != mExtents.begin())
+	{
+		auto prev = std::prev(first);
+		uint64_t prevEnd = prev->first + prev->second.data.size();
+		if (prevEnd > offset || (prevEnd == offset && prev->second.data.size() + len <= WRITEBACK_MAX_EXTENT))
+			first = prev;
+	}
+
+	auto last = first;
+	for (; last != mExtents.end(); ++last)
+	{
+		if (last->first > end || (last->first == end && end - start + last->second.data.size() > WRITEBACK_MAX_EXTENT))
+			break;
+		start = std::min(start, last->first);
+		end = std::max(end, last->first + last->second.data.size());
+	}
+
+	Extent merged;
+	merged.data.resize(end - start);
+	for (auto it = first; it != last; ++it)
+	{
+		memcpy(merged.data.data() + (it->first - start), it->second.data.data(), it->second.data.size());
+		mDirty -= it->second.data.size();
+	}
+	mExtents.erase(first, last);
+
+	memcpy(merged.data.data() + (offset - start), buf, len);
+	merged.version = ++mVersion;
+	mDirty += merged.data.size();
+	mExtents[start] = std::move(merged);
+
+	if (mDirty >= mMaxDirty / 2)
+		mCond.notify_all();
+	return len;
+}
+
+uint64_t WriteBackBlockDevice::Size()
+{
+	uint64_t dirtyEnd = 0;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (!mExtents.empty())
+		{
+			auto it = std::prev(mExtents.end());
+			dirtyEnd = it->first + it->second.data.size();
+		}
+	}
+	return std::max(mDev->Size(), dirtyEnd);
+}
+
+bool WriteBackBlockDevice::Flush()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	mSyncWaiters++;
+	mCond.notify_all();
+	mDone.wait(lock, [this] { return mExtents.empty() || mQuit; });
+	mSyncWaiters--;
+
+	bool ok = !mError;
+	mError = false;
+	lock.unlock();
+	return mDev->Flush() && ok;
+}
+
+void WriteBackBlockDevice::Discard()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		// A write the worker already issued still lands, WriteOut() finds nothing after it
+		mExtents.clear();
+		mDirty = 0;
+		mRetired++;
+		mError = false;
+	}
+	mDone.notify_all();
+	mDev->Discard();
+}
+
+// One pass over the extents in offset order, false if a write failed
+bool WriteBackBlockDevice::WriteOut(std::unique_lock<std::mutex>& lock)
+{
+	bool ok = true;
+	uint64_t pos = 0;
+	while (true)
+	{
+		auto it = mExtents.lower_bound(pos);
+		if (it == mExtents.end())
+			break;
+
+		uint64_t start = it->first;
+		uint64_t version = it->second.version;
+		std::vector<uint8_t> data = it->second.data;
+
+		lock.unlock();
+		int64_t ret = mDev->Write(start, data.data(), data.size());
+		lock.lock();
+
+		if (ret != (int64_t)data.size())
+		{
+			OSDebugOut(TEXT("writeback: writing %u bytes at %llu failed\n"),
+				(uint32_t)data.size(), (unsigned long long)start);
+			// Dropped, Flush() reports it
+			mError = true;
+			ok = false;
+		}
+
+		auto cur = mExtents.find(start);
+		if (cur != mExtents.end() && cur->second.version == version)
+		{
+			mDirty -= cur->second.data.size();
+			mExtents.erase(cur);
+		}
+		mRetired++;
+		mDone.notify_all();
+		pos = start + data.size();
+	}
+	return ok;
+}
+
+void WriteBackBlockDevice::Worker()
+{
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (!mQuit)
+	{
+		mCond.wait_for(lock, std::chrono::milliseconds(WRITEBACK_DELAY_MS),
+			[this] { return mQuit || (mSyncWaiters > 0 && !mExtents.empty()) || mDirty >= mMaxDirty / 2; });
+		WriteOut(lock);
+		mDone.notify_all();
+	}
+	WriteOut(lock);
+}
@@ -0,0 +1,68 @@
+#ifndef BLOCKWRITEBACK_H
+#define BLOCKWRITEBACK_H
+#include <cstdint>
+#include <map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "blockdev.h"
+
+#define S_WRITE_BACK	TEXT("Write-back buffer (KiB, 0 for write-through)")
+#define N_WRITE_BACK	TEXT("write_back")
+
+#define WRITEBACK_DEFAULT_KB 2048
+// How long writes may sit in memory before the flusher picks them up
+#define WRITEBACK_DELAY_MS 500
+// Stop merging neighbours past this, a busy extent gets written again whole
+#define WRITEBACK_MAX_EXTENT (1024 * 1024)
+
+/*
+	Acknowledges writes from memory and writes them out from a worker.
+	Dirty data is kept as non-overlapping extents, new writes merge into
+	adjacent or overlapping ones so the flusher issues few, large writes.
+	Reads see dirty data. Flush() writes out everything written before it
+	and then syncs the device, so it is the durability point for
+	SYNCHRONIZE CACHE, savestates and closing.
+*/
+class WriteBackBlockDevice : public BlockDevice
+{
+	struct Extent
+	{
+		std::vector<uint8_t> data;
+		uint64_t version; // changes on every merge, flusher keeps extents that changed under it
+	};
+	typedef std::map<uint64_t, Extent> ExtentMap;
+
+public:
+	// Takes ownership of dev
+	WriteBackBlockDevice(BlockDevice *dev, uint32_t maxDirtyKB);
+	~WriteBackBlockDevice();
+
+	int64_t Read(uint64_t offset, void *buf, uint32_t len);
+	int64_t Write(uint64_t offset, const void *buf, uint32_t len);
+	uint64_t Size();
+	bool Flush();
+	void Discard();
+
+private:
+	void Worker();
+	bool WriteOut(std::unique_lock<std::mutex>& lock);
+	void Overlay(uint64_t offset, uint8_t *buf, uint32_t len, uint32_t& valid);
+
+	BlockDevice *mDev;
+	size_t mMaxDirty;
+	size_t mDirty;
+	ExtentMap mExtents;
+	uint64_t mVersion;
+	uint64_t mRetired; // bumped when an extent leaves the map, see Read()
+	uint32_t mSyncWaiters;
+	bool mError; // a background write failed since the last Flush()
+	bool mQuit;
+
+	std::mutex mMutex;
+	std::condition_variable mCond; // wakes the worker
+	std::condition_variable mDone; // extents written
+	std::thread mThread;
+};
+#endif
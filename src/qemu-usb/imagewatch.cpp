@@ -0,0 +1,160 @@
+#include "imagewatch.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+// Writers closing the file, and new files or renames landing on its name
+#define IMAGEWATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+ImageWatch::ImageWatch(const TSTDSTRING& path)
+: mFd(-1)
+, mWd(-1)
+, mStopFd(-1)
+, mPending(false)
+, mPath(path)
+, mState()
+{
+	// Block devices and vfat folders have nothing useful to watch
+	struct stat st;
+	if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+		return;
+	Snapshot();
+
+	TSTDSTRING dir = ".";
+	mName = path;
+	size_t slash = path.rfind('/');
+	if (slash != TSTDSTRING::npos)
+	{
+		dir = slash ? path.substr(0, slash) : "/";
+		mName = path.substr(slash + 1);
+	}
+
+	mFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (mFd < 0)
+		return;
+	mWd = inotify_add_watch(mFd, dir.c_str(), IMAGEWATCH_EVENTS);
+	if (mWd >= 0)
+		mStopFd = eventfd(0, EFD_CLOEXEC);
+	if (mStopFd < 0)
+	{
+		close(mFd);
+		mFd = -1;
+		return;
+	}
+	mThread = std::thread(&ImageWatch::Thread, this);
+}
+
+ImageWatch::~ImageWatch()
+{
+	if (mThread.joinable())
+	{
+		uint64_t one = 1;
+		if (write(mStopFd, &one, sizeof(one)) < 0)
+			perror("imagewatch: write");
+		mThread.join();
+	}
+	if (mStopFd >= 0)
+		close(mStopFd);
+	if (mFd >= 0)
+		close(mFd);
+}
+
+void ImageWatch::Thread()
+{
+	struct pollfd fds[2] = {};
+	fds[0].fd = mFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = mStopFd;
+	fds[1].events = POLLIN;
+
+	alignas(struct inotify_event) char buf[4096];
+	for (;;)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		ssize_t len;
+		while ((len = read(mFd, buf, sizeof(buf))) > 0)
+		{
+			for (char *p = buf; p < buf + len; )
+			{
+				const struct inotify_event *ev = (const struct inotify_event *)p;
+				if (ev->len && mName == ev->name)
+					mPending = true;
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+	}
+}
+
+bool ImageWatch::Changed()
+{
+	// Plain load while nothing happened, that's every other command
+	if (!mPending.load(std::memory_order_relaxed) || !mPending.exchange(false))
+		return false;
+
+	FileState now = Stat();
+	return now.exists != mState.exists || now.dev != mState.dev || now.ino != mState.ino
+		|| now.size != mState.size || now.mtimeNs != mState.mtimeNs;
+}
+
+void ImageWatch::Snapshot()
+{
+	mState = Stat();
+}
+
+ImageWatch::FileState ImageWatch::Stat() const
+{
+	FileState fs = {};
+	struct stat st;
+	if (stat(mPath.c_str(), &st))
+		return fs;
+	fs.exists = true;
+	fs.dev = st.st_dev;
+	fs.ino = st.st_ino;
+	fs.size = st.st_size;
+	fs.mtimeNs = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	return fs;
+}
+
+#undef IMAGEWATCH_EVENTS
+
+#else
+
+ImageWatch::ImageWatch(const TSTDSTRING& path)
+: mFd(-1)
+, mWd(-1)
+, mStopFd(-1)
+, mPending(false)
+, mPath(path)
+, mState()
+{
+}
+
+ImageWatch::~ImageWatch()
+{
+}
+
+bool ImageWatch::Changed()
+{
+	return false;
+}
+
+void ImageWatch::Snapshot()
+{
+}
+
+#endif
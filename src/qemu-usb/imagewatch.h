@@ -0,0 +1,53 @@
+#ifndef IMAGEWATCH_H
+#define IMAGEWATCH_H
+#include <cstdint>
+#include <string>
+#include <atomic>
+#include <thread>
+#include "../platcompat.h"
+
+/*
+	Notices when an image file is rewritten, replaced or removed by another
+	program while the emulator has it open. Watches the containing directory
+	so a copy or rename over the old path is caught as well. Events only
+	count when the file's identity, size or mtime moved off the snapshot,
+	so our own handles closing don't look like a change. A thread waits on
+	the events, the command path only loads its flag. Only regular files
+	on Linux are watched, elsewhere Changed() never fires.
+*/
+class ImageWatch
+{
+public:
+	ImageWatch(const TSTDSTRING& path);
+	~ImageWatch();
+
+	// Cheap unless an event came in, true if the image differs from the snapshot
+	bool Changed();
+	// Take the file as it is now as the snapshot, before it gets reopened
+	void Snapshot();
+
+private:
+	ImageWatch(const ImageWatch&) = delete;
+
+	struct FileState
+	{
+		bool exists;
+		uint64_t dev;
+		uint64_t ino;
+		uint64_t size;
+		int64_t mtimeNs;
+	};
+	FileState Stat() const;
+	void Thread();
+
+	int mFd;
+	int mWd;
+	int mStopFd;
+	std::thread mThread;
+	std::atomic<bool> mPending;
+	TSTDSTRING mPath;
+	TSTDSTRING mName;
+	FileState mState;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "msdstats.h"
+#include "../usb-mic/audiostats.h"
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+uint64_t SinceNs(MsdStats::Clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(MsdStats::Clock::now() - start).count();
+}
+
+// Upper bound of the bucket holding the given fraction of commands, in us
+uint64_t Percentile(const MsdOpStats& op, double fraction)
+{
+	uint64_t want = (uint64_t)(op.count * fraction);
+	uint64_t seen = 0;
+	for (int i = 0; i < MSDSTATS_BUCKETS; i++)
+	{
+		seen += op.latency[i];
+		if (seen > want)
+			return 1ULL << i;
+	}
+	return 1ULL << (MSDSTATS_BUCKETS - 1);
+}
+
+}
+
+MsdStats::MsdStats(const char *dev, int port, OpcodeName name)
+: mDev(dev)
+, mPort(port)
+, mName(name)
+, mInterval(LoadStatsInterval(port, dev))
+, mLast(Clock::now())
+, mActive(false)
+, mOpcode(0)
+, mHostNs(0)
+{
+	memset(mOps, 0, sizeof(mOps));
+}
+
+void MsdStats::Begin(uint8_t opcode)
+{
+	if (mActive)
+		End(true);
+	mActive = true;
+	mOpcode = opcode;
+	mHostNs = 0;
+	mStart = Clock::now();
+}
+
+void MsdStats::AddHost(Clock::time_point start)
+{
+	if (mActive)
+		mHostNs += SinceNs(start);
+}
+
+void MsdStats::End(bool failed)
+{
+	if (!mActive)
+		return;
+	mActive = false;
+
+	uint64_t ns = SinceNs(mStart);
+	MsdOpStats& op = mOps[mOpcode];
+	op.count++;
+	if (failed)
+		op.failed++;
+	op.hostNs += mHostNs;
+	op.usbNs += ns > mHostNs ? ns - mHostNs : 0;
+	if (ns > op.maxNs)
+		op.maxNs = ns;
+
+	int bucket = 0;
+	for (uint64_t us = ns / 1000; us && bucket < MSDSTATS_BUCKETS - 1; us >>= 1)
+		bucket++;
+	op.latency[bucket]++;
+}
+
+bool MsdStats::Due()
+{
+	if (!Enabled())
+		return false;
+
+	auto now = Clock::now();
+	if (now - mLast < mInterval)
+		return false;
+	mLast = now;
+	return true;
+}
+
+void MsdStats::Log(bool full) const
+{
+	for (int i = 0; i < 256; i++)
+	{
+		const MsdOpStats& op = mOps[i];
+		if (!op.count)
+			continue;
+
+		const char *name = mName ? mName(i) : nullptr;
+		char hex[8];
+		if (!name)
+		{
+			snprintf(hex, sizeof(hex), "0x%02x", i);
+			name = hex;
+		}
+
+		fprintf(stderr, "%s %d %s: %llu cmds %llu failed %llu KiB, host %.1fus usb %.1fus per cmd,"
+			" p50 <%lluus p99 <%lluus max %.1fus\n",
+			mDev, mPort, name, (unsigned long long)op.count, (unsigned long long)op.failed,
+			(unsigned long long)(op.bytes >> 10),
+			op.hostNs / 1000.0 / op.count, op.usbNs / 1000.0 / op.count,
+			(unsigned long long)Percentile(op, 0.5), (unsigned long long)Percentile(op, 0.99),
+			op.maxNs / 1000.0);
+
+		if (!full)
+			continue;
+		fprintf(stderr, "%s %d %s: latency", mDev, mPort, name);
+		for (int b = 0; b < MSDSTATS_BUCKETS; b++)
+			if (op.latency[b])
+				fprintf(stderr, " <%lluus:%llu", 1ULL << b, (unsigned long long)op.latency[b]);
+		fprintf(stderr, "\n");
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef MSDSTATS_H
+#define MSDSTATS_H
+#include <chrono>
+#include <cstdint>
+
+// Bucket n counts commands that took less than 2^n us, the last one everything slower
+#define MSDSTATS_BUCKETS 24
+
+struct MsdOpStats
+{
+	uint64_t count;
+	uint64_t failed;
+	uint64_t bytes; // data phase, both directions
+	uint64_t hostNs; // spent in the image backend
+	uint64_t usbNs; // rest of CBW to CSW, mostly waiting on the guest
+	uint64_t maxNs;
+	uint64_t latency[MSDSTATS_BUCKETS];
+};
+
+/*
+	Per-opcode command counters for the mass storage device. A command runs
+	from its CBW to its CSW, time spent in the backend is taken out of that
+	and kept apart so caching and async changes can be measured on their
+	own. Summaries go to stderr every "stats_interval" seconds (the same
+	setting the audio devices use) and on close.
+*/
+class MsdStats
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+	typedef const char* (*OpcodeName)(uint8_t opcode);
+
+	MsdStats(const char *dev, int port, OpcodeName name);
+
+	// CBW accepted
+	void Begin(uint8_t opcode);
+	void AddBytes(uint32_t len) { if (mActive) mOps[mOpcode].bytes += len; }
+	// Backend call that started at start has returned
+	void AddHost(Clock::time_point start);
+	// CSW sent, or the command was dropped by a stall or reset
+	void End(bool failed);
+
+	bool Enabled() const { return mInterval.count() > 0; }
+	// True once per interval, call after End()
+	bool Due();
+	// Histograms are only printed when full is set
+	void Log(bool full) const;
+
+	const MsdOpStats& Get(uint8_t opcode) const { return mOps[opcode]; }
+
+private:
+	const char *mDev;
+	int mPort;
+	OpcodeName mName;
+	std::chrono::seconds mInterval;
+	Clock::time_point mLast;
+
+	bool mActive;
+	uint8_t mOpcode;
+	Clock::time_point mStart;
+	uint64_t mHostNs;
+	MsdOpStats mOps[256];
+};
+
+#endif
@@ -0,0 +1,168 @@
+#include "sparseimage.h"
+#include <cstring>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#define SPARSE_ZSTD_LEVEL 3
+#endif
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+bool SparseReadAt(FILE *file, uint64_t offset, void *buf, size_t len)
+{
+	if (fseeko(file, offset, SEEK_SET))
+		return false;
+	return fread(buf, 1, len, file) == len;
+}
+
+bool SparseWriteAt(FILE *file, uint64_t offset, const void *buf, size_t len)
+{
+	if (fseeko(file, offset, SEEK_SET))
+		return false;
+	return fwrite(buf, 1, len, file) == len;
+}
+
+uint64_t SparseFileSize(FILE *file)
+{
+	if (fseeko(file, 0, SEEK_END))
+		return 0;
+	int64_t end = ftello(file);
+	return end > 0 ? end : 0;
+}
+
+bool SparseReadHeader(FILE *file, SparseHeader& header, std::vector<SparseIndexEntry>& index)
+{
+	if (!SparseReadAt(file, 0, &header, sizeof(header)) ||
+		memcmp(header.magic, SPARSE_MAGIC, sizeof(header.magic)) ||
+		header.version != SPARSE_VERSION)
+		return false;
+
+	if (!header.clusterSize || header.clusterSize > SPARSE_MAX_CLUSTER ||
+		header.clusters != (header.size + header.clusterSize - 1) / header.clusterSize)
+		return false;
+
+	index.resize(header.clusters);
+	return SparseReadAt(file, header.indexOffset, index.data(), index.size() * sizeof(SparseIndexEntry));
+}
+
+bool SparseWriteHeader(FILE *file, const SparseHeader& header)
+{
+	uint8_t block[SPARSE_HEADER_SIZE] = {};
+	memcpy(block, &header, sizeof(header));
+	return SparseWriteAt(file, 0, block, sizeof(block));
+}
+
+bool SparseWriteIndex(FILE *file, const SparseHeader& header, const SparseIndexEntry *entries, uint64_t first, uint64_t count)
+{
+	return SparseWriteAt(file, header.indexOffset + first * sizeof(SparseIndexEntry),
+		entries, count * sizeof(SparseIndexEntry));
+}
+
+bool SparseCodecAvailable(uint32_t type)
+{
+	switch (type)
+	{
+	case SPARSE_ZERO:
+	case SPARSE_RAW:
+		return true;
+#ifdef HAVE_LZ4
+	case SPARSE_LZ4:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case SPARSE_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool SparseCompress(uint32_t type, const uint8_t *src, uint32_t len, std::vector<uint8_t>& out)
+{
+	switch (type)
+	{
+#ifdef HAVE_LZ4
+	case SPARSE_LZ4:
+	{
+		out.resize(LZ4_compressBound(len));
+		int ret = LZ4_compress_default((const char *)src, (char *)out.data(), len, out.size());
+		if (ret <= 0 || (uint32_t)ret >= len)
+			return false;
+		out.resize(ret);
+		return true;
+	}
+#endif
+#ifdef HAVE_ZSTD
+	case SPARSE_ZSTD:
+	{
+		out.resize(ZSTD_compressBound(len));
+		size_t ret = ZSTD_compress(out.data(), out.size(), src, len, SPARSE_ZSTD_LEVEL);
+		if (ZSTD_isError(ret) || ret >= len)
+			return false;
+		out.resize(ret);
+		return true;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+bool SparseReadCluster(FILE *file, const SparseHeader& header, const SparseIndexEntry& entry,
+	uint8_t *out, std::vector<uint8_t>& scratch)
+{
+	uint32_t size = header.clusterSize;
+	switch (entry.type)
+	{
+	case SPARSE_ZERO:
+		memset(out, 0, size);
+		return true;
+	case SPARSE_RAW:
+		return entry.length == size && SparseReadAt(file, entry.offset, out, size);
+	default:
+		break;
+	}
+
+	if (entry.length > SPARSE_MAX_CLUSTER * 2)
+		return false;
+	scratch.resize(entry.length);
+	if (!SparseReadAt(file, entry.offset, scratch.data(), entry.length))
+		return false;
+
+	switch (entry.type)
+	{
+#ifdef HAVE_LZ4
+	case SPARSE_LZ4:
+		return LZ4_decompress_safe((const char *)scratch.data(), (char *)out, entry.length, size) == (int)size;
+#endif
+#ifdef HAVE_ZSTD
+	case SPARSE_ZSTD:
+		return ZSTD_decompress(out, size, scratch.data(), entry.length) == size;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool SparseIsZero(const uint8_t *buf, size_t len)
+{
+	// Word at a time, clusters are large and usually aligned
+	size_t i = 0;
+	for (; i < len && ((uintptr_t)(buf + i) & (sizeof(uint64_t) - 1)); i++)
+		if (buf[i])
+			return false;
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+		if (*(const uint64_t *)(buf + i))
+			return false;
+	for (; i < len; i++)
+		if (buf[i])
+			return false;
+	return true;
+}
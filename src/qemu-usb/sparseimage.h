@@ -0,0 +1,67 @@
+#ifndef SPARSEIMAGE_H
+#define SPARSEIMAGE_H
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/*
+	Sparse image container, shared by the "sparse" MSD backend and the
+	msdconvert tool. Little endian, like every host we run on.
+
+	[header, SPARSE_HEADER_SIZE bytes]
+	[index, one SparseIndexEntry per cluster]
+	[cluster data, stored RAW, LZ4 or ZSTD]
+
+	All-zero clusters take no space. Clusters written by the emulator are
+	appended RAW, msdconvert packs the image again.
+*/
+
+#define SPARSE_MAGIC "USBQSPR1"
+#define SPARSE_VERSION 1
+#define SPARSE_HEADER_SIZE 4096
+#define SPARSE_DEFAULT_CLUSTER (64 * 1024)
+#define SPARSE_MAX_CLUSTER (1024 * 1024)
+
+enum SparseClusterType {
+	SPARSE_ZERO = 0,
+	SPARSE_RAW,
+	SPARSE_LZ4,
+	SPARSE_ZSTD,
+};
+
+struct SparseHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t clusterSize;
+	uint64_t size; // guest visible image size
+	uint64_t clusters;
+	uint64_t indexOffset;
+};
+
+struct SparseIndexEntry
+{
+	uint64_t offset;
+	uint32_t length; // stored bytes
+	uint32_t type; // SparseClusterType
+};
+
+// Positioned stdio helpers, false on a short transfer
+bool SparseReadAt(FILE *file, uint64_t offset, void *buf, size_t len);
+bool SparseWriteAt(FILE *file, uint64_t offset, const void *buf, size_t len);
+uint64_t SparseFileSize(FILE *file);
+
+bool SparseReadHeader(FILE *file, SparseHeader& header, std::vector<SparseIndexEntry>& index);
+bool SparseWriteHeader(FILE *file, const SparseHeader& header);
+bool SparseWriteIndex(FILE *file, const SparseHeader& header, const SparseIndexEntry *entries, uint64_t first, uint64_t count);
+
+// Whether this build can read and write clusters of the type
+bool SparseCodecAvailable(uint32_t type);
+// False if the codec is missing or can't make the cluster smaller
+bool SparseCompress(uint32_t type, const uint8_t *src, uint32_t len, std::vector<uint8_t>& out);
+// Decode one cluster into out (clusterSize bytes), scratch holds the stored bytes
+bool SparseReadCluster(FILE *file, const SparseHeader& header, const SparseIndexEntry& entry,
+	uint8_t *out, std::vector<uint8_t>& scratch);
+
+bool SparseIsZero(const uint8_t *buf, size_t len);
+#endif
@@ -3,8 +3,6 @@
 #include "../configuration.h"
 #include <gtk/gtk.h>
 
-#define APINAME "cstdio"
-
 static void entryChanged(GtkWidget *widget, gpointer data)
 {
 	const gchar *text = gtk_entry_get_text(GTK_ENTRY(widget));
@@ -16,9 +14,11 @@ static void fileChooser( GtkWidget *widget, gpointer data)
 	GtkWidget *dialog, *entry = NULL;
 
 	entry = (GtkWidget*)data;
-	dialog = gtk_file_chooser_dialog_new ("Open File",
+	//vfat takes a directory
+	bool folder = g_object_get_data (G_OBJECT (widget), "folder") != NULL;
+	dialog = gtk_file_chooser_dialog_new (folder ? "Select Folder" : "Open File",
 					  NULL,
-					  GTK_FILE_CHOOSER_ACTION_OPEN,
+					  folder ? GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER : GTK_FILE_CHOOSER_ACTION_OPEN,
 					  GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
 					  GTK_STOCK_OPEN, GTK_RESPONSE_ACCEPT,
 					  NULL);
@@ -72,7 +72,7 @@ int MsdDevice::Configure(int port, std::string api, void *data)
 
 	{
 		CONFIGVARIANT var(N_CONFIG_PATH, CONFIG_TYPE_CHAR);
-		if(LoadSetting(port, APINAME, var))
+		if(LoadImagePath(port, api, var))
 			gtk_entry_set_text(GTK_ENTRY(entry), var.strValue.c_str());
 	}
 
@@ -80,14 +80,89 @@ int MsdDevice::Configure(int port, std::string api, void *data)
 
 	GtkWidget *button = gtk_button_new_with_label ("Browse");
 	gtk_button_set_image(GTK_BUTTON (button), gtk_image_new_from_icon_name ("gtk-open", GTK_ICON_SIZE_BUTTON));
+	if (api == "vfat")
+		g_object_set_data (G_OBJECT (button), "folder", GINT_TO_POINTER (1));
 	g_signal_connect (button, "clicked", G_CALLBACK (fileChooser), entry);
 
 	gtk_box_pack_start (GTK_BOX (rs_hbox), entry, TRUE, TRUE, 5);
 	gtk_box_pack_start (GTK_BOX (rs_hbox), button, FALSE, FALSE, 5);
 
+	GtkWidget *direct_cb = NULL, *hint_cb = NULL;
+	if (api == "pread")
+	{
+		CONFIGVARIANT varDirect(N_DIRECT_IO, CONFIG_TYPE_INT);
+		CONFIGVARIANT varHint(N_FADVISE, CONFIG_TYPE_INT);
+		LoadSetting(port, api, varDirect);
+		LoadSetting(port, api, varHint);
+
+		direct_cb = gtk_check_button_new_with_label (S_DIRECT_IO);
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (direct_cb), varDirect.intValue != 0);
+		gtk_box_pack_start (GTK_BOX (vbox), direct_cb, FALSE, FALSE, 5);
+
+		rs_hbox = gtk_hbox_new (FALSE, 0);
+		gtk_box_pack_start (GTK_BOX (vbox), rs_hbox, FALSE, TRUE, 0);
+		rs_label = gtk_label_new (S_FADVISE);
+		gtk_box_pack_start (GTK_BOX (rs_hbox), rs_label, FALSE, FALSE, 5);
+
+		// Same order as BlockAccessHint
+		hint_cb = gtk_combo_box_text_new ();
+		gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (hint_cb), "None");
+		gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (hint_cb), "Sequential");
+		gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (hint_cb), "Random");
+		gtk_combo_box_set_active (GTK_COMBO_BOX (hint_cb),
+			varHint.intValue >= BLOCK_HINT_NONE && varHint.intValue <= BLOCK_HINT_RANDOM ? varHint.intValue : BLOCK_HINT_NONE);
+		gtk_box_pack_start (GTK_BOX (rs_hbox), hint_cb, TRUE, TRUE, 5);
+	}
+
+	GtkWidget *vfat_spin = NULL;
+	if (api == "vfat")
+	{
+		CONFIGVARIANT varSize(N_VFAT_SIZE, CONFIG_TYPE_INT);
+		if (!LoadSetting(port, api, varSize) || varSize.intValue <= 0)
+			varSize.intValue = 4096;
+
+		rs_hbox = gtk_hbox_new (FALSE, 0);
+		gtk_box_pack_start (GTK_BOX (vbox), rs_hbox, FALSE, TRUE, 0);
+		rs_label = gtk_label_new (S_VFAT_SIZE);
+		gtk_box_pack_start (GTK_BOX (rs_hbox), rs_label, FALSE, FALSE, 5);
+
+		vfat_spin = gtk_spin_button_new_with_range (512, 1024 * 1024, 512);
+		gtk_spin_button_set_value (GTK_SPIN_BUTTON (vfat_spin), varSize.intValue);
+		gtk_box_pack_start (GTK_BOX (rs_hbox), vfat_spin, TRUE, TRUE, 5);
+	}
+
+	GtkWidget *delta_entry = NULL, *discard_cb = NULL;
+	if (api == "overlay")
+	{
+		CONFIGVARIANT varDelta(N_DELTA_PATH, CONFIG_TYPE_CHAR);
+		CONFIGVARIANT varDiscard(N_DISCARD_DELTA, CONFIG_TYPE_INT);
+		LoadSetting(port, api, varDelta);
+		if (!LoadSetting(port, api, varDiscard))
+			varDiscard.intValue = 1;
+
+		rs_hbox = gtk_hbox_new (FALSE, 0);
+		gtk_box_pack_start (GTK_BOX (vbox), rs_hbox, FALSE, TRUE, 0);
+		rs_label = gtk_label_new (S_DELTA_PATH);
+		gtk_box_pack_start (GTK_BOX (rs_hbox), rs_label, FALSE, FALSE, 5);
+
+		delta_entry = gtk_entry_new ();
+		gtk_entry_set_max_length (GTK_ENTRY (delta_entry), MAX_PATH);
+		gtk_entry_set_text (GTK_ENTRY (delta_entry), varDelta.strValue.c_str());
+		gtk_box_pack_start (GTK_BOX (rs_hbox), delta_entry, TRUE, TRUE, 5);
+
+		discard_cb = gtk_check_button_new_with_label (S_DISCARD_DELTA);
+		gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (discard_cb), varDiscard.intValue != 0);
+		gtk_box_pack_start (GTK_BOX (vbox), discard_cb, FALSE, FALSE, 5);
+	}
+
 	gtk_widget_show_all (dlg);
 	gint result = gtk_dialog_run (GTK_DIALOG (dlg));
 	std::string path = gtk_entry_get_text(GTK_ENTRY(entry));
+	int direct = direct_cb ? gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (direct_cb)) : 0;
+	int hint = hint_cb ? gtk_combo_box_get_active (GTK_COMBO_BOX (hint_cb)) : 0;
+	int vfatSize = vfat_spin ? gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (vfat_spin)) : 0;
+	std::string deltaPath = delta_entry ? gtk_entry_get_text (GTK_ENTRY (delta_entry)) : "";
+	int discard = discard_cb ? gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (discard_cb)) : 1;
 	gtk_widget_destroy (dlg);
 
 	// Wait for all gtk events to be consumed ...
@@ -97,10 +172,32 @@ int MsdDevice::Configure(int port, std::string api, void *data)
 	if (result == GTK_RESPONSE_OK)
 	{
 		CONFIGVARIANT var(N_CONFIG_PATH, path);
-		if(SaveSetting(port, APINAME, var))
-			return RESULT_OK;
-		else
+		if(!SaveSetting(port, api, var))
 			return RESULT_FAILED;
+
+		if (direct_cb)
+		{
+			CONFIGVARIANT varDirect(N_DIRECT_IO, (int32_t)direct);
+			CONFIGVARIANT varHint(N_FADVISE, (int32_t)(hint < 0 ? BLOCK_HINT_NONE : hint));
+			if (!SaveSetting(port, api, varDirect) || !SaveSetting(port, api, varHint))
+				return RESULT_FAILED;
+		}
+
+		if (vfat_spin)
+		{
+			CONFIGVARIANT varSize(N_VFAT_SIZE, (int32_t)vfatSize);
+			if (!SaveSetting(port, api, varSize))
+				return RESULT_FAILED;
+		}
+
+		if (delta_entry)
+		{
+			CONFIGVARIANT varDelta(N_DELTA_PATH, deltaPath);
+			CONFIGVARIANT varDiscard(N_DISCARD_DELTA, (int32_t)discard);
+			if (!SaveSetting(port, api, varDelta) || !SaveSetting(port, api, varDiscard))
+				return RESULT_FAILED;
+		}
+		return RESULT_OK;
 	}
 
 	return RESULT_CANCELED;
@@ -131,4 +228,3 @@ bool MsdDevice::SaveSettings(int port, std::vector<CONFIGVARIANT>& params)
 	return true;
 }
 */
-#undef APINAME
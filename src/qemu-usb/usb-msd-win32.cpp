@@ -2,8 +2,8 @@
 #include "../Win32/Config-win32.h"
 #include "../Win32/resource.h"
 
-#define APINAME "cstdio"
 static OPENFILENAMEW ofn;
+static std::string msdApi;
 
 BOOL CALLBACK MsdDlgProc(HWND hW, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 	int port;
@@ -16,7 +16,7 @@ BOOL CALLBACK MsdDlgProc(HWND hW, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 		port = (int)lParam;
 		SetWindowLong(hW, GWL_USERDATA, (LONG)lParam);
 		CONFIGVARIANT var(N_CONFIG_PATH, CONFIG_TYPE_WCHAR);
-		if (LoadSetting(port, APINAME, var))
+		if (LoadImagePath(port, msdApi, var))
 			wcsncpy_s(buff, var.wstrValue.c_str(), ARRAYSIZE(buff));
 		SetWindowTextW(GetDlgItem(hW, IDC_EDIT1), buff);
 		return TRUE;
@@ -52,7 +52,7 @@ BOOL CALLBACK MsdDlgProc(HWND hW, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 				GetWindowTextW(GetDlgItem(hW, IDC_EDIT1), buff, ARRAYSIZE(buff));
 				port = (int)GetWindowLong(hW, GWL_USERDATA);
 				CONFIGVARIANT var(N_CONFIG_PATH, buff);
-				if (!SaveSetting(port, APINAME, var))
+				if (!SaveSetting(port, msdApi, var))
 					res = RESULT_FAILED;
 				//strcpy_s(conf.usb_img, ofn.lpstrFile);
 				EndDialog(hW, res);
@@ -70,6 +70,7 @@ BOOL CALLBACK MsdDlgProc(HWND hW, UINT uMsg, WPARAM wParam, LPARAM lParam) {
 int MsdDevice::Configure(int port, std::string api, void *data)
 {
 	Win32Handles handles = *(Win32Handles*)data;
+	msdApi = api;
 	return DialogBoxParam(handles.hInst,
 		MAKEINTRESOURCE(IDD_DLGMSD),
 		handles.hWnd,
@@ -84,4 +85,3 @@ bool MsdDevice::LoadSettings(int port, TSTDSTRING& path)
 bool MsdDevice::SaveSettings(int port, TSTDSTRING& path)
 {
 }*/
-#undef APINAME
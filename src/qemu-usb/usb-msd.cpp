@@ -13,6 +13,11 @@
 #include <string.h>
 #include "vl.h"
 #include "usb-msd.h"
+#include "blockstream.h"
+#include "blockcache.h"
+#include "blockwriteback.h"
+#include "msdstats.h"
+#include "imagewatch.h"
 
 #define DEVICENAME "msd"
 
@@ -59,21 +64,36 @@ enum USBMSDMode {
     USB_MSDM_CSW /* Command Status.  */
 };
 
+//One image with its own backend stack and stream worker, so background
+//I/O on different LUNs overlaps
+typedef struct MSDLun {
+	BlockDevice *blkdev;
+	CachedBlockDevice *cache; //same object as blkdev if caching, for stats
+	BlockStream *stream; //data phase of READ/WRITE commands
+	ImageWatch *watch; //outlives blkdev, a replaced image is reopened
+	uint64_t capacity; //image size in bytes, taken at open
+	bool unit_attention; //medium changed, not reported yet
+	uint8_t sense_buf[18];
+} MSDLun;
+
 typedef struct MSDState {
 	USBDevice	dev;
 
 	enum USBMSDMode mode;
 	int32_t data_len;
 	uint32_t tag;
-	FILE *hfile;
-	//char fn[MAX_PATH+1]; //TODO Could use with open/close, 
-							//but error recovery currently can't deal with file suddenly
-							//becoming not accessible
+	int port;
+	MSDLun luns[MSD_MAX_LUNS];
+	int lun_count;
+	MSDLun *lun; //addressed by the current command
+	MsdStats *stats;
+	bool streaming;
+	bool read_direct; //mapped image, read straight into the packet
+	uint64_t read_off;
 	int result;
 
 	uint32_t off; //buffer offset
 	uint8_t buf[4096];//random length right now
-	uint8_t sense_buf[18];
 	uint8_t last_cmd;
 } MSDState;
 
@@ -268,6 +288,30 @@ static const uint8_t qemu_msd_config_descriptor[] = {
 #define MISCOMPARE          0x0e
 /* Additional sense codes */
 #define INVALID_COMMAND_OPERATION 0x20
+#define WRITE_PROTECTED           0x27
+#define MEDIUM_CHANGED            0x28
+#define MEDIUM_NOT_PRESENT        0x3a
+
+static const char *scsi_cmd_name(uint8_t cmd)
+{
+	switch (cmd) {
+	case TEST_UNIT_READY: return "TEST_UNIT_READY";
+	case REQUEST_SENSE: return "REQUEST_SENSE";
+	case INQUIRY: return "INQUIRY";
+	case MODE_SENSE: return "MODE_SENSE";
+	case MODE_SENSE_10: return "MODE_SENSE_10";
+	case START_STOP: return "START_STOP";
+	case ALLOW_MEDIUM_REMOVAL: return "ALLOW_MEDIUM_REMOVAL";
+	case READ_CAPACITY: return "READ_CAPACITY";
+	case READ_10: return "READ_10";
+	case READ_12: return "READ_12";
+	case WRITE_10: return "WRITE_10";
+	case WRITE_12: return "WRITE_12";
+	case VERIFY: return "VERIFY";
+	case SYNCHRONIZE_CACHE: return "SYNCHRONIZE_CACHE";
+	default: return NULL;
+	}
+}
 
 static void usb_msd_command_complete(void *opaque, uint32_t tag, int fail)
 {
@@ -284,6 +328,12 @@ static void usb_msd_handle_reset(USBDevice *dev)
 
     DPRINTF("Reset\n");
     s->mode = USB_MSDM_CBW;
+    s->streaming = false;
+    for (int i = 0; i < s->lun_count; i++)
+        if (s->luns[i].stream)
+            s->luns[i].stream->Cancel();
+    if (s->stats)
+        s->stats->End(true);
 }
 
 #ifndef bswap32
@@ -303,19 +353,36 @@ static void usb_msd_handle_reset(USBDevice *dev)
 static void set_sense(void *opaque, uint32_t sense, uint8_t extra)
 {
 	MSDState *s = (MSDState *)opaque;
-	memset(s->sense_buf, 0, sizeof(s->sense_buf));
+	memset(s->lun->sense_buf, 0, sizeof(s->lun->sense_buf));
 	//SENSE request
-	s->sense_buf[0] = 0x70;//0x70 - current sense
-	//s->sense_buf[1] = 0x00;
-	s->sense_buf[2] = sense;//ILLEGAL_REQUEST;
+	s->lun->sense_buf[0] = 0x70;//0x70 - current sense
+	//s->lun->sense_buf[1] = 0x00;
+	s->lun->sense_buf[2] = sense;//ILLEGAL_REQUEST;
 	//sense information like LBA where error occured
-	//s->sense_buf[3] = 0x00;
-	//s->sense_buf[4] = 0x00;
-	//s->sense_buf[5] = 0x00;
-	//s->sense_buf[6] = 0x00;
-	s->sense_buf[7] = extra ? 0x0a : 0x00; //Additional sense length (10 bytes if any)
-	s->sense_buf[12] = extra; //Additional sense code
-	//s->sense_buf[13] = 0x0; //Additional sense code qualifier
+	//s->lun->sense_buf[3] = 0x00;
+	//s->lun->sense_buf[4] = 0x00;
+	//s->lun->sense_buf[5] = 0x00;
+	//s->lun->sense_buf[6] = 0x00;
+	s->lun->sense_buf[7] = extra ? 0x0a : 0x00; //Additional sense length (10 bytes if any)
+	s->lun->sense_buf[12] = extra; //Additional sense code
+	//s->lun->sense_buf[13] = 0x0; //Additional sense code qualifier
+}
+
+static bool usb_msd_open_lun(MSDLun *lun, int port, int n);
+static void usb_msd_close_lun(MSDLun *lun, int n, bool discard);
+
+//Image was rewritten or replaced on the host, drop everything cached about it
+static void usb_msd_medium_changed(MSDState *s, MSDLun *lun)
+{
+	int n = lun - s->luns;
+	fprintf(stderr, "usb-msd: Image on LUN %d changed on the host, reopening\n", n);
+	//Unwritten data belongs to the old image, flushing it would corrupt the new one
+	usb_msd_close_lun(lun, n, true);
+	//Before opening, so a change that lands meanwhile is still seen next time
+	lun->watch->Snapshot();
+	if (!usb_msd_open_lun(lun, s->port, n))
+		fprintf(stderr, "usb-msd: LUN %d has no medium until the image is back\n", n);
+	lun->unit_attention = true;
 }
 
 static void send_command(void *opaque, struct usb_msd_cbw *cbw)
@@ -326,6 +393,24 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
 	uint32_t lba;
 	uint32_t xfer_len;
 	s->last_cmd = cbw->cmd[0];
+	s->streaming = false;
+
+	if (s->lun->watch && s->lun->watch->Changed())
+		usb_msd_medium_changed(s, s->lun);
+
+	//Guest learns about the new medium once, INQUIRY is exempt
+	if (s->lun->unit_attention && cbw->cmd[0] != INQUIRY) {
+		s->lun->unit_attention = false;
+		set_sense(s, UNIT_ATTENTION, MEDIUM_CHANGED);
+		if (cbw->cmd[0] != REQUEST_SENSE) {
+			s->result = 0x1; //COMMAND_FAILED
+			return;
+		}
+	} else if (!s->lun->blkdev && cbw->cmd[0] != INQUIRY && cbw->cmd[0] != REQUEST_SENSE) {
+		s->result = 0x1;
+		set_sense(s, NOT_READY, MEDIUM_NOT_PRESENT);
+		return;
+	}
 
 	switch(cbw->cmd[0])
 	{
@@ -339,10 +424,10 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
 		break;
 	case REQUEST_SENSE: //device shall keep old sense data
 		s->result = GOOD;
-		//memcpy_s(s->buf, s->data_len, s->sense_buf, sizeof(s->sense_buf)); //not on !WINDOWS
-		memcpy(s->buf, s->sense_buf, 
+		//memcpy_s(s->buf, s->data_len, s->lun->sense_buf, sizeof(s->lun->sense_buf)); //not on !WINDOWS
+		memcpy(s->buf, s->lun->sense_buf, 
 			/* TODO or error out instead? */
-			s->data_len < sizeof(s->sense_buf) ? s->data_len : sizeof(s->sense_buf));
+			s->data_len < sizeof(s->lun->sense_buf) ? s->data_len : sizeof(s->lun->sense_buf));
 		break;
 	case INQUIRY:
 		set_sense(s, NO_SENSE, 0);
@@ -359,17 +444,14 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
 		break;
 
 	case READ_CAPACITY:
-		long cur_tell, end_tell;
+		uint64_t end_tell;
 		uint32_t *last_lba, *blk_len;
 
 		set_sense(s, NO_SENSE, 0);
 		memset(s->buf, 0, sizeof(s->buf));
 		s->off = 0;
 
-		cur_tell = ftell(s->hfile);
-		fseek(s->hfile, 0, SEEK_END);
-		end_tell = ftell(s->hfile);
-		fseek(s->hfile, cur_tell, SEEK_SET);
+		end_tell = s->lun->capacity;
 
 		last_lba = (uint32_t*)&s->buf[0];
 		blk_len = (uint32_t*)&s->buf[4]; //in bytes
@@ -401,19 +483,14 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
 		if(xfer_len == 0) //TODO nothing to do
 			break;
 
-		if(fseek(s->hfile, lba * LBA_BLOCK_SIZE, SEEK_SET)) {
-			s->result = 0x2;//PHASE_ERROR
-			set_sense(s, MEDIUM_ERROR, 0);
-			return;
-		}
-
-		memset(s->buf, 0, sizeof(s->buf));
-		//Or do actual reading in USB_MSDM_DATAIN?
 		//TODO probably dont set data_len to read length
-		if(!(s->data_len = fread(s->buf, 1, /*s->data_len*/ xfer_len * LBA_BLOCK_SIZE, s->hfile))) {
-			s->result = 0x2;//PHASE_ERROR
-			set_sense(s, MEDIUM_ERROR, 0);
-		}
+		//Data is read ahead in chunks and handed out in USB_MSDM_DATAIN
+		s->data_len = xfer_len * LBA_BLOCK_SIZE;
+		s->read_off = (uint64_t)lba * LBA_BLOCK_SIZE;
+		s->read_direct = s->lun->blkdev->Mapped();
+		if (!s->read_direct)
+			s->lun->stream->StartRead(s->read_off, s->data_len);
+		s->streaming = true;
 		break;
 
 	case WRITE_12:
@@ -431,13 +508,25 @@ static void send_command(void *opaque, struct usb_msd_cbw *cbw)
 
 		//if(xfer_len == 0) //nothing to do
 		//	break;
-		if(fseek(s->hfile, lba * LBA_BLOCK_SIZE, SEEK_SET)) {
-			s->result = 0x2;//PHASE_ERROR
-			set_sense(s, MEDIUM_ERROR, 0);
-			return;
-		}
 		s->data_len = xfer_len * LBA_BLOCK_SIZE;
+		if (s->lun->blkdev->ReadOnly()) {
+			//Data phase is still taken, then dropped
+			s->result = 0x1; //COMMAND_FAILED
+			set_sense(s, DATA_PROTECT, WRITE_PROTECTED);
+			break;
+		}
 		//Actual write comes with next command in USB_MSDM_DATAOUT
+		s->lun->stream->StartWrite((uint64_t)lba * LBA_BLOCK_SIZE, s->data_len);
+		s->streaming = true;
+		break;
+	case SYNCHRONIZE_CACHE:
+		//Everything written so far reaches the image before status goes out
+		s->result = GOOD;
+		set_sense(s, NO_SENSE, 0);
+		if (!s->lun->blkdev->Flush()) {
+			s->result = 0x1; //COMMAND_FAILED
+			set_sense(s, MEDIUM_ERROR, 0);
+		}
 		break;
 	default:
 		OSDebugOut(TEXT("usb-msd: invalid command %d\n"), cbw->cmd[0]);
@@ -550,7 +639,7 @@ static int usb_msd_handle_control(USBDevice *dev, int request, int value,
         ret = 0;
         break;
     case GetMaxLun:
-        data[0] = 0;
+        data[0] = s->lun_count - 1;
         ret = 1;
         break;
     default:
@@ -575,6 +664,8 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
     // 2.) USB_MSDM_DATAOUT: return USB_RET_ASYNC status if command is in progress,
     // 3.) USB_MSDM_CSW: return USB_RET_ASYNC status if command is still in progress
     //     or complete and set mode to USB_MSDM_CBW.
+    //Our OHCI has no USB_RET_ASYNC, streamed data phases and CSW NAK instead
+    //while the BlockStream worker is busy and the TD is retried next frame.
 
     switch (pid) {
     case USB_TOKEN_OUT:
@@ -594,10 +685,11 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
                 goto fail;
             }
             DPRINTF("Command on LUN %d\n", cbw.lun);
-            if (cbw.lun != 0) {
+            if (cbw.lun >= s->lun_count) {
                 fprintf(stderr, "usb-msd: Bad LUN %d\n", cbw.lun);
                 goto fail;
             }
+            s->lun = &s->luns[cbw.lun];
             s->tag = le32_to_cpu(cbw.tag);
             s->data_len = le32_to_cpu(cbw.data_len);
             if (s->data_len == 0) {
@@ -609,7 +701,13 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
             }
             DPRINTF("Command tag 0x%x flags %08x len %d data %d\n",
                     s->tag, cbw.flags, cbw.cmd_len, s->data_len);
-			send_command(s, &cbw);
+			s->stats->Begin(cbw.cmd[0]);
+			{
+				//READ_CAPACITY, SYNCHRONIZE_CACHE and starting streams hit the backend
+				MsdStats::Clock::time_point start = MsdStats::Clock::now();
+				send_command(s, &cbw);
+				s->stats->AddHost(start);
+			}
             ret = len;
             break;
 
@@ -621,12 +719,31 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
             if (len > s->data_len)
                 goto fail;
 
-            if (!fwrite(data, 1, len, s->hfile))
-                goto fail;
+            //Worker still busy with the chunk, host sends this packet again
+            if (s->streaming && !s->lun->stream->WriteReady(len)) {
+                ret = USB_RET_NAK;
+                break;
+            }
+
+            //Keep taking data after an error, status goes out with CSW.
+            //Data for other commands is dropped.
+            s->stats->AddBytes(len);
+            if (s->streaming) {
+                MsdStats::Clock::time_point start = MsdStats::Clock::now();
+                if (!s->lun->stream->Write(data, len) && s->result == GOOD) {
+                    s->result = 0x1; //COMMAND_FAILED
+                    set_sense(s, MEDIUM_ERROR, 0);
+                }
+                s->stats->AddHost(start);
+            }
 
             s->data_len -= len;
-            if (s->data_len == 0)
+            if (s->data_len == 0) {
+                //Status waits in USB_MSDM_CSW until the last chunk is written
+                if (s->streaming)
+                    s->lun->stream->EndWrite();
                 s->mode = USB_MSDM_CSW;
+            }
             ret = len;
             break;
 
@@ -647,6 +764,21 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
             if (len < 13)
                 goto fail;
 
+            //Write stream still going, NAK until the worker is done
+            if (s->streaming) {
+                if (!s->lun->stream->Idle()) {
+                    ret = USB_RET_NAK;
+                    break;
+                }
+                MsdStats::Clock::time_point start = MsdStats::Clock::now();
+                if (!s->lun->stream->FinishWrite() && s->result == GOOD) {
+                    s->result = 0x1;
+                    set_sense(s, MEDIUM_ERROR, 0);
+                }
+                s->stats->AddHost(start);
+                s->streaming = false;
+            }
+
             csw.sig = cpu_to_le32(0x53425355);
             csw.tag = cpu_to_le32(s->tag);
             csw.residue = 0;
@@ -654,6 +786,9 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
             memcpy(data, &csw, 13);
             ret = 13;
             s->mode = USB_MSDM_CBW;
+            s->stats->End(s->result != GOOD);
+            if (s->stats->Due())
+                s->stats->Log(false);
             break;
 
         case USB_MSDM_DATAIN:
@@ -661,15 +796,48 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
             if (len > s->data_len)
                 len = s->data_len;
 
-			if(s->off + len > sizeof(s->buf))
-				goto fail;
-
-			memcpy(data, &s->buf[s->off], len);
-			s->off += len;
+			//Read-ahead has not landed yet, host asks again next frame
+			if (s->streaming && !s->read_direct && !s->lun->stream->ReadReady(len)) {
+				ret = USB_RET_NAK;
+				break;
+			}
+
+			s->stats->AddBytes(len);
+			if (s->streaming && s->read_direct) {
+				MsdStats::Clock::time_point start = MsdStats::Clock::now();
+				int64_t got = s->lun->blkdev->Read(s->read_off, data, len);
+				if (got < len) {
+					memset(data + (got > 0 ? got : 0), 0, len - (got > 0 ? got : 0));
+					if (s->result == GOOD) {
+						s->result = 0x1; //COMMAND_FAILED
+						set_sense(s, MEDIUM_ERROR, 0);
+					}
+				}
+				s->read_off += len;
+				s->stats->AddHost(start);
+			} else if (s->streaming) {
+				MsdStats::Clock::time_point start = MsdStats::Clock::now();
+				if (!s->lun->stream->Read(data, len) && s->result == GOOD) {
+					s->result = 0x1; //COMMAND_FAILED
+					set_sense(s, MEDIUM_ERROR, 0);
+				}
+				s->stats->AddHost(start);
+			} else if (s->result != GOOD) {
+				//Failed command, pad the data phase and report in CSW
+				memset(data, 0, len);
+			} else {
+				if(s->off + len > sizeof(s->buf))
+					goto fail;
+
+				memcpy(data, &s->buf[s->off], len);
+				s->off += len;
+			}
 
             s->data_len -= len;
-            if (s->data_len == 0)
+            if (s->data_len == 0) {
+                s->streaming = false;
                 s->mode = USB_MSDM_CSW;
+            }
             ret = len;
             break;
 
@@ -684,47 +852,145 @@ static int usb_msd_handle_data(USBDevice *dev, int pid, uint8_t devep,
     fail:
         ret = USB_RET_STALL;
 		s->mode = USB_MSDM_CBW;
+		s->stats->End(true);
+		if (s->streaming) {
+			s->lun->stream->Cancel();
+			s->streaming = false;
+		}
         break;
     }
 
     return ret;
 }
 
+static void usb_msd_handle_flush(USBDevice *dev)
+{
+	MSDState *s = (MSDState *)dev;
+	for (int i = 0; i < s->lun_count; i++)
+		if (s->luns[i].blkdev && !s->luns[i].blkdev->Flush())
+			fprintf(stderr, "usb-msd: Flushing image on LUN %d failed\n", i);
+}
+
+static void usb_msd_close_lun(MSDLun *lun, int n, bool discard)
+{
+	delete lun->stream;
+	lun->stream = NULL;
+	if (lun->cache) {
+		BlockCacheStats st = lun->cache->GetStats();
+		fprintf(stderr, "usb-msd: LUN %d cache hits %llu misses %llu, read-ahead %llu lines (used %llu, wasted %llu)\n",
+			n, (unsigned long long)st.hits, (unsigned long long)st.misses,
+			(unsigned long long)st.prefetched, (unsigned long long)st.prefetchUsed,
+			(unsigned long long)st.prefetchWasted);
+	}
+	if (lun->blkdev) {
+		if (discard)
+			lun->blkdev->Discard();
+		else
+			lun->blkdev->Flush();
+	}
+	delete lun->blkdev;
+	lun->blkdev = NULL;
+	lun->cache = NULL;
+}
+
 static void usb_msd_handle_destroy(USBDevice *dev)
 {
 	MSDState *s = (MSDState *)dev;
 	if (s)
 	{
-		if(s->hfile)
-			fclose(s->hfile);
-		s->hfile = NULL;
+		if (s->stats) {
+			s->stats->Log(true);
+			delete s->stats;
+			s->stats = NULL;
+		}
+		for (int i = 0; i < s->lun_count; i++) {
+			usb_msd_close_lun(&s->luns[i], i, false);
+			delete s->luns[i].watch;
+		}
 	}
 	free(s);
 }
 
-USBDevice *MsdDevice::CreateDevice(int port)
+//Backend, write-back and cache for one LUN. Past LUN 0 the settings come
+//from "msd_lun<n>" and "<api>_lun<n>" sections.
+static bool usb_msd_open_lun(MSDLun *lun, int port, int n)
 {
-	MSDState *s = (MSDState *)qemu_mallocz(sizeof(MSDState));
-	if (!s)
-		return NULL;
-
-	//CONFIGVARIANT varApi(N_DEVICE_API, CONFIG_TYPE_CHAR);
-	//LoadSetting(port, DEVICENAME, varApi);
-	std::string api = *MsdDevice::APIs().begin();
+	std::string dev = LunKey(DEVICENAME, n);
+	std::string api = APINAME;
+	{
+		CONFIGVARIANT varApi(N_DEVICE_API, CONFIG_TYPE_CHAR);
+		if (LoadSetting(port, dev, varApi) && RegisterBlockDevice::instance().Proxy(varApi.strValue))
+			api = varApi.strValue;
+	}
 
 	CONFIGVARIANT var(N_CONFIG_PATH, CONFIG_TYPE_TCHAR);
-
-	if(!LoadSetting(port, api, var))
+	std::string section = LunKey(api, n);
+	//Older configs keep the only image under cstdio
+	if (n == 0 ? !LoadImagePath(port, api, var) : !LoadSetting(port, section, var))
 	{
-		fprintf(stderr, "usb-msd: Could not load settings\n");
-		return NULL;
+		fprintf(stderr, "usb-msd: Could not load settings for LUN %d\n", n);
+		return false;
 	}
 
-	s->hfile = wfopen(var.tstrValue.c_str(), TEXT("r+b"));
-	if (!s->hfile) {
-		fprintf(stderr, "usb-msd: Could not open image file\n");
+	if (!lun->watch)
+		lun->watch = new ImageWatch(var.tstrValue);
+
+	auto proxy = RegisterBlockDevice::instance().Proxy(api);
+	if (proxy)
+		lun->blkdev = proxy->CreateObject(port, section, var.tstrValue);
+	if (!lun->blkdev) {
+		fprintf(stderr, "usb-msd: Could not open image file for LUN %d\n", n);
+		return false;
+	}
+
+	//Mapped images are already in memory
+	if (!lun->blkdev->Mapped()) {
+		CONFIGVARIANT varWriteBack(N_WRITE_BACK, CONFIG_TYPE_INT);
+		int writeBackKB = LoadSetting(port, dev, varWriteBack) ? varWriteBack.intValue : WRITEBACK_DEFAULT_KB;
+		if (writeBackKB > 0 && !lun->blkdev->ReadOnly())
+			lun->blkdev = new WriteBackBlockDevice(lun->blkdev, writeBackKB);
+
+		CONFIGVARIANT varSize(N_CACHE_SIZE, CONFIG_TYPE_INT);
+		CONFIGVARIANT varAhead(N_READ_AHEAD, CONFIG_TYPE_INT);
+		int cacheKB = LoadSetting(port, dev, varSize) ? varSize.intValue : BLOCKCACHE_DEFAULT_KB;
+		int readAhead = LoadSetting(port, dev, varAhead) ? varAhead.intValue : BLOCKCACHE_DEFAULT_READ_AHEAD;
+		if (cacheKB > 0) {
+			lun->cache = new CachedBlockDevice(lun->blkdev, cacheKB, readAhead > 0 ? readAhead : 0);
+			lun->blkdev = lun->cache;
+		}
+	}
+	lun->stream = new BlockStream(lun->blkdev);
+	//Fixed for as long as the image is open, READ_CAPACITY is asked often
+	lun->capacity = lun->blkdev->Size();
+	return true;
+}
+
+USBDevice *MsdDevice::CreateDevice(int port)
+{
+	MSDState *s = (MSDState *)qemu_mallocz(sizeof(MSDState));
+	if (!s)
 		return NULL;
+
+	s->port = port;
+	CONFIGVARIANT varLuns(N_LUNS, CONFIG_TYPE_INT);
+	int luns = LoadSetting(port, DEVICENAME, varLuns) ? varLuns.intValue : 1;
+	if (luns < 1)
+		luns = 1;
+	else if (luns > MSD_MAX_LUNS)
+		luns = MSD_MAX_LUNS;
+
+	for (s->lun_count = 0; s->lun_count < luns; s->lun_count++) {
+		if (!usb_msd_open_lun(&s->luns[s->lun_count], port, s->lun_count)) {
+			for (int i = 0; i <= s->lun_count; i++) {
+				usb_msd_close_lun(&s->luns[i], i, false);
+				delete s->luns[i].watch;
+			}
+			free(s);
+			return NULL;
+		}
 	}
+	s->lun = &s->luns[0];
+	s->stats = new MsdStats(DEVICENAME, port, scsi_cmd_name);
 
 	s->last_cmd = -1;
 	s->dev.speed = USB_SPEED_FULL;
@@ -734,6 +1000,7 @@ USBDevice *MsdDevice::CreateDevice(int port)
 	s->dev.handle_control = usb_msd_handle_control;
 	s->dev.handle_data = usb_msd_handle_data;
 	s->dev.handle_destroy = usb_msd_handle_destroy;
+	s->dev.handle_flush = usb_msd_handle_flush;
 
 	sprintf(s->dev.devname, "QEMU USB MSD(%.16s)",
 			 ""/*filename*/);
@@ -742,6 +1009,23 @@ USBDevice *MsdDevice::CreateDevice(int port)
 	return (USBDevice *)s;
 }
 
+// Device section settings are not in the dialogs, LUNs past 0 read their
+// image from the "<api>_lun<n>" sections (see LunKey)
+std::vector<CONFIGVARIANT> MsdDevice::GetSettings(const std::string &api)
+{
+	std::vector<CONFIGVARIANT> params;
+	params.push_back(CONFIGVARIANT(S_CONFIG_PATH, N_CONFIG_PATH, CONFIG_TYPE_TCHAR));
+	params.push_back(CONFIGVARIANT(S_LUNS, N_LUNS, CONFIG_TYPE_INT));
+	params.push_back(CONFIGVARIANT(S_WRITE_BACK, N_WRITE_BACK, CONFIG_TYPE_INT));
+	params.push_back(CONFIGVARIANT(S_CACHE_SIZE, N_CACHE_SIZE, CONFIG_TYPE_INT));
+	params.push_back(CONFIGVARIANT(S_READ_AHEAD, N_READ_AHEAD, CONFIG_TYPE_INT));
+	auto proxy = RegisterBlockDevice::instance().Proxy(api);
+	if (proxy)
+		for (auto& p : proxy->GetSettings())
+			params.push_back(p);
+	return params;
+}
+
 REGISTER_DEVICE(1, DEVICENAME, MsdDevice);
 #undef DPRINTF
 #undef DEVICENAME
@@ -1,11 +1,30 @@
 #ifndef USBMSD_H
 #define USBMSD_H
 #include "../deviceproxy.h"
+#include "blockdev.h"
 
 // Catch typos at compile time
 #define S_CONFIG_PATH TEXT("Image path")
 #define N_CONFIG_PATH TEXT("path")
 #define APINAME "cstdio"
+#define S_LUNS TEXT("Number of LUNs")
+#define N_LUNS TEXT("luns")
+// Bulk-only transport allows 16, more images than this is a hub's job
+#define MSD_MAX_LUNS 8
+
+// LUN 0 keeps the plain sections, LUN n reads "<key>_lun<n>"
+static inline std::string LunKey(const std::string& key, int lun)
+{
+	if (lun == 0)
+		return key;
+	return key + "_lun" + std::to_string(lun);
+}
+
+// Image path is kept per backend, older configs only have it under cstdio
+static inline bool LoadImagePath(int port, const std::string& api, CONFIGVARIANT& var)
+{
+	return LoadSetting(port, api, var) || (api != APINAME && LoadSetting(port, APINAME, var));
+}
 
 class MsdDevice : public Device
 {
@@ -18,23 +37,20 @@ public:
 	}
 	static std::list<std::string> APIs()
 	{
-		return std::list<std::string> { "cstdio" };
+		return RegisterBlockDevice::instance().Names();
 	}
 	static const TCHAR* LongAPIName(const std::string& name)
 	{
-		return TEXT("cstdio");
+		auto proxy = RegisterBlockDevice::instance().Proxy(name);
+		if (proxy)
+			return proxy->Name();
+		return nullptr;
 	}
 
 //	static bool LoadSettings(int port, std::vector<CONFIGVARIANT>& params);
 //	static bool SaveSettings(int port, std::vector<CONFIGVARIANT>& params);
 
 	static int Configure(int port, std::string api, void *data);
-	static std::vector<CONFIGVARIANT> GetSettings(const std::string &api)
-	{
-		(void)api;
-		std::vector<CONFIGVARIANT> params;
-		params.push_back(CONFIGVARIANT(S_CONFIG_PATH, N_CONFIG_PATH, CONFIG_TYPE_TCHAR));
-		return params;
-	}
+	static std::vector<CONFIGVARIANT> GetSettings(const std::string &api);
 };
 #endif
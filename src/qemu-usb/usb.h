@@ -146,6 +146,8 @@ struct USBDevice {
                          uint8_t devaddr, uint8_t devep,
                          uint8_t *data, int len);
     void (*handle_destroy)(USBDevice *dev);
+    /* Optional, write anything cached out to the host (e.g. before savestate) */
+    void (*handle_flush)(USBDevice *dev);
 
 	//might be useful
 	int (*open)(USBDevice *dev);
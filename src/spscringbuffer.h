@@ -0,0 +1,113 @@
+#ifndef SPSCRINGBUFFER_H
+#define SPSCRINGBUFFER_H
+#include <algorithm> // for std::min
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/*
+	Fixed size ring for exactly one writer and one reader thread. Both
+	indices only ever grow and are masked on access, so each side owns
+	its own index and needs no lock. Capacity is rounded up to a power
+	of two. clear() is only safe while neither side is active.
+*/
+template<typename T>
+class SPSCRingBuffer
+{
+	SPSCRingBuffer(SPSCRingBuffer&) = delete;
+public:
+	explicit SPSCRingBuffer(size_t capacity)
+	: m_head(0)
+	, m_tail(0)
+	{
+		size_t cap = 1;
+		while (cap < capacity)
+			cap <<= 1;
+		m_data.resize(cap);
+		m_mask = cap - 1;
+	}
+
+	size_t capacity() const { return m_mask + 1; }
+	size_t size() const { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire); }
+
+	void clear()
+	{
+		m_head.store(0, std::memory_order_relaxed);
+		m_tail.store(0, std::memory_order_relaxed);
+	}
+
+	// Writer side
+
+	size_t free_space() const
+	{
+		return capacity() - (m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_acquire));
+	}
+
+	// Contiguous free space starting 'offset' elements past back()
+	size_t peek_write(size_t offset = 0) const
+	{
+		size_t free = free_space();
+		if (offset >= free)
+			return 0;
+		size_t pos = (m_head.load(std::memory_order_relaxed) + offset) & m_mask;
+		return std::min(free - offset, capacity() - pos);
+	}
+
+	T* back(size_t offset = 0) { return &m_data[(m_head.load(std::memory_order_relaxed) + offset) & m_mask]; }
+
+	// Publish elements filled in through back()
+	void write(size_t count) { m_head.store(m_head.load(std::memory_order_relaxed) + count, std::memory_order_release); }
+
+	// Copies what fits, returns element count written
+	size_t write(const T *src, size_t count)
+	{
+		count = std::min(count, free_space());
+		for (size_t done = 0, n; done < count; done += n)
+		{
+			n = std::min(count - done, peek_write(done));
+			memcpy(back(done), src + done, n * sizeof(T));
+		}
+		write(count);
+		return count;
+	}
+
+	// Reader side
+
+	// Contiguous data starting 'offset' elements past front()
+	size_t peek_read(size_t offset = 0) const
+	{
+		size_t avail = size();
+		if (offset >= avail)
+			return 0;
+		size_t pos = (m_tail.load(std::memory_order_relaxed) + offset) & m_mask;
+		return std::min(avail - offset, capacity() - pos);
+	}
+
+	T* front(size_t offset = 0) { return &m_data[(m_tail.load(std::memory_order_relaxed) + offset) & m_mask]; }
+
+	// Release elements consumed through front()
+	void read(size_t count) { m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release); }
+
+	size_t read(T *dst, size_t count)
+	{
+		count = std::min(count, size());
+		for (size_t done = 0, n; done < count; done += n)
+		{
+			n = std::min(count - done, peek_read(done));
+			memcpy(dst + done, front(done), n * sizeof(T));
+		}
+		read(count);
+		return count;
+	}
+
+private:
+	std::vector<T> m_data;
+	size_t m_mask;
+	// Padded apart so writer and reader don't false share a cache line
+	std::atomic<size_t> m_head;
+	char m_pad[64];
+	std::atomic<size_t> m_tail;
+};
+
+#endif
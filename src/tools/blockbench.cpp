@@ -0,0 +1,149 @@
+// Compares the MSD block device backends on a scratch image.
+// Usage: blockbench [image path] [size in MiB] [seconds per test]
+// The default path is on /dev/shm so the numbers show backend overhead,
+// not the disk.
+
+#include "../qemu-usb/blockdev.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+
+// Backends only read their own settings, defaults are fine here
+bool LoadSetting(int port, const std::string& key, CONFIGVARIANT& var)
+{
+	return false;
+}
+
+bool SaveSetting(int port, const std::string& key, CONFIGVARIANT& var)
+{
+	return false;
+}
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Workload
+{
+	const char *name;
+	uint32_t blockSize;
+	bool random;
+	bool write;
+};
+
+const Workload workloads[] = {
+	{ "seq 64K read",  64 * 1024, false, false },
+	{ "seq 64K write", 64 * 1024, false, true },
+	{ "rand 4K read",  4096,      true,  false },
+	{ "rand 4K write", 4096,      true,  true },
+};
+
+// xorshift, only has to spread offsets over the image
+uint64_t NextRandom(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+bool CreateImage(const char *path, uint64_t size)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return false;
+
+	std::vector<uint8_t> block(1024 * 1024);
+	for (size_t i = 0; i < block.size(); i++)
+		block[i] = (uint8_t)(i * 31);
+	bool ok = true;
+	for (uint64_t done = 0; ok && done < size; done += block.size())
+		ok = fwrite(block.data(), 1, block.size(), file) == block.size();
+	return fclose(file) == 0 && ok;
+}
+
+void Run(BlockDevice *dev, const Workload& w, uint64_t size, double seconds)
+{
+	std::vector<uint8_t> buf(w.blockSize, 0x5a);
+	uint64_t blocks = size / w.blockSize;
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+	uint64_t ops = 0;
+	uint64_t next = 0;
+	bool failed = false;
+
+	Clock::time_point start = Clock::now();
+	Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(seconds));
+	Clock::time_point now = start;
+	while (now < end && !failed)
+	{
+		// Check the clock every few ops, it is not free either
+		for (int i = 0; i < 64; i++)
+		{
+			uint64_t block = w.random ? NextRandom(rng) % blocks : next++ % blocks;
+			uint64_t offset = block * w.blockSize;
+			int64_t ret = w.write ?
+				dev->Write(offset, buf.data(), w.blockSize) :
+				dev->Read(offset, buf.data(), w.blockSize);
+			if (ret != (int64_t)w.blockSize)
+			{
+				failed = true;
+				break;
+			}
+			ops++;
+		}
+		now = Clock::now();
+	}
+	if (w.write && !dev->Flush())
+		failed = true;
+	now = Clock::now();
+
+	double elapsed = std::chrono::duration<double>(now - start).count();
+	if (failed)
+		printf("  %-14s failed after %llu ops\n", w.name, (unsigned long long)ops);
+	else
+		printf("  %-14s %10.0f IOPS %9.1f MiB/s\n", w.name, ops / elapsed,
+			ops * (double)w.blockSize / elapsed / (1024 * 1024));
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = argc > 1 ? argv[1] : "/dev/shm/blockbench.img";
+	uint64_t size = (argc > 2 ? strtoull(argv[2], nullptr, 10) : 256) * 1024 * 1024;
+	double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+
+	if (!size || seconds <= 0)
+	{
+		fprintf(stderr, "usage: %s [image path] [size in MiB] [seconds per test]\n", argv[0]);
+		return 1;
+	}
+
+	if (!CreateImage(path, size))
+	{
+		fprintf(stderr, "Could not create %s\n", path);
+		return 1;
+	}
+
+	printf("%s, %llu MiB, %.1fs per test\n", path, (unsigned long long)(size >> 20), seconds);
+	for (auto& it : RegisterBlockDevice::instance().Map())
+	{
+		BlockDevice *dev = it.second->CreateObject(0, it.first, path);
+		printf("%s (%s)\n", it.first.c_str(), it.second->Name());
+		if (!dev)
+		{
+			printf("  could not open\n");
+			continue;
+		}
+		for (const Workload& w : workloads)
+			Run(dev, w, size, seconds);
+		delete dev;
+	}
+
+	unlink(path);
+	return 0;
+}
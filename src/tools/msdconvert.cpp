@@ -0,0 +1,215 @@
+// Converts raw mass storage images to the sparse container and back.
+// Usage: msdconvert [-c none|lz4|zstd] [-s cluster KiB] <raw image> <sparse image>
+//        msdconvert -x <sparse image> <raw image>
+// Running a sparse image through -x and back also packs clusters the
+// emulator rewrote.
+
+#include "../qemu-usb/sparseimage.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+void Usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-c none|lz4|zstd] [-s cluster KiB] <raw image> <sparse image>\n"
+		"       %s -x <sparse image> <raw image>\n", prog, prog);
+}
+
+int Pack(const char *in, const char *out, uint32_t codec, uint32_t clusterSize)
+{
+	FILE *src = fopen(in, "rb");
+	if (!src)
+	{
+		fprintf(stderr, "Could not open %s\n", in);
+		return 1;
+	}
+	FILE *dst = fopen(out, "wb");
+	if (!dst)
+	{
+		fprintf(stderr, "Could not create %s\n", out);
+		fclose(src);
+		return 1;
+	}
+
+	SparseHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SPARSE_MAGIC, sizeof(header.magic));
+	header.version = SPARSE_VERSION;
+	header.clusterSize = clusterSize;
+	header.size = SparseFileSize(src);
+	header.clusters = (header.size + clusterSize - 1) / clusterSize;
+	header.indexOffset = SPARSE_HEADER_SIZE;
+
+	std::vector<SparseIndexEntry> index(header.clusters);
+	uint64_t end = header.indexOffset + index.size() * sizeof(SparseIndexEntry);
+	// Keep cluster data block aligned for the host
+	end = (end + SPARSE_HEADER_SIZE - 1) / SPARSE_HEADER_SIZE * SPARSE_HEADER_SIZE;
+
+	std::vector<uint8_t> buf(clusterSize), packed;
+	uint64_t zero = 0, compressed = 0;
+	bool ok = SparseWriteHeader(dst, header);
+	for (uint64_t i = 0; ok && i < header.clusters; i++)
+	{
+		uint64_t pos = i * clusterSize;
+		size_t n = (size_t)std::min<uint64_t>(clusterSize, header.size - pos);
+		memset(buf.data(), 0, buf.size());
+		if (!SparseReadAt(src, pos, buf.data(), n))
+		{
+			fprintf(stderr, "Read error at %llu\n", (unsigned long long)pos);
+			ok = false;
+			break;
+		}
+
+		SparseIndexEntry& entry = index[i];
+		if (SparseIsZero(buf.data(), buf.size()))
+		{
+			entry.offset = 0;
+			entry.length = 0;
+			entry.type = SPARSE_ZERO;
+			zero++;
+			continue;
+		}
+
+		const uint8_t *data = buf.data();
+		entry.type = SPARSE_RAW;
+		entry.length = clusterSize;
+		if (codec != SPARSE_RAW && SparseCompress(codec, buf.data(), clusterSize, packed))
+		{
+			data = packed.data();
+			entry.type = codec;
+			entry.length = packed.size();
+			compressed++;
+		}
+		entry.offset = end;
+		ok = SparseWriteAt(dst, end, data, entry.length);
+		end += entry.length;
+	}
+
+	ok = ok && SparseWriteIndex(dst, header, index.data(), 0, index.size());
+	fclose(src);
+	if (fclose(dst) || !ok)
+	{
+		fprintf(stderr, "Write error on %s\n", out);
+		return 1;
+	}
+
+	printf("%llu clusters of %u KiB: %llu zero, %llu compressed, %llu raw\n",
+		(unsigned long long)header.clusters, clusterSize / 1024, (unsigned long long)zero,
+		(unsigned long long)compressed, (unsigned long long)(header.clusters - zero - compressed));
+	printf("%llu KiB -> %llu KiB\n", (unsigned long long)(header.size >> 10), (unsigned long long)(end >> 10));
+	return 0;
+}
+
+int Unpack(const char *in, const char *out)
+{
+	FILE *src = fopen(in, "rb");
+	if (!src)
+	{
+		fprintf(stderr, "Could not open %s\n", in);
+		return 1;
+	}
+
+	SparseHeader header;
+	std::vector<SparseIndexEntry> index;
+	if (!SparseReadHeader(src, header, index))
+	{
+		fprintf(stderr, "%s is not a sparse image\n", in);
+		fclose(src);
+		return 1;
+	}
+
+	FILE *dst = fopen(out, "wb");
+	if (!dst)
+	{
+		fprintf(stderr, "Could not create %s\n", out);
+		fclose(src);
+		return 1;
+	}
+
+	std::vector<uint8_t> buf(header.clusterSize), scratch;
+	bool ok = true;
+	for (uint64_t i = 0; ok && i < header.clusters; i++)
+	{
+		if (!SparseReadCluster(src, header, index[i], buf.data(), scratch))
+		{
+			fprintf(stderr, "Cluster %llu is corrupt or uses a missing codec\n", (unsigned long long)i);
+			ok = false;
+			break;
+		}
+		uint64_t pos = i * header.clusterSize;
+		size_t n = (size_t)std::min<uint64_t>(header.clusterSize, header.size - pos);
+		ok = fwrite(buf.data(), 1, n, dst) == n;
+	}
+
+	fclose(src);
+	if (fclose(dst) || !ok)
+	{
+		fprintf(stderr, "Could not write %s\n", out);
+		return 1;
+	}
+	return 0;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t codec = SPARSE_RAW;
+	uint32_t clusterSize = SPARSE_DEFAULT_CLUSTER;
+	bool unpack = false;
+
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; i++)
+	{
+		if (!strcmp(argv[i], "-x"))
+			unpack = true;
+		else if (!strcmp(argv[i], "-c") && i + 1 < argc)
+		{
+			std::string name = argv[++i];
+			if (name == "none")
+				codec = SPARSE_RAW;
+			else if (name == "lz4")
+				codec = SPARSE_LZ4;
+			else if (name == "zstd")
+				codec = SPARSE_ZSTD;
+			else
+			{
+				Usage(argv[0]);
+				return 1;
+			}
+			if (!SparseCodecAvailable(codec))
+			{
+				fprintf(stderr, "%s support was not built in\n", name.c_str());
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+		{
+			clusterSize = (uint32_t)strtoul(argv[++i], nullptr, 10) * 1024;
+			// Power of two so clusters line up with guest sectors
+			if (clusterSize < 4096 || clusterSize > SPARSE_MAX_CLUSTER || (clusterSize & (clusterSize - 1)))
+			{
+				fprintf(stderr, "Cluster size must be a power of two from 4 to %d KiB\n", SPARSE_MAX_CLUSTER / 1024);
+				return 1;
+			}
+		}
+		else
+		{
+			Usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - i != 2)
+	{
+		Usage(argv[0]);
+		return 1;
+	}
+	return unpack ? Unpack(argv[i], argv[i + 1]) : Pack(argv[i], argv[i + 1], codec, clusterSize);
+}
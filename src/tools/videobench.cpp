@@ -0,0 +1,172 @@
+// Times the EyeToy frame conversions with every kernel set the CPU runs
+// and checks each against the scalar reference, odd sizes included.
+// Usage: videobench [seconds per test]
+
+#include "../usb-eyetoy/videoconvert.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+enum Kind
+{
+	KIND_YUYV,
+	KIND_BGR32,
+	KIND_HALVE,
+};
+
+struct Workload
+{
+	const char *name;
+	Kind kind;
+	uint32_t width; // output size
+	uint32_t height;
+};
+
+const Workload workloads[] = {
+	{ "yuyv 640x480",       KIND_YUYV,  640, 480 },
+	{ "bgr32 640x480",      KIND_BGR32, 640, 480 },
+	{ "halve 640x480",      KIND_HALVE, 320, 240 },
+	{ "yuyv 320x240",       KIND_YUYV,  320, 240 },
+	{ "bgr32 320x240",      KIND_BGR32, 320, 240 },
+};
+
+// Sizes that leave tails for every kernel width
+const uint32_t checkSizes[][2] = {
+	{ 640, 480 }, { 320, 240 }, { 176, 144 }, { 62, 6 }, { 30, 2 }, { 2, 2 },
+};
+
+// xorshift, only has to fill frames with something that isn't flat
+uint64_t NextRandom(uint64_t& state)
+{
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+struct Frame
+{
+	std::vector<uint8_t> packed; // YUYV or BGR32 source
+	uint32_t stride;
+	VideoImage planar; // I420 source for scaling
+	VideoImage out;
+};
+
+// Rows are padded so kernels that ignore the stride show up in the check
+void MakeFrame(Frame& f, Kind kind, uint32_t w, uint32_t h)
+{
+	uint64_t rng = 0x9e3779b97f4a7c15ULL;
+	f.stride = w * (kind == KIND_BGR32 ? 4 : 2) + 24;
+	f.packed.resize(f.stride * h);
+	for (auto& b : f.packed)
+		b = (uint8_t)NextRandom(rng);
+	f.planar.Resize(w * 2, h * 2);
+	for (auto& b : f.planar.data)
+		b = (uint8_t)NextRandom(rng);
+	f.out.Resize(w, h);
+}
+
+void Convert(Frame& f, Kind kind)
+{
+	switch (kind)
+	{
+	case KIND_YUYV:
+		YuyvToI420(f.packed.data(), f.stride, f.out);
+		break;
+	case KIND_BGR32:
+		Bgr32ToI420(f.packed.data(), f.stride, f.out);
+		break;
+	case KIND_HALVE:
+		ScaleI420(f.planar, f.out);
+		break;
+	}
+}
+
+bool Check(Kind kind, VideoSimd simd)
+{
+	for (auto& size : checkSizes)
+	{
+		Frame f;
+		MakeFrame(f, kind, size[0], size[1]);
+		SetVideoSimd(VIDEO_SIMD_NONE);
+		Convert(f, kind);
+		std::vector<uint8_t> ref = f.out.data;
+
+		SetVideoSimd(simd);
+		std::fill(f.out.data.begin(), f.out.data.end(), 0);
+		Convert(f, kind);
+		for (size_t i = 0; i < ref.size(); i++)
+		{
+			if (ref[i] != f.out.data[i])
+			{
+				printf("  %s differs at %ux%u, byte %zu: %u instead of %u\n", VideoSimdName(simd),
+					size[0], size[1], i, f.out.data[i], ref[i]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+double Run(const Workload& w, double seconds)
+{
+	Frame f;
+	MakeFrame(f, w.kind, w.width, w.height);
+	uint64_t frames = 0;
+
+	Clock::time_point start = Clock::now();
+	Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double>(seconds));
+	Clock::time_point now = start;
+	while (now < end)
+	{
+		for (int i = 0; i < 16; i++)
+			Convert(f, w.kind);
+		frames += 16;
+		now = Clock::now();
+	}
+	return std::chrono::duration<double, std::micro>(now - start).count() / frames;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+	if (seconds <= 0)
+	{
+		fprintf(stderr, "usage: %s [seconds per test]\n", argv[0]);
+		return 1;
+	}
+
+	VideoSimd best = VideoSimdSupported();
+	printf("best kernels: %s, %.1fs per test\n", VideoSimdName(best), seconds);
+
+	bool ok = true;
+	for (const Workload& w : workloads)
+	{
+		printf("%s\n", w.name);
+		double scalar = 0;
+		for (int s = VIDEO_SIMD_NONE; s <= best; s++)
+		{
+			VideoSimd simd = (VideoSimd)s;
+			if (simd != VIDEO_SIMD_NONE && !Check(w.kind, simd))
+			{
+				ok = false;
+				continue;
+			}
+			SetVideoSimd(simd);
+			double us = Run(w, seconds);
+			if (simd == VIDEO_SIMD_NONE)
+				scalar = us;
+			printf("  %-8s %9.1f us/frame %6.2fx\n", VideoSimdName(simd), us, scalar / us);
+		}
+	}
+	return ok ? 0 : 1;
+}
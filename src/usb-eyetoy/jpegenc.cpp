@@ -0,0 +1,342 @@
+#include "jpegenc.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+const uint8_t zigzag[64] = {
+	 0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Annex K.1, natural order
+const uint8_t lumaQuant[64] = {
+	16,  11,  10,  16,  24,  40,  51,  61,
+	12,  12,  14,  19,  26,  58,  60,  55,
+	14,  13,  16,  24,  40,  57,  69,  56,
+	14,  17,  22,  29,  51,  87,  80,  62,
+	18,  22,  37,  56,  68, 109, 103,  77,
+	24,  35,  55,  64,  81, 104, 113,  92,
+	49,  64,  78,  87, 103, 121, 120, 101,
+	72,  92,  95,  98, 112, 100, 103,  99,
+};
+
+const uint8_t chromaQuant[64] = {
+	17, 18, 24, 47, 99, 99, 99, 99,
+	18, 21, 26, 66, 99, 99, 99, 99,
+	24, 26, 56, 99, 99, 99, 99, 99,
+	47, 66, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+	99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+// Annex K.3, code counts per length 1-16 followed by the symbols
+const uint8_t dcLumaBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+const uint8_t dcChromaBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+const uint8_t dcVals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+const uint8_t acLumaBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+const uint8_t acLumaVals[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+const uint8_t acChromaBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+const uint8_t acChromaVals[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa,
+};
+
+const float aanScale[8] = {
+	1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+	1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+// Canonical Huffman codes from the DHT counts, indexed by symbol
+template <class Code>
+void BuildCodes(const uint8_t *bits, const uint8_t *vals, Code *codes)
+{
+	uint16_t code = 0;
+	int k = 0;
+	for (int len = 1; len <= 16; len++)
+	{
+		for (int i = 0; i < bits[len - 1]; i++, k++)
+		{
+			codes[vals[k]].code = code++;
+			codes[vals[k]].len = len;
+		}
+		code <<= 1;
+	}
+}
+
+// Float AAN forward DCT (IJG jfdctflt.c), output still needs the aanScale factors
+void ForwardDCT(float *d)
+{
+	for (int pass = 0; pass < 2; pass++)
+	{
+		// Rows first, then columns
+		int step = pass ? 8 : 1, next = pass ? 1 : 8;
+		for (int i = 0; i < 8; i++)
+		{
+			float *p = d + i * next;
+			float tmp0 = p[0 * step] + p[7 * step];
+			float tmp7 = p[0 * step] - p[7 * step];
+			float tmp1 = p[1 * step] + p[6 * step];
+			float tmp6 = p[1 * step] - p[6 * step];
+			float tmp2 = p[2 * step] + p[5 * step];
+			float tmp5 = p[2 * step] - p[5 * step];
+			float tmp3 = p[3 * step] + p[4 * step];
+			float tmp4 = p[3 * step] - p[4 * step];
+
+			float tmp10 = tmp0 + tmp3;
+			float tmp13 = tmp0 - tmp3;
+			float tmp11 = tmp1 + tmp2;
+			float tmp12 = tmp1 - tmp2;
+			p[0 * step] = tmp10 + tmp11;
+			p[4 * step] = tmp10 - tmp11;
+			float z1 = (tmp12 + tmp13) * 0.707106781f;
+			p[2 * step] = tmp13 + z1;
+			p[6 * step] = tmp13 - z1;
+
+			tmp10 = tmp4 + tmp5;
+			tmp11 = tmp5 + tmp6;
+			tmp12 = tmp6 + tmp7;
+			float z5 = (tmp10 - tmp12) * 0.382683433f;
+			float z2 = 0.541196100f * tmp10 + z5;
+			float z4 = 1.306562965f * tmp12 + z5;
+			float z3 = tmp11 * 0.707106781f;
+			float z11 = tmp7 + z3;
+			float z13 = tmp7 - z3;
+			p[5 * step] = z13 + z2;
+			p[3 * step] = z13 - z2;
+			p[1 * step] = z11 + z4;
+			p[7 * step] = z11 - z4;
+		}
+	}
+}
+
+// 8x8 samples at x, y, level shifted. Edges repeat for sizes that aren't whole blocks
+void LoadBlock(const uint8_t *plane, uint32_t w, uint32_t h, uint32_t x, uint32_t y, float *block)
+{
+	for (int r = 0; r < 8; r++)
+	{
+		const uint8_t *row = plane + std::min(y + r, h - 1) * w;
+		for (int c = 0; c < 8; c++)
+			block[r * 8 + c] = row[std::min(x + c, w - 1)] - 128.0f;
+	}
+}
+
+// Bits needed for the magnitude of v, the JPEG size category
+int Category(int v)
+{
+	if (v < 0)
+		v = -v;
+	int n = 0;
+	for (; v; v >>= 1)
+		n++;
+	return n;
+}
+
+void Put16(std::vector<uint8_t>& out, uint32_t v)
+{
+	out.push_back(v >> 8);
+	out.push_back(v & 0xff);
+}
+
+void PutTable(std::vector<uint8_t>& out, uint8_t cls, const uint8_t *bits, const uint8_t *vals, int count)
+{
+	out.push_back(0xff);
+	out.push_back(0xc4);
+	Put16(out, 2 + 1 + 16 + count);
+	out.push_back(cls);
+	out.insert(out.end(), bits, bits + 16);
+	out.insert(out.end(), vals, vals + count);
+}
+
+}
+
+JpegEncoder::JpegEncoder()
+: mQuality(0)
+, mOut(nullptr)
+, mBits(0)
+, mBitCount(0)
+{
+	BuildCodes(dcLumaBits, dcVals, mDC[0]);
+	BuildCodes(dcChromaBits, dcVals, mDC[1]);
+	BuildCodes(acLumaBits, acLumaVals, mAC[0]);
+	BuildCodes(acChromaBits, acChromaVals, mAC[1]);
+}
+
+void JpegEncoder::SetQuality(int quality)
+{
+	quality = std::max(1, std::min(quality, 100));
+	if (quality == mQuality)
+		return;
+	mQuality = quality;
+
+	// IJG quality scaling
+	int factor = quality < 50 ? 5000 / quality : 200 - quality * 2;
+	for (int t = 0; t < 2; t++)
+	{
+		const uint8_t *base = t ? chromaQuant : lumaQuant;
+		uint8_t natural[64];
+		for (int i = 0; i < 64; i++)
+			natural[i] = std::max(1, std::min((base[i] * factor + 50) / 100, 255));
+		for (int k = 0; k < 64; k++)
+			mQuant[t][k] = natural[zigzag[k]];
+		for (int i = 0; i < 64; i++)
+			mScale[t][i] = 1.0f / (natural[i] * aanScale[i / 8] * aanScale[i % 8] * 8.0f);
+	}
+}
+
+void JpegEncoder::WriteHeaders(uint32_t width, uint32_t height)
+{
+	static const uint8_t jfif[] = {
+		0xff, 0xd8, // SOI
+		0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+	};
+	std::vector<uint8_t>& out = *mOut;
+	out.insert(out.end(), jfif, jfif + sizeof(jfif));
+
+	for (int t = 0; t < 2; t++)
+	{
+		out.push_back(0xff);
+		out.push_back(0xdb);
+		Put16(out, 2 + 1 + 64);
+		out.push_back(t);
+		out.insert(out.end(), mQuant[t], mQuant[t] + 64);
+	}
+
+	// SOF0: 8 bits, Y at 2x2 with table 0, Cb and Cr at 1x1 with table 1
+	const uint8_t sof[] = {
+		0xff, 0xc0, 0x00, 0x11, 0x08,
+		(uint8_t)(height >> 8), (uint8_t)height, (uint8_t)(width >> 8), (uint8_t)width,
+		0x03, 0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+	};
+	out.insert(out.end(), sof, sof + sizeof(sof));
+
+	PutTable(out, 0x00, dcLumaBits, dcVals, sizeof(dcVals));
+	PutTable(out, 0x10, acLumaBits, acLumaVals, sizeof(acLumaVals));
+	PutTable(out, 0x01, dcChromaBits, dcVals, sizeof(dcVals));
+	PutTable(out, 0x11, acChromaBits, acChromaVals, sizeof(acChromaVals));
+
+	static const uint8_t sos[] = {
+		0xff, 0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00,
+	};
+	out.insert(out.end(), sos, sos + sizeof(sos));
+}
+
+void JpegEncoder::PutBits(uint32_t bits, int len)
+{
+	mBits = (mBits << len) | (bits & ((1u << len) - 1));
+	mBitCount += len;
+	while (mBitCount >= 8)
+	{
+		uint8_t b = mBits >> (mBitCount - 8);
+		mOut->push_back(b);
+		// Stuffed so the decoder doesn't take it for a marker
+		if (b == 0xff)
+			mOut->push_back(0);
+		mBitCount -= 8;
+	}
+}
+
+void JpegEncoder::FlushBits()
+{
+	if (mBitCount)
+		PutBits(0x7f, 8 - mBitCount);
+	mBits = 0;
+	mBitCount = 0;
+}
+
+void JpegEncoder::EncodeBlock(float *block, const float *scale, int& prevDC,
+	const HuffCode *dc, const HuffCode *ac)
+{
+	ForwardDCT(block);
+
+	int coef[64];
+	for (int k = 0; k < 64; k++)
+	{
+		int i = zigzag[k];
+		coef[k] = (int)lrintf(block[i] * scale[i]);
+	}
+
+	int diff = coef[0] - prevDC;
+	prevDC = coef[0];
+	int cat = Category(diff);
+	PutBits(dc[cat].code, dc[cat].len);
+	if (cat)
+		PutBits(diff < 0 ? diff - 1 : diff, cat);
+
+	int run = 0;
+	for (int k = 1; k < 64; k++)
+	{
+		if (!coef[k])
+		{
+			run++;
+			continue;
+		}
+		for (; run >= 16; run -= 16)
+			PutBits(ac[0xf0].code, ac[0xf0].len); // ZRL
+		cat = Category(coef[k]);
+		int sym = (run << 4) | cat;
+		PutBits(ac[sym].code, ac[sym].len);
+		PutBits(coef[k] < 0 ? coef[k] - 1 : coef[k], cat);
+		run = 0;
+	}
+	if (run)
+		PutBits(ac[0x00].code, ac[0x00].len); // EOB
+}
+
+void JpegEncoder::Encode(const VideoImage& img, int quality, std::vector<uint8_t>& out)
+{
+	SetQuality(quality);
+	mOut = &out;
+	WriteHeaders(img.width, img.height);
+
+	uint32_t w = img.width, h = img.height, cw = w / 2, ch = h / 2;
+	int dcY = 0, dcU = 0, dcV = 0;
+	float block[64];
+	for (uint32_t y = 0; y < h; y += 16)
+	{
+		for (uint32_t x = 0; x < w; x += 16)
+		{
+			for (int b = 0; b < 4; b++)
+			{
+				LoadBlock(img.Y(), w, h, x + (b & 1) * 8, y + (b >> 1) * 8, block);
+				EncodeBlock(block, mScale[0], dcY, mDC[0], mAC[0]);
+			}
+			LoadBlock(img.U(), cw, ch, x / 2, y / 2, block);
+			EncodeBlock(block, mScale[1], dcU, mDC[1], mAC[1]);
+			LoadBlock(img.V(), cw, ch, x / 2, y / 2, block);
+			EncodeBlock(block, mScale[1], dcV, mDC[1], mAC[1]);
+		}
+	}
+	FlushBits();
+
+	out.push_back(0xff);
+	out.push_back(0xd9); // EOI
+	mOut = nullptr;
+}
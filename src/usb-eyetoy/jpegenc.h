@@ -0,0 +1,45 @@
+#ifndef JPEGENC_H
+#define JPEGENC_H
+#include <cstdint>
+#include <vector>
+#include "videodev.h"
+
+/*
+	Baseline JPEG, 4:2:0 YCbCr with the standard Annex K tables, which is
+	what the OV519 sends when compression is on. Only quality changes
+	between frames, tables are rebuilt when it does.
+*/
+class JpegEncoder
+{
+public:
+	JpegEncoder();
+
+	// Appends a complete JFIF image of img to out, quality 1-100
+	void Encode(const VideoImage& img, int quality, std::vector<uint8_t>& out);
+
+private:
+	struct HuffCode
+	{
+		uint16_t code;
+		uint8_t len;
+	};
+
+	void SetQuality(int quality);
+	void WriteHeaders(uint32_t width, uint32_t height);
+	void EncodeBlock(float *block, const float *scale, int& prevDC,
+		const HuffCode *dc, const HuffCode *ac);
+	void PutBits(uint32_t bits, int len);
+	void FlushBits();
+
+	int mQuality;
+	uint8_t mQuant[2][64];  // zigzag order, as written to DQT
+	float mScale[2][64];    // natural order, folds in the AAN DCT scaling
+	HuffCode mDC[2][12];
+	HuffCode mAC[2][256];
+
+	std::vector<uint8_t> *mOut;
+	uint32_t mBits;
+	int mBitCount;
+};
+
+#endif
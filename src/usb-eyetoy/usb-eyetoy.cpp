@@ -26,7 +26,14 @@
 
 #define MAX_PORTS 8
 
+#include "../USB.h"
 #include "../qemu-usb/vl.h"
+#include "usb-eyetoy.h"
+#include "videocapture.h"
+#include "../usb-mic/audiostats.h"
+
+#define DEVICENAME "eyetoy"
+#define APINAME "pattern"
 
 /* HID interface requests */
 #define GET_REPORT   0xa101
@@ -35,11 +42,34 @@
 #define SET_IDLE     0x210a
 #define SET_PROTOCOL 0x210b
 
+/* OV519 bridge registers, names as in the driver below */
+#define OV519_CAM_H_SIZE     0x10 /* width / 16 */
+#define OV519_CAM_V_SIZE     0x11 /* height / 8 */
+#define R51x_I2C_W_SID       0x41
+#define R51x_I2C_SADDR_3     0x42
+#define R51x_I2C_SADDR_2     0x43
+#define R51x_I2C_R_SID       0x44
+#define R51x_I2C_DATA        0x45
+#define R518_I2C_CTL         0x47
+#define OV519_SYS_RESET1     0x51 /* 0x0f holds the camera in reset */
+#define OV519_SYS_EN_CLK1    0x54 /* bit 2 enables the JPEG encoder */
+
 typedef struct EYETOYState {
     USBDevice dev;
-	//nothing yet
+	int port;
+	uint8_t regs[0x100];   /* bridge */
+	uint8_t sensor[0x100]; /* OV7648 behind the bridge's I2C port */
+	uint8_t i2c_addr;      /* latched by a 2-byte write cycle */
+	uint8_t alt;           /* video interface alternate setting */
+	VideoCapture *capture;
+	VideoFrame *frame;     /* being sent, null between frames */
+	uint32_t pos;          /* bytes of frame already sent */
+	uint32_t packet;       /* next packet of frame */
 } EYETOYState;
 
+/* wMaxPacketSize of the video alternate settings below */
+static const uint32_t eyetoy_alt_packet[] = { 0, 384, 512, 768, 896 };
+
 /* same as Linux kernel root hubs */
 
 /* mostly the same values as the Bochs USB Mouse device */
@@ -147,10 +177,68 @@ static const uint8_t eyetoy_config_descriptor[] = {
 	0x07, 0x25, 0x01, 0x00, 0x00, 0x00, 0x00
 };
 
+static void eyetoy_update_streaming(EYETOYState *s)
+{
+	bool on = s->alt > 0 && s->regs[OV519_SYS_RESET1] != 0x0f;
+	if (!on && s->frame) {
+		s->capture->Release(s->frame, false);
+		s->frame = NULL;
+	}
+	if (s->alt > 0)
+		s->capture->SetPacketSize(eyetoy_alt_packet[s->alt]);
+	s->capture->SetStreaming(on);
+}
+
+static void eyetoy_reg_write(EYETOYState *s, uint8_t reg, uint8_t val)
+{
+	s->regs[reg] = val;
+
+	switch (reg) {
+	case OV519_CAM_H_SIZE:
+	case OV519_CAM_V_SIZE:
+		/* Takes effect from the next captured frame */
+		s->capture->SetMode(s->regs[OV519_CAM_H_SIZE] << 4, s->regs[OV519_CAM_V_SIZE] << 3);
+		break;
+	case OV519_SYS_RESET1:
+		eyetoy_update_streaming(s);
+		break;
+	case OV519_SYS_EN_CLK1:
+		s->capture->SetCompression((val & 0x04) != 0);
+		break;
+	case R518_I2C_CTL:
+		switch (val) {
+		case 0x01: /* 3-byte write cycle */
+			s->sensor[s->regs[R51x_I2C_SADDR_3]] = s->regs[R51x_I2C_DATA];
+			break;
+		case 0x03: /* 2-byte write cycle, selects the register to read */
+			s->i2c_addr = s->regs[R51x_I2C_SADDR_2];
+			break;
+		case 0x05: /* 2-byte read cycle */
+			s->regs[R51x_I2C_DATA] = s->sensor[s->i2c_addr];
+			break;
+		}
+		break;
+	}
+}
+
 static void eyetoy_handle_reset(USBDevice *dev)
 {
-    /* XXX: do it */
-	return;
+	EYETOYState *s = (EYETOYState *)dev;
+
+	s->alt = 0;
+	eyetoy_update_streaming(s);
+
+	memset(s->regs, 0, sizeof(s->regs));
+	memset(s->sensor, 0, sizeof(s->sensor));
+	s->i2c_addr = 0;
+	/* OV7648, detected like an OV7610 with a different product id */
+	s->sensor[0x0a] = 0x76;
+	s->sensor[0x0b] = 0x48;
+	s->sensor[0x1c] = 0x7f;
+	s->sensor[0x1d] = 0xa2;
+	eyetoy_reg_write(s, OV519_CAM_H_SIZE, VIDEO_MAX_WIDTH >> 4);
+	eyetoy_reg_write(s, OV519_CAM_V_SIZE, VIDEO_MAX_HEIGHT >> 3);
+	eyetoy_reg_write(s, OV519_SYS_EN_CLK1, 0);
 }
 
 static int eyetoy_handle_control(USBDevice *dev, int request, int value,
@@ -235,10 +323,32 @@ static int eyetoy_handle_control(USBDevice *dev, int request, int value,
         ret = 0;
         break;
     case DeviceRequest | USB_REQ_GET_INTERFACE:
-        data[0] = 0;
+    case InterfaceRequest | USB_REQ_GET_INTERFACE:
+        data[0] = index == 0 ? s->alt : 0;
         ret = 1;
         break;
     case DeviceOutRequest | USB_REQ_SET_INTERFACE:
+    case InterfaceOutRequest | USB_REQ_SET_INTERFACE:
+        /* Only the video interface streams, alt 0 has no bandwidth */
+        if (index == 0) {
+            if (value > 4)
+                goto fail;
+            s->alt = value;
+            eyetoy_update_streaming(s);
+        }
+        ret = 0;
+        break;
+    /* OV51x register access, request 1 (REG_IO) */
+    case VendorDeviceRequest | 0x01:
+        if (length < 1)
+            goto fail;
+        data[0] = s->regs[index & 0xff];
+        ret = 1;
+        break;
+    case VendorDeviceOutRequest | 0x01:
+        /* Multibyte values go to a single register, keep the low byte */
+        if (length >= 1)
+            eyetoy_reg_write(s, index & 0xff, data[0]);
         ret = 0;
         break;
         /* hid specific requests */
@@ -267,6 +377,38 @@ static int eyetoy_handle_control(USBDevice *dev, int request, int value,
     return ret;
 }
 
+/*
+	One ISO packet of the current frame. The capture thread already laid
+	the frame out with its SOF and EOF headers and cut it into packets for
+	the current alternate setting, nothing here waits or converts.
+*/
+static int eyetoy_send_video(EYETOYState *s, uint8_t *data, int len)
+{
+	if (!s->frame) {
+		s->frame = s->capture->Acquire();
+		if (!s->frame)
+			return 0;
+		s->pos = 0;
+		s->packet = 0;
+	}
+
+	uint32_t n = s->frame->packets[s->packet];
+	/* Host asked for less than the alternate setting's size, start over */
+	if (n > (uint32_t)len) {
+		s->capture->Release(s->frame, false);
+		s->frame = NULL;
+		return 0;
+	}
+	memcpy(data, s->frame->data.data() + s->pos, n);
+	s->pos += n;
+
+	if (++s->packet == s->frame->packets.size()) {
+		s->capture->Release(s->frame, true);
+		s->frame = NULL;
+	}
+	return n;
+}
+
 static int eyetoy_handle_data(USBDevice *dev, int pid, 
                                uint8_t devep, uint8_t *data, int len)
 {
@@ -276,6 +418,11 @@ static int eyetoy_handle_data(USBDevice *dev, int pid,
     switch(pid) {
     case USB_TOKEN_IN:
         if (devep == 1) {
+            ret = eyetoy_send_video(s, data, len);
+        } else if (devep == 2) {
+            /* No microphone yet, empty ISO packets */
+            ret = 0;
+        } else {
             goto fail;
         }
         break;
@@ -293,26 +440,66 @@ static void eyetoy_handle_destroy(USBDevice *dev)
 {
     EYETOYState *s = (EYETOYState *)dev;
 
+	if (s->frame)
+		s->capture->Release(s->frame, false);
+	s->capture->LogStats();
+	delete s->capture;
+
     free(s);
 }
 
-int eyetoy_handle_packet(USBDevice *s, int pid, 
-                              uint8_t devaddr, uint8_t devep,
-                              uint8_t *data, int len)
+USBDevice *EyeToyDevice::CreateDevice(int port)
 {
-	fprintf(stderr,"usb-eyetoy: packet received with pid=%x, devaddr=%x, devep=%x and len=%x\n",pid,devaddr,devep,len);
-	return usb_generic_handle_packet(s,pid,devaddr,devep,data,len);
-}
+	std::string api = APINAME;
+	{
+		CONFIGVARIANT var(N_DEVICE_API, CONFIG_TYPE_CHAR);
+		if (LoadSetting(port, DEVICENAME, var) && !var.strValue.empty())
+			api = var.strValue;
+	}
 
-USBDevice *eyetoy_init()
-{
-    EYETOYState *s;
+	VideoDeviceProxyBase *proxy = RegisterVideoDevice::instance().Proxy(api);
+	if (!proxy) {
+		fprintf(stderr, "%s %d: unknown video source %s\n", DEVICENAME, port, api.c_str());
+		return NULL;
+	}
+	VideoDevice *vdev = proxy->CreateObject(port, api);
+	if (!vdev)
+		return NULL;
+
+	VideoCaptureConfig config;
+	config.fps = 30;
+	CONFIGVARIANT varFps(N_VIDEO_FPS, CONFIG_TYPE_INT);
+	if (LoadSetting(port, DEVICENAME, varFps) && varFps.intValue > 0 && varFps.intValue <= 60)
+		config.fps = varFps.intValue;
+
+	config.realtime = true;
+	CONFIGVARIANT varRealtime(N_VIDEO_REALTIME, CONFIG_TYPE_INT);
+	if (LoadSetting(port, DEVICENAME, varRealtime))
+		config.realtime = varRealtime.intValue != 0;
+
+	config.quality = 80;
+	CONFIGVARIANT varQuality(N_VIDEO_QUALITY, CONFIG_TYPE_INT);
+	if (LoadSetting(port, DEVICENAME, varQuality) && varQuality.intValue > 0 && varQuality.intValue <= 100)
+		config.quality = varQuality.intValue;
+
+	config.bitrate = 0;
+	CONFIGVARIANT varBitrate(N_VIDEO_BITRATE, CONFIG_TYPE_INT);
+	if (LoadSetting(port, DEVICENAME, varBitrate) && varBitrate.intValue > 0)
+		config.bitrate = varBitrate.intValue;
+
+	config.statsInterval = LoadStatsInterval(port, DEVICENAME);
+
+	EYETOYState *s = (EYETOYState *)qemu_mallocz(sizeof(EYETOYState));
+	if (!s) {
+		delete vdev;
+		return NULL;
+	}
+
+	s->port = port;
+	s->capture = new VideoCapture(vdev, config, DEVICENAME, port);
 
-    s = (struct EYETOYState *)qemu_mallocz(sizeof(EYETOYState));
-    if (!s)
-        return NULL;
     s->dev.speed = USB_SPEED_FULL;
-    s->dev.handle_packet = eyetoy_handle_packet;
+    s->dev.handle_packet = usb_generic_handle_packet;
 
     s->dev.handle_reset = eyetoy_handle_reset;
     s->dev.handle_control = eyetoy_handle_control;
@@ -321,10 +508,16 @@ USBDevice *eyetoy_init()
 
     strncpy(s->dev.devname, "EyeToy USB camera Namtai", sizeof(s->dev.devname));
 
+	eyetoy_handle_reset((USBDevice *)s);
     return (USBDevice *)s;
 
 }
 
+REGISTER_DEVICE(5, DEVICENAME, EyeToyDevice);
+#undef DEVICENAME
+#undef APINAME
+
+
 #ifdef X_DRIVER
 ////////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////////
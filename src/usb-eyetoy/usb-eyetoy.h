@@ -0,0 +1,56 @@
+#ifndef USBEYETOY_H
+#define USBEYETOY_H
+#include "../deviceproxy.h"
+#include "videodev.h"
+
+#define S_VIDEO_FPS TEXT("Frame rate")
+#define N_VIDEO_FPS TEXT("fps")
+#define S_VIDEO_REALTIME TEXT("Pace frames in real time")
+#define N_VIDEO_REALTIME TEXT("realtime")
+#define S_VIDEO_QUALITY TEXT("JPEG quality (max)")
+#define N_VIDEO_QUALITY TEXT("quality")
+#define S_VIDEO_BITRATE TEXT("JPEG bitrate (kbit/s, 0 fits the USB bandwidth)")
+#define N_VIDEO_BITRATE TEXT("bitrate")
+
+struct USBDevice;
+
+class EyeToyDevice : public Device
+{
+public:
+	virtual ~EyeToyDevice() {}
+	static USBDevice* CreateDevice(int port);
+	static const TCHAR* Name()
+	{
+		return TEXT("EyeToy");
+	}
+	static std::list<std::string> APIs()
+	{
+		return RegisterVideoDevice::instance().Names();
+	}
+	static const TCHAR* LongAPIName(const std::string& name)
+	{
+		auto proxy = RegisterVideoDevice::instance().Proxy(name);
+		if (proxy)
+			return proxy->Name();
+		return nullptr;
+	}
+	// Frame sources have no dialogs of their own, everything is in the ini
+	static int Configure(int port, std::string api, void *data)
+	{
+		return RESULT_OK;
+	}
+	static std::vector<CONFIGVARIANT> GetSettings(const std::string &api)
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_VIDEO_FPS, N_VIDEO_FPS, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_VIDEO_REALTIME, N_VIDEO_REALTIME, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_VIDEO_QUALITY, N_VIDEO_QUALITY, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_VIDEO_BITRATE, N_VIDEO_BITRATE, CONFIG_TYPE_INT));
+		auto proxy = RegisterVideoDevice::instance().Proxy(api);
+		if (proxy)
+			for (auto& p : proxy->GetSettings())
+				params.push_back(p);
+		return params;
+	}
+};
+#endif
@@ -0,0 +1,386 @@
+#include "videocapture.h"
+#include "videoconvert.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+typedef std::chrono::steady_clock Clock;
+
+// Retry a failing source this often, a file that ended keeps its last frame on screen
+#define VIDEO_RETRY_MS 100
+#define VIDEO_SOF 0x50
+#define VIDEO_EOF 0x51
+// The EOF header counts the payload in 8-byte words, 16 bits of them
+#define VIDEO_MAX_PAYLOAD (0xffff * 8)
+#define VIDEO_MIN_QUALITY 5
+
+namespace {
+
+uint64_t SinceUs(Clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+}
+
+void FrameHeader(uint8_t *data, uint8_t type)
+{
+	memset(data, 0, VIDEO_HEADER_SIZE);
+	data[0] = data[1] = data[2] = 0xff;
+	data[3] = type;
+}
+
+}
+
+VideoCapture::VideoCapture(VideoDevice *dev, const VideoCaptureConfig& config, const char *name, int port)
+: mDev(dev)
+, mInterval(1000000 / (config.fps ? config.fps : 30))
+, mRealtime(config.realtime)
+, mFps(config.fps ? config.fps : 30)
+, mMaxQuality(std::max(VIDEO_MIN_QUALITY, std::min(config.quality, 100)))
+, mBitrate(config.bitrate)
+, mName(name)
+, mPort(port)
+, mStatsInterval(config.statsInterval)
+, mQuality(mMaxQuality)
+, mLatest(-1)
+, mSeq(0)
+, mWidth(VIDEO_MAX_WIDTH)
+, mHeight(VIDEO_MAX_HEIGHT)
+, mCompressed(false)
+, mPacketSize(VIDEO_MIN_PACKET)
+, mStreaming(false)
+, mQuit(false)
+{
+	memset(&mStats, 0, sizeof(mStats));
+	mStats.quality = mQuality;
+	for (auto& f : mFrames)
+	{
+		// Raw frames are the biggest ones that fit the header's length field
+		f.data.reserve(OvRawSize(VIDEO_MAX_WIDTH, VIDEO_MAX_HEIGHT) + 2 * VIDEO_HEADER_SIZE);
+		f.packets.reserve(OvRawSize(VIDEO_MAX_WIDTH, VIDEO_MAX_HEIGHT) / VIDEO_MIN_PACKET + 3);
+		f.width = 0;
+		f.height = 0;
+		f.compressed = false;
+		f.packetSize = 0;
+		f.seq = 0;
+		f.state = VideoFrame::FREE;
+		f.fresh = false;
+		f.delivered = false;
+	}
+	// No reallocation when the mode changes later
+	mScaled.data.reserve(OvRawSize(VIDEO_MAX_WIDTH, VIDEO_MAX_HEIGHT));
+	mThread = std::thread(&VideoCapture::Worker, this);
+}
+
+VideoCapture::~VideoCapture()
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mQuit = true;
+	}
+	mCond.notify_all();
+	if (mThread.joinable())
+		mThread.join();
+	delete mDev;
+}
+
+void VideoCapture::SetMode(uint32_t width, uint32_t height)
+{
+	width &= ~15;
+	height &= ~15;
+	if (!width || !height || width > VIDEO_MAX_WIDTH || height > VIDEO_MAX_HEIGHT)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mWidth == width && mHeight == height)
+			return;
+		mWidth = width;
+		mHeight = height;
+		DropReady();
+	}
+	mCond.notify_all();
+}
+
+void VideoCapture::SetCompression(bool on)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mCompressed == on)
+			return;
+		mCompressed = on;
+		DropReady();
+	}
+	mCond.notify_all();
+}
+
+void VideoCapture::SetPacketSize(uint32_t size)
+{
+	if (size < VIDEO_HEADER_SIZE)
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mPacketSize == size)
+			return;
+		mPacketSize = size;
+		DropReady();
+	}
+	mCond.notify_all();
+}
+
+void VideoCapture::SetStreaming(bool on)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mStreaming == on)
+			return;
+		mStreaming = on;
+		// Don't open the next stream with a picture from the last one
+		if (!on)
+			DropReady();
+	}
+	mCond.notify_all();
+}
+
+void VideoCapture::DropReady()
+{
+	for (auto& f : mFrames)
+		if (f.state == VideoFrame::READY)
+			f.state = VideoFrame::FREE;
+	mLatest = -1;
+}
+
+VideoFrame* VideoCapture::Acquire()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (mLatest < 0 || mFrames[mLatest].state != VideoFrame::READY)
+		return nullptr;
+
+	VideoFrame& f = mFrames[mLatest];
+	if (!f.fresh)
+		mStats.repeated++;
+	f.fresh = false;
+	f.state = VideoFrame::SENDING;
+	mCond.notify_all();
+	return &f;
+}
+
+void VideoCapture::Release(VideoFrame *frame, bool delivered)
+{
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		// Repeats only say how stale the picture got, not how long the pipeline takes
+		if (delivered && !frame->delivered)
+		{
+			uint64_t us = SinceUs(frame->captured);
+			frame->delivered = true;
+			mStats.delivered++;
+			mStats.latencyUs += us;
+			mStats.latencyMaxUs = std::max(mStats.latencyMaxUs, us);
+		}
+		// Newest frame stays around to be repeated
+		bool latest = mLatest >= 0 && frame == &mFrames[mLatest];
+		frame->state = latest ? VideoFrame::READY : VideoFrame::FREE;
+	}
+	mCond.notify_all();
+}
+
+VideoCaptureStats VideoCapture::GetStats()
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mStats;
+}
+
+void VideoCapture::LogStats()
+{
+	VideoCaptureStats st = GetStats();
+	fprintf(stderr, "%s %d: %llu frames captured, %llu dropped, %llu repeated, %llu errors,"
+		" %.1f ms to pack, %llu bytes/frame, quality %d, latency %.1f ms avg %.1f ms max\n",
+		mName, mPort, (unsigned long long)st.captured, (unsigned long long)st.dropped,
+		(unsigned long long)st.repeated, (unsigned long long)st.errors,
+		st.captured ? st.packUs / 1000.0 / st.captured : 0.0,
+		st.captured ? (unsigned long long)(st.bytes / st.captured) : 0ULL, st.quality,
+		st.delivered ? st.latencyUs / 1000.0 / st.delivered : 0.0, st.latencyMaxUs / 1000.0);
+}
+
+void VideoCapture::UpdateQuality(uint32_t bytes, uint32_t packetSize)
+{
+	// Full speed runs one ISO packet per millisecond
+	uint32_t budget = mBitrate ? mBitrate * 125 / mFps : packetSize * 1000 / mFps;
+	if (bytes > budget)
+		mQuality -= bytes > budget + budget / 2 ? 10 : 2;
+	else if (bytes < budget - budget / 4)
+		mQuality++;
+	mQuality = std::max(VIDEO_MIN_QUALITY, std::min(mQuality, mMaxQuality));
+}
+
+void VideoCapture::Packetize(VideoFrame& frame, uint32_t payload)
+{
+	uint32_t padded = (payload + 7) & ~7;
+	frame.data.resize(VIDEO_HEADER_SIZE + padded + VIDEO_HEADER_SIZE);
+	memset(frame.data.data() + VIDEO_HEADER_SIZE + payload, 0, padded - payload);
+	FrameHeader(frame.data.data(), VIDEO_SOF);
+
+	// Byte 9 clear marks a frame with image data
+	uint8_t *eof = frame.data.data() + VIDEO_HEADER_SIZE + padded;
+	FrameHeader(eof, VIDEO_EOF);
+	eof[14] = (padded / 8) & 0xff;
+	eof[15] = (padded / 8) >> 8;
+
+	// SOF rides with the first data, EOF goes on its own
+	frame.packets.clear();
+	for (uint32_t left = VIDEO_HEADER_SIZE + padded; left; )
+	{
+		uint32_t n = std::min(left, frame.packetSize);
+		frame.packets.push_back(n);
+		left -= n;
+	}
+	frame.packets.push_back(VIDEO_HEADER_SIZE);
+}
+
+void VideoCapture::Pack(VideoFrame& frame)
+{
+	const VideoImage *img = &mSource;
+	if (mSource.width != frame.width || mSource.height != frame.height)
+	{
+		mScaled.Resize(frame.width, frame.height);
+		ScaleI420(mSource, mScaled);
+		img = &mScaled;
+	}
+
+	if (!frame.compressed)
+	{
+		uint32_t size = OvRawSize(frame.width, frame.height);
+		frame.data.resize(VIDEO_HEADER_SIZE + size);
+		I420ToOvRaw(*img, frame.data.data() + VIDEO_HEADER_SIZE);
+		Packetize(frame, size);
+		return;
+	}
+
+	uint32_t size;
+	while (true)
+	{
+		frame.data.resize(VIDEO_HEADER_SIZE);
+		mEncoder.Encode(*img, mQuality, frame.data);
+		size = frame.data.size() - VIDEO_HEADER_SIZE;
+		// Only near-lossless settings on noise get here, retry rather than lose the frame
+		if (size <= VIDEO_MAX_PAYLOAD || mQuality <= VIDEO_MIN_QUALITY)
+			break;
+		mQuality = std::max(VIDEO_MIN_QUALITY, mQuality - 10);
+	}
+	UpdateQuality(size, frame.packetSize);
+	Packetize(frame, std::min<uint32_t>(size, VIDEO_MAX_PAYLOAD));
+}
+
+void VideoCapture::Worker()
+{
+	Clock::time_point next = Clock::now();
+	Clock::time_point lastLog = next;
+	bool failing = false;
+
+	auto canCapture = [this] {
+		bool free = false;
+		for (auto& f : mFrames)
+		{
+			if (f.state == VideoFrame::FREE)
+				free = true;
+			// Without realtime, wait for the guest to take what we made
+			else if (!mRealtime && f.state == VideoFrame::READY && f.fresh)
+				return false;
+		}
+		return free;
+	};
+
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true)
+	{
+		mCond.wait(lock, [&] { return mQuit || (mStreaming && canCapture()); });
+		if (mQuit)
+			break;
+
+		// Pace files and generators, live devices block in Capture() instead
+		if (mRealtime && !mDev->Live())
+		{
+			Clock::time_point now = Clock::now();
+			// Fell behind, don't burst to catch up
+			if (next + mInterval < now)
+				next = now;
+			if (mCond.wait_until(lock, next, [this] { return mQuit || !mStreaming; }))
+				continue;
+			next += mInterval;
+		}
+
+		// Only this thread takes free frames, the one found above is still free
+		int idx = 0;
+		while (mFrames[idx].state != VideoFrame::FREE)
+			idx++;
+		VideoFrame& f = mFrames[idx];
+		f.state = VideoFrame::CAPTURE;
+		f.width = mWidth;
+		f.height = mHeight;
+		f.compressed = mCompressed;
+		f.packetSize = mPacketSize;
+		lock.unlock();
+
+		uint64_t packUs = 0;
+		bool ok = mDev->Capture(mSource);
+		if (ok)
+		{
+			f.captured = Clock::now();
+			Pack(f);
+			packUs = SinceUs(f.captured);
+		}
+
+		lock.lock();
+		if (!ok)
+		{
+			f.state = VideoFrame::FREE;
+			mStats.errors++;
+			if (!failing)
+				fprintf(stderr, "usb-eyetoy: video source stopped delivering frames\n");
+			failing = true;
+			mCond.wait_for(lock, std::chrono::milliseconds(VIDEO_RETRY_MS), [this] { return mQuit; });
+			continue;
+		}
+		failing = false;
+
+		// Guest switched modes while this one was being made
+		if (f.width != mWidth || f.height != mHeight || f.compressed != mCompressed || f.packetSize != mPacketSize)
+		{
+			f.state = VideoFrame::FREE;
+			continue;
+		}
+
+		for (auto& old : mFrames)
+		{
+			if (old.state != VideoFrame::READY)
+				continue;
+			if (old.fresh)
+				mStats.dropped++;
+			old.state = VideoFrame::FREE;
+		}
+		f.state = VideoFrame::READY;
+		f.fresh = true;
+		f.delivered = false;
+		f.seq = ++mSeq;
+		mLatest = idx;
+		mStats.captured++;
+		mStats.packUs += packUs;
+		mStats.bytes += f.data.size() - 2 * VIDEO_HEADER_SIZE;
+		mStats.quality = mQuality;
+		mCond.notify_all();
+
+		if (mStatsInterval.count() > 0 && Clock::now() - lastLog >= mStatsInterval)
+		{
+			lastLog = Clock::now();
+			lock.unlock();
+			LogStats();
+			lock.lock();
+		}
+	}
+}
+
+#undef VIDEO_RETRY_MS
+#undef VIDEO_SOF
+#undef VIDEO_EOF
+#undef VIDEO_MAX_PAYLOAD
+#undef VIDEO_MIN_QUALITY
@@ -0,0 +1,143 @@
+#ifndef VIDEOCAPTURE_H
+#define VIDEOCAPTURE_H
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "videodev.h"
+#include "jpegenc.h"
+
+// Largest mode the OV519 streams
+#define VIDEO_MAX_WIDTH 640
+#define VIDEO_MAX_HEIGHT 480
+// One being captured, one newest and one on the wire
+#define VIDEO_POOL_FRAMES 3
+// Smallest ISO packet of the video alternate settings
+#define VIDEO_MIN_PACKET 384
+// OV519 ISO frame header, see ov519_move_data()
+#define VIDEO_HEADER_SIZE 16
+
+struct VideoFrame
+{
+	enum State {
+		FREE,
+		CAPTURE, // capture thread is filling it
+		READY,
+		SENDING, // USB side is packetizing it
+	};
+
+	// SOF header, payload padded to 8 bytes, EOF header, exactly as it goes out
+	std::vector<uint8_t> data;
+	std::vector<uint32_t> packets; // ISO packet sizes, in order
+	uint32_t width;
+	uint32_t height;
+	bool compressed;
+	uint32_t packetSize;
+	uint64_t seq;
+	std::chrono::steady_clock::time_point captured;
+	State state;
+	bool fresh; // not handed to the USB side yet
+	bool delivered; // sent completely at least once
+};
+
+struct VideoCaptureConfig
+{
+	uint32_t fps;
+	bool realtime;
+	int quality; // JPEG quality ceiling, 1-100
+	uint32_t bitrate; // kbit/s for JPEG frames, 0 fits them to the ISO bandwidth
+	uint32_t statsInterval; // seconds between stats lines, 0 for none
+};
+
+struct VideoCaptureStats
+{
+	uint64_t captured;
+	uint64_t dropped; // replaced by a newer frame before it was sent
+	uint64_t repeated; // sent again because nothing newer was ready
+	uint64_t errors;
+	uint64_t delivered; // first complete sends, the latency below is over these
+	uint64_t latencyUs; // capture to last packet
+	uint64_t latencyMaxUs;
+	uint64_t packUs; // scale, convert or encode and packetize, over captured frames
+	uint64_t bytes; // payload of captured frames
+	int quality; // JPEG quality in use
+};
+
+/*
+	Runs the frame source on its own thread so the emulator thread only
+	ever picks up finished frames. Frames come from a fixed pool and are
+	scaled, packed or JPEG encoded and cut into ISO packets for the
+	guest's current mode on the capture thread, the USB side only copies
+	the packets out. JPEG quality drops when frames go over the byte
+	budget and creeps back up to the configured ceiling when they don't.
+	In realtime mode files and generators are paced to the frame rate and
+	stale frames are dropped; otherwise frames are made as fast as the
+	guest takes them, which is what benchmarks want.
+*/
+class VideoCapture
+{
+public:
+	// Takes ownership of dev, name and port only label the stats
+	VideoCapture(VideoDevice *dev, const VideoCaptureConfig& config, const char *name, int port);
+	~VideoCapture();
+
+	// Frame size the guest asked for, multiples of 16 up to the maximum
+	void SetMode(uint32_t width, uint32_t height);
+	// JPEG or raw 4:2:0, as the bridge's JPEG clock enable says
+	void SetCompression(bool on);
+	// Max packet size of the selected alternate setting
+	void SetPacketSize(uint32_t size);
+	// Capture only runs while the guest has the video endpoint enabled
+	void SetStreaming(bool on);
+
+	// Newest frame, or the last one again if nothing newer is ready. Null before the first frame
+	VideoFrame* Acquire();
+	// delivered is set when the last packet went out, otherwise the frame was cut short
+	void Release(VideoFrame *frame, bool delivered);
+
+	VideoCaptureStats GetStats();
+	void LogStats();
+
+private:
+	void Worker();
+	// Scale to the frame's mode, pack or encode it and cut it into packets
+	void Pack(VideoFrame& frame);
+	void Packetize(VideoFrame& frame, uint32_t payload);
+	// Rate control, bytes is the payload of the frame just encoded
+	void UpdateQuality(uint32_t bytes, uint32_t packetSize);
+	// Settings changed, frames made with the old ones must not go out
+	void DropReady();
+
+	VideoDevice *mDev;
+	std::chrono::microseconds mInterval;
+	bool mRealtime;
+	uint32_t mFps;
+	int mMaxQuality;
+	uint32_t mBitrate;
+	const char *mName;
+	int mPort;
+	std::chrono::seconds mStatsInterval;
+
+	JpegEncoder mEncoder;
+	int mQuality; // capture thread only, mirrored into mStats
+
+	VideoImage mSource; // as the device delivered it
+	VideoImage mScaled;
+	VideoFrame mFrames[VIDEO_POOL_FRAMES];
+	int mLatest;
+	uint64_t mSeq;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	bool mCompressed;
+	uint32_t mPacketSize;
+	bool mStreaming;
+	bool mQuit;
+	VideoCaptureStats mStats;
+
+	std::mutex mMutex;
+	std::condition_variable mCond;
+	std::thread mThread;
+};
+#endif
@@ -0,0 +1,509 @@
+#include "videoconvert.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+// Kernels are built for their own target and picked at runtime, the plugin itself targets plain i686
+#define VC_SSE2 __attribute__((target("sse2")))
+#define VC_AVX2 __attribute__((target("avx2")))
+#define VC_HAVE_SSE2() __builtin_cpu_supports("sse2")
+#define VC_HAVE_AVX2() __builtin_cpu_supports("avx2")
+#elif defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <intrin.h>
+#define VC_SSE2
+#define VC_AVX2
+#define VC_HAVE_SSE2() true
+#define VC_HAVE_AVX2() HaveAvx2()
+
+static bool HaveAvx2()
+{
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	// AVX with OSXSAVE, and the OS saving YMM state
+	__cpuid(info, 1);
+	if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & 0x20) != 0;
+}
+#endif
+
+#ifdef VC_SSE2
+#include <immintrin.h>
+#endif
+
+static VideoSimd DetectSimd()
+{
+#ifdef VC_SSE2
+	if (VC_HAVE_AVX2())
+		return VIDEO_SIMD_AVX2;
+	if (VC_HAVE_SSE2())
+		return VIDEO_SIMD_SSE2;
+#endif
+	return VIDEO_SIMD_NONE;
+}
+
+static std::atomic<int> gSimdCap(VIDEO_SIMD_AVX2);
+
+VideoSimd VideoSimdSupported()
+{
+	static const VideoSimd simd = DetectSimd();
+	return simd;
+}
+
+static inline VideoSimd CurrentSimd()
+{
+	return std::min(VideoSimdSupported(), (VideoSimd)gSimdCap.load(std::memory_order_relaxed));
+}
+
+VideoSimd SetVideoSimd(VideoSimd simd)
+{
+	gSimdCap = simd;
+	return CurrentSimd();
+}
+
+const char* VideoSimdName(VideoSimd simd)
+{
+	switch (simd)
+	{
+	case VIDEO_SIMD_SSE2: return "sse2";
+	case VIDEO_SIMD_AVX2: return "avx2";
+	default: return "scalar";
+	}
+}
+
+/*
+	Row kernels work on a pair of source rows starting at pixel x and
+	return where they stopped; the scalar ones finish the tail. Widths
+	only have to be even.
+*/
+
+static uint32_t YuyvRowsScalar(const uint8_t *s0, const uint8_t *s1,
+	uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t x, uint32_t w)
+{
+	for (; x < w; x += 2)
+	{
+		y0[x] = s0[x * 2];
+		y0[x + 1] = s0[x * 2 + 2];
+		y1[x] = s1[x * 2];
+		y1[x + 1] = s1[x * 2 + 2];
+		u[x / 2] = (s0[x * 2 + 1] + s1[x * 2 + 1] + 1) >> 1;
+		v[x / 2] = (s0[x * 2 + 3] + s1[x * 2 + 3] + 1) >> 1;
+	}
+	return x;
+}
+
+// BT.601 limited range, same integer math as the SIMD kernels
+static inline uint8_t LumaBgr(int b, int g, int r)
+{
+	return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+static inline uint8_t ChromaU(int b, int g, int r)
+{
+	return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+
+static inline uint8_t ChromaV(int b, int g, int r)
+{
+	return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+static uint32_t BgrRowsScalar(const uint8_t *s0, const uint8_t *s1,
+	uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t x, uint32_t w)
+{
+	for (; x < w; x += 2)
+	{
+		const uint8_t *a = s0 + x * 4, *b = s1 + x * 4;
+		y0[x] = LumaBgr(a[0], a[1], a[2]);
+		y0[x + 1] = LumaBgr(a[4], a[5], a[6]);
+		y1[x] = LumaBgr(b[0], b[1], b[2]);
+		y1[x + 1] = LumaBgr(b[4], b[5], b[6]);
+
+		int sb = (a[0] + a[4] + b[0] + b[4] + 2) >> 2;
+		int sg = (a[1] + a[5] + b[1] + b[5] + 2) >> 2;
+		int sr = (a[2] + a[6] + b[2] + b[6] + 2) >> 2;
+		u[x / 2] = ChromaU(sb, sg, sr);
+		v[x / 2] = ChromaV(sb, sg, sr);
+	}
+	return x;
+}
+
+// One output row of a 2x2 box downscale, x counts output pixels
+static uint32_t HalveRowScalar(const uint8_t *s0, const uint8_t *s1, uint8_t *d, uint32_t x, uint32_t w)
+{
+	for (; x < w; x++)
+		d[x] = (s0[x * 2] + s0[x * 2 + 1] + s1[x * 2] + s1[x * 2 + 1] + 2) >> 2;
+	return x;
+}
+
+#ifdef VC_SSE2
+VC_SSE2 static uint32_t YuyvRowsSSE2(const uint8_t *s0, const uint8_t *s1,
+	uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t x, uint32_t w)
+{
+	const __m128i lo = _mm_set1_epi16(0xff);
+	for (; x + 16 <= w; x += 16)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + x * 2));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(s0 + x * 2 + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(s1 + x * 2));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + x * 2 + 16));
+
+		_mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(_mm_and_si128(a0, lo), _mm_and_si128(a1, lo)));
+		_mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(_mm_and_si128(b0, lo), _mm_and_si128(b1, lo)));
+
+		// pavgb rounds up like the scalar code, the luma bytes averaged along are dropped
+		__m128i c0 = _mm_srli_epi16(_mm_avg_epu8(a0, b0), 8);
+		__m128i c1 = _mm_srli_epi16(_mm_avg_epu8(a1, b1), 8);
+		__m128i uv = _mm_packus_epi16(c0, c1);
+		__m128i uuvv = _mm_packus_epi16(_mm_and_si128(uv, lo), _mm_srli_epi16(uv, 8));
+		_mm_storel_epi64((__m128i *)(u + x / 2), uuvv);
+		_mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uuvv, 8));
+	}
+	return x;
+}
+
+// Eight B, G, R, X pixels to 16-bit B, G and R
+VC_SSE2 static inline void SplitBgrSSE2(const uint8_t *p, __m128i& b, __m128i& g, __m128i& r)
+{
+	const __m128i lo = _mm_set1_epi32(0xff);
+	__m128i p0 = _mm_loadu_si128((const __m128i *)p);
+	__m128i p1 = _mm_loadu_si128((const __m128i *)(p + 16));
+	b = _mm_packs_epi32(_mm_and_si128(p0, lo), _mm_and_si128(p1, lo));
+	g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), lo), _mm_and_si128(_mm_srli_epi32(p1, 8), lo));
+	r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), lo), _mm_and_si128(_mm_srli_epi32(p1, 16), lo));
+}
+
+// Sums reach 56228, so wrap around in 16 bits and shift unsigned
+VC_SSE2 static inline __m128i LumaSSE2(__m128i b, __m128i g, __m128i r)
+{
+	__m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+	y = _mm_add_epi16(y, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+// Chroma sums stay within +-28688, signed 16 bits is enough
+VC_SSE2 static inline __m128i ChromaSSE2(__m128i b, __m128i g, __m128i r, int kb, int kg, int kr)
+{
+	__m128i c = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+	c = _mm_add_epi16(c, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+}
+
+// Rounded average of each horizontal pair of two rows' 16-bit samples, two vectors of eight to one
+VC_SSE2 static inline __m128i Box2x2SSE2(__m128i a0, __m128i b0, __m128i a1, __m128i b1)
+{
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i s = _mm_packs_epi32(_mm_madd_epi16(_mm_add_epi16(a0, b0), one), _mm_madd_epi16(_mm_add_epi16(a1, b1), one));
+	return _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(2)), 2);
+}
+
+VC_SSE2 static uint32_t BgrRowsSSE2(const uint8_t *s0, const uint8_t *s1,
+	uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t x, uint32_t w)
+{
+	for (; x + 16 <= w; x += 16)
+	{
+		__m128i ab0, ag0, ar0, ab1, ag1, ar1, bb0, bg0, br0, bb1, bg1, br1;
+		SplitBgrSSE2(s0 + x * 4, ab0, ag0, ar0);
+		SplitBgrSSE2(s0 + x * 4 + 32, ab1, ag1, ar1);
+		SplitBgrSSE2(s1 + x * 4, bb0, bg0, br0);
+		SplitBgrSSE2(s1 + x * 4 + 32, bb1, bg1, br1);
+
+		_mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(LumaSSE2(ab0, ag0, ar0), LumaSSE2(ab1, ag1, ar1)));
+		_mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(LumaSSE2(bb0, bg0, br0), LumaSSE2(bb1, bg1, br1)));
+
+		__m128i cb = Box2x2SSE2(ab0, bb0, ab1, bb1);
+		__m128i cg = Box2x2SSE2(ag0, bg0, ag1, bg1);
+		__m128i cr = Box2x2SSE2(ar0, br0, ar1, br1);
+		__m128i uv = _mm_packus_epi16(ChromaSSE2(cb, cg, cr, 112, -74, -38), ChromaSSE2(cb, cg, cr, -18, -94, 112));
+		_mm_storel_epi64((__m128i *)(u + x / 2), uv);
+		_mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv, 8));
+	}
+	return x;
+}
+
+VC_SSE2 static inline __m128i HalveSSE2(__m128i a, __m128i b)
+{
+	const __m128i lo = _mm_set1_epi16(0xff);
+	__m128i s = _mm_add_epi16(_mm_and_si128(a, lo), _mm_srli_epi16(a, 8));
+	s = _mm_add_epi16(s, _mm_add_epi16(_mm_and_si128(b, lo), _mm_srli_epi16(b, 8)));
+	return _mm_srli_epi16(_mm_add_epi16(s, _mm_set1_epi16(2)), 2);
+}
+
+VC_SSE2 static uint32_t HalveRowSSE2(const uint8_t *s0, const uint8_t *s1, uint8_t *d, uint32_t x, uint32_t w)
+{
+	for (; x + 16 <= w; x += 16)
+	{
+		__m128i a0 = _mm_loadu_si128((const __m128i *)(s0 + x * 2));
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(s0 + x * 2 + 16));
+		__m128i b0 = _mm_loadu_si128((const __m128i *)(s1 + x * 2));
+		__m128i b1 = _mm_loadu_si128((const __m128i *)(s1 + x * 2 + 16));
+		_mm_storeu_si128((__m128i *)(d + x), _mm_packus_epi16(HalveSSE2(a0, b0), HalveSSE2(a1, b1)));
+	}
+	return x;
+}
+#endif
+
+/*
+	AVX2 packs work within 128-bit lanes, so results come out with their
+	lanes interleaved and get put back in order before the store.
+*/
+#ifdef VC_AVX2
+VC_AVX2 static uint32_t YuyvRowsAVX2(const uint8_t *s0, const uint8_t *s1,
+	uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t x, uint32_t w)
+{
+	const __m256i lo = _mm256_set1_epi16(0xff);
+	for (; x + 32 <= w; x += 32)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(s0 + x * 2));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(s0 + x * 2 + 32));
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)(s1 + x * 2));
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(s1 + x * 2 + 32));
+
+		__m256i ya = _mm256_packus_epi16(_mm256_and_si256(a0, lo), _mm256_and_si256(a1, lo));
+		__m256i yb = _mm256_packus_epi16(_mm256_and_si256(b0, lo), _mm256_and_si256(b1, lo));
+		_mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(ya, 0xd8));
+		_mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(yb, 0xd8));
+
+		__m256i c0 = _mm256_srli_epi16(_mm256_avg_epu8(a0, b0), 8);
+		__m256i c1 = _mm256_srli_epi16(_mm256_avg_epu8(a1, b1), 8);
+		__m256i uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(c0, c1), 0xd8);
+		__m256i uuvv = _mm256_packus_epi16(_mm256_and_si256(uv, lo), _mm256_srli_epi16(uv, 8));
+		uuvv = _mm256_permute4x64_epi64(uuvv, 0xd8);
+		_mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(uuvv));
+		_mm_storeu_si128((__m128i *)(v + x / 2), _mm256_extracti128_si256(uuvv, 1));
+	}
+	return x;
+}
+
+// Sixteen pixels, 16-bit results in the order 0-3 8-11 | 4-7 12-15
+VC_AVX2 static inline void SplitBgrAVX2(const uint8_t *p, __m256i& b, __m256i& g, __m256i& r)
+{
+	const __m256i lo = _mm256_set1_epi32(0xff);
+	__m256i p0 = _mm256_loadu_si256((const __m256i *)p);
+	__m256i p1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+	b = _mm256_packs_epi32(_mm256_and_si256(p0, lo), _mm256_and_si256(p1, lo));
+	g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), lo), _mm256_and_si256(_mm256_srli_epi32(p1, 8), lo));
+	r = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), lo), _mm256_and_si256(_mm256_srli_epi32(p1, 16), lo));
+}
+
+VC_AVX2 static inline __m256i LumaAVX2(__m256i b, __m256i g, __m256i r)
+{
+	__m256i y = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)), _mm256_mullo_epi16(g, _mm256_set1_epi16(129)));
+	y = _mm256_add_epi16(y, _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(25)), _mm256_set1_epi16(128)));
+	return _mm256_add_epi16(_mm256_srli_epi16(y, 8), _mm256_set1_epi16(16));
+}
+
+VC_AVX2 static inline __m256i ChromaAVX2(__m256i b, __m256i g, __m256i r, int kb, int kg, int kr)
+{
+	__m256i c = _mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(kr)), _mm256_mullo_epi16(g, _mm256_set1_epi16(kg)));
+	c = _mm256_add_epi16(c, _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(kb)), _mm256_set1_epi16(128)));
+	return _mm256_add_epi16(_mm256_srai_epi16(c, 8), _mm256_set1_epi16(128));
+}
+
+VC_AVX2 static inline __m256i Box2x2AVX2(__m256i a0, __m256i b0, __m256i a1, __m256i b1)
+{
+	const __m256i one = _mm256_set1_epi16(1);
+	__m256i s = _mm256_packs_epi32(_mm256_madd_epi16(_mm256_add_epi16(a0, b0), one), _mm256_madd_epi16(_mm256_add_epi16(a1, b1), one));
+	return _mm256_srli_epi16(_mm256_add_epi16(s, _mm256_set1_epi16(2)), 2);
+}
+
+VC_AVX2 static uint32_t BgrRowsAVX2(const uint8_t *s0, const uint8_t *s1,
+	uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, uint32_t x, uint32_t w)
+{
+	// Luma dwords come out as pixels 0-3 8-11 16-19 24-27 | 4-7 12-15 20-23 28-31
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	for (; x + 32 <= w; x += 32)
+	{
+		__m256i ab0, ag0, ar0, ab1, ag1, ar1, bb0, bg0, br0, bb1, bg1, br1;
+		SplitBgrAVX2(s0 + x * 4, ab0, ag0, ar0);
+		SplitBgrAVX2(s0 + x * 4 + 64, ab1, ag1, ar1);
+		SplitBgrAVX2(s1 + x * 4, bb0, bg0, br0);
+		SplitBgrAVX2(s1 + x * 4 + 64, bb1, bg1, br1);
+
+		__m256i ya = _mm256_packus_epi16(LumaAVX2(ab0, ag0, ar0), LumaAVX2(ab1, ag1, ar1));
+		__m256i yb = _mm256_packus_epi16(LumaAVX2(bb0, bg0, br0), LumaAVX2(bb1, bg1, br1));
+		_mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permutevar8x32_epi32(ya, order));
+		_mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permutevar8x32_epi32(yb, order));
+
+		// Chroma pairs come out as 01 45 89 CD | 23 67 AB EF, interleave the lanes' words back
+		__m256i cb = Box2x2AVX2(ab0, bb0, ab1, bb1);
+		__m256i cg = Box2x2AVX2(ag0, bg0, ag1, bg1);
+		__m256i cr = Box2x2AVX2(ar0, br0, ar1, br1);
+		__m256i uv = _mm256_packus_epi16(ChromaAVX2(cb, cg, cr, 112, -74, -38), ChromaAVX2(cb, cg, cr, -18, -94, 112));
+		__m256i swapped = _mm256_permute4x64_epi64(uv, 0x4e);
+		_mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(_mm256_unpacklo_epi16(uv, swapped)));
+		_mm_storeu_si128((__m128i *)(v + x / 2), _mm256_castsi256_si128(_mm256_unpackhi_epi16(uv, swapped)));
+	}
+	return x;
+}
+
+VC_AVX2 static inline __m256i HalveAVX2(__m256i a, __m256i b)
+{
+	const __m256i lo = _mm256_set1_epi16(0xff);
+	__m256i s = _mm256_add_epi16(_mm256_and_si256(a, lo), _mm256_srli_epi16(a, 8));
+	s = _mm256_add_epi16(s, _mm256_add_epi16(_mm256_and_si256(b, lo), _mm256_srli_epi16(b, 8)));
+	return _mm256_srli_epi16(_mm256_add_epi16(s, _mm256_set1_epi16(2)), 2);
+}
+
+VC_AVX2 static uint32_t HalveRowAVX2(const uint8_t *s0, const uint8_t *s1, uint8_t *d, uint32_t x, uint32_t w)
+{
+	for (; x + 32 <= w; x += 32)
+	{
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)(s0 + x * 2));
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(s0 + x * 2 + 32));
+		__m256i b0 = _mm256_loadu_si256((const __m256i *)(s1 + x * 2));
+		__m256i b1 = _mm256_loadu_si256((const __m256i *)(s1 + x * 2 + 32));
+		__m256i d8 = _mm256_packus_epi16(HalveAVX2(a0, b0), HalveAVX2(a1, b1));
+		_mm256_storeu_si256((__m256i *)(d + x), _mm256_permute4x64_epi64(d8, 0xd8));
+	}
+	return x;
+}
+#endif
+
+typedef uint32_t (*RowsKernel)(const uint8_t *, const uint8_t *,
+	uint8_t *, uint8_t *, uint8_t *, uint8_t *, uint32_t, uint32_t);
+
+// Runs the widest kernel first, narrower ones and then the scalar code pick up the rest of each row
+static void ConvertRows(const uint8_t *src, uint32_t stride, VideoImage& dst,
+	RowsKernel avx2, RowsKernel sse2, RowsKernel scalar)
+{
+	uint32_t w = dst.width, h = dst.height, cw = w / 2;
+	VideoSimd simd = CurrentSimd();
+
+	for (uint32_t row = 0; row < h; row += 2)
+	{
+		const uint8_t *s0 = src + row * stride;
+		const uint8_t *s1 = s0 + stride;
+		uint8_t *y0 = dst.Y() + row * w;
+		uint8_t *y1 = y0 + w;
+		uint8_t *u = dst.U() + row / 2 * cw;
+		uint8_t *v = dst.V() + row / 2 * cw;
+
+		uint32_t x = 0;
+		if (simd >= VIDEO_SIMD_AVX2 && avx2)
+			x = avx2(s0, s1, y0, y1, u, v, x, w);
+		if (simd >= VIDEO_SIMD_SSE2 && sse2)
+			x = sse2(s0, s1, y0, y1, u, v, x, w);
+		scalar(s0, s1, y0, y1, u, v, x, w);
+	}
+}
+
+#ifndef VC_SSE2
+#define YuyvRowsSSE2 nullptr
+#define BgrRowsSSE2 nullptr
+#endif
+#ifndef VC_AVX2
+#define YuyvRowsAVX2 nullptr
+#define BgrRowsAVX2 nullptr
+#endif
+
+void YuyvToI420(const uint8_t *src, uint32_t stride, VideoImage& dst)
+{
+	ConvertRows(src, stride, dst, YuyvRowsAVX2, YuyvRowsSSE2, YuyvRowsScalar);
+}
+
+void Bgr32ToI420(const uint8_t *src, uint32_t stride, VideoImage& dst)
+{
+	ConvertRows(src, stride, dst, BgrRowsAVX2, BgrRowsSSE2, BgrRowsScalar);
+}
+
+static void HalvePlane(const uint8_t *src, uint32_t sw, uint8_t *dst, uint32_t dw, uint32_t dh)
+{
+	VideoSimd simd = CurrentSimd();
+	for (uint32_t y = 0; y < dh; y++)
+	{
+		const uint8_t *s0 = src + y * 2 * sw;
+		const uint8_t *s1 = s0 + sw;
+		uint8_t *d = dst + y * dw;
+
+		uint32_t x = 0;
+#ifdef VC_AVX2
+		if (simd >= VIDEO_SIMD_AVX2)
+			x = HalveRowAVX2(s0, s1, d, x, dw);
+#endif
+#ifdef VC_SSE2
+		if (simd >= VIDEO_SIMD_SSE2)
+			x = HalveRowSSE2(s0, s1, d, x, dw);
+#endif
+		HalveRowScalar(s0, s1, d, x, dw);
+	}
+}
+
+static void ScalePlane(const uint8_t *src, uint32_t sw, uint32_t sh,
+	uint8_t *dst, uint32_t dw, uint32_t dh)
+{
+	for (uint32_t y = 0; y < dh; y++)
+	{
+		const uint8_t *srow = src + (uint64_t)y * sh / dh * sw;
+		uint8_t *drow = dst + y * dw;
+		// 16.16 step, source widths are far below 64K
+		uint32_t step = (sw << 16) / dw, pos = 0;
+		for (uint32_t x = 0; x < dw; x++, pos += step)
+			drow[x] = srow[pos >> 16];
+	}
+}
+
+void ScaleI420(const VideoImage& src, VideoImage& dst)
+{
+	if (src.width == dst.width && src.height == dst.height)
+	{
+		memcpy(dst.data.data(), src.data.data(), dst.data.size());
+		return;
+	}
+
+	// 640x480 cameras to the 320x240 mode, worth filtering properly
+	if (src.width == dst.width * 2 && src.height == dst.height * 2 && !(dst.width & 1) && !(dst.height & 1))
+	{
+		HalvePlane(src.Y(), src.width, dst.Y(), dst.width, dst.height);
+		HalvePlane(src.U(), src.width / 2, dst.U(), dst.width / 2, dst.height / 2);
+		HalvePlane(src.V(), src.width / 2, dst.V(), dst.width / 2, dst.height / 2);
+		return;
+	}
+
+	ScalePlane(src.Y(), src.width, src.height, dst.Y(), dst.width, dst.height);
+	ScalePlane(src.U(), src.width / 2, src.height / 2, dst.U(), dst.width / 2, dst.height / 2);
+	ScalePlane(src.V(), src.width / 2, src.height / 2, dst.V(), dst.width / 2, dst.height / 2);
+}
+
+static inline void Copy8x8(const uint8_t *src, uint32_t stride, uint8_t *out)
+{
+	for (int y = 0; y < 8; y++)
+		memcpy(out + y * 8, src + y * stride, 8);
+}
+
+/*
+	Inverse of yuv420raw_to_yuv420p() in usb-eyetoy.cpp. Segments are 384
+	bytes: 8x8 U and 8x8 V of one 16x16 macroblock, then four 8x8 Y blocks.
+	Chroma macroblocks and Y blocks are each taken in raster order, so the
+	Y blocks of a segment do not sit under its chroma.
+*/
+void I420ToOvRaw(const VideoImage& src, uint8_t *out)
+{
+	uint32_t w = src.width, h = src.height, cw = w / 2;
+
+	uint32_t seg = 0;
+	for (uint32_t y = 0; y < h; y += 16)
+	{
+		for (uint32_t x = 0; x < w; x += 16, seg++)
+		{
+			Copy8x8(src.U() + y / 2 * cw + x / 2, cw, out + seg * 384);
+			Copy8x8(src.V() + y / 2 * cw + x / 2, cw, out + seg * 384 + 64);
+		}
+	}
+
+	uint32_t block = 0;
+	for (uint32_t y = 0; y < h; y += 8)
+	{
+		for (uint32_t x = 0; x < w; x += 8, block++)
+			Copy8x8(src.Y() + y * w + x, w, out + block / 4 * 384 + 128 + block % 4 * 64);
+	}
+}
+
+#undef VC_SSE2
+#undef VC_AVX2
+#undef VC_HAVE_SSE2
+#undef VC_HAVE_AVX2
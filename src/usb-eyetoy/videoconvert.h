@@ -0,0 +1,38 @@
+#ifndef VIDEOCONVERT_H
+#define VIDEOCONVERT_H
+#include <cstdint>
+#include "videodev.h"
+
+// Kernel sets, scalar is the reference the others must match bit for bit
+enum VideoSimd
+{
+	VIDEO_SIMD_NONE,
+	VIDEO_SIMD_SSE2,
+	VIDEO_SIMD_AVX2,
+};
+
+// Best set this CPU and build can run
+VideoSimd VideoSimdSupported();
+// Caps the kernels used from now on, returns the set actually in effect
+VideoSimd SetVideoSimd(VideoSimd simd);
+const char* VideoSimdName(VideoSimd simd);
+
+// Packed YUYV (YUY2) to I420, dst is already sized. Chroma of two rows is averaged
+void YuyvToI420(const uint8_t *src, uint32_t stride, VideoImage& dst);
+
+// Packed 32-bit B, G, R, X to BT.601 limited range I420, chroma from 2x2 averages
+void Bgr32ToI420(const uint8_t *src, uint32_t stride, VideoImage& dst);
+
+// Scale to dst's size: plain copy when sizes match, 2x2 box for exact halving, else nearest neighbour
+void ScaleI420(const VideoImage& src, VideoImage& dst);
+
+// Bytes of an uncompressed OV51x YUV 4:2:0 frame
+static inline uint32_t OvRawSize(uint32_t width, uint32_t height)
+{
+	return width * height * 3 / 2;
+}
+
+// I420 to the OV51x raw 4:2:0 segment layout, sizes must be multiples of 16
+void I420ToOvRaw(const VideoImage& src, uint8_t *out);
+
+#endif
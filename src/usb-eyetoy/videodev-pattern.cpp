@@ -0,0 +1,108 @@
+#include "videodev.h"
+#include <cstring>
+
+#define APINAME "pattern"
+
+#define PATTERN_WIDTH 640
+#define PATTERN_HEIGHT 480
+// Frame counter along the bottom edge, one block per bit
+#define PATTERN_BITS 16
+#define PATTERN_BOX 64
+
+namespace videodev_pattern {
+
+struct Yuv { uint8_t y, u, v; };
+
+// 75% colour bars, BT.601 studio range
+static const Yuv bars[] = {
+	{ 180, 128, 128 }, // white
+	{ 162, 44, 142 }, // yellow
+	{ 131, 156, 44 }, // cyan
+	{ 112, 72, 58 }, // green
+	{ 84, 184, 198 }, // magenta
+	{ 65, 100, 212 }, // red
+	{ 35, 212, 114 }, // blue
+	{ 16, 128, 128 }, // black
+};
+
+/*
+	Colour bars with a box bouncing across them and the frame number in
+	binary along the bottom, white blocks for ones. Dropped or repeated
+	frames show up as skips in the counter on the guest side. Needs no
+	host hardware or files, so it is what headless runs use.
+*/
+class PatternVideoDevice : public VideoDevice
+{
+public:
+	PatternVideoDevice(int port, const std::string& api)
+	: mFrame(0)
+	{
+		mBackground.Resize(PATTERN_WIDTH, PATTERN_HEIGHT);
+		DrawBars();
+	}
+
+	bool Capture(VideoImage& img)
+	{
+		if (img.width != PATTERN_WIDTH || img.height != PATTERN_HEIGHT)
+			img.Resize(PATTERN_WIDTH, PATTERN_HEIGHT);
+		memcpy(img.data.data(), mBackground.data.data(), img.data.size());
+
+		// Bounce horizontally over the bars at 8px a frame, at 30fps one pass
+		// takes 2.4 seconds and there and back 4.8
+		uint32_t range = PATTERN_WIDTH - PATTERN_BOX;
+		uint32_t pos = (mFrame * 8) % (range * 2);
+		uint32_t x = pos < range ? pos : range * 2 - pos;
+		Fill(img, x, PATTERN_HEIGHT / 3, PATTERN_BOX, PATTERN_BOX, bars[0]);
+
+		uint32_t bw = PATTERN_WIDTH / PATTERN_BITS;
+		for (int bit = 0; bit < PATTERN_BITS; bit++)
+		{
+			bool one = (mFrame >> (PATTERN_BITS - 1 - bit)) & 1;
+			Fill(img, bit * bw, PATTERN_HEIGHT - 32, bw, 32, one ? bars[0] : bars[7]);
+		}
+
+		mFrame++;
+		return true;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("Test pattern");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return std::vector<CONFIGVARIANT>();
+	}
+
+private:
+	void DrawBars()
+	{
+		uint32_t bw = PATTERN_WIDTH / 8;
+		for (int i = 0; i < 8; i++)
+			Fill(mBackground, i * bw, 0, bw, PATTERN_HEIGHT, bars[i]);
+	}
+
+	// Even coordinates and sizes, so chroma lines up
+	static void Fill(VideoImage& img, uint32_t x, uint32_t y, uint32_t w, uint32_t h, const Yuv& c)
+	{
+		for (uint32_t row = y; row < y + h; row++)
+			memset(img.Y() + row * img.width + x, c.y, w);
+		for (uint32_t row = y / 2; row < (y + h) / 2; row++)
+		{
+			memset(img.U() + row * img.width / 2 + x / 2, c.u, w / 2);
+			memset(img.V() + row * img.width / 2 + x / 2, c.v, w / 2);
+		}
+	}
+
+	VideoImage mBackground;
+	uint32_t mFrame;
+};
+
+REGISTER_VIDEODEV(APINAME, PatternVideoDevice);
+};
+#undef APINAME
+#undef PATTERN_WIDTH
+#undef PATTERN_HEIGHT
+#undef PATTERN_BITS
+#undef PATTERN_BOX
@@ -0,0 +1,248 @@
+#include "videodev.h"
+#include "videoconvert.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#define APINAME "v4l2"
+
+#define V4L2_WIDTH 640
+#define V4L2_HEIGHT 480
+#define V4L2_BUFFERS 4
+// Give up on a frame after this long, the capture thread retries
+#define V4L2_TIMEOUT_MS 1000
+
+namespace videodev_v4l2 {
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+	int ret;
+	do ret = ioctl(fd, req, arg);
+	while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+// Tried in order, YUYV is what every UVC camera offers
+static const uint32_t formats[] = {
+	V4L2_PIX_FMT_YUYV,
+#ifdef V4L2_PIX_FMT_XBGR32
+	V4L2_PIX_FMT_XBGR32,
+#endif
+	V4L2_PIX_FMT_BGR32, // older name for the same byte order
+};
+
+static uint32_t BytesPerPixel(uint32_t format)
+{
+	return format == V4L2_PIX_FMT_YUYV ? 2 : 4;
+}
+
+/*
+	Webcam through V4L2 memory mapped streaming at 640x480, YUYV or
+	32-bit BGR so nothing has to be decompressed here.
+*/
+class V4l2VideoDevice : public VideoDevice
+{
+public:
+	V4l2VideoDevice(int port, const std::string& api)
+	: mFd(-1), mFormat(0), mStride(0), mCount(0), mStreaming(false)
+	{
+		memset(mBufs, 0, sizeof(mBufs));
+
+		std::string path = "/dev/video0";
+		CONFIGVARIANT varPath(N_VIDEO_PATH, CONFIG_TYPE_CHAR);
+		if (LoadSetting(port, api, varPath) && !varPath.strValue.empty())
+			path = varPath.strValue;
+
+		mFd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if (mFd < 0)
+			throw VideoDeviceError("Could not open video device");
+
+		try
+		{
+			Init();
+		}
+		catch (VideoDeviceError&)
+		{
+			Close();
+			throw;
+		}
+	}
+
+	~V4l2VideoDevice()
+	{
+		Close();
+	}
+
+	bool Capture(VideoImage& img)
+	{
+		if (img.width != V4L2_WIDTH || img.height != V4L2_HEIGHT)
+			img.Resize(V4L2_WIDTH, V4L2_HEIGHT);
+
+		v4l2_buffer buf;
+		while (true)
+		{
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			if (!xioctl(mFd, VIDIOC_DQBUF, &buf))
+				break;
+			if (errno != EAGAIN)
+				return false;
+
+			pollfd pfd = { mFd, POLLIN, 0 };
+			int ret = poll(&pfd, 1, V4L2_TIMEOUT_MS);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+				return false;
+		}
+
+		// Short frames come from a hiccup on the camera's side, skip them
+		bool ok = buf.index < mCount && !(buf.flags & V4L2_BUF_FLAG_ERROR) &&
+			buf.bytesused >= mStride * V4L2_HEIGHT;
+		if (ok && mFormat == V4L2_PIX_FMT_YUYV)
+			YuyvToI420((const uint8_t *)mBufs[buf.index].start, mStride, img);
+		else if (ok)
+			Bgr32ToI420((const uint8_t *)mBufs[buf.index].start, mStride, img);
+
+		if (xioctl(mFd, VIDIOC_QBUF, &buf))
+			return false;
+		return ok;
+	}
+
+	bool Live() const
+	{
+		return true;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("Video4Linux2 camera");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_VIDEO_PATH, N_VIDEO_PATH, CONFIG_TYPE_CHAR));
+		return params;
+	}
+
+private:
+	void Init()
+	{
+		v4l2_capability cap;
+		memset(&cap, 0, sizeof(cap));
+		if (xioctl(mFd, VIDIOC_QUERYCAP, &cap))
+			throw VideoDeviceError("Not a V4L2 device");
+		uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+		if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING))
+			throw VideoDeviceError("Device can not stream video");
+
+		// Drivers answer S_FMT with the closest they have, keep the first exact match
+		v4l2_format fmt;
+		for (uint32_t format : formats)
+		{
+			memset(&fmt, 0, sizeof(fmt));
+			fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			fmt.fmt.pix.width = V4L2_WIDTH;
+			fmt.fmt.pix.height = V4L2_HEIGHT;
+			fmt.fmt.pix.pixelformat = format;
+			fmt.fmt.pix.field = V4L2_FIELD_NONE;
+			if (!xioctl(mFd, VIDIOC_S_FMT, &fmt) && fmt.fmt.pix.pixelformat == format &&
+				fmt.fmt.pix.width == V4L2_WIDTH && fmt.fmt.pix.height == V4L2_HEIGHT)
+			{
+				mFormat = format;
+				break;
+			}
+		}
+		if (!mFormat)
+			throw VideoDeviceError("Device has no 640x480 YUYV or BGR32 mode");
+		mStride = fmt.fmt.pix.bytesperline;
+		if (mStride < V4L2_WIDTH * BytesPerPixel(mFormat))
+			mStride = V4L2_WIDTH * BytesPerPixel(mFormat);
+
+		// Not every driver lets the rate be set, the capture thread copes either way
+		v4l2_streamparm parm;
+		memset(&parm, 0, sizeof(parm));
+		parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		parm.parm.capture.timeperframe.numerator = 1;
+		parm.parm.capture.timeperframe.denominator = 30;
+		xioctl(mFd, VIDIOC_S_PARM, &parm);
+
+		v4l2_requestbuffers req;
+		memset(&req, 0, sizeof(req));
+		req.count = V4L2_BUFFERS;
+		req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		req.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(mFd, VIDIOC_REQBUFS, &req) || req.count < 2)
+			throw VideoDeviceError("Could not get capture buffers");
+
+		for (uint32_t i = 0; i < req.count && i < V4L2_BUFFERS; i++)
+		{
+			v4l2_buffer buf;
+			memset(&buf, 0, sizeof(buf));
+			buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buf.memory = V4L2_MEMORY_MMAP;
+			buf.index = i;
+			if (xioctl(mFd, VIDIOC_QUERYBUF, &buf))
+				throw VideoDeviceError("Could not query capture buffer");
+
+			void *start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, buf.m.offset);
+			if (start == MAP_FAILED)
+				throw VideoDeviceError("Could not map capture buffer");
+			mBufs[i].start = start;
+			mBufs[i].length = buf.length;
+			mCount = i + 1;
+
+			if (xioctl(mFd, VIDIOC_QBUF, &buf))
+				throw VideoDeviceError("Could not queue capture buffer");
+		}
+
+		v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (xioctl(mFd, VIDIOC_STREAMON, &type))
+			throw VideoDeviceError("Could not start streaming");
+		mStreaming = true;
+	}
+
+	void Close()
+	{
+		if (mStreaming)
+		{
+			v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			xioctl(mFd, VIDIOC_STREAMOFF, &type);
+			mStreaming = false;
+		}
+		for (uint32_t i = 0; i < mCount; i++)
+			munmap(mBufs[i].start, mBufs[i].length);
+		mCount = 0;
+		if (mFd >= 0)
+			close(mFd);
+		mFd = -1;
+	}
+
+	struct Buffer
+	{
+		void *start;
+		size_t length;
+	};
+
+	int mFd;
+	uint32_t mFormat;
+	uint32_t mStride;
+	Buffer mBufs[V4L2_BUFFERS];
+	uint32_t mCount;
+	bool mStreaming;
+};
+
+REGISTER_VIDEODEV(APINAME, V4l2VideoDevice);
+};
+#undef APINAME
+#undef V4L2_WIDTH
+#undef V4L2_HEIGHT
+#undef V4L2_BUFFERS
+#undef V4L2_TIMEOUT_MS
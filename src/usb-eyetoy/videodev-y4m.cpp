@@ -0,0 +1,160 @@
+#include "videodev.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define APINAME "y4m"
+
+#ifdef _WIN32
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+// Longest header or FRAME line we accept
+#define Y4M_MAX_LINE 256
+
+namespace videodev_y4m {
+
+/*
+	YUV4MPEG2 file, as written by ffmpeg -f yuv4mpegpipe or x264 --dump-yuv.
+	8-bit 4:2:0 and mono only, chroma siting is ignored. Plays at the rate
+	set on the device, not the rate in the header, and starts over at the
+	end unless loop is off.
+*/
+class Y4mVideoDevice : public VideoDevice
+{
+public:
+	Y4mVideoDevice(int port, const std::string& api)
+	: mFile(nullptr), mWidth(0), mHeight(0), mMono(false), mLoop(true), mStart(0)
+	{
+		CONFIGVARIANT varPath(N_VIDEO_PATH, CONFIG_TYPE_TCHAR);
+		if (!LoadSetting(port, api, varPath) || varPath.tstrValue.empty())
+			throw VideoDeviceError("No video file set");
+
+		CONFIGVARIANT varLoop(N_VIDEO_LOOP, CONFIG_TYPE_INT);
+		if (LoadSetting(port, api, varLoop))
+			mLoop = varLoop.intValue != 0;
+
+		mFile = wfopen(varPath.tstrValue.c_str(), TEXT("rb"));
+		if (!mFile)
+			throw VideoDeviceError("Could not open video file");
+
+		if (!ReadHeader())
+		{
+			fclose(mFile);
+			throw VideoDeviceError("Not an 8-bit 4:2:0 YUV4MPEG2 file");
+		}
+		mStart = ftello(mFile);
+	}
+
+	~Y4mVideoDevice()
+	{
+		if (mFile)
+			fclose(mFile);
+	}
+
+	bool Capture(VideoImage& img)
+	{
+		if (img.width != mWidth || img.height != mHeight)
+			img.Resize(mWidth, mHeight);
+
+		if (!ReadFrame(img))
+		{
+			if (!mLoop || fseeko(mFile, mStart, SEEK_SET) || !ReadFrame(img))
+				return false;
+		}
+		return true;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("YUV4MPEG2 file");
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_VIDEO_PATH, N_VIDEO_PATH, CONFIG_TYPE_TCHAR));
+		params.push_back(CONFIGVARIANT(S_VIDEO_LOOP, N_VIDEO_LOOP, CONFIG_TYPE_INT));
+		return params;
+	}
+
+private:
+	bool ReadLine(char *line)
+	{
+		int c, n = 0;
+		while ((c = fgetc(mFile)) != EOF && c != '\n')
+		{
+			if (n == Y4M_MAX_LINE - 1)
+				return false;
+			line[n++] = c;
+		}
+		line[n] = 0;
+		return c == '\n';
+	}
+
+	bool ReadHeader()
+	{
+		char line[Y4M_MAX_LINE];
+		if (!ReadLine(line) || strncmp(line, "YUV4MPEG2 ", 10))
+			return false;
+
+		for (char *tok = strtok(line + 10, " "); tok; tok = strtok(nullptr, " "))
+		{
+			switch (tok[0])
+			{
+			case 'W':
+				mWidth = strtoul(tok + 1, nullptr, 10);
+				break;
+			case 'H':
+				mHeight = strtoul(tok + 1, nullptr, 10);
+				break;
+			case 'C':
+				// 4:2:0 siting variants all decode the same, no high bit depths
+				if (!strcmp(tok, "Cmono"))
+					mMono = true;
+				else if (strcmp(tok, "C420") && strcmp(tok, "C420jpeg") &&
+					strcmp(tok, "C420paldv") && strcmp(tok, "C420mpeg2"))
+					return false;
+				break;
+			case 'I':
+				// Interlaced frames are shown as they are
+			default:
+				break;
+			}
+		}
+
+		// Chroma planes need even sizes, and keep a corrupt header from allocating gigabytes
+		return mWidth && mHeight && !(mWidth & 1) && !(mHeight & 1) &&
+			mWidth <= 4096 && mHeight <= 4096;
+	}
+
+	bool ReadFrame(VideoImage& img)
+	{
+		char line[Y4M_MAX_LINE];
+		if (!ReadLine(line) || strncmp(line, "FRAME", 5))
+			return false;
+
+		size_t luma = mWidth * mHeight;
+		if (fread(img.Y(), 1, luma, mFile) != luma)
+			return false;
+		if (mMono)
+		{
+			memset(img.U(), 128, luma / 2);
+			return true;
+		}
+		return fread(img.U(), 1, luma / 2, mFile) == luma / 2;
+	}
+
+	FILE *mFile;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	bool mMono;
+	bool mLoop;
+	int64_t mStart; // first FRAME line
+};
+
+REGISTER_VIDEODEV(APINAME, Y4mVideoDevice);
+};
+#undef APINAME
+#undef Y4M_MAX_LINE
@@ -0,0 +1,6 @@
+#include "videodev.h"
+
+VideoDeviceProxyBase::VideoDeviceProxyBase(const std::string& name)
+{
+	RegisterVideoDevice::instance().Add(name, this);
+}
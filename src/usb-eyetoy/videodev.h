@@ -0,0 +1,164 @@
+#ifndef VIDEODEV_H
+#define VIDEODEV_H
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include "../helpers.h"
+#include "../configuration.h"
+#include "../osdebugout.h"
+
+// Frame source options, kept in the source's own section
+#define S_VIDEO_PATH	TEXT("Video file or device")
+#define N_VIDEO_PATH	TEXT("path")
+#define S_VIDEO_LOOP	TEXT("Loop video file")
+#define N_VIDEO_LOOP	TEXT("loop")
+
+/*
+	Planar YUV 4:2:0 (I420): full size Y plane, then U and V at half
+	width and height. Width and height are even.
+*/
+struct VideoImage
+{
+	uint32_t width;
+	uint32_t height;
+	std::vector<uint8_t> data;
+
+	VideoImage() : width(0), height(0) {}
+
+	void Resize(uint32_t w, uint32_t h)
+	{
+		width = w;
+		height = h;
+		data.resize(w * h * 3 / 2);
+	}
+
+	uint8_t* Y() { return data.data(); }
+	uint8_t* U() { return data.data() + width * height; }
+	uint8_t* V() { return data.data() + width * height * 5 / 4; }
+	const uint8_t* Y() const { return data.data(); }
+	const uint8_t* U() const { return data.data() + width * height; }
+	const uint8_t* V() const { return data.data() + width * height * 5 / 4; }
+};
+
+class VideoDeviceError : public std::runtime_error
+{
+public:
+	VideoDeviceError(const char* msg) : std::runtime_error(msg) {}
+	virtual ~VideoDeviceError() throw () {}
+};
+
+/*
+	Where camera frames come from. Capture() is only ever called from the
+	capture thread, it may block and may resize img to the source's own
+	size; scaling to the guest's mode happens afterwards.
+*/
+class VideoDevice
+{
+public:
+	virtual ~VideoDevice() {}
+
+	// Next frame, false on a device error or the end of a non-looping file
+	virtual bool Capture(VideoImage& img) = 0;
+	// Delivers frames at its own pace, the capture thread does not throttle it
+	virtual bool Live() const { return false; }
+
+	//Remember to add to your class
+	//static const TCHAR* Name();
+	//static std::vector<CONFIGVARIANT> GetSettings();
+};
+
+class VideoDeviceProxyBase
+{
+	VideoDeviceProxyBase(const VideoDeviceProxyBase&) = delete;
+
+	public:
+	VideoDeviceProxyBase(const std::string& name);
+	virtual ~VideoDeviceProxyBase() {}
+	virtual VideoDevice* CreateObject(int port, const std::string& api) const = 0;
+	virtual const TCHAR* Name() const = 0;
+	virtual std::vector<CONFIGVARIANT> GetSettings() = 0;
+};
+
+template <class T>
+class VideoDeviceProxy : public VideoDeviceProxyBase
+{
+	VideoDeviceProxy(const VideoDeviceProxy&) = delete;
+
+	public:
+	VideoDeviceProxy(const std::string& name): VideoDeviceProxyBase(name) {}
+	VideoDevice* CreateObject(int port, const std::string& api) const
+	{
+		try
+		{
+			return new T(port, api);
+		}
+		catch(VideoDeviceError& err)
+		{
+			OSDebugOut(TEXT("VideoDevice port %d: %") TEXT(SFMTs) TEXT("\n"), port, err.what());
+			(void)err;
+			return nullptr;
+		}
+	}
+	virtual const TCHAR* Name() const
+	{
+		return T::Name();
+	}
+	virtual std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return T::GetSettings();
+	}
+};
+
+class RegisterVideoDevice
+{
+	RegisterVideoDevice(const RegisterVideoDevice&) = delete;
+	RegisterVideoDevice() {}
+
+	public:
+	typedef std::map<std::string, VideoDeviceProxyBase* > RegisterVideoDeviceMap;
+	static RegisterVideoDevice& instance() {
+		static RegisterVideoDevice registerVideoDevice;
+		return registerVideoDevice;
+	}
+
+	~RegisterVideoDevice() {}
+
+	void Add(const std::string& name, VideoDeviceProxyBase* creator)
+	{
+		registerVideoDeviceMap[name] = creator;
+	}
+
+	VideoDeviceProxyBase* Proxy(const std::string& name)
+	{
+		auto it = registerVideoDeviceMap.find(name);
+		if (it != registerVideoDeviceMap.end())
+			return it->second;
+		return nullptr;
+	}
+
+	std::list<std::string> Names() const
+	{
+		std::list<std::string> nameList;
+		std::transform(
+			registerVideoDeviceMap.begin(), registerVideoDeviceMap.end(),
+			std::back_inserter(nameList),
+			SelectKey());
+		return nameList;
+	}
+
+	const RegisterVideoDeviceMap& Map() const
+	{
+		return registerVideoDeviceMap;
+	}
+
+private:
+	RegisterVideoDeviceMap registerVideoDeviceMap;
+};
+
+#define REGISTER_VIDEODEV(name,cls) VideoDeviceProxy<cls> g##cls##Proxy(name)
+#endif
@@ -0,0 +1,794 @@
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../osdebugout.h"
+#include "audiodeviceproxy.h"
+#include "../libsamplerate/samplerate.h"
+#include "resampler.h"
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <gtk/gtk.h>
+#include <alsa/asoundlib.h>
+
+GtkWidget *new_combobox(const char* label, GtkWidget *vbox); // src/linux/config-gtk.cpp
+
+#define APINAME "alsa"
+
+#define S_PERIOD_LEN	TEXT("Period length")
+#define N_PERIOD_LEN	TEXT("period_len")
+
+namespace audiodev_alsa {
+
+// Device names, as in "hw:0,0", "plughw:1", "null" or a pcm from asoundrc
+static void alsa_get_devicelist(AudioDeviceInfoList& list, AudioDir dir)
+{
+	void **hints;
+	if (snd_device_name_hint(-1, "pcm", &hints) < 0)
+		return;
+
+	const char *filter = dir == AUDIODIR_SOURCE ? "Input" : "Output";
+	for (void **n = hints; *n; n++)
+	{
+		char *name = snd_device_name_get_hint(*n, "NAME");
+		char *desc = snd_device_name_get_hint(*n, "DESC");
+		char *ioid = snd_device_name_get_hint(*n, "IOID");
+
+		// NULL IOID means both directions
+		if (name && (!ioid || !strcmp(ioid, filter)))
+		{
+			AudioDeviceInfo dev;
+			dev.strID = name;
+			dev.strName = name;
+			if (desc)
+			{
+				// Descriptions are multiline
+				std::string d(desc);
+				std::replace(d.begin(), d.end(), '\n', ' ');
+				dev.strName += " - " + d;
+			}
+			list.push_back(dev);
+		}
+
+		free(name);
+		free(desc);
+		free(ioid);
+	}
+	snd_device_name_free_hint(hints);
+}
+
+// GTK+ config. dialog stuff
+static void populateDeviceWidget(GtkComboBox *widget, const std::string& devName, const AudioDeviceInfoList& devs)
+{
+	gtk_list_store_clear (GTK_LIST_STORE (gtk_combo_box_get_model (widget)));
+	gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (widget), "None");
+	gtk_combo_box_set_active (GTK_COMBO_BOX (widget), 0);
+
+	int i = 1;
+	for (auto& dev: devs)
+	{
+		gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (widget), dev.strName.c_str());
+		if (!devName.empty() && devName == dev.strID)
+			gtk_combo_box_set_active (GTK_COMBO_BOX (widget), i);
+		i++;
+	}
+}
+
+static void deviceChanged (GtkComboBox *widget, gpointer data)
+{
+	*(int*) data = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
+}
+
+static GtkWidget *new_spin(const char* label, GtkWidget *vbox, int min, int max, int value)
+{
+	GtkWidget *hbox = gtk_hbox_new (FALSE, 5);
+	gtk_box_pack_start (GTK_BOX (vbox), hbox, FALSE, TRUE, 0);
+	GtkWidget *lbl = gtk_label_new (label);
+	gtk_box_pack_start (GTK_BOX (hbox), lbl, FALSE, FALSE, 5);
+	GtkWidget *spin = gtk_spin_button_new_with_range (min, max, 1);
+	gtk_spin_button_set_value (GTK_SPIN_BUTTON (spin), value);
+	gtk_box_pack_end (GTK_BOX (hbox), spin, FALSE, FALSE, 5);
+	return spin;
+}
+
+static int LoadIntSetting(int port, const TCHAR *name, int def)
+{
+	CONFIGVARIANT var(name, CONFIG_TYPE_INT);
+	if (LoadSetting(port, APINAME, var))
+		return var.intValue;
+	return def;
+}
+
+static int GtkConfigure(int port, void *data)
+{
+	int dev_idxs[] = {0, 0, 0};
+
+	AudioDeviceInfoList srcDevs, sinkDevs;
+	alsa_get_devicelist(srcDevs, AUDIODIR_SOURCE);
+	alsa_get_devicelist(sinkDevs, AUDIODIR_SINK);
+
+	GtkWidget *dlg = gtk_dialog_new_with_buttons (
+		"ALSA Settings", GTK_WINDOW (data), GTK_DIALOG_MODAL,
+		GTK_STOCK_CANCEL, GTK_RESPONSE_CANCEL,
+		GTK_STOCK_OK, GTK_RESPONSE_OK,
+		NULL);
+	gtk_window_set_position (GTK_WINDOW (dlg), GTK_WIN_POS_CENTER);
+	gtk_window_set_resizable (GTK_WINDOW (dlg), TRUE);
+	GtkWidget *dlg_area_box = gtk_dialog_get_content_area (GTK_DIALOG (dlg));
+
+	GtkWidget *ro_frame = gtk_frame_new (NULL);
+	gtk_box_pack_start (GTK_BOX (dlg_area_box), ro_frame, TRUE, FALSE, 5);
+
+	GtkWidget *main_vbox = gtk_vbox_new (FALSE, 5);
+	gtk_container_add (GTK_CONTAINER (ro_frame), main_vbox);
+
+	const char* labels[] = {"Source 1", "Source 2", "Sink 1"};
+	const char* names[] = {N_AUDIO_SOURCE0, N_AUDIO_SOURCE1, N_AUDIO_SINK0};
+	for (int i=0; i<3; i++)
+	{
+		std::string devName;
+		CONFIGVARIANT var(names[i], CONFIG_TYPE_CHAR);
+		if (LoadSetting(port, APINAME, var))
+			devName = var.strValue;
+
+		GtkWidget *cb = new_combobox(labels[i], main_vbox);
+		g_signal_connect (G_OBJECT (cb), "changed", G_CALLBACK (deviceChanged), (gpointer)&dev_idxs[i]);
+		populateDeviceWidget (GTK_COMBO_BOX (cb), devName, i < 2 ? srcDevs : sinkDevs);
+	}
+
+	GtkWidget *buffer_spin = new_spin ("Buffer (ms)", main_vbox, 2, 1000,
+		LoadIntSetting(port, N_BUFFER_LEN, 20));
+	GtkWidget *period_spin = new_spin ("Period (ms)", main_vbox, 1, 500,
+		LoadIntSetting(port, N_PERIOD_LEN, 5));
+
+	gtk_widget_show_all (dlg);
+	gint result = gtk_dialog_run (GTK_DIALOG (dlg));
+
+	int buffer_len = gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (buffer_spin));
+	int period_len = gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (period_spin));
+
+	gtk_widget_destroy (dlg);
+
+	// Wait for all gtk events to be consumed ...
+	while (gtk_events_pending ())
+		gtk_main_iteration_do (FALSE);
+
+	if (result == GTK_RESPONSE_OK)
+	{
+		for (int i=0; i<3; i++)
+		{
+			const AudioDeviceInfoList& devs = i < 2 ? srcDevs : sinkDevs;
+			CONFIGVARIANT var(names[i], "");
+			if (dev_idxs[i] > 0)
+				var.strValue = devs[dev_idxs[i] - 1].strID;
+			if (!SaveSetting(port, APINAME, var))
+				return RESULT_FAILED;
+		}
+
+		CONFIGVARIANT var0(N_BUFFER_LEN, (int32_t)buffer_len);
+		CONFIGVARIANT var1(N_PERIOD_LEN, (int32_t)period_len);
+		if (!SaveSetting(port, APINAME, var0) || !SaveSetting(port, APINAME, var1))
+			return RESULT_FAILED;
+		return RESULT_OK;
+	}
+
+	return RESULT_CANCELED;
+}
+
+/*
+	Transfers go straight between the mmap'd ring of the PCM and the
+	resampler, driven by a thread sleeping in poll() on the PCM descriptors.
+	Guest side data is kept at the guest's rate in mBuffer like the pulse
+	backend does.
+*/
+class AlsaAudioDevice : public AudioDevice
+{
+public:
+	AlsaAudioDevice(int port, int device, AudioDir dir)
+	: mPort(port)
+	, mDevice(device)
+	, mAudioDir(dir)
+	, mPCM(nullptr)
+	, mMmap(true)
+	, mChannels(2)
+	, mRate(48000)
+	, mSamplesPerSec(48000)
+	, mResampler(nullptr)
+	, mResampleRatio(1.0)
+	, mQuit(false)
+	, mPaused(true)
+	, mXruns(0)
+	, mDelayFrames(0)
+	, mDroppedFrames(0)
+	, mSilenceFrames(0)
+	, mCbLastUs(0)
+	, mCbMaxUs(0)
+	, mCbTotalUs(0)
+	, mCbCount(0)
+	{
+		mWakeFd[0] = mWakeFd[1] = -1;
+
+		const char *name = dir == AUDIODIR_SOURCE ?
+			(device ? N_AUDIO_SOURCE1 : N_AUDIO_SOURCE0) : N_AUDIO_SINK0;
+		CONFIGVARIANT var(name, CONFIG_TYPE_CHAR);
+		if (!LoadSetting(mPort, APINAME, var) || var.strValue.empty())
+			throw AudioDeviceError(APINAME ": failed to load device settings");
+		mDeviceName = var.strValue;
+
+		mBufferMs = std::max(2, LoadIntSetting(mPort, N_BUFFER_LEN, 20));
+		mPeriodMs = std::max(1, std::min(mBufferMs / 2, LoadIntSetting(mPort, N_PERIOD_LEN, 5)));
+
+		if (!Init())
+		{
+			Uninit();
+			throw AudioDeviceError(APINAME ": failed to init");
+		}
+
+		int ret = 0;
+		mResampler = src_new(SRC_SINC_FASTEST, mChannels, &ret);
+		if (!mResampler)
+		{
+			Uninit();
+			throw AudioDeviceError(APINAME ": failed to create resampler");
+		}
+		SetResampling(mSamplesPerSec);
+
+		if (pipe(mWakeFd) < 0)
+		{
+			Uninit();
+			mResampler = src_delete(mResampler);
+			throw AudioDeviceError(APINAME ": failed to create wake up pipe");
+		}
+		fcntl(mWakeFd[0], F_SETFL, O_NONBLOCK);
+		fcntl(mWakeFd[1], F_SETFL, O_NONBLOCK);
+
+		mThread = std::thread(&AlsaAudioDevice::PollThread, this);
+	}
+
+	~AlsaAudioDevice()
+	{
+		mQuit = true;
+		Wake();
+		if (mThread.joinable())
+			mThread.join();
+		Uninit();
+		mResampler = src_delete(mResampler);
+		for (int i = 0; i < 2; i++)
+			if (mWakeFd[i] >= 0)
+				close(mWakeFd[i]);
+		OSDebugOut(APINAME ": %s xruns %u\n", mDeviceName.c_str(), mXruns);
+	}
+
+	uint32_t GetBuffer(int16_t *buff, uint32_t frames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		mLastGuestIo = std::chrono::steady_clock::now();
+		uint32_t samples = std::min<size_t>(frames * mChannels, mBuffer.size());
+		if (samples > 0)
+		{
+			memcpy(buff, mBuffer.data(), sizeof(int16_t) * samples);
+			mBuffer.erase(mBuffer.begin(), mBuffer.begin() + samples);
+		}
+		return samples / mChannels;
+	}
+
+	uint32_t SetBuffer(int16_t *buff, uint32_t frames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		mLastGuestIo = std::chrono::steady_clock::now();
+		size_t old_size = mBuffer.size();
+		mBuffer.resize(old_size + frames * mChannels);
+		memcpy(mBuffer.data() + old_size, buff, frames * mChannels * sizeof(int16_t));
+
+		// Don't let latency build up if the device stalls
+		size_t max = mSamplesPerSec * mChannels;
+		if (mBuffer.size() > max)
+		{
+			mDroppedFrames += (mBuffer.size() - max) / mChannels;
+			mBuffer.erase(mBuffer.begin(), mBuffer.end() - max);
+		}
+		return frames;
+	}
+
+	bool GetFrames(uint32_t *size)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		*size = mBuffer.size() / mChannels;
+		return true;
+	}
+
+	void SetResampling(int samplerate)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		mSamplesPerSec = samplerate;
+		if (mAudioDir == AUDIODIR_SOURCE)
+		{
+			mResampleRatio = double(samplerate) / double(mRate);
+			mFixedResampler.reset(resampler::CreateFixedResampler(mRate, samplerate, mChannels));
+		}
+		else
+		{
+			mResampleRatio = double(mRate) / double(samplerate);
+			mFixedResampler.reset(resampler::CreateFixedResampler(samplerate, mRate, mChannels));
+		}
+		src_reset(mResampler);
+		mBuffer.clear();
+		mFloatBuffer.clear();
+	}
+
+	uint32_t GetChannels()
+	{
+		return mChannels;
+	}
+
+	bool GetStats(AudioStats& stats)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		int64_t since = -1;
+		if (mLastGuestIo.time_since_epoch().count())
+			since = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - mLastGuestIo).count();
+
+		stats.guestBufferedMs = mBuffer.size() * 1000.0 / mChannels / mSamplesPerSec;
+		stats.hostBufferedMs = (mFloatBuffer.size() / mChannels + mDelayFrames) * 1000.0 / mRate;
+		stats.resampleRatio = mResampleRatio;
+		stats.droppedFrames = mDroppedFrames;
+		stats.silenceFrames = mSilenceFrames;
+		stats.callbackLastUs = mCbLastUs;
+		stats.callbackMaxUs = mCbMaxUs;
+		stats.callbackAvgUs = mCbCount ? mCbTotalUs / (int64_t)mCbCount : 0;
+		if (mAudioDir == AUDIODIR_SOURCE)
+			stats.sinceGetBufferMs = since;
+		else
+			stats.sinceSetBufferMs = since;
+		return true;
+	}
+
+	void Start()
+	{
+		{
+			std::lock_guard<std::mutex> lk(mMutex);
+			mBuffer.clear();
+			mFloatBuffer.clear();
+			src_reset(mResampler);
+			if (mFixedResampler)
+				mFixedResampler->Reset();
+			mPaused = false;
+		}
+		Wake();
+	}
+
+	void Stop()
+	{
+		mPaused = true;
+		Wake();
+	}
+
+	virtual MicMode GetMicMode(AudioDevice* compare)
+	{
+		if (compare)
+		{
+			AlsaAudioDevice *src = dynamic_cast<AlsaAudioDevice *>(compare);
+			if (src && mDeviceName == src->mDeviceName)
+				return MIC_MODE_SHARED;
+			return MIC_MODE_SEPARATE;
+		}
+
+		CONFIGVARIANT var(mDevice ? N_AUDIO_SOURCE0 : N_AUDIO_SOURCE1, CONFIG_TYPE_CHAR);
+		if (LoadSetting(mPort, APINAME, var) && var.strValue == mDeviceName)
+			return MIC_MODE_SHARED;
+
+		return MIC_MODE_SINGLE;
+	}
+
+	static const TCHAR* Name()
+	{
+		return "ALSA";
+	}
+
+	static int Configure(int port, void *data)
+	{
+		return GtkConfigure(port, data);
+	}
+
+	static void AudioDevices(std::vector<AudioDeviceInfo> &devices, AudioDir dir)
+	{
+		alsa_get_devicelist(devices, dir);
+	}
+
+	static bool AudioInit()
+	{
+		return true;
+	}
+
+	static void AudioDeinit()
+	{
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		return std::vector<CONFIGVARIANT>();
+	}
+
+private:
+	bool Init()
+	{
+		int ret;
+		snd_pcm_stream_t stream = mAudioDir == AUDIODIR_SOURCE ?
+			SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK;
+
+		ret = snd_pcm_open(&mPCM, mDeviceName.c_str(), stream, SND_PCM_NONBLOCK);
+		if (ret < 0)
+		{
+			OSDebugOut(APINAME ": snd_pcm_open %s: %s\n", mDeviceName.c_str(), snd_strerror(ret));
+			return false;
+		}
+
+		snd_pcm_hw_params_t *hw;
+		snd_pcm_hw_params_alloca(&hw);
+		snd_pcm_hw_params_any(mPCM, hw);
+
+		// Not every plugin can mmap, fall back to read/write
+		if (snd_pcm_hw_params_set_access(mPCM, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) < 0)
+		{
+			mMmap = false;
+			if ((ret = snd_pcm_hw_params_set_access(mPCM, hw, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+				return HwError("set_access", ret);
+		}
+
+		if ((ret = snd_pcm_hw_params_set_format(mPCM, hw, SND_PCM_FORMAT_S16_LE)) < 0)
+			return HwError("set_format", ret);
+
+		unsigned int channels = mChannels;
+		if ((ret = snd_pcm_hw_params_set_channels_near(mPCM, hw, &channels)) < 0)
+			return HwError("set_channels", ret);
+		mChannels = channels;
+
+		unsigned int rate = mRate;
+		if ((ret = snd_pcm_hw_params_set_rate_near(mPCM, hw, &rate, nullptr)) < 0)
+			return HwError("set_rate", ret);
+		mRate = rate;
+
+		snd_pcm_uframes_t period = mRate * mPeriodMs / 1000;
+		if ((ret = snd_pcm_hw_params_set_period_size_near(mPCM, hw, &period, nullptr)) < 0)
+			return HwError("set_period_size", ret);
+
+		snd_pcm_uframes_t buffer = std::max<snd_pcm_uframes_t>(mRate * mBufferMs / 1000, period * 2);
+		if ((ret = snd_pcm_hw_params_set_buffer_size_near(mPCM, hw, &buffer)) < 0)
+			return HwError("set_buffer_size", ret);
+
+		if ((ret = snd_pcm_hw_params(mPCM, hw)) < 0)
+			return HwError("hw_params", ret);
+
+		snd_pcm_hw_params_get_period_size(hw, &mPeriodFrames, nullptr);
+		snd_pcm_hw_params_get_buffer_size(hw, &mBufferFrames);
+
+		// Wake up once per period, start playback as soon as one is queued
+		snd_pcm_sw_params_t *sw;
+		snd_pcm_sw_params_alloca(&sw);
+		snd_pcm_sw_params_current(mPCM, sw);
+		snd_pcm_sw_params_set_avail_min(mPCM, sw, mPeriodFrames);
+		snd_pcm_sw_params_set_start_threshold(mPCM, sw, mPeriodFrames);
+		if ((ret = snd_pcm_sw_params(mPCM, sw)) < 0)
+			return HwError("sw_params", ret);
+
+		OSDebugOut(APINAME ": %s %s %u Hz %d ch, period %lu buffer %lu frames\n",
+			mDeviceName.c_str(), mMmap ? "mmap" : "rw", mRate, mChannels,
+			(unsigned long)mPeriodFrames, (unsigned long)mBufferFrames);
+
+		return snd_pcm_prepare(mPCM) >= 0;
+	}
+
+	void Uninit()
+	{
+		if (mPCM)
+		{
+			snd_pcm_drop(mPCM);
+			snd_pcm_close(mPCM);
+			mPCM = nullptr;
+		}
+	}
+
+	bool HwError(const char *what, int ret)
+	{
+		OSDebugOut(APINAME ": %s %s: %s\n", mDeviceName.c_str(), what, snd_strerror(ret));
+		return false;
+	}
+
+	void Wake()
+	{
+		if (mWakeFd[1] >= 0)
+		{
+			char c = 0;
+			ssize_t r = write(mWakeFd[1], &c, 1);
+			(void)r;
+		}
+	}
+
+	bool Recover(int err)
+	{
+		if (err == -EPIPE)
+			mXruns++;
+		err = snd_pcm_recover(mPCM, err, 1);
+		if (err < 0)
+		{
+			OSDebugOut(APINAME ": recover failed: %s\n", snd_strerror(err));
+			return false;
+		}
+		if (mAudioDir == AUDIODIR_SOURCE)
+			snd_pcm_start(mPCM);
+		return true;
+	}
+
+	void PollThread()
+	{
+		int count = snd_pcm_poll_descriptors_count(mPCM);
+		std::vector<struct pollfd> fds(count + 1);
+		fds[0].fd = mWakeFd[0];
+		fds[0].events = POLLIN;
+		snd_pcm_poll_descriptors(mPCM, &fds[1], count);
+
+		bool running = false;
+		while (!mQuit)
+		{
+			if (mPaused != !running)
+			{
+				running = !mPaused;
+				if (running)
+				{
+					snd_pcm_prepare(mPCM);
+					if (mAudioDir == AUDIODIR_SOURCE)
+						snd_pcm_start(mPCM);
+					else
+						Transfer(); // prime with one period
+				}
+				else
+					snd_pcm_drop(mPCM);
+			}
+
+			// Sleep until device wants data or someone calls Start/Stop
+			int ret = poll(fds.data(), running ? fds.size() : 1, -1);
+			if (ret < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+
+			if (fds[0].revents & POLLIN)
+			{
+				char buf[16];
+				while (read(mWakeFd[0], buf, sizeof(buf)) > 0) {}
+			}
+
+			if (!running)
+				continue;
+
+			unsigned short revents = 0;
+			snd_pcm_poll_descriptors_revents(mPCM, &fds[1], count, &revents);
+			if (revents & POLLERR)
+			{
+				if (!Recover(snd_pcm_state(mPCM) == SND_PCM_STATE_XRUN ? -EPIPE : -ESTRPIPE))
+					break;
+			}
+			if (revents & (POLLIN | POLLOUT))
+				Transfer();
+		}
+	}
+
+	// One wake up's worth of work, timed for GetStats
+	void Transfer()
+	{
+		auto start = std::chrono::steady_clock::now();
+		TransferFrames();
+
+		snd_pcm_sframes_t delay = 0;
+		if (snd_pcm_delay(mPCM, &delay) < 0)
+			delay = 0;
+
+		std::lock_guard<std::mutex> lk(mMutex);
+		mDelayFrames = delay;
+		mCbLastUs = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count();
+		mCbMaxUs = std::max(mCbMaxUs, mCbLastUs);
+		mCbTotalUs += mCbLastUs;
+		mCbCount++;
+	}
+
+	// Everything the device has room for or has captured
+	void TransferFrames()
+	{
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(mPCM);
+		if (avail < 0)
+		{
+			Recover(avail);
+			return;
+		}
+
+		while (avail >= (snd_pcm_sframes_t)mPeriodFrames || (avail > 0 && mAudioDir == AUDIODIR_SOURCE))
+		{
+			snd_pcm_uframes_t frames = avail;
+			int ret;
+
+			if (mMmap)
+			{
+				const snd_pcm_channel_area_t *areas;
+				snd_pcm_uframes_t offset;
+				if ((ret = snd_pcm_mmap_begin(mPCM, &areas, &offset, &frames)) < 0)
+				{
+					Recover(ret);
+					return;
+				}
+
+				// Interleaved, so first area covers all channels
+				int16_t *ptr = (int16_t *)((uint8_t *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8);
+				if (mAudioDir == AUDIODIR_SOURCE)
+					Captured(ptr, frames);
+				else
+					Render(ptr, frames);
+
+				snd_pcm_sframes_t committed = snd_pcm_mmap_commit(mPCM, offset, frames);
+				if (committed < 0 || (snd_pcm_uframes_t)committed != frames)
+				{
+					Recover(committed >= 0 ? -EPIPE : committed);
+					return;
+				}
+			}
+			else
+			{
+				mStaging.resize(frames * mChannels);
+				snd_pcm_sframes_t n;
+				if (mAudioDir == AUDIODIR_SOURCE)
+				{
+					n = snd_pcm_readi(mPCM, mStaging.data(), frames);
+					if (n > 0)
+						Captured(mStaging.data(), n);
+				}
+				else
+				{
+					Render(mStaging.data(), frames);
+					n = snd_pcm_writei(mPCM, mStaging.data(), frames);
+				}
+
+				if (n == -EAGAIN)
+					return;
+				if (n < 0)
+				{
+					Recover(n);
+					return;
+				}
+				frames = n;
+			}
+
+			avail -= frames;
+		}
+	}
+
+	// Device rate -> guest rate
+	void Captured(const int16_t *src, snd_pcm_uframes_t frames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		if (mPaused)
+			return;
+
+		mFloatIn.resize(mFloatBuffer.size() + frames * mChannels);
+		std::copy(mFloatBuffer.begin(), mFloatBuffer.end(), mFloatIn.begin());
+		src_short_to_float_array(src, mFloatIn.data() + mFloatBuffer.size(), frames * mChannels);
+
+		size_t outFrames = size_t(mFloatIn.size() / mChannels * mResampleRatio) + 1;
+		mFloatOut.resize(outFrames * mChannels);
+
+		SRC_DATA data;
+		memset(&data, 0, sizeof(SRC_DATA));
+		data.data_in = mFloatIn.data();
+		data.input_frames = mFloatIn.size() / mChannels;
+		data.data_out = mFloatOut.data();
+		data.output_frames = outFrames;
+		data.src_ratio = mResampleRatio;
+		Resample(&data);
+
+		// Unused input goes in front of the next batch
+		mFloatBuffer.assign(mFloatIn.begin() + data.input_frames_used * mChannels, mFloatIn.end());
+
+		size_t old_size = mBuffer.size();
+		mBuffer.resize(old_size + data.output_frames_gen * mChannels);
+		src_float_to_short_array(mFloatOut.data(), mBuffer.data() + old_size, data.output_frames_gen * mChannels);
+
+		// Game isn't reading, keep the most recent second
+		size_t max = mSamplesPerSec * mChannels;
+		if (mBuffer.size() > max)
+		{
+			mDroppedFrames += (mBuffer.size() - max) / mChannels;
+			mBuffer.erase(mBuffer.begin(), mBuffer.end() - max);
+		}
+	}
+
+	// Guest rate -> device rate, silence when the guest falls behind
+	void Render(int16_t *dst, snd_pcm_uframes_t frames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+
+		// Just enough input to fill the device buffer
+		size_t needed = size_t(frames / mResampleRatio) + 1;
+		size_t inSamples = std::min(needed * mChannels, mBuffer.size());
+
+		mFloatIn.resize(inSamples);
+		src_short_to_float_array(mBuffer.data(), mFloatIn.data(), inSamples);
+		mFloatOut.resize(frames * mChannels);
+
+		SRC_DATA data;
+		memset(&data, 0, sizeof(SRC_DATA));
+		data.data_in = mFloatIn.data();
+		data.input_frames = inSamples / mChannels;
+		data.data_out = mFloatOut.data();
+		data.output_frames = frames;
+		data.src_ratio = mResampleRatio;
+		Resample(&data);
+
+		mBuffer.erase(mBuffer.begin(), mBuffer.begin() + data.input_frames_used * mChannels);
+
+		size_t gen = data.output_frames_gen * mChannels;
+		src_float_to_short_array(mFloatOut.data(), dst, gen);
+		memset(dst + gen, 0, (frames * mChannels - gen) * sizeof(int16_t));
+		mSilenceFrames += frames - data.output_frames_gen;
+	}
+
+	int Resample(SRC_DATA *data)
+	{
+		if (mFixedResampler)
+			return mFixedResampler->Process(data);
+		return src_process(mResampler, data);
+	}
+
+	int mPort;
+	int mDevice;
+	AudioDir mAudioDir;
+	std::string mDeviceName;
+	int mBufferMs;
+	int mPeriodMs;
+
+	snd_pcm_t *mPCM;
+	bool mMmap;
+	int mChannels;
+	unsigned int mRate; // device side
+	snd_pcm_uframes_t mPeriodFrames;
+	snd_pcm_uframes_t mBufferFrames;
+	int mSamplesPerSec; // guest side
+
+	SRC_STATE *mResampler;
+	std::unique_ptr<resampler::FixedResampler> mFixedResampler;
+	double mResampleRatio;
+
+	std::mutex mMutex;
+	std::vector<int16_t> mBuffer; // guest rate
+	std::vector<float> mFloatBuffer; // capture input not consumed by resampler yet
+	std::vector<float> mFloatIn;
+	std::vector<float> mFloatOut;
+	std::vector<int16_t> mStaging; // rw access only
+
+	std::thread mThread;
+	int mWakeFd[2];
+	std::atomic<bool> mQuit;
+	std::atomic<bool> mPaused;
+	uint32_t mXruns;
+
+	// Stats, guarded by mMutex
+	snd_pcm_sframes_t mDelayFrames;
+	uint64_t mDroppedFrames;
+	uint64_t mSilenceFrames;
+	int64_t mCbLastUs;
+	int64_t mCbMaxUs;
+	int64_t mCbTotalUs;
+	uint64_t mCbCount;
+	std::chrono::steady_clock::time_point mLastGuestIo;
+};
+
+REGISTER_AUDIODEV(APINAME, AlsaAudioDevice);
+};
+#undef APINAME
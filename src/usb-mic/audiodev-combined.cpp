@@ -0,0 +1,155 @@
+#include "audiodev-combined.h"
+#include "../osdebugout.h"
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+
+// How often both sources get polled
+#define COMBINED_POLL_MS 2
+// Sources this far apart get realigned by dropping from the one ahead
+#define COMBINED_MAX_DRIFT_MS 20
+// Game stopped reading, keep only the most recent data
+#define COMBINED_MAX_BUFFER_MS 500
+
+CombinedAudioDevice::CombinedAudioDevice(AudioDevice *src0, AudioDevice *src1)
+: mQuit(false)
+, mSamplesPerSec(48000)
+{
+	mSources[0] = src0;
+	mSources[1] = src1;
+	mDropped[0] = mDropped[1] = 0;
+}
+
+CombinedAudioDevice::~CombinedAudioDevice()
+{
+	Stop();
+}
+
+void CombinedAudioDevice::Start()
+{
+	for (int i = 0; i < 2; i++)
+		mSources[i]->Start();
+
+	if (!mThread.joinable())
+	{
+		mQuit = false;
+		mThread = std::thread(&CombinedAudioDevice::CaptureThread, this);
+	}
+}
+
+void CombinedAudioDevice::Stop()
+{
+	if (mThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lk(mThreadMutex);
+			mQuit = true;
+		}
+		mCond.notify_all();
+		mThread.join();
+	}
+
+	for (int i = 0; i < 2; i++)
+		mSources[i]->Stop();
+
+	OSDebugOut(TEXT("combined: dropped %u / %u frames to realign\n"), mDropped[0], mDropped[1]);
+}
+
+void CombinedAudioDevice::SetResampling(int samplerate)
+{
+	{
+		std::lock_guard<std::mutex> lk(mThreadMutex);
+		mSamplesPerSec = samplerate;
+		for (int i = 0; i < 2; i++)
+		{
+			mSources[i]->SetResampling(samplerate);
+			mPending[i].clear();
+		}
+	}
+
+	std::lock_guard<std::mutex> lk(mMutex);
+	mBuffer.clear();
+}
+
+bool CombinedAudioDevice::GetFrames(uint32_t *size)
+{
+	std::lock_guard<std::mutex> lk(mMutex);
+	*size = mBuffer.size() / 2;
+	return true;
+}
+
+uint32_t CombinedAudioDevice::GetBuffer(int16_t *buff, uint32_t frames)
+{
+	std::lock_guard<std::mutex> lk(mMutex);
+	uint32_t samples = std::min<size_t>(frames * 2, mBuffer.size());
+	if (samples > 0)
+	{
+		memcpy(buff, mBuffer.data(), samples * sizeof(int16_t));
+		mBuffer.erase(mBuffer.begin(), mBuffer.begin() + samples);
+	}
+	return samples / 2;
+}
+
+void CombinedAudioDevice::CaptureThread()
+{
+	std::unique_lock<std::mutex> lk(mThreadMutex);
+	while (!mQuit)
+	{
+		Capture();
+		mCond.wait_for(lk, std::chrono::milliseconds(COMBINED_POLL_MS));
+	}
+}
+
+// Called with mThreadMutex held
+void CombinedAudioDevice::Capture()
+{
+	for (int i = 0; i < 2; i++)
+	{
+		uint32_t frames = 0;
+		if (!mSources[i]->GetFrames(&frames) || !frames)
+			continue;
+
+		uint32_t chn = mSources[i]->GetChannels();
+		mScratch.resize(frames * chn);
+		frames = mSources[i]->GetBuffer(mScratch.data(), frames);
+
+		std::vector<int16_t>& pending = mPending[i];
+		size_t old_size = pending.size();
+		pending.resize(old_size + frames);
+		for (uint32_t k = 0; k < frames; k++)
+			pending[old_size + k] = mScratch[k * chn];
+	}
+
+	// Sources run off separate clocks, drop from whichever got ahead
+	size_t maxDrift = mSamplesPerSec * COMBINED_MAX_DRIFT_MS / 1000;
+	int lead = mPending[0].size() > mPending[1].size() ? 0 : 1;
+	size_t drift = mPending[lead].size() - mPending[!lead].size();
+	if (drift > maxDrift)
+	{
+		mPending[lead].erase(mPending[lead].begin(), mPending[lead].begin() + drift);
+		mDropped[lead] += drift;
+	}
+
+	size_t frames = std::min(mPending[0].size(), mPending[1].size());
+	if (!frames)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		size_t old_size = mBuffer.size();
+		mBuffer.resize(old_size + frames * 2);
+		int16_t *dst = mBuffer.data() + old_size;
+		for (size_t k = 0; k < frames; k++)
+		{
+			dst[k * 2] = mPending[0][k];
+			dst[k * 2 + 1] = mPending[1][k];
+		}
+
+		size_t maxSamples = 2 * mSamplesPerSec * COMBINED_MAX_BUFFER_MS / 1000;
+		if (mBuffer.size() > maxSamples)
+			mBuffer.erase(mBuffer.begin(), mBuffer.end() - maxSamples);
+	}
+
+	for (int i = 0; i < 2; i++)
+		mPending[i].erase(mPending[i].begin(), mPending[i].begin() + frames);
+}
@@ -0,0 +1,54 @@
+#ifndef AUDIODEV_COMBINED_H
+#define AUDIODEV_COMBINED_H
+
+#include "audiodev.h"
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*
+	Pulls two mono/stereo sources from one thread and keeps them frame aligned
+	in an interleaved stereo buffer: first channel of source 0 goes left,
+	first channel of source 1 right. The sources are not owned.
+*/
+class CombinedAudioDevice : public AudioDevice
+{
+public:
+	CombinedAudioDevice(AudioDevice *src0, AudioDevice *src1);
+	~CombinedAudioDevice();
+
+	uint32_t GetBuffer(int16_t *buff, uint32_t frames);
+	uint32_t SetBuffer(int16_t *buff, uint32_t frames) { return 0; }
+	bool GetFrames(uint32_t *size);
+	void SetResampling(int samplerate);
+	uint32_t GetChannels() { return 2; }
+
+	void Start();
+	void Stop();
+
+	MicMode GetMicMode(AudioDevice* compare) { return MIC_MODE_SEPARATE; }
+
+private:
+	void CaptureThread();
+	void Capture();
+
+	AudioDevice *mSources[2];
+	// Mono samples read from each source but not yet paired up
+	std::vector<int16_t> mPending[2];
+	std::vector<int16_t> mScratch;
+
+	std::vector<int16_t> mBuffer; // interleaved stereo
+	std::mutex mMutex;
+
+	std::thread mThread;
+	std::mutex mThreadMutex;
+	std::condition_variable mCond;
+	bool mQuit;
+
+	int mSamplesPerSec;
+	uint32_t mDropped[2];
+};
+
+#endif
@@ -0,0 +1,429 @@
+#include "audiodeviceproxy.h"
+#include "resampler.h"
+#include "../libsamplerate/samplerate.h"
+#include "../USB.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <chrono>
+
+#define APINAME "file"
+#define APINAMEW TEXT(APINAME)
+
+// Sources are paths in audio_src_0/1, sink path in audio_sink_0
+#define S_FILE_LOOP		TEXT("Loop source files")
+#define N_FILE_LOOP		TEXT("loop")
+#define S_FILE_REALTIME	TEXT("Pace sources in real time")
+#define N_FILE_REALTIME	TEXT("realtime")
+#define S_FILE_RAW_RATE	TEXT("Raw file sample rate")
+#define N_FILE_RAW_RATE	TEXT("raw_rate")
+#define S_FILE_RAW_CHNS	TEXT("Raw file channels")
+#define N_FILE_RAW_CHNS	TEXT("raw_channels")
+
+// Plenty to keep fwrite out of the way of the USB thread
+#define FILE_WRITE_BUFFER (1 << 20)
+
+namespace audiodev_file {
+
+typedef std::chrono::steady_clock hrc;
+
+#pragma pack(push, 1)
+struct WavHeader
+{
+	char riff[4];
+	uint32_t riffSize;
+	char wave[4];
+	char fmt[4];
+	uint32_t fmtSize;
+	uint16_t format;
+	uint16_t channels;
+	uint32_t samplerate;
+	uint32_t byterate;
+	uint16_t blockalign;
+	uint16_t bits;
+	char data[4];
+	uint32_t dataSize;
+};
+#pragma pack(pop)
+
+static int LoadIntSetting(int port, const TCHAR *name, int def)
+{
+	CONFIGVARIANT var(name, CONFIG_TYPE_INT);
+	if (LoadSetting(port, APINAME, var))
+		return var.intValue;
+	return def;
+}
+
+/*
+	Reads 16-bit PCM WAV into memory. Anything without a RIFF header is taken
+	as raw s16le with rate and channel count from config.
+*/
+static bool LoadPCM(FILE *f, std::vector<int16_t>& samples, uint32_t& rate, uint32_t& channels)
+{
+	char id[4];
+	uint32_t size;
+
+	if (fread(id, 1, 4, f) == 4 && !memcmp(id, "RIFF", 4))
+	{
+		char wave[4];
+		if (fread(&size, 4, 1, f) != 1 || fread(wave, 1, 4, f) != 4 || memcmp(wave, "WAVE", 4))
+			return false;
+
+		bool gotFmt = false;
+		while (fread(id, 1, 4, f) == 4 && fread(&size, 4, 1, f) == 1)
+		{
+			if (!memcmp(id, "fmt ", 4) && size >= 16)
+			{
+				uint16_t fmt[8];
+				if (fread(fmt, 1, 16, f) != 16)
+					return false;
+				// PCM, 16 bits
+				if (fmt[0] != 1 || fmt[7] != 16)
+					return false;
+				channels = fmt[1];
+				rate = fmt[2] | (fmt[3] << 16);
+				gotFmt = true;
+				fseek(f, size - 16 + (size & 1), SEEK_CUR);
+			}
+			else if (!memcmp(id, "data", 4) && gotFmt)
+			{
+				samples.resize(size / sizeof(int16_t));
+				samples.resize(fread(samples.data(), sizeof(int16_t), samples.size(), f));
+				return true;
+			}
+			else
+				fseek(f, size + (size & 1), SEEK_CUR);
+		}
+		return false;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len <= 0)
+		return false;
+	samples.resize(len / sizeof(int16_t));
+	samples.resize(fread(samples.data(), sizeof(int16_t), samples.size(), f));
+	return true;
+}
+
+class FileAudioDevice : public AudioDevice
+{
+public:
+	FileAudioDevice(int port, int mic, AudioDir dir)
+	: mPort(port)
+	, mDevice(mic)
+	, mAudioDir(dir)
+	, mLoop(true)
+	, mRealtime(false)
+	, mFile(nullptr)
+	, mFileRate(48000)
+	, mFileChannels(dir == AUDIODIR_SOURCE ? 1 : 2)
+	, mSamplesPerSec(48000)
+	, mPos(0)
+	, mFramesOut(0)
+	, mDataBytes(0)
+	, mEmuStartUs(0)
+	{
+		const TCHAR *name = dir == AUDIODIR_SOURCE ?
+			(mic ? N_AUDIO_SOURCE1 : N_AUDIO_SOURCE0) : N_AUDIO_SINK0;
+		CONFIGVARIANT var(name, CONFIG_TYPE_TCHAR);
+		if (!LoadSetting(mPort, APINAME, var) || var.tstrValue.empty())
+		{
+			// Sink without a file just discards, source has nothing to play
+			if (dir == AUDIODIR_SOURCE)
+				throw AudioDeviceError("FileAudioDevice:: no file set");
+			return;
+		}
+
+		mLoop = LoadIntSetting(mPort, N_FILE_LOOP, 1) != 0;
+		mRealtime = LoadIntSetting(mPort, N_FILE_REALTIME, 0) != 0;
+
+		if (dir == AUDIODIR_SOURCE)
+		{
+			FILE *f = wfopen(var.tstrValue.c_str(), TEXT("rb"));
+			if (!f)
+				throw AudioDeviceError("FileAudioDevice:: failed to open source file");
+
+			mFileRate = LoadIntSetting(mPort, N_FILE_RAW_RATE, 48000);
+			mFileChannels = LoadIntSetting(mPort, N_FILE_RAW_CHNS, 1);
+			bool ok = LoadPCM(f, mFileData, mFileRate, mFileChannels);
+			fclose(f);
+
+			if (!ok || !mFileRate || !mFileChannels || mFileData.size() < mFileChannels)
+				throw AudioDeviceError("FileAudioDevice:: unsupported source file");
+			mFileData.resize(mFileData.size() - mFileData.size() % mFileChannels);
+
+			OSDebugOut(TEXT("file: %u frames, %u Hz, %u channels\n"),
+				uint32_t(mFileData.size() / mFileChannels), mFileRate, mFileChannels);
+			SetResampling(mSamplesPerSec);
+		}
+		else
+		{
+			mFile = wfopen(var.tstrValue.c_str(), TEXT("wb"));
+			if (!mFile)
+				throw AudioDeviceError("FileAudioDevice:: failed to open sink file");
+			mWriteBuffer.resize(FILE_WRITE_BUFFER);
+			setvbuf(mFile, mWriteBuffer.data(), _IOFBF, mWriteBuffer.size());
+
+			// Sizes get filled in on close
+			WavHeader hdr = {};
+			fwrite(&hdr, sizeof(hdr), 1, mFile);
+		}
+	}
+
+	~FileAudioDevice()
+	{
+		if (!mFile)
+			return;
+
+		WavHeader hdr;
+		memcpy(hdr.riff, "RIFF", 4);
+		hdr.riffSize = sizeof(hdr) - 8 + mDataBytes;
+		memcpy(hdr.wave, "WAVE", 4);
+		memcpy(hdr.fmt, "fmt ", 4);
+		hdr.fmtSize = 16;
+		hdr.format = 1;
+		hdr.channels = mFileChannels;
+		hdr.samplerate = mSamplesPerSec;
+		hdr.bits = 16;
+		hdr.blockalign = hdr.channels * sizeof(int16_t);
+		hdr.byterate = hdr.samplerate * hdr.blockalign;
+		memcpy(hdr.data, "data", 4);
+		hdr.dataSize = mDataBytes;
+
+		fseek(mFile, 0, SEEK_SET);
+		fwrite(&hdr, sizeof(hdr), 1, mFile);
+		fclose(mFile);
+	}
+
+	void Start()
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		mStart = hrc::now();
+		mEmuStartUs = GetEmulatedTimeUs();
+		mFramesOut = 0;
+	}
+
+	void Stop()
+	{
+		if (mFile)
+			fflush(mFile);
+	}
+
+	/*
+		Whatever is due since Start() and not read yet. Realtime goes by the
+		wall clock, otherwise by emulated USB time so runs don't depend on
+		host speed. Only GetBuffer moves the position, polling is free.
+	*/
+	virtual bool GetFrames(uint32_t *size)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		if (mAudioDir != AUDIODIR_SOURCE)
+		{
+			*size = 0;
+			return true;
+		}
+
+		int64_t us = mRealtime ?
+			std::chrono::duration_cast<std::chrono::microseconds>(hrc::now() - mStart).count() :
+			GetEmulatedTimeUs() - mEmuStartUs;
+		uint64_t due = uint64_t(std::max<int64_t>(us, 0)) * mSamplesPerSec / 1000000;
+		*size = due > mFramesOut ? uint32_t(due - mFramesOut) : 0;
+		return true;
+	}
+
+	virtual uint32_t GetBuffer(int16_t *outBuf, uint32_t outFrames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		const uint32_t chns = mFileChannels;
+		const size_t total = mData.size() / chns;
+
+		for (uint32_t i = 0; i < outFrames; )
+		{
+			if (mPos >= total)
+			{
+				if (!mLoop || !total)
+				{
+					// Past the end, pad with silence
+					memset(outBuf + i * chns, 0, (outFrames - i) * chns * sizeof(int16_t));
+					break;
+				}
+				mPos = 0;
+			}
+
+			size_t n = std::min<size_t>(outFrames - i, total - mPos);
+			memcpy(outBuf + i * chns, mData.data() + mPos * chns, n * chns * sizeof(int16_t));
+			mPos += n;
+			i += n;
+		}
+
+		mFramesOut += outFrames;
+		return outFrames;
+	}
+
+	virtual uint32_t SetBuffer(int16_t *inBuf, uint32_t inFrames)
+	{
+		if (!mFile)
+			return inFrames;
+
+		std::lock_guard<std::mutex> lk(mMutex);
+		size_t written = fwrite(inBuf, sizeof(int16_t) * mFileChannels, inFrames, mFile);
+		mDataBytes += written * sizeof(int16_t) * mFileChannels;
+		return inFrames;
+	}
+
+	/*
+		Source is converted once for the whole file: fixed ratio resampler
+		when the rate pair has one, libsamplerate otherwise. Sink keeps the
+		guest's rate, whatever the guest sends is written as-is.
+	*/
+	virtual void SetResampling(int samplerate)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		if (mAudioDir == AUDIODIR_SOURCE)
+		{
+			if (samplerate == mSamplesPerSec && !mData.empty())
+				return;
+			mSamplesPerSec = samplerate;
+			Convert();
+			mPos = 0;
+		}
+		else
+		{
+			if (mDataBytes && samplerate != mSamplesPerSec)
+				OSDebugOut(TEXT("file: sink rate changed mid stream %d -> %d\n"), mSamplesPerSec, samplerate);
+			mSamplesPerSec = samplerate;
+		}
+	}
+
+	virtual uint32_t GetChannels()
+	{
+		return mFileChannels;
+	}
+
+	virtual MicMode GetMicMode(AudioDevice* compare)
+	{
+		CONFIGVARIANT var0(N_AUDIO_SOURCE0, CONFIG_TYPE_TCHAR);
+		CONFIGVARIANT var1(N_AUDIO_SOURCE1, CONFIG_TYPE_TCHAR);
+		if (LoadSetting(mPort, APINAME, var0) && LoadSetting(mPort, APINAME, var1)
+			&& !var0.tstrValue.empty() && var0.tstrValue == var1.tstrValue)
+			return MIC_MODE_SHARED;
+		return MIC_MODE_SEPARATE;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("File");
+	}
+
+	static bool AudioInit()
+	{
+		return true;
+	}
+
+	static void AudioDeinit()
+	{
+	}
+
+	static void AudioDevices(std::vector<AudioDeviceInfo> &devices, AudioDir )
+	{
+		AudioDeviceInfo info;
+		info.strID = TEXT("file");
+		info.strName = TEXT("WAV/raw file");
+		devices.push_back(info);
+	}
+
+	static int Configure(int port, void *data)
+	{
+		// Paths are only set through the ini for now
+		return RESULT_OK;
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_AUDIO_SOURCE0, N_AUDIO_SOURCE0, CONFIG_TYPE_TCHAR));
+		params.push_back(CONFIGVARIANT(S_AUDIO_SOURCE1, N_AUDIO_SOURCE1, CONFIG_TYPE_TCHAR));
+		params.push_back(CONFIGVARIANT(S_AUDIO_SINK0, N_AUDIO_SINK0, CONFIG_TYPE_TCHAR));
+		params.push_back(CONFIGVARIANT(S_FILE_LOOP, N_FILE_LOOP, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_FILE_REALTIME, N_FILE_REALTIME, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_FILE_RAW_RATE, N_FILE_RAW_RATE, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_FILE_RAW_CHNS, N_FILE_RAW_CHNS, CONFIG_TYPE_INT));
+		return params;
+	}
+
+private:
+	void Convert()
+	{
+		const uint32_t chns = mFileChannels;
+		if (mSamplesPerSec == (int)mFileRate)
+		{
+			mData = mFileData;
+			return;
+		}
+
+		long inFrames = mFileData.size() / chns;
+		double ratio = double(mSamplesPerSec) / mFileRate;
+		std::vector<float> in(mFileData.size());
+		// Extra room for the fixed resampler's rounding and filter tail
+		std::vector<float> out((size_t(inFrames * ratio) + 64) * chns);
+		src_short_to_float_array(mFileData.data(), in.data(), in.size());
+
+		SRC_DATA data;
+		memset(&data, 0, sizeof(SRC_DATA));
+		data.data_in = in.data();
+		data.input_frames = inFrames;
+		data.data_out = out.data();
+		data.output_frames = out.size() / chns;
+		data.src_ratio = ratio;
+		data.end_of_input = 1;
+
+		std::unique_ptr<resampler::FixedResampler> fixed(
+			resampler::CreateFixedResampler(mFileRate, mSamplesPerSec, chns));
+		int ret = 0;
+		if (fixed)
+			ret = fixed->Process(&data);
+		else
+			ret = src_simple(&data, SRC_SINC_FASTEST, chns);
+
+		if (ret)
+		{
+			OSDebugOut(TEXT("file: resampling failed: %") TEXT(SFMTs) TEXT("\n"), src_strerror(ret));
+			data.output_frames_gen = 0;
+		}
+
+		mData.resize(data.output_frames_gen * chns);
+		src_float_to_short_array(out.data(), mData.data(), mData.size());
+		OSDebugOut(TEXT("file: resampled %u Hz -> %d Hz with %") TEXT(SFMTs) TEXT("\n"),
+			mFileRate, mSamplesPerSec, fixed ? "fixed ratio filter" : "libsamplerate");
+	}
+
+	int mPort;
+	int mDevice;
+	AudioDir mAudioDir;
+	bool mLoop;
+	bool mRealtime;
+	std::mutex mMutex;
+
+	FILE *mFile;
+	std::vector<char> mWriteBuffer;
+
+	std::vector<int16_t> mFileData; // as read from file
+	std::vector<int16_t> mData; // at mSamplesPerSec
+	uint32_t mFileRate;
+	uint32_t mFileChannels;
+	int mSamplesPerSec;
+
+	size_t mPos;
+	uint64_t mFramesOut;
+	uint32_t mDataBytes;
+	hrc::time_point mStart;
+	int64_t mEmuStartUs;
+};
+
+REGISTER_AUDIODEV(APINAME, FileAudioDevice);
+};
+#undef APINAME
+#undef APINAMEW
@@ -0,0 +1,454 @@
+#include "audiodeviceproxy.h"
+#include "../USB.h"
+#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <chrono>
+
+#define APINAME "generator"
+#define APINAMEW TEXT(APINAME)
+
+#define S_GEN_SIGNAL	TEXT("Signal (0 sine, 1 chirp, 2 impulse train)")
+#define N_GEN_SIGNAL	TEXT("signal")
+#define S_GEN_FREQ		TEXT("Sine frequency (Hz)")
+#define N_GEN_FREQ		TEXT("frequency")
+#define S_GEN_MARKER	TEXT("Marker period (ms)")
+#define N_GEN_MARKER	TEXT("marker_ms")
+#define S_GEN_REALTIME	TEXT("Pace source in real time")
+#define N_GEN_REALTIME	TEXT("realtime")
+
+/*
+	Every marker_ms the test signal is replaced by a marker:
+	1ms silence, 2ms preamble, 1ms silence, 16 bits of 1ms each
+	(tone on/off, MSB first) carrying a sequence number, 1ms silence.
+	Test signal stays at -12dBFS so only markers cross the detector
+	threshold.
+*/
+#define MARKER_MS		21
+#define MARKER_BITS		16
+#define MARKER_TONE		3000
+#define MARKER_AMP		0.8
+#define SIGNAL_AMP		0.25
+#define DETECT_THRESHOLD 0.4
+
+namespace audiodev_generator {
+
+enum GenSignal {
+	GEN_SINE,
+	GEN_CHIRP,
+	GEN_IMPULSE
+};
+
+typedef std::chrono::steady_clock hrc;
+
+static const double pi = 3.14159265358979323846;
+
+/*
+	Source stamps when each marker's preamble left GetBuffer, sink matches
+	it up when it comes back through SetBuffer. Shared between the two by
+	port, and cleared when a new source is made so runs don't mix.
+*/
+struct LatencyProbe
+{
+	std::mutex mutex;
+	std::map<uint16_t, hrc::time_point> sent;
+	uint32_t markersSent;
+	uint32_t markersReceived;
+	uint32_t markersLost;
+	double latencyMin, latencyMax, latencySum; // ms
+	int64_t framesLost; // negative if frames got duplicated
+
+	LatencyProbe()
+	: markersSent(0), markersReceived(0), markersLost(0)
+	, latencyMin(1e9), latencyMax(0), latencySum(0), framesLost(0) {}
+
+	void Reset()
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		sent.clear();
+		markersSent = markersReceived = markersLost = 0;
+		latencyMin = 1e9;
+		latencyMax = latencySum = 0;
+		framesLost = 0;
+	}
+
+	static LatencyProbe& Get(int port)
+	{
+		static std::mutex lock;
+		static std::map<int, LatencyProbe> probes;
+		std::lock_guard<std::mutex> lk(lock);
+		return probes[port];
+	}
+
+	void Sent(uint16_t seq, hrc::time_point when)
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		sent[seq] = when;
+		markersSent++;
+		// Loopback isn't connected, don't grow forever
+		if (sent.size() > 1024)
+			sent.erase(sent.begin());
+	}
+
+	void Received(uint16_t seq, hrc::time_point when)
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		auto it = sent.find(seq);
+		if (it == sent.end())
+			return;
+
+		double ms = std::chrono::duration_cast<std::chrono::microseconds>(when - it->second).count() / 1000.0;
+		sent.erase(it);
+		markersReceived++;
+		latencySum += ms;
+		if (ms < latencyMin) latencyMin = ms;
+		if (ms > latencyMax) latencyMax = ms;
+	}
+
+	void Report(int port)
+	{
+		std::lock_guard<std::mutex> lk(mutex);
+		if (!markersReceived)
+		{
+			fprintf(stderr, "generator port %d: %u markers sent, none received\n", port, markersSent);
+			return;
+		}
+		fprintf(stderr, "generator port %d: markers sent %u received %u lost %u, "
+			"latency min %.2f avg %.2f max %.2f ms, frames lost %lld\n",
+			port, markersSent, markersReceived, markersLost,
+			latencyMin, latencySum / markersReceived, latencyMax, (long long)framesLost);
+	}
+};
+
+static int LoadIntSetting(int port, const TCHAR *name, int def)
+{
+	CONFIGVARIANT var(name, CONFIG_TYPE_INT);
+	if (LoadSetting(port, APINAME, var))
+		return var.intValue;
+	return def;
+}
+
+class GeneratorAudioDevice : public AudioDevice
+{
+public:
+	GeneratorAudioDevice(int port, int mic, AudioDir dir)
+	: mPort(port)
+	, mDevice(mic)
+	, mAudioDir(dir)
+	, mSamplesPerSec(48000)
+	, mPhase(0)
+	, mChirpPhase(0)
+	, mPos(0)
+	, mSweepPos(0)
+	, mSeq(0)
+	, mFramesOut(0)
+	, mEmuStartUs(0)
+	, mProbe(LatencyProbe::Get(port))
+	, mWindowPos(0)
+	, mDetectState(DETECT_IDLE)
+	, mQuiet(0)
+	, mTotalFrames(0)
+	, mEdge(0)
+	, mLastMarkerFrame(-1)
+	, mLastSeq(0)
+	{
+		mSignal = (GenSignal)LoadIntSetting(port, N_GEN_SIGNAL, GEN_SINE);
+		mFrequency = LoadIntSetting(port, N_GEN_FREQ, 440);
+		mMarkerMs = LoadIntSetting(port, N_GEN_MARKER, 250);
+		mRealtime = LoadIntSetting(port, N_GEN_REALTIME, 0) != 0;
+		if (mMarkerMs < MARKER_MS * 2)
+			mMarkerMs = MARKER_MS * 2;
+		if (dir == AUDIODIR_SOURCE && mic == 0)
+			mProbe.Reset();
+		SetResampling(mSamplesPerSec);
+	}
+
+	~GeneratorAudioDevice()
+	{
+		if (mAudioDir == AUDIODIR_SINK)
+			mProbe.Report(mPort);
+	}
+
+	void Start()
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		mStart = hrc::now();
+		mEmuStartUs = GetEmulatedTimeUs();
+		mFramesOut = 0;
+	}
+
+	// Same pacing as the file backend
+	virtual bool GetFrames(uint32_t *size)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		if (mAudioDir != AUDIODIR_SOURCE)
+		{
+			*size = 0;
+			return true;
+		}
+
+		int64_t us = mRealtime ?
+			std::chrono::duration_cast<std::chrono::microseconds>(hrc::now() - mStart).count() :
+			GetEmulatedTimeUs() - mEmuStartUs;
+		uint64_t due = uint64_t(std::max<int64_t>(us, 0)) * mSamplesPerSec / 1000000;
+		*size = due > mFramesOut ? uint32_t(due - mFramesOut) : 0;
+		return true;
+	}
+
+	virtual uint32_t GetBuffer(int16_t *outBuf, uint32_t outFrames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		auto now = hrc::now();
+		for (uint32_t i = 0; i < outFrames; i++)
+		{
+			// Sink times from the preamble's edge, 1ms into the marker.
+			// Singstar's second mic would stamp the same numbers
+			if (mPos == Ms(1) && mDevice == 0)
+				mProbe.Sent(mSeq, now);
+			outBuf[i] = int16_t(Generate() * 32767);
+			if (++mPos >= mPeriod)
+			{
+				mPos = 0;
+				mSeq++;
+			}
+			if (++mSweepPos >= mSamplesPerSec)
+				mSweepPos = 0;
+		}
+		mFramesOut += outFrames;
+		return outFrames;
+	}
+
+	virtual uint32_t SetBuffer(int16_t *inBuf, uint32_t inFrames)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		auto now = hrc::now();
+		for (uint32_t i = 0; i < inFrames; i++)
+			Detect(inBuf[i * 2] / 32768.0, now);
+		return inFrames;
+	}
+
+	virtual void SetResampling(int samplerate)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		mSamplesPerSec = samplerate;
+		mPeriod = int64_t(mMarkerMs) * samplerate / 1000;
+		mPos = 0;
+		mSweepPos = 0;
+		// Peak over one marker tone period
+		mWindow.assign((samplerate + MARKER_TONE - 1) / MARKER_TONE, 0.0);
+		mWindowPos = 0;
+		mDetectState = DETECT_IDLE;
+		mLastMarkerFrame = -1;
+	}
+
+	virtual uint32_t GetChannels()
+	{
+		return mAudioDir == AUDIODIR_SOURCE ? 1 : 2;
+	}
+
+	virtual MicMode GetMicMode(AudioDevice* compare)
+	{
+		return MIC_MODE_SEPARATE;
+	}
+
+	static const TCHAR* Name()
+	{
+		return TEXT("Signal generator");
+	}
+
+	static bool AudioInit()
+	{
+		return true;
+	}
+
+	static void AudioDeinit()
+	{
+	}
+
+	static void AudioDevices(std::vector<AudioDeviceInfo> &devices, AudioDir )
+	{
+		AudioDeviceInfo info;
+		info.strID = TEXT("generator");
+		info.strName = TEXT("Signal generator");
+		devices.push_back(info);
+	}
+
+	static int Configure(int port, void *data)
+	{
+		return RESULT_OK;
+	}
+
+	static std::vector<CONFIGVARIANT> GetSettings()
+	{
+		std::vector<CONFIGVARIANT> params;
+		params.push_back(CONFIGVARIANT(S_GEN_SIGNAL, N_GEN_SIGNAL, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_GEN_FREQ, N_GEN_FREQ, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_GEN_MARKER, N_GEN_MARKER, CONFIG_TYPE_INT));
+		params.push_back(CONFIGVARIANT(S_GEN_REALTIME, N_GEN_REALTIME, CONFIG_TYPE_INT));
+		return params;
+	}
+
+private:
+	int64_t Ms(int ms) const
+	{
+		return int64_t(ms) * mSamplesPerSec / 1000;
+	}
+
+	double Generate()
+	{
+		double t = double(mPos) / mSamplesPerSec;
+		if (mPos < Ms(MARKER_MS))
+		{
+			bool on = false;
+			if (mPos >= Ms(1) && mPos < Ms(3))
+				on = true;
+			else if (mPos >= Ms(4) && mPos < Ms(4 + MARKER_BITS))
+			{
+				int bit = int((mPos - Ms(4)) * 1000 / mSamplesPerSec);
+				on = (mSeq >> (MARKER_BITS - 1 - bit)) & 1;
+			}
+			return on ? MARKER_AMP * sin(2 * pi * MARKER_TONE * t) : 0.0;
+		}
+
+		switch (mSignal)
+		{
+		case GEN_CHIRP:
+		{
+			// 100Hz up to 0.45 * rate, once a second. Markers cut into the
+			// sweep but don't restart it
+			double pos = double(mSweepPos) / mSamplesPerSec;
+			double freq = 100.0 + (0.45 * mSamplesPerSec - 100.0) * pos;
+			mChirpPhase = fmod(mChirpPhase + 2 * pi * freq / mSamplesPerSec, 2 * pi);
+			return SIGNAL_AMP * sin(mChirpPhase);
+		}
+		case GEN_IMPULSE:
+			// One every 10ms
+			return (mPos % Ms(10)) == 0 ? SIGNAL_AMP : 0.0;
+		case GEN_SINE:
+		default:
+			mPhase = fmod(mPhase + 2 * pi * mFrequency / mSamplesPerSec, 2 * pi);
+			return SIGNAL_AMP * sin(mPhase);
+		}
+	}
+
+	enum DetectState {
+		DETECT_IDLE,
+		DETECT_PREAMBLE,
+		DETECT_BITS
+	};
+
+	// Marker timing is measured from the preamble's rising edge
+	void Detect(double x, hrc::time_point now)
+	{
+		mWindow[mWindowPos] = fabs(x);
+		mWindowPos = (mWindowPos + 1) % mWindow.size();
+		double envelope = *std::max_element(mWindow.begin(), mWindow.end());
+		bool high = envelope >= DETECT_THRESHOLD;
+		int64_t pos = mTotalFrames++ - mEdge;
+
+		switch (mDetectState)
+		{
+		case DETECT_IDLE:
+			if (!high)
+				mQuiet++;
+			else
+			{
+				if (mQuiet >= Ms(1) / 2)
+				{
+					mDetectState = DETECT_PREAMBLE;
+					mEdge = mTotalFrames - 1;
+					mEdgeTime = now;
+				}
+				mQuiet = 0;
+			}
+			break;
+		case DETECT_PREAMBLE:
+			if (!high)
+			{
+				// Expect 2ms plus up to a tone period of hold
+				if (pos >= Ms(3) / 2 && pos <= Ms(3))
+				{
+					mDetectState = DETECT_BITS;
+					mBits = 0;
+					mBit = 0;
+				}
+				else
+					mDetectState = DETECT_IDLE;
+				mQuiet = 1;
+			}
+			break;
+		case DETECT_BITS:
+			// Sample middle of each bit
+			if (pos == (Ms(2 * (3 + mBit)) + Ms(1)) / 2)
+			{
+				mBits = (mBits << 1) | (high ? 1 : 0);
+				if (++mBit == MARKER_BITS)
+				{
+					Marker(uint16_t(mBits));
+					mDetectState = DETECT_IDLE;
+					mQuiet = 0;
+				}
+			}
+			break;
+		}
+	}
+
+	void Marker(uint16_t seq)
+	{
+		mProbe.Received(seq, mEdgeTime);
+
+		if (mLastMarkerFrame >= 0)
+		{
+			uint16_t diff = seq - mLastSeq;
+			int64_t expected = int64_t(diff) * mMarkerMs * mSamplesPerSec / 1000;
+			std::lock_guard<std::mutex> lk(mProbe.mutex);
+			if (diff > 1)
+				mProbe.markersLost += diff - 1;
+			mProbe.framesLost += expected - (mEdge - mLastMarkerFrame);
+		}
+		mLastMarkerFrame = mEdge;
+		mLastSeq = seq;
+	}
+
+	int mPort;
+	int mDevice;
+	AudioDir mAudioDir;
+	std::mutex mMutex;
+	int mSamplesPerSec;
+
+	// Source
+	GenSignal mSignal;
+	int mFrequency;
+	int mMarkerMs;
+	bool mRealtime;
+	double mPhase;
+	double mChirpPhase;
+	int64_t mPeriod;
+	int64_t mPos;
+	int mSweepPos; // chirp position, wraps once a second
+	uint16_t mSeq;
+	uint64_t mFramesOut;
+	hrc::time_point mStart;
+	int64_t mEmuStartUs;
+
+	// Sink
+	LatencyProbe& mProbe;
+	std::vector<double> mWindow;
+	size_t mWindowPos;
+	DetectState mDetectState;
+	int64_t mQuiet;
+	int64_t mTotalFrames;
+	int64_t mEdge;
+	hrc::time_point mEdgeTime;
+	uint32_t mBits;
+	int mBit;
+	int64_t mLastMarkerFrame;
+	uint16_t mLastSeq;
+};
+
+REGISTER_AUDIODEV(APINAME, GeneratorAudioDevice);
+};
+#undef APINAME
+#undef APINAMEW
@@ -3,9 +3,15 @@
 #include "../osdebugout.h"
 #include "audiodeviceproxy.h"
 #include "../libsamplerate/samplerate.h"
+#include "resampler.h"
+#include "../spscringbuffer.h"
+#include "timestretch.h"
+#include "../USB.h"
 #include <typeinfo>
+#include <memory>
 //#include <thread>
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <gtk/gtk.h>
 #include <pulse/pulseaudio.h>
@@ -23,6 +29,16 @@ using sec = std::chrono::seconds;
 GtkWidget *new_combobox(const char* label, GtkWidget *vbox); // src/linux/config-gtk.cpp
 
 #define APINAME "pulse"
+#define N_LOW_LATENCY	TEXT("low_latency")
+#define N_TIME_STRETCH	TEXT("time_stretch")
+
+// How streams follow emulation speed
+enum TimeStretchMode
+{
+	STRETCH_OFF,
+	STRETCH_RESAMPLE, // through mTimeAdjust, pitch follows speed
+	STRETCH_WSOLA, // pitch preserving
+};
 
 namespace audiodev_pulse {
 
@@ -231,9 +247,47 @@ static int GtkConfigure(int port, void *data)
 		populateDeviceWidget (GTK_COMBO_BOX (cb), devName, sinkDevs);
 	}
 
+	int buffer_len = 50, low_latency = 0, time_stretch = STRETCH_OFF;
+	{
+		CONFIGVARIANT var(N_BUFFER_LEN, CONFIG_TYPE_INT);
+		if (LoadSetting(port, APINAME, var))
+			buffer_len = var.intValue;
+	}
+	{
+		CONFIGVARIANT var(N_LOW_LATENCY, CONFIG_TYPE_INT);
+		if (LoadSetting(port, APINAME, var))
+			low_latency = var.intValue;
+	}
+	{
+		CONFIGVARIANT var(N_TIME_STRETCH, CONFIG_TYPE_INT);
+		if (LoadSetting(port, APINAME, var))
+			time_stretch = var.intValue;
+	}
+
+	GtkWidget *hbox = gtk_hbox_new (FALSE, 5);
+	gtk_box_pack_start (GTK_BOX (main_vbox), hbox, FALSE, TRUE, 0);
+	gtk_box_pack_start (GTK_BOX (hbox), gtk_label_new ("Buffer (ms)"), FALSE, FALSE, 5);
+	GtkWidget *buffer_spin = gtk_spin_button_new_with_range (5, 1000, 1);
+	gtk_spin_button_set_value (GTK_SPIN_BUTTON (buffer_spin), buffer_len);
+	gtk_box_pack_end (GTK_BOX (hbox), buffer_spin, FALSE, FALSE, 5);
+
+	GtkWidget *ll_check = gtk_check_button_new_with_label ("Low latency (small server buffers)");
+	gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (ll_check), low_latency != 0);
+	gtk_box_pack_start (GTK_BOX (main_vbox), ll_check, FALSE, TRUE, 0);
+
+	GtkWidget *ts_cb = new_combobox ("Follow emulation speed", main_vbox);
+	gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (ts_cb), "Off");
+	gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (ts_cb), "Resample (changes pitch)");
+	gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (ts_cb), "Time stretch (keeps pitch)");
+	gtk_combo_box_set_active (GTK_COMBO_BOX (ts_cb), time_stretch);
+
 	gtk_widget_show_all (dlg);
 	gint result = gtk_dialog_run (GTK_DIALOG (dlg));
 
+	buffer_len = gtk_spin_button_get_value_as_int (GTK_SPIN_BUTTON (buffer_spin));
+	low_latency = gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (ll_check)) ? 1 : 0;
+	time_stretch = gtk_combo_box_get_active (GTK_COMBO_BOX (ts_cb));
+
 	gtk_widget_destroy (dlg);
 
 	// Wait for all gtk events to be consumed ...
@@ -266,6 +320,13 @@ static int GtkConfigure(int port, void *data)
 						return RESULT_FAILED;
 			}
 		}
+
+		CONFIGVARIANT var0(N_BUFFER_LEN, (int32_t)buffer_len);
+		CONFIGVARIANT var1(N_LOW_LATENCY, (int32_t)low_latency);
+		CONFIGVARIANT var2(N_TIME_STRETCH, (int32_t)MAX(time_stretch, 0));
+		if (!SaveSetting(port, APINAME, var0) || !SaveSetting(port, APINAME, var1)
+			|| !SaveSetting(port, APINAME, var2))
+			return RESULT_FAILED;
 		return RESULT_OK;
 	}
 
@@ -278,6 +339,17 @@ public:
 	PulseAudioDevice(int port, int device, AudioDir dir): mPort(port)
 	, mDevice(device)
 	, mBuffering(50)
+	, mLowLatency(false)
+	, mStretchMode(STRETCH_OFF)
+	, mLatency(0)
+	, mDroppedFrames(0)
+	, mSilenceFrames(0)
+	, mCbLastUs(0)
+	, mCbMaxUs(0)
+	, mCbTotalUs(0)
+	, mCbCount(0)
+	, mRing(48000 * 2)
+	, mRingDropped(0)
 	, mPaused(true)
 	, mQuit(false)
 	, mPMainLoop(nullptr)
@@ -309,9 +381,25 @@ public:
 			throw AudioDeviceError(APINAME ": failed to load device settings");
 
 		{
+			CONFIGVARIANT var(N_LOW_LATENCY, CONFIG_TYPE_INT);
+			if(LoadSetting(mPort, APINAME, var))
+				mLowLatency = var.intValue != 0;
+		}
+
+		{
+			CONFIGVARIANT var(N_TIME_STRETCH, CONFIG_TYPE_INT);
+			if(LoadSetting(mPort, APINAME, var) && var.intValue >= STRETCH_OFF && var.intValue <= STRETCH_WSOLA)
+				mStretchMode = var.intValue;
+		}
+
+		{
+			// Low latency mode lets the server run with a few ms of buffering
+			int minBuffering = mLowLatency ? 5 : 25;
+			if (mLowLatency)
+				mBuffering = 10;
 			CONFIGVARIANT var(N_BUFFER_LEN, CONFIG_TYPE_INT);
 			if(LoadSetting(mPort, APINAME, var))
-				mBuffering = MAX(25, var.intValue);
+				mBuffering = MAX(minBuffering, var.intValue);
 		}
 
 		if (!AudioInit())
@@ -321,6 +409,9 @@ public:
 		mSSpec.channels = 2;
 		mSSpec.rate = 48000;
 
+		if (mStretchMode == STRETCH_WSOLA)
+			mStretcher.reset(new TimeStretch(mSSpec.channels, mSamplesPerSec));
+
 		if (!Init())
 			throw AudioDeviceError(APINAME ": failed to init");
 	}
@@ -336,6 +427,7 @@ public:
 
 	uint32_t GetBuffer(int16_t *buff, uint32_t frames)
 	{
+		UpdateTimeAdjust();
 		auto now = hrc::now();
 		auto dur = std::chrono::duration_cast<ms>(now-mLastGetBuffer).count();
 
@@ -389,8 +481,10 @@ public:
 		return totalFrames / mSSpec.channels;
 	}
 
-	uint32_t SetBuffer(int16_t *buff, uint32_t frames)
+	// Sink side bookkeeping before queueing, false if still disconnected
+	bool SinkReady()
 	{
+		UpdateTimeAdjust();
 		auto now = hrc::now();
 		auto dur = std::chrono::duration_cast<ms>(now-mLastGetBuffer).count();
 
@@ -412,16 +506,23 @@ public:
 
 			OSDebugOut("pa_context_connect %s\n", pa_strerror(ret));
 			if (ret != PA_OK)
-				return frames;
+				return false;
 		}
 		else
 			mLastGetBuffer = now;
+		return true;
+	}
+
+	// Emulator thread is the only writer to mRing, write_cb the only reader
+	uint32_t SetBuffer(int16_t *buff, uint32_t frames)
+	{
+		if (!SinkReady())
+			return frames;
 
-		std::lock_guard<std::mutex> lk(mMutex);
-		size_t old_size = mShortBuffer.size();
 		size_t nshort = frames * mSSpec.channels;
-		mShortBuffer.resize(old_size + nshort);
-		memcpy(mShortBuffer.data() + old_size, buff, nshort * sizeof(int16_t));
+		size_t written = mRing.write(buff, nshort);
+		if (written < nshort)
+			mRingDropped += (nshort - written) / mSSpec.channels;
 
 #if 0
 		if (!file)
@@ -432,13 +533,42 @@ public:
 		}
 
 		if (file)
-			fwrite(mShortBuffer.data() + old_size, 1, nshort * sizeof(int16_t), file);
+			fwrite(buff, 1, nshort * sizeof(int16_t), file);
 #endif
 		return frames;
 	}
 
+	uint32_t SetBufferMixed(const int16_t *buff, uint32_t frames, uint32_t srcChannels, const uint8_t *vol)
+	{
+		if (!SinkReady())
+			return frames;
+
+		// Mix straight into the ring, wrapping at most once. Ring size is a power of two
+		// and channels is 2, so both halves hold whole frames.
+		uint32_t chns = mSSpec.channels;
+		uint32_t fit = MIN(frames, (uint32_t)(mRing.free_space() / chns));
+		uint32_t done = 0;
+		while (done < fit)
+		{
+			uint32_t n = MIN(fit - done, (uint32_t)(mRing.peek_write(done * chns) / chns));
+			MixVolume(mRing.back(done * chns), chns, buff + done * srcChannels, srcChannels, vol, n);
+			done += n;
+		}
+		mRing.write(done * chns);
+
+		if (done < frames)
+			mRingDropped += frames - done;
+		return frames;
+	}
+
 	bool GetFrames(uint32_t *size)
 	{
+		if (mAudioDir == AUDIODIR_SINK)
+		{
+			*size = mRing.size() / mSSpec.channels;
+			return true;
+		}
+
 		std::lock_guard<std::mutex> lk(mMutex);
 		*size = mShortBuffer.size() / mSSpec.channels;
 		return true;
@@ -452,6 +582,18 @@ public:
 		else
 			mResampleRatio = double(mSSpec.rate) / double(samplerate);
 		//mResample = true;
+
+		// Stream callbacks run with mainloop lock held
+		if (mPMainLoop)
+			pa_threaded_mainloop_lock(mPMainLoop);
+		if (mAudioDir == AUDIODIR_SOURCE)
+			mFixedResampler.reset(resampler::CreateFixedResampler(mSSpec.rate, samplerate, mSSpec.channels));
+		else
+			mFixedResampler.reset(resampler::CreateFixedResampler(samplerate, mSSpec.rate, mSSpec.channels));
+		if (mPMainLoop)
+			pa_threaded_mainloop_unlock(mPMainLoop);
+		OSDebugOut("%s resampler for %d Hz\n", mFixedResampler ? "Fixed ratio" : "Sinc", samplerate);
+
 		ResetBuffers();
 	}
 
@@ -584,6 +726,7 @@ public:
 			goto unlock_and_fail;
 
 		pa_stream_set_state_callback(mStream, stream_state_cb, this);
+		pa_stream_set_latency_update_callback(mStream, stream_latency_cb, this);
 
 		// Sets individual read callback fragsize but recording itself
 		// still "lags" ~1sec (read_cb is called in bursts) without
@@ -603,10 +746,16 @@ public:
 				this
 			);
 
+			// Timing updates feed stream_latency_cb
+			pa_stream_flags_t flags = (pa_stream_flags_t)
+				(PA_STREAM_INTERPOLATE_TIMING |
+				PA_STREAM_AUTO_TIMING_UPDATE |
+				PA_STREAM_ADJUST_LATENCY);
+
 			ret = pa_stream_connect_record(mStream,
 				mDeviceName.c_str(),
 				&buffer_attr,
-				PA_STREAM_ADJUST_LATENCY
+				flags
 			);
 			OSDebugOut("pa_stream_connect_record %s\n", pa_strerror(ret));
 		}
@@ -621,6 +770,9 @@ public:
 			buffer_attr.prebuf = 0; // Don't stop on underrun but then
 									// stream also only starts manually with uncorking.
 			buffer_attr.tlength = pa_usec_to_bytes(mBuffering * 1000, &mSSpec);
+			// Ask for refills in small steps so the server side queue stays short
+			if (mLowLatency)
+				buffer_attr.minreq = pa_usec_to_bytes(mBuffering * 1000 / 4, &mSSpec);
 			pa_stream_flags_t flags = (pa_stream_flags_t)
 				(PA_STREAM_INTERPOLATE_TIMING |
 				PA_STREAM_NOT_MONOTONIC |
@@ -650,6 +802,13 @@ public:
 			pa_threaded_mainloop_wait(mPMainLoop);
 		}
 
+		{
+			const pa_buffer_attr *attr = pa_stream_get_buffer_attr(mStream);
+			if (attr)
+				OSDebugOut("pulse: maxlength %u tlength %u minreq %u fragsize %u\n",
+					attr->maxlength, attr->tlength, attr->minreq, attr->fragsize);
+		}
+
 		OSDebugOut("pa_stream_is_corked %d\n", pa_stream_is_corked(mStream));
 		OSDebugOut("pa_stream_is_suspended %d\n", pa_stream_is_suspended (mStream));
 
@@ -691,7 +850,14 @@ public:
 		bytes = pa_bytes_per_second(&ss) * 5;
 		mShortBuffer.resize(0);
 		mShortBuffer.reserve(bytes);
+		// Called from the writer's thread and write_cb holds mMutex, so neither side is active
+		mRing.clear();
+		mStretchBuf.clear();
+		if (mStretcher)
+			mStretcher->SetRate(mSamplesPerSec);
 		src_reset(mResampler);
+		if (mFixedResampler)
+			mFixedResampler->Reset();
 	}
 
 	static const TCHAR* Name()
@@ -738,23 +904,111 @@ public:
 	static void stream_state_cb(pa_stream *s, void *userdata);
 	static void stream_read_cb (pa_stream *p, size_t nbytes, void *userdata);
 	static void stream_write_cb (pa_stream *p, size_t nbytes, void *userdata);
+	static void stream_latency_cb (pa_stream *p, void *userdata);
+
+	bool GetStats(AudioStats& stats)
+	{
+		std::lock_guard<std::mutex> lk(mMutex);
+		auto since = std::chrono::duration_cast<ms>(hrc::now() - mLastGetBuffer).count();
+
+		size_t queued = mAudioDir == AUDIODIR_SINK ? mRing.size() : mShortBuffer.size();
+		stats.guestBufferedMs = queued * 1000.0 / mSSpec.channels / mSamplesPerSec;
+		stats.hostBufferedMs = mFloatBuffer.size() * 1000.0 / mSSpec.channels / mSSpec.rate
+			+ mLatency / 1000.0;
+		stats.resampleRatio = mResampleRatio * mTimeAdjust;
+		stats.droppedFrames = mDroppedFrames + mRingDropped;
+		stats.silenceFrames = mSilenceFrames;
+		stats.callbackLastUs = mCbLastUs;
+		stats.callbackMaxUs = mCbMaxUs;
+		stats.callbackAvgUs = mCbCount ? mCbTotalUs / (int64_t)mCbCount : 0;
+		if (mAudioDir == AUDIODIR_SOURCE)
+			stats.sinceGetBufferMs = since;
+		else
+			stats.sinceSetBufferMs = since;
+		return true;
+	}
+
+	// Called with mMutex held
+	void AddCallbackTime(hrc::time_point start)
+	{
+		mCbLastUs = std::chrono::duration_cast<us>(hrc::now() - start).count();
+		mCbMaxUs = MAX(mCbMaxUs, mCbLastUs);
+		mCbTotalUs += mCbLastUs;
+		mCbCount++;
+	}
 	static void stream_success_cb (pa_stream *p, int success, void *userdata) {}
 
+	// Emulator thread, tracks speed measured from USBasync cycles
+	void UpdateTimeAdjust()
+	{
+		if (mStretchMode == STRETCH_OFF)
+			return;
+
+		double speed = GetEmulationSpeed();
+		// Buffers absorb small deviations and the fixed resampler stays usable
+		if (speed > 0.98 && speed < 1.02)
+			speed = 1.0;
+		// Capture has to produce more per wall second when running fast, playback less
+		mTimeAdjust = mAudioDir == AUDIODIR_SOURCE ? speed : 1.0 / speed;
+	}
+
+	// Last stream latency reported by the server in microseconds
+	int64_t GetLatency() const { return mLatency; }
+
+	// How much the guest side queue may hold before old samples get dropped.
+	// Low latency mode keeps guest queue plus server latency within two
+	// buffer lengths so the round trip stays bounded.
+	int QueueLimitMs() const
+	{
+		if (!mLowLatency)
+			return MAX(mBuffering, 25);
+		int serverMs = static_cast<int>(mLatency / 1000);
+		return MAX(mBuffering, mBuffering * 2 - serverMs);
+	}
+
+	int Resample(SRC_DATA *data)
+	{
+		// Time adjusted ratios are not fixed anymore
+		if (mFixedResampler && data->src_ratio == mResampleRatio)
+			return mFixedResampler->Process(data);
+		return src_process(mResampler, data);
+	}
+
 protected:
 	int mPort;
 	int mDevice;
 	int mChannels;
 	int mBuffering;
+	bool mLowLatency;
+	std::atomic<int64_t> mLatency;
+
+	// Stats, guarded by mMutex
+	uint64_t mDroppedFrames;
+	uint64_t mSilenceFrames;
+	int64_t mCbLastUs;
+	int64_t mCbMaxUs;
+	int64_t mCbTotalUs;
+	uint64_t mCbCount;
 	std::string mDeviceName;
 	int mSamplesPerSec;
 	pa_sample_spec mSSpec;
 	AudioDir mAudioDir;
 
 	SRC_STATE *mResampler;
+	// Used instead of mResampler for common USB audio rates
+	std::unique_ptr<resampler::FixedResampler> mFixedResampler;
 	double mResampleRatio;
-	// Speed up or slow down audio
-	double mTimeAdjust;
-	std::vector<short> mShortBuffer;
+	// Speed up or slow down audio, written by emulator thread
+	std::atomic<double> mTimeAdjust;
+	int mStretchMode;
+	// Pitch preserving stretch at guest rate, guarded by mainloop lock like the resamplers
+	std::unique_ptr<TimeStretch> mStretcher;
+	std::vector<float> mStretchBuf;
+	std::vector<short> mShortBuffer; // source only
+	// Sink queue at guest rate, 1 second of 48kHz stereo
+	SPSCRingBuffer<int16_t> mRing;
+	std::atomic<uint64_t> mRingDropped;
+	std::vector<float> mRingFloat; // write_cb scratch
 	std::vector<float> mFloatBuffer;
 	//std::thread mThread;
 	//std::condition_variable mEvent;
@@ -808,6 +1062,18 @@ void PulseAudioDevice::stream_state_cb(pa_stream *s, void *userdata)
 	pa_threaded_mainloop_signal(padev->mPMainLoop, 0);
 }
 
+void PulseAudioDevice::stream_latency_cb(pa_stream *p, void *userdata)
+{
+	PulseAudioDevice *padev = (PulseAudioDevice *)userdata;
+	pa_usec_t usec = 0;
+	int negative = 0;
+
+	if (pa_stream_get_latency(p, &usec, &negative) != PA_OK)
+		return;
+	// Playback can be ahead of the sink's read index, treat it as no latency
+	padev->mLatency = negative ? 0 : static_cast<int64_t>(usec);
+}
+
 void PulseAudioDevice::stream_read_cb (pa_stream *p, size_t nbytes, void *userdata)
 {
 	PulseAudioDevice *padev = (PulseAudioDevice *) userdata;
@@ -815,6 +1081,8 @@ void PulseAudioDevice::stream_read_cb (pa_stream *p, size_t nbytes, void *userda
 	if (padev->mQuit)
 		return;
 
+	auto cbStart = hrc::now();
+
 	//OSDebugOut("stream_read_callback %d bytes\n", nbytes);
 
 	int ret = pa_stream_peek(p, &padata, &nbytes);
@@ -842,7 +1110,11 @@ void PulseAudioDevice::stream_read_cb (pa_stream *p, size_t nbytes, void *userda
 			OSDebugOut("pa_stream_drop %s\n", pa_strerror(ret));
 	}
 
-	size_t resampled = static_cast<size_t>(padev->mFloatBuffer.size() * padev->mResampleRatio * padev->mTimeAdjust);// * padev->mSSpec.channels;
+	double adjust = padev->mTimeAdjust;
+	TimeStretch *stretcher = padev->mStretcher.get();
+	double ratio = padev->mResampleRatio * (stretcher ? 1.0 : adjust);
+
+	size_t resampled = static_cast<size_t>(padev->mFloatBuffer.size() * ratio);// * padev->mSSpec.channels;
 	if (resampled == 0)
 		resampled = padev->mFloatBuffer.size();
 
@@ -854,33 +1126,47 @@ void PulseAudioDevice::stream_read_cb (pa_stream *p, size_t nbytes, void *userda
 	data.input_frames = padev->mFloatBuffer.size() / padev->mSSpec.channels;
 	data.data_out = rebuf.data();
 	data.output_frames = resampled / padev->mSSpec.channels;
-	data.src_ratio = padev->mResampleRatio * padev->mTimeAdjust;
+	data.src_ratio = ratio;
 
-	src_process(padev->mResampler, &data);
+	padev->Resample(&data);
 
+	// Stretcher state is reset by ResetBuffers under mMutex
 	std::lock_guard<std::mutex> lock(padev->mMutex);
 
+	const float *out = rebuf.data();
 	uint32_t len = data.output_frames_gen * padev->mSSpec.channels;
+	if (stretcher)
+	{
+		stretcher->SetStretch(adjust);
+		padev->mStretchBuf.clear();
+		stretcher->Process(rebuf.data(), data.output_frames_gen, padev->mStretchBuf);
+		out = padev->mStretchBuf.data();
+		len = padev->mStretchBuf.size();
+	}
+
 	size_t size = padev->mShortBuffer.size();
 	if (len > 0)
 	{
 		//too long, drop samples, caused by saving/loading savestates and random stutters
 		int sizeInMS = (((padev->mShortBuffer.size() + len) * 1000 / padev->mSSpec.channels) / padev->mSamplesPerSec);
-		int threshold = padev->mBuffering > 25 ? padev->mBuffering : 25;
+		int threshold = padev->QueueLimitMs();
 		if (sizeInMS > threshold)
 		{
+			padev->mDroppedFrames += size / padev->mSSpec.channels;
 			size = 0;
 			padev->mShortBuffer.resize(len);
 		}
 		else
 			padev->mShortBuffer.resize(size + len);
-		src_float_to_short_array(rebuf.data(), &(padev->mShortBuffer[size]), len);
+		src_float_to_short_array(out, &(padev->mShortBuffer[size]), len);
 	}
 
 	auto remSize = data.input_frames_used * padev->mSSpec.channels;
 	if (remSize > 0)
 		padev->mFloatBuffer.erase(padev->mFloatBuffer.begin(), padev->mFloatBuffer.begin() + remSize);
 
+	padev->AddCallbackTime(cbStart);
+
 	//OSDebugOut("Resampler: in %ld out %ld used %ld gen %ld, rb: %zd, qb: %zd\n",
 		//data.input_frames, data.output_frames,
 		//data.input_frames_used, data.output_frames_gen,
@@ -895,7 +1181,7 @@ void PulseAudioDevice::stream_write_cb (pa_stream *p, size_t nbytes, void *userd
 	ssize_t remaining_bytes = nbytes;
 	size_t floats_written = 0;
 	int ret = PA_OK;
-	std::vector<float> float_samples;
+	size_t queued;
 	SRC_DATA data;
 	memset(&data, 0, sizeof(SRC_DATA));
 
@@ -903,11 +1189,50 @@ void PulseAudioDevice::stream_write_cb (pa_stream *p, size_t nbytes, void *userd
 	if (padev->mQuit)
 		return;
 
+	auto cbStart = hrc::now();
+	// Only guards resampler state against SetResampling, the emulator
+	// thread queues through mRing without taking it
 	std::lock_guard<std::mutex> lock(padev->mMutex);
 
-	size_t resampled = static_cast<size_t>(padev->mShortBuffer.size() * padev->mResampleRatio * padev->mTimeAdjust);
+	// Snapshot, writer may keep appending meanwhile
+	queued = padev->mRing.size();
+
+	if (padev->mLowLatency)
+	{
+		// Guest got ahead of the sink, skip oldest samples instead of letting latency grow
+		size_t limit = (size_t)padev->QueueLimitMs() * padev->mSamplesPerSec / 1000 * padev->mSSpec.channels;
+		if (queued > limit)
+		{
+			padev->mDroppedFrames += (queued - limit) / padev->mSSpec.channels;
+			padev->mRing.read(queued - limit);
+			queued = limit;
+		}
+	}
+
+	double adjust = padev->mTimeAdjust;
+	TimeStretch *stretcher = padev->mStretcher.get();
+	double ratio = padev->mResampleRatio * (stretcher ? 1.0 : adjust);
+
+	std::vector<float>& float_samples = padev->mRingFloat;
+	float_samples.resize(queued);
+	for (size_t done = 0, n; done < queued; done += n)
+	{
+		n = MIN(queued - done, padev->mRing.peek_read(done));
+		src_short_to_float_array(padev->mRing.front(done), float_samples.data() + done, n);
+	}
+
+	// Resampler input is the ring as is, or stretched audio still waiting to be resampled
+	std::vector<float>& input = stretcher ? padev->mStretchBuf : float_samples;
+	if (stretcher)
+	{
+		stretcher->SetStretch(adjust);
+		stretcher->Process(float_samples.data(), queued / padev->mSSpec.channels, padev->mStretchBuf);
+		padev->mRing.read(queued);
+	}
+
+	size_t resampled = static_cast<size_t>(input.size() * ratio);
 	if (resampled == 0)
-		resampled = padev->mShortBuffer.size() * (padev->mResampleRatio > 1.0 ? padev->mResampleRatio : 1.0);
+		resampled = input.size() * (ratio > 1.0 ? ratio : 1.0);
 
 	old_size = padev->mFloatBuffer.size();
 	padev->mFloatBuffer.resize(old_size + resampled - resampled % padev->mSSpec.channels);
@@ -916,26 +1241,24 @@ void PulseAudioDevice::stream_write_cb (pa_stream *p, size_t nbytes, void *userd
 	//	old_size, padev->mFloatBuffer.size(), resampled, nbytes);
 
 	// Convert short samples to float and to final output sample rate
-	if (padev->mShortBuffer.size() > 0)
+	if (input.size() > 0)
 	{
-		float_samples.resize(padev->mShortBuffer.size());
-		src_short_to_float_array(padev->mShortBuffer.data(),
-				float_samples.data(), padev->mShortBuffer.size());
-
-		data.data_in = float_samples.data();
-		data.input_frames = float_samples.size() / padev->mSSpec.channels;
+		data.data_in = input.data();
+		data.input_frames = input.size() / padev->mSSpec.channels;
 		data.data_out = padev->mFloatBuffer.data() + old_size;
 		data.output_frames = resampled / padev->mSSpec.channels;
-		data.src_ratio = padev->mResampleRatio * padev->mTimeAdjust;
+		data.src_ratio = ratio;
 
-		src_process(padev->mResampler, &data);
+		padev->Resample(&data);
 
 		uint32_t new_len = data.output_frames_gen * padev->mSSpec.channels;
 		padev->mFloatBuffer.resize(old_size + new_len);
 
-		auto remSize = data.input_frames_used * padev->mSSpec.channels;
-		if (remSize > 0)
-			padev->mShortBuffer.erase(padev->mShortBuffer.begin(), padev->mShortBuffer.begin() + remSize);
+		size_t used = data.input_frames_used * padev->mSSpec.channels;
+		if (stretcher)
+			padev->mStretchBuf.erase(padev->mStretchBuf.begin(), padev->mStretchBuf.begin() + used);
+		else
+			padev->mRing.read(used);
 	}
 
 	// Write converted float samples or silence to PulseAudio stream
@@ -973,7 +1296,10 @@ void PulseAudioDevice::stream_write_cb (pa_stream *p, size_t nbytes, void *userd
 		}
 
 		if (pa_bytes > final_bytes)
+		{
 			memset((uint8_t*)pa_buffer + final_bytes, 0, pa_bytes - final_bytes);
+			padev->mSilenceFrames += (pa_bytes - final_bytes) / pa_frame_size(&padev->mSSpec);
+		}
 
 		ret = pa_stream_write(padev->mStream, pa_buffer, pa_bytes, NULL, 0LL, PA_SEEK_RELATIVE);
 		if (ret != PA_OK)
@@ -994,6 +1320,8 @@ exit:
 
 	if (floats_written > 0)
 		padev->mFloatBuffer.erase(padev->mFloatBuffer.begin(), padev->mFloatBuffer.begin() + floats_written);
+
+	padev->AddCallbackTime(cbStart);
 }
 
 REGISTER_AUDIODEV(APINAME, PulseAudioDevice);
@@ -5,9 +5,11 @@
 #ifndef AUDIODEV_H
 #define AUDIODEV_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <queue>
+#include "audiomix.h"
 
 #define S_AUDIO_SOURCE0	TEXT("Audio source 1")
 #define S_AUDIO_SOURCE1	TEXT("Audio source 2")
@@ -55,6 +57,27 @@ struct AudioDeviceInfoW
 #define AudioDeviceInfo AudioDeviceInfoA
 #endif
 
+// Snapshot of a device's stream health, -1 where a backend has no value
+struct AudioStats
+{
+	double guestBufferedMs; // queued at guest sample rate
+	double hostBufferedMs; // queued on host side, including server latency
+	double resampleRatio;
+	uint64_t droppedFrames; // discarded to keep latency bounded
+	uint64_t silenceFrames; // padding written on sink underrun
+	int64_t callbackLastUs;
+	int64_t callbackMaxUs;
+	int64_t callbackAvgUs;
+	int64_t sinceGetBufferMs;
+	int64_t sinceSetBufferMs;
+
+	AudioStats()
+	: guestBufferedMs(-1), hostBufferedMs(-1), resampleRatio(-1)
+	, droppedFrames(0), silenceFrames(0)
+	, callbackLastUs(-1), callbackMaxUs(-1), callbackAvgUs(-1)
+	, sinceGetBufferMs(-1), sinceSetBufferMs(-1) {}
+};
+
 class AudioDevice
 {
 public:
@@ -62,6 +85,28 @@ public:
 	//get buffer, converted to 16bit int format
 	virtual uint32_t GetBuffer(int16_t *buff, uint32_t len) = 0;
 	virtual uint32_t SetBuffer(int16_t *buff, uint32_t len) = 0;
+	/*
+		SetBuffer with per channel volume (0-255) and channel mapping from
+		srcChannels to GetChannels(), see MixVolume(). Backends with their
+		own queue can mix straight into it instead of going through here.
+	*/
+	virtual uint32_t SetBufferMixed(const int16_t *buff, uint32_t frames, uint32_t srcChannels, const uint8_t *vol)
+	{
+		int16_t tmp[1024];
+		uint32_t chns = GetChannels();
+		uint32_t chunk = sizeof(tmp) / sizeof(tmp[0]) / chns;
+		uint32_t done = 0;
+		while (done < frames)
+		{
+			uint32_t n = frames - done < chunk ? frames - done : chunk;
+			MixVolume(tmp, chns, buff + done * srcChannels, srcChannels, vol, n);
+			uint32_t written = SetBuffer(tmp, n);
+			done += written;
+			if (written < n)
+				break;
+		}
+		return done;
+	}
 	/*
 		Get how many frames has been recorded so that caller knows 
 		how much to allocated for 16-bit buffer.
@@ -75,6 +120,9 @@ public:
 
 	virtual MicMode GetMicMode(AudioDevice* compare) = 0;
 
+	// Fill in what the backend tracks, false if it tracks nothing
+	virtual bool GetStats(AudioStats& stats) { return false; }
+
 	//Remember to add to your class
 	//static const wchar_t* GetName();
 };
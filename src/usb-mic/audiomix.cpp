@@ -0,0 +1,102 @@
+#include "audiomix.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+// 32-bit builds don't assume SSE2, so compile that path separately and check at runtime
+#define MIX_SSE2 __attribute__((target("sse2")))
+#define MIX_HAVE_SSE2() __builtin_cpu_supports("sse2")
+#elif defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MIX_SSE2
+#define MIX_HAVE_SSE2() true
+#endif
+
+#ifdef MIX_SSE2
+#include <emmintrin.h>
+#endif
+
+// Same as headset's SetVolume()
+static inline int16_t ScaleSample(int16_t sample, int vol)
+{
+	return (int16_t)((int32_t)sample * vol / 0xFF);
+}
+
+static void MixScalar(int16_t *dst, uint32_t dstChannels,
+	const int16_t *src, uint32_t srcChannels,
+	const uint8_t *vol, uint32_t frames)
+{
+	for (uint32_t i = 0; i < frames; i++)
+	{
+		for (uint32_t c = 0; c < dstChannels; c++)
+		{
+			int16_t s = srcChannels == 1 ? src[i] : (c < srcChannels ? src[i * srcChannels + c] : 0);
+			dst[i * dstChannels + c] = ScaleSample(s, vol[c]);
+		}
+	}
+}
+
+#ifdef MIX_SSE2
+/*
+	sample * vol fits exactly in a float and the division is correctly
+	rounded, so truncating matches the integer ScaleSample() bit for bit.
+*/
+MIX_SSE2 static inline __m128i ScaleSSE2(__m128i s, __m128 gain)
+{
+	const __m128 div = _mm_set1_ps(255.0f);
+	__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+	__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+	__m128 flo = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(lo), gain), div);
+	__m128 fhi = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(hi), gain), div);
+	return _mm_packs_epi32(_mm_cvttps_epi32(flo), _mm_cvttps_epi32(fhi));
+}
+
+// Handles the layouts the headset uses, returns frames done
+MIX_SSE2 static uint32_t MixSSE2(int16_t *dst, uint32_t dstChannels,
+	const int16_t *src, uint32_t srcChannels,
+	const uint8_t *vol, uint32_t frames)
+{
+	uint32_t i = 0;
+	if (dstChannels == 2 && srcChannels == 2)
+	{
+		__m128 gain = _mm_setr_ps(vol[0], vol[1], vol[0], vol[1]);
+		for (; i + 4 <= frames; i += 4)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)(src + i * 2));
+			_mm_storeu_si128((__m128i *)(dst + i * 2), ScaleSSE2(s, gain));
+		}
+	}
+	else if (dstChannels == 2 && srcChannels == 1)
+	{
+		__m128 gain = _mm_setr_ps(vol[0], vol[1], vol[0], vol[1]);
+		for (; i + 8 <= frames; i += 8)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i * 2), ScaleSSE2(_mm_unpacklo_epi16(s, s), gain));
+			_mm_storeu_si128((__m128i *)(dst + i * 2 + 8), ScaleSSE2(_mm_unpackhi_epi16(s, s), gain));
+		}
+	}
+	else if (dstChannels == 1 && srcChannels == 1)
+	{
+		__m128 gain = _mm_set1_ps(vol[0]);
+		for (; i + 8 <= frames; i += 8)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), ScaleSSE2(s, gain));
+		}
+	}
+	return i;
+}
+#endif
+
+void MixVolume(int16_t *dst, uint32_t dstChannels,
+	const int16_t *src, uint32_t srcChannels,
+	const uint8_t *vol, uint32_t frames)
+{
+	uint32_t done = 0;
+#ifdef MIX_SSE2
+	static const bool sse2 = MIX_HAVE_SSE2();
+	if (sse2)
+		done = MixSSE2(dst, dstChannels, src, srcChannels, vol, frames);
+#endif
+	// Tail and uncommon layouts
+	MixScalar(dst + done * dstChannels, dstChannels,
+		src + done * srcChannels, srcChannels, vol, frames - done);
+}
@@ -0,0 +1,16 @@
+#ifndef AUDIOMIX_H
+#define AUDIOMIX_H
+
+#include <cstdint>
+
+/*
+	Scale and map 'frames' of interleaved samples from srcChannels to
+	dstChannels in one pass. Output channel c gets sample * vol[c] / 255,
+	mono goes to every output and surplus source channels are dropped.
+	vol needs an entry for every output channel.
+*/
+void MixVolume(int16_t *dst, uint32_t dstChannels,
+	const int16_t *src, uint32_t srcChannels,
+	const uint8_t *vol, uint32_t frames);
+
+#endif
@@ -0,0 +1,55 @@
+#include "audiostats.h"
+#include "jitterbuffer.h"
+#include "../configuration.h"
+#include <cstdio>
+#include <cinttypes>
+
+AudioStatsLog::AudioStatsLog(const char *dev, int port, uint32_t intervalSec)
+: mDev(dev)
+, mPort(port)
+, mInterval(intervalSec)
+, mLast(std::chrono::steady_clock::now())
+{
+}
+
+bool AudioStatsLog::Due()
+{
+	if (!Enabled())
+		return false;
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - mLast < mInterval)
+		return false;
+	mLast = now;
+	return true;
+}
+
+void AudioStatsLog::Log(const char *stream, AudioDevice *audiodev, const JitterBuffer *jitter)
+{
+	AudioStats st;
+	if (!audiodev || !audiodev->GetStats(st))
+	{
+		fprintf(stderr, "%s %d %s: no stats\n", mDev, mPort, stream);
+		return;
+	}
+
+	fprintf(stderr, "%s %d %s: guest %.1fms host %.1fms ratio %.6f dropped %" PRIu64
+		" silence %" PRIu64 " cb %" PRId64 "/%" PRId64 "/%" PRId64 "us idle %" PRId64 "/%" PRId64 "ms",
+		mDev, mPort, stream, st.guestBufferedMs, st.hostBufferedMs, st.resampleRatio,
+		st.droppedFrames, st.silenceFrames,
+		st.callbackLastUs, st.callbackAvgUs, st.callbackMaxUs,
+		st.sinceGetBufferMs, st.sinceSetBufferMs);
+
+	if (jitter)
+		fprintf(stderr, " jitter %u frames, %u under %u over",
+			jitter->Depth(), jitter->Underruns(), jitter->Overruns());
+	fprintf(stderr, "\n");
+}
+
+uint32_t LoadStatsInterval(int port, const char *dev)
+{
+	CONFIGVARIANT var(N_STATS_INTERVAL, CONFIG_TYPE_INT);
+	if (LoadSetting(port, dev, var) && var.intValue > 0)
+		return var.intValue;
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef AUDIOSTATS_H
+#define AUDIOSTATS_H
+
+#include "audiodev.h"
+#include <chrono>
+#include <cstdint>
+
+#define S_STATS_INTERVAL	TEXT("Audio stats log interval (s)")
+#define N_STATS_INTERVAL	TEXT("stats_interval")
+
+class JitterBuffer;
+
+/*
+	Prints one line per audio stream to stderr every few seconds so
+	dropouts can be lined up with emulator slowdowns. Disabled with a
+	zero interval.
+*/
+class AudioStatsLog
+{
+public:
+	AudioStatsLog(const char *dev, int port, uint32_t intervalSec);
+
+	bool Enabled() const { return mInterval.count() > 0; }
+	// True once per interval, call from the USB data path
+	bool Due();
+	void Log(const char *stream, AudioDevice *audiodev, const JitterBuffer *jitter = nullptr);
+
+private:
+	const char *mDev;
+	int mPort;
+	std::chrono::seconds mInterval;
+	std::chrono::steady_clock::time_point mLast;
+};
+
+// Interval from "<device> <port>" config section, 0 if unset
+uint32_t LoadStatsInterval(int port, const char *dev);
+
+#endif
@@ -0,0 +1,91 @@
+#include "jitterbuffer.h"
+#include "../configuration.h"
+#include "../osdebugout.h"
+#include <cstring>
+#include <algorithm>
+
+JitterBuffer::JitterBuffer(uint32_t channels, uint32_t samplerate, uint32_t targetMs)
+: mChannels(channels ? channels : 1)
+, mTargetMs(targetMs)
+, mUnderruns(0)
+, mOverruns(0)
+{
+	SetRate(samplerate);
+}
+
+void JitterBuffer::SetRate(uint32_t samplerate)
+{
+	mRate = samplerate;
+	mTargetFrames = mRate * mTargetMs / 1000;
+	// Leave room for host side bursts before dropping anything
+	mMaxFrames = mTargetFrames * 2 + mRate / 100;
+	Reset();
+}
+
+void JitterBuffer::Reset()
+{
+	mBuffer.clear();
+	mRemainder = 0;
+	mPrimed = false;
+}
+
+void JitterBuffer::Fill(AudioDevice *src)
+{
+	uint32_t frames = 0;
+	if (!src || !src->GetFrames(&frames) || !frames)
+		return;
+
+	size_t old_size = mBuffer.size();
+	mBuffer.resize(old_size + frames * mChannels);
+	frames = src->GetBuffer(mBuffer.data() + old_size, frames);
+	mBuffer.resize(old_size + frames * mChannels);
+
+	if (Depth() > mMaxFrames)
+	{
+		// Guest fell behind, skip back to target depth
+		size_t drop = (Depth() - mTargetFrames) * mChannels;
+		mBuffer.erase(mBuffer.begin(), mBuffer.begin() + drop);
+		mOverruns++;
+		OSDebugOut(TEXT("jitter: overrun %u, dropped %u frames\n"), mOverruns, uint32_t(drop / mChannels));
+	}
+}
+
+uint32_t JitterBuffer::Pop(int16_t *dst, uint32_t maxFrames)
+{
+	mRemainder += mRate;
+	uint32_t frames = mRemainder / 1000;
+	mRemainder -= frames * 1000;
+	frames = std::min(frames, maxFrames);
+
+	if (!mPrimed)
+	{
+		if (Depth() < mTargetFrames)
+		{
+			memset(dst, 0, frames * mChannels * sizeof(int16_t));
+			return frames;
+		}
+		mPrimed = true;
+	}
+
+	uint32_t avail = std::min(frames, Depth());
+	memcpy(dst, mBuffer.data(), avail * mChannels * sizeof(int16_t));
+	mBuffer.erase(mBuffer.begin(), mBuffer.begin() + avail * mChannels);
+
+	if (avail < frames)
+	{
+		memset(dst + avail * mChannels, 0, (frames - avail) * mChannels * sizeof(int16_t));
+		mUnderruns++;
+		mPrimed = false;
+		OSDebugOut(TEXT("jitter: underrun %u, short by %u frames\n"), mUnderruns, frames - avail);
+	}
+
+	return frames;
+}
+
+uint32_t LoadJitterTarget(int port, const char *dev)
+{
+	CONFIGVARIANT var(N_JITTER_TARGET, CONFIG_TYPE_INT);
+	if (LoadSetting(port, dev, var) && var.intValue >= 0 && var.intValue <= 200)
+		return var.intValue;
+	return JITTER_TARGET_DEFAULT;
+}
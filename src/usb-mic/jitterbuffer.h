@@ -0,0 +1,54 @@
+#ifndef JITTERBUFFER_H
+#define JITTERBUFFER_H
+
+#include "audiodev.h"
+#include <cstdint>
+#include <vector>
+
+#define S_JITTER_TARGET	TEXT("Jitter buffer (ms)")
+#define N_JITTER_TARGET	TEXT("jitter_target")
+#define JITTER_TARGET_DEFAULT 10
+
+/*
+	Sits between an AudioDevice source and an ISO IN endpoint. Every 1ms USB
+	frame gets exactly rate/1000 frames, with the remainder carried over so
+	e.g. 44.1kHz comes out as nine 44 frame packets and one 45 frame packet.
+	Output starts once target depth is buffered and restarts the same way
+	after an underrun.
+*/
+class JitterBuffer
+{
+public:
+	JitterBuffer(uint32_t channels, uint32_t samplerate, uint32_t targetMs);
+
+	void SetRate(uint32_t samplerate);
+	void Reset();
+
+	// Pull everything the source has buffered
+	void Fill(AudioDevice *src);
+	// Frames for next USB frame, padded with silence on underrun
+	uint32_t Pop(int16_t *dst, uint32_t maxFrames);
+
+	uint32_t GetChannels() const { return mChannels; }
+	uint32_t Depth() const { return mBuffer.size() / mChannels; }
+	uint32_t Underruns() const { return mUnderruns; }
+	uint32_t Overruns() const { return mOverruns; }
+
+private:
+	uint32_t mChannels;
+	uint32_t mRate;
+	uint32_t mTargetMs;
+	uint32_t mTargetFrames;
+	uint32_t mMaxFrames;
+	uint32_t mRemainder; // in 1/1000 frames
+	bool mPrimed;
+
+	std::vector<int16_t> mBuffer;
+	uint32_t mUnderruns;
+	uint32_t mOverruns;
+};
+
+// Target depth from "<device> <port>" config section
+uint32_t LoadJitterTarget(int port, const char *dev);
+
+#endif
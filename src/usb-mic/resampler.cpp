@@ -0,0 +1,41 @@
+#include "resampler.h"
+
+namespace resampler {
+
+template<int Up, int Down>
+static FixedResampler* Create(int channels)
+{
+	return new PolyphaseResampler<Up, Down>(channels);
+}
+
+FixedResampler* CreateFixedResampler(int inRate, int outRate, int channels)
+{
+	if (inRate == RESAMPLER_HOST_RATE)
+	{
+		// Capture: host -> device rate
+		switch (outRate)
+		{
+		case 8000:  return Create<1, 6>(channels);
+		case 11025: return Create<147, 640>(channels);
+		case 16000: return Create<1, 3>(channels);
+		case 22050: return Create<147, 320>(channels);
+		case 44100: return Create<147, 160>(channels);
+		case 48000: return Create<1, 1>(channels);
+		}
+	}
+	else if (outRate == RESAMPLER_HOST_RATE)
+	{
+		// Playback: device -> host rate
+		switch (inRate)
+		{
+		case 8000:  return Create<6, 1>(channels);
+		case 11025: return Create<640, 147>(channels);
+		case 16000: return Create<3, 1>(channels);
+		case 22050: return Create<320, 147>(channels);
+		case 44100: return Create<160, 147>(channels);
+		}
+	}
+	return nullptr;
+}
+
+} // namespace resampler
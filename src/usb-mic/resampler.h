@@ -0,0 +1,199 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include "../libsamplerate/samplerate.h"
+
+namespace resampler {
+
+// Host streams run at 48kHz, USB audio devices only ever ask for a handful
+// of rates. Those get a fixed ratio polyphase FIR instead of libsamplerate's
+// variable ratio sinc converter.
+#define RESAMPLER_HOST_RATE 48000
+
+/*
+	Same calling convention as src_process(): fills input_frames_used and
+	output_frames_gen. Input frames that are not needed yet are left to the
+	caller, like libsamplerate does. data->src_ratio is ignored.
+*/
+class FixedResampler
+{
+public:
+	virtual ~FixedResampler() {}
+	virtual int Process(SRC_DATA *data) = 0;
+	virtual void Reset() = 0;
+	virtual double Ratio() const = 0;
+};
+
+// Kaiser window needs zeroth order modified Bessel function of the first kind
+inline double BesselI0(double x)
+{
+	double sum = 1.0, term = 1.0, y = x * x / 4.0;
+	for (int k = 1; k < 64 && term > sum * 1e-12; k++)
+	{
+		term *= y / (double(k) * k);
+		sum += term;
+	}
+	return sum;
+}
+
+/*
+	Upsample by Up, lowpass, decimate by Down. Filter length and the phase
+	table dimensions are compile time constants per ratio, so inner loops have
+	fixed trip counts. Coefficients are computed once per ratio on first use
+	(sin/exp are not constexpr in C++11) and shared by every instance.
+*/
+template<int Up, int Down>
+class PolyphaseResampler : public FixedResampler
+{
+public:
+	// Zero crossings of the prototype sinc on each side, at the lower rate
+	static const int ZeroCrossings = 24;
+	static const int MaxFactor = Up > Down ? Up : Down;
+	// Taps per phase
+	static const int Taps = (2 * ZeroCrossings * MaxFactor + Up - 1) / Up;
+	static const int TableSize = Up * Taps;
+
+	PolyphaseResampler(int channels)
+	: mChannels(channels)
+	, mCoeffs(Table())
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		mPhase = 0;
+		mPos = Taps - 1;
+		// History starts out as silence
+		mBuffer.assign((Taps - 1) * mChannels, 0.0f);
+	}
+
+	double Ratio() const
+	{
+		return double(Up) / double(Down);
+	}
+
+	int Process(SRC_DATA *data)
+	{
+		const int chns = mChannels;
+		size_t old_frames = mBuffer.size() / chns;
+		mBuffer.resize((old_frames + data->input_frames) * chns);
+		if (data->input_frames > 0)
+			memcpy(&mBuffer[old_frames * chns], data->data_in, data->input_frames * chns * sizeof(float));
+
+		const long avail = long(mBuffer.size() / chns);
+		const float *in = mBuffer.data();
+		float *out = data->data_out;
+		long gen = 0;
+
+		while (gen < data->output_frames && mPos < avail)
+		{
+			// Newest input frame first, coefficients are stored in the same order
+			const float *coeffs = &mCoeffs[mPhase * Taps];
+			const float *x = in + mPos * chns;
+			for (int c = 0; c < chns; c++)
+			{
+				float acc = 0.0f;
+				for (int j = 0; j < Taps; j++)
+					acc += coeffs[j] * x[c - j * chns];
+				out[c] = acc;
+			}
+			out += chns;
+			gen++;
+
+			mPhase += Down;
+			mPos += mPhase / Up;
+			mPhase %= Up;
+		}
+
+		// Frames not reached yet go back to the caller
+		long unused = avail - mPos;
+		if (unused < 0)
+			unused = 0;
+		if (unused > data->input_frames)
+			unused = data->input_frames;
+		data->input_frames_used = data->input_frames - unused;
+		data->output_frames_gen = gen;
+
+		// Keep Taps - 1 frames of history before the next input frame
+		long keep_from = mPos - (Taps - 1);
+		long keep_to = avail - unused;
+		mBuffer.erase(mBuffer.begin() + keep_to * chns, mBuffer.end());
+		if (keep_from > 0)
+		{
+			mBuffer.erase(mBuffer.begin(), mBuffer.begin() + keep_from * chns);
+			mPos -= keep_from;
+		}
+		return 0;
+	}
+
+private:
+	static const std::vector<float>& Table()
+	{
+		static const std::vector<float> table = MakeTable();
+		return table;
+	}
+
+	static std::vector<float> MakeTable()
+	{
+		const int length = TableSize;
+		const double beta = 8.0;
+		// Cutoff relative to upsampled rate, pulled a bit below the lower Nyquist
+		const double fc = 0.5 / MaxFactor * 0.91;
+		const double center = (length - 1) / 2.0;
+		const double i0beta = BesselI0(beta);
+		const double pi = 3.14159265358979323846;
+
+		std::vector<float> table(length);
+		for (int n = 0; n < length; n++)
+		{
+			double t = n - center;
+			double sinc = t == 0.0 ? 2.0 * fc : std::sin(2.0 * pi * fc * t) / (pi * t);
+			double r = t / (center + 1.0);
+			double window = BesselI0(beta * std::sqrt(1.0 - r * r)) / i0beta;
+			// Gain of Up makes up for zero stuffing
+			double h = sinc * window * Up;
+			// Prototype tap n belongs to phase n % Up and multiplies the input
+			// frame n / Up steps back from the newest one
+			table[(n % Up) * Taps + n / Up] = float(h);
+		}
+		return table;
+	}
+
+	int mChannels;
+	int mPhase;
+	long mPos; // next input frame to use, index into mBuffer
+	std::vector<float> mBuffer;
+	const std::vector<float>& mCoeffs;
+};
+
+// Host and device agree on the rate, just copy
+template<>
+class PolyphaseResampler<1, 1> : public FixedResampler
+{
+public:
+	PolyphaseResampler(int channels) : mChannels(channels) {}
+	void Reset() {}
+	double Ratio() const { return 1.0; }
+	int Process(SRC_DATA *data)
+	{
+		long frames = data->input_frames < data->output_frames ? data->input_frames : data->output_frames;
+		if (frames > 0)
+			memcpy(data->data_out, data->data_in, frames * mChannels * sizeof(float));
+		data->input_frames_used = frames;
+		data->output_frames_gen = frames;
+		return 0;
+	}
+private:
+	int mChannels;
+};
+
+// Returns nullptr if the rate pair has no fixed ratio specialization
+FixedResampler* CreateFixedResampler(int inRate, int outRate, int channels);
+
+} // namespace resampler
+#endif
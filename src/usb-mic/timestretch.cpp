@@ -0,0 +1,157 @@
+#include "timestretch.h"
+#include <algorithm>
+#include <cmath>
+
+// Same as SoundTouch's speech friendly defaults
+#define SEQUENCE_MS 40
+#define SEEK_MS 15
+#define OVERLAP_MS 8
+
+TimeStretch::TimeStretch(uint32_t channels, uint32_t rate)
+: mChannels(channels ? channels : 1)
+, mStretch(1.0)
+{
+	SetRate(rate);
+}
+
+void TimeStretch::SetRate(uint32_t rate)
+{
+	mRate = rate;
+	mSequence = rate * SEQUENCE_MS / 1000;
+	mSeek = rate * SEEK_MS / 1000;
+	mOverlap = std::max<size_t>(rate * OVERLAP_MS / 1000, 1);
+	Reset();
+}
+
+void TimeStretch::Reset()
+{
+	mInput.clear();
+	mTail.clear();
+	mSkipFrac = 0;
+	mActive = false;
+	mFirst = true;
+}
+
+void TimeStretch::SetStretch(double stretch)
+{
+	mStretch = std::min(std::max(stretch, 0.25), 4.0);
+}
+
+// Offset into mInput whose start best continues mTail
+size_t TimeStretch::BestOffset()
+{
+	size_t len = mSeek + mOverlap;
+	mMono.resize(len + mOverlap);
+	float *in = mMono.data();
+	float *ref = in + len;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		float sum = 0;
+		for (uint32_t c = 0; c < mChannels; c++)
+			sum += mInput[i * mChannels + c];
+		in[i] = sum;
+	}
+	for (size_t i = 0; i < mOverlap; i++)
+	{
+		float sum = 0;
+		for (uint32_t c = 0; c < mChannels; c++)
+			sum += mTail[i * mChannels + c];
+		// Weigh the middle of the overlap most, like the cross fade does
+		ref[i] = sum * i * (mOverlap - i);
+	}
+
+	double norm = 0;
+	for (size_t i = 0; i < mOverlap; i++)
+		norm += in[i] * in[i];
+
+	size_t best = 0;
+	double bestCorr = -1e30;
+	for (size_t off = 0; off < mSeek; off++)
+	{
+		double corr = 0;
+		for (size_t i = 0; i < mOverlap; i++)
+			corr += ref[i] * in[off + i];
+		corr /= std::sqrt(norm < 1e-9 ? 1e-9 : norm);
+		if (corr > bestCorr)
+		{
+			bestCorr = corr;
+			best = off;
+		}
+		// Slide the energy window by one frame
+		norm += in[off + mOverlap] * in[off + mOverlap] - in[off] * in[off];
+	}
+	return best;
+}
+
+void TimeStretch::CrossFade(const float *next, std::vector<float>& out)
+{
+	size_t old_size = out.size();
+	out.resize(old_size + mOverlap * mChannels);
+	float *dst = out.data() + old_size;
+	for (size_t i = 0; i < mOverlap; i++)
+	{
+		float t = float(i) / mOverlap;
+		for (uint32_t c = 0; c < mChannels; c++)
+		{
+			size_t k = i * mChannels + c;
+			dst[k] = mTail[k] * (1.0f - t) + next[k] * t;
+		}
+	}
+}
+
+// Back to pass-through, blend the pending tail into what is left of the input
+void TimeStretch::Flush(std::vector<float>& out)
+{
+	if (!mFirst && Pending() >= mOverlap)
+	{
+		CrossFade(mInput.data(), out);
+		out.insert(out.end(), mInput.begin() + mOverlap * mChannels, mInput.end());
+	}
+	else
+		out.insert(out.end(), mInput.begin(), mInput.end());
+	Reset();
+}
+
+void TimeStretch::Process(const float *in, size_t frames, std::vector<float>& out)
+{
+	if (!mActive)
+	{
+		if (mStretch == 1.0)
+		{
+			out.insert(out.end(), in, in + frames * mChannels);
+			return;
+		}
+		mActive = true;
+	}
+
+	mInput.insert(mInput.end(), in, in + frames * mChannels);
+
+	for (;;)
+	{
+		double skip = (mSequence - mOverlap) / mStretch + mSkipFrac;
+		size_t iskip = static_cast<size_t>(skip);
+		if (Pending() < std::max(mSeek + mSequence, iskip))
+			break;
+
+		size_t offset = mFirst ? 0 : BestOffset();
+		const float *seq = mInput.data() + offset * mChannels;
+
+		if (mFirst)
+			out.insert(out.end(), seq, seq + (mSequence - mOverlap) * mChannels);
+		else
+		{
+			CrossFade(seq, out);
+			out.insert(out.end(), seq + mOverlap * mChannels, seq + (mSequence - mOverlap) * mChannels);
+		}
+
+		mTail.assign(seq + (mSequence - mOverlap) * mChannels, seq + mSequence * mChannels);
+		mFirst = false;
+
+		mSkipFrac = skip - iskip;
+		mInput.erase(mInput.begin(), mInput.begin() + iskip * mChannels);
+	}
+
+	if (mStretch == 1.0)
+		Flush(out);
+}
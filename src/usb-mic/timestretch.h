@@ -0,0 +1,51 @@
+#ifndef TIMESTRETCH_H
+#define TIMESTRETCH_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+	WSOLA time stretcher for interleaved float audio. Input is cut into
+	overlapping sequences, each placed where it best matches the tail of
+	the previous one and cross faded, so duration changes while pitch
+	stays put. Adds roughly one sequence plus seek window of latency
+	while stretching and passes audio straight through at 1.0.
+*/
+class TimeStretch
+{
+public:
+	TimeStretch(uint32_t channels, uint32_t rate);
+
+	void SetRate(uint32_t rate);
+	void Reset();
+
+	// Output length / input length, above 1.0 makes audio longer
+	void SetStretch(double stretch);
+	double GetStretch() const { return mStretch; }
+
+	// Appends stretched frames to out, input that can't be used yet is kept
+	void Process(const float *in, size_t frames, std::vector<float>& out);
+
+private:
+	size_t Pending() const { return mInput.size() / mChannels; }
+	size_t BestOffset();
+	void CrossFade(const float *next, std::vector<float>& out);
+	void Flush(std::vector<float>& out);
+
+	uint32_t mChannels;
+	uint32_t mRate;
+	size_t mSequence; // frames per output piece
+	size_t mSeek; // search window
+	size_t mOverlap; // cross fade length
+	double mStretch;
+	double mSkipFrac;
+	bool mActive;
+	bool mFirst;
+
+	std::vector<float> mInput; // not consumed yet
+	std::vector<float> mTail; // end of previous sequence, mOverlap frames
+	std::vector<float> mMono; // correlation scratch
+};
+
+#endif
@@ -28,6 +28,8 @@
 #include "../qemu-usb/vl.h"
 #include "../deviceproxy.h"
 #include "audiodeviceproxy.h"
+#include "jitterbuffer.h"
+#include "audiostats.h"
 #include <assert.h>
 
 #define DEVICENAME "headset"
@@ -80,6 +82,7 @@ typedef struct HeadsetState {
     AudioDevice *audsrc;
     AudioDevice *audsink;
     AudioDeviceProxyBase *audsrcproxy;
+    AudioStatsLog *stats;
     MicMode mode;
 
     /* state */
@@ -88,7 +91,6 @@ typedef struct HeadsetState {
         bool mute;
         uint8_t vol[2];
         uint32_t srate;
-        std::vector<int16_t> buffer;
         //struct streambuf buf;
     } out;
 
@@ -97,6 +99,7 @@ typedef struct HeadsetState {
         uint8_t vol;
         uint32_t srate;
         std::vector<int16_t> buffer;
+        JitterBuffer *jitter;
     } in;
 
     struct {
@@ -712,6 +715,8 @@ static int usb_audio_ep_control(HeadsetState *s, uint8_t attrib,
         OSDebugOut(TEXT("=> mic set cn %d sampling to %d\n"), cn, s->in.srate);
         if(s->audsrc)
             s->audsrc->SetResampling(s->in.srate);
+        if(s->in.jitter)
+            s->in.jitter->SetRate(s->in.srate);
         ret = 0;
         break;
     case ATTRIB_ID(AUDIO_SAMPLING_FREQ_CONTROL, AUDIO_REQUEST_GET_CUR, 0x84):
@@ -918,6 +923,11 @@ static int headset_handle_data(USBDevice *dev, int pid,
     HeadsetState *s = (HeadsetState *)dev;
     int ret = USB_RET_STALL;
 
+    if (s->stats && s->stats->Due()) {
+        s->stats->Log("in", s->audsrc, s->in.jitter);
+        s->stats->Log("out", s->audsink);
+    }
+
     switch(pid) {
     case USB_TOKEN_IN:
         //fprintf(stderr, "token in ep: %d len: %d\n", devep, len);
@@ -932,12 +942,9 @@ static int headset_handle_data(USBDevice *dev, int pid,
             //Divide 'len' bytes between n channels of 16 bits
             uint32_t maxFrames = len / (outChns * sizeof(int16_t)), frames = 0;
 
-            if(s->audsrc->GetFrames(&frames))
-            {
-                frames = MIN(frames, maxFrames);
-                s->in.buffer.resize(frames * inChns);
-                frames = s->audsrc->GetBuffer(s->in.buffer.data(), frames);
-            }
+            s->in.buffer.resize(maxFrames * inChns);
+            s->in.jitter->Fill(s->audsrc);
+            frames = s->in.jitter->Pop(s->in.buffer.data(), maxFrames);
 
             uint32_t i = 0;
             for(; i < frames; i++)
@@ -974,27 +981,9 @@ static int headset_handle_data(USBDevice *dev, int pid,
         if (devep == 1 && s->altset[1]) {
             int16_t *src = (int16_t *)data;
             uint32_t inChns = s->altset[1] == 1 ? 2 : 1;
-            uint32_t outChns = s->audsink->GetChannels();
             //Divide 'len' bytes between n channels of 16 bits
             uint32_t frames = len / (inChns * sizeof(int16_t));
 
-            s->out.buffer.resize(frames * outChns); //TODO move to AudioDevice for less data copying
-
-            uint32_t i = 0;
-            for(; i < frames; i++)
-            {
-                if (inChns == outChns)
-                {
-                    for (int cn = 0; cn < outChns; cn++)
-                        s->out.buffer[i * outChns + cn] = SetVolume(src[i * inChns + cn], s->out.vol[cn]);
-                }
-                else if (inChns < outChns)
-                {
-                    for (int cn = 0; cn < outChns; cn++)
-                        s->out.buffer[i * outChns + cn] = SetVolume(src[i * inChns], s->out.vol[cn]);
-                }
-            }
-
 #if 0
             if (!file)
             {
@@ -1007,7 +996,8 @@ static int headset_handle_data(USBDevice *dev, int pid,
                 fwrite(data, sizeof(short), frames * inChns, file);
 #endif
 
-            frames = s->audsink->SetBuffer(s->out.buffer.data(), frames);
+            // Volume and channel mapping happen while copying into the sink's queue
+            frames = s->audsink->SetBufferMixed(src, frames, inChns, s->out.vol);
 
             return frames * inChns * sizeof(int16_t);
         }
@@ -1033,15 +1023,23 @@ static void headset_handle_destroy(USBDevice *dev)
         s->in.buffer.clear();
     }
 
+    if(s->in.jitter)
+    {
+        OSDebugOut(TEXT("headset: jitter underruns %u overruns %u\n"), s->in.jitter->Underruns(), s->in.jitter->Overruns());
+        delete s->in.jitter;
+        s->in.jitter = NULL;
+    }
+
     if(s->audsink)
     {
         s->audsink->Stop();
         delete s->audsink;
         s->audsink = NULL;
-        //delete [] s->out.buffer[i];
-        s->out.buffer.clear();
     }
 
+    delete s->stats;
+    s->stats = NULL;
+
     s->audsrcproxy->AudioDeinit();
     free(s);
     if (file)
@@ -1054,6 +1052,9 @@ static int headset_handle_open(USBDevice *dev)
     HeadsetState *s = (HeadsetState *)dev;
     if (s)
     {
+        if (s->in.jitter)
+            s->in.jitter->Reset();
+
         if (s->audsrc)
             s->audsrc->Start();
 
@@ -1125,7 +1126,9 @@ USBDevice* HeadsetDevice::CreateDevice(int port, const std::string& api)
     }
 
     s->in.buffer.reserve(BUFFER_FRAMES * s->audsrc->GetChannels());
-    s->out.buffer.reserve(BUFFER_FRAMES * s->audsink->GetChannels());
+    s->in.jitter = new JitterBuffer(s->audsrc->GetChannels(), 48000, LoadJitterTarget(port, DEVICENAME));
+    if (uint32_t interval = LoadStatsInterval(port, DEVICENAME))
+        s->stats = new AudioStatsLog(DEVICENAME, port, interval);
 
     s->dev.speed = USB_SPEED_FULL;
     s->dev.handle_packet  = headset_handle_packet;
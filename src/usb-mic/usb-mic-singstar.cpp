@@ -27,6 +27,9 @@
 #include "../USB.h"
 #include "../qemu-usb/vl.h"
 #include "usb-mic-singstar.h"
+#include "audiodev-combined.h"
+#include "jitterbuffer.h"
+#include "audiostats.h"
 #include <assert.h>
 
 #define DEVICENAME "singstar"
@@ -81,6 +84,10 @@ typedef struct SINGSTARMICState {
     int intf;
     AudioDevice *audsrc[2];
     AudioDeviceProxyBase *audsrcproxy;
+    // Both sources aligned into one stereo stream in MIC_MODE_SEPARATE
+    CombinedAudioDevice *audcombined;
+    JitterBuffer *jitter;
+    AudioStatsLog *stats;
     MicMode mode;
 
     /* state */
@@ -449,11 +456,16 @@ static int usb_audio_ep_control(SINGSTARMICState *s, uint8_t attrib,
 			s->srate[0] = data[0] | (data[1] << 8) | (data[2] << 16);
 			s->srate[1] = s->srate[0];
 
-			if(s->audsrc[0])
-				s->audsrc[0]->SetResampling(s->srate[0]);
+			if(s->audcombined)
+				s->audcombined->SetResampling(s->srate[0]);
+			else
+			{
+				if(s->audsrc[0])
+					s->audsrc[0]->SetResampling(s->srate[0]);
 
-			if(s->audsrc[1])
-				s->audsrc[1]->SetResampling(s->srate[1]);
+				if(s->audsrc[1])
+					s->audsrc[1]->SetResampling(s->srate[1]);
+			}
 
 			OSDebugOut(TEXT("singstar: set sampling to %d\n"), s->srate[0]);
 		} else if( cn < 2) {
@@ -463,6 +475,7 @@ static int usb_audio_ep_control(SINGSTARMICState *s, uint8_t attrib,
 			if(s->audsrc[cn])
 				s->audsrc[cn]->SetResampling(s->srate[cn]);
 		}
+		s->jitter->SetRate(s->srate[s->audsrc[0] ? 0 : 1]);
         ret = 0;
         break;
     case ATTRIB_ID(AUDIO_SAMPLING_FREQ_CONTROL, AUDIO_REQUEST_GET_CUR, 0x81):
@@ -665,20 +678,21 @@ static int singstar_mic_handle_data(USBDevice *dev, int pid,
 			//TODO
 			int outChns = s->intf == 1 ? 1 : 2;
 			uint32_t frames, outlen[2] = {0}, chn;
-			int16_t *src1, *src2;
+			int16_t *src1;
 			int16_t *dst = (int16_t *)data;
 			//Divide 'len' bytes between 2 channels of 16 bits
 			uint32_t maxPerChnFrames = len / (outChns * sizeof(uint16_t));
 
-			for(int i = 0; i<2; i++)
-			{
-				frames = maxPerChnFrames;
-				if(s->audsrc[i] &&
-					s->audsrc[i]->GetFrames(&frames))
-				{
-					frames = MIN(maxPerChnFrames, frames); //max 50 frames usually
-					outlen[i] = s->audsrc[i]->GetBuffer(s->buffer[i], frames);
-				}
+			// Combined stream is already interleaved and goes to buffer[0]
+			int k = s->audsrc[0] ? 0 : 1;
+			s->jitter->Fill(s->audcombined ? s->audcombined : s->audsrc[k]);
+			outlen[k] = s->jitter->Pop(s->buffer[k], maxPerChnFrames);
+
+			if (s->stats && s->stats->Due()) {
+				if (s->audsrc[0])
+					s->stats->Log("src 1", s->audsrc[0], s->jitter);
+				if (s->audsrc[1])
+					s->stats->Log("src 2", s->audsrc[1], s->audsrc[0] ? nullptr : s->jitter);
 			}
 
 			OSDebugOut(TEXT("data len: %d bytes, src[0]: %d frames, src[1]: %d frames\n"), len, outlen[0], outlen[1]);
@@ -730,19 +744,14 @@ static int singstar_mic_handle_data(USBDevice *dev, int pid,
 			//else if(s->buffer[0] && s->buffer[1])
 			case MIC_MODE_SEPARATE:
 			{
-				uint32_t cn1 = s->audsrc[0]->GetChannels();
-				uint32_t cn2 = s->audsrc[1]->GetChannels();
-				uint32_t minLen = MIN(outlen[0], outlen[1]);
-
-				src1 = (int16_t *)s->buffer[0];
-				src2 = (int16_t *)s->buffer[1];
+				src1 = s->buffer[0];
 
 				uint32_t i = 0;
-				for(; i < minLen && i < maxPerChnFrames; i++)
+				for(; i < outlen[0] && i < maxPerChnFrames; i++)
 				{
-					dst[i * outChns] = SetVolume(src1[i * cn1], s->out.vol[0]);
+					dst[i * outChns] = SetVolume(src1[i * 2], s->out.vol[0]);
 					if(outChns > 1)
-						dst[i * 2 + 1] = SetVolume(src2[i * cn2], s->out.vol[1]);
+						dst[i * 2 + 1] = SetVolume(src1[i * 2 + 1], s->out.vol[1]);
 				}
 
 				ret = i;
@@ -784,6 +793,15 @@ static void singstar_mic_handle_destroy(USBDevice *dev)
 {
     SINGSTARMICState *s = (SINGSTARMICState *)dev;
 
+	if (s->jitter)
+		OSDebugOut(TEXT("singstar: jitter underruns %u overruns %u\n"), s->jitter->Underruns(), s->jitter->Overruns());
+	delete s->jitter;
+	s->jitter = NULL;
+	delete s->audcombined;
+	s->audcombined = NULL;
+	delete s->stats;
+	s->stats = NULL;
+
 	for(int i=0; i<2; i++)
 	{
 		if(s->audsrc[i])
@@ -808,8 +826,14 @@ static int singstar_mic_handle_open(USBDevice *dev)
 	SINGSTARMICState *s = (SINGSTARMICState *)dev;
 	if (s)
 	{
-		for (int i = 0; i < 2; i++)
-			if (s->audsrc[i]) s->audsrc[i]->Start();
+		s->jitter->Reset();
+		if (s->audcombined)
+			s->audcombined->Start();
+		else
+		{
+			for (int i = 0; i < 2; i++)
+				if (s->audsrc[i]) s->audsrc[i]->Start();
+		}
 	}
 	return 0;
 }
@@ -819,8 +843,13 @@ static void singstar_mic_handle_close(USBDevice *dev)
 	SINGSTARMICState *s = (SINGSTARMICState *)dev;
 	if (s)
 	{
-		for (int i = 0; i < 2; i++)
-			if (s->audsrc[i]) s->audsrc[i]->Stop();
+		if (s->audcombined)
+			s->audcombined->Stop();
+		else
+		{
+			for (int i = 0; i < 2; i++)
+				if (s->audsrc[i]) s->audsrc[i]->Stop();
+		}
 	}
 }
 
@@ -873,9 +902,19 @@ USBDevice* SingstarDevice::CreateDevice(int port, const std::string& api)
 	if(s->mode != MIC_MODE_SHARED && (!s->audsrc[0] || (s->audsrc[0] && !s->audsrc[1])))
 		s->mode = MIC_MODE_SINGLE;
 
+	if (s->mode == MIC_MODE_SEPARATE)
+		s->audcombined = new CombinedAudioDevice(s->audsrc[0], s->audsrc[1]);
+
+	if (src)
+		s->jitter = new JitterBuffer(s->audcombined ? 2 : src->GetChannels(), 48000,
+			LoadJitterTarget(port, DEVICENAME));
+
+	if (uint32_t interval = LoadStatsInterval(port, DEVICENAME))
+		s->stats = new AudioStatsLog(DEVICENAME, port, interval);
+
 	for (int i = 0; i < 2; i++)
 		if (s->audsrc[i])
-			s->buffer[i] = new int16_t[BUFFER_FRAMES * s->audsrc[i]->GetChannels()];
+			s->buffer[i] = new int16_t[BUFFER_FRAMES * MAX(2, s->audsrc[i]->GetChannels())];
 
 	/*if(!devs[0].empty() && !devs[1].empty()
 		&& (devs[0] == devs[1]))